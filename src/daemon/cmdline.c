@@ -53,6 +53,8 @@ enum {
     ARG_LOG_TARGET,
     ARG_LOG_META,
     ARG_LOG_TIME,
+    ARG_LOG_ASYNC,
+    ARG_PROFILE_STARTUP,
     ARG_LOG_BACKTRACE,
     ARG_LOAD,
     ARG_FILE,
@@ -89,6 +91,8 @@ static const struct option long_options[] = {
     {"log-target",                  1, 0, ARG_LOG_TARGET},
     {"log-meta",                    2, 0, ARG_LOG_META},
     {"log-time",                    2, 0, ARG_LOG_TIME},
+    {"log-async",                   2, 0, ARG_LOG_ASYNC},
+    {"profile-startup",             2, 0, ARG_PROFILE_STARTUP},
     {"log-backtrace",               1, 0, ARG_LOG_BACKTRACE},
     {"load",                        1, 0, ARG_LOAD},
     {"file",                        1, 0, ARG_FILE},
@@ -145,7 +149,11 @@ void pa_cmdline_help(const char *argv0) {
            "                                        Specify the log target\n"
            "      --log-meta[=BOOL]                 Include code location in log messages\n"
            "      --log-time[=BOOL]                 Include timestamps in log messages\n"
+           "      --log-async[=BOOL]                Write log messages from a background\n"
+           "                                        thread\n"
            "      --log-backtrace=FRAMES            Include a backtrace in log messages\n"
+           "      --profile-startup[=BOOL]          Log how long each startup phase and\n"
+           "                                        module took\n"
            "  -p, --dl-search-path=PATH             Set the search path for dynamic shared\n"
            "                                        objects (plugins)\n"
            "      --resample-method=METHOD          Use the specified resampling method\n"
@@ -341,6 +349,22 @@ int pa_cmdline_parse(pa_daemon_conf *conf, int argc, char *const argv [], int *d
                 conf->log_time = !!b;
                 break;
 
+            case ARG_LOG_ASYNC:
+                if ((b = optarg ? pa_parse_boolean(optarg) : 1) < 0) {
+                    pa_log(_("--log-async expects boolean argument"));
+                    goto fail;
+                }
+                conf->log_async = !!b;
+                break;
+
+            case ARG_PROFILE_STARTUP:
+                if ((b = optarg ? pa_parse_boolean(optarg) : 1) < 0) {
+                    pa_log(_("--profile-startup expects boolean argument"));
+                    goto fail;
+                }
+                conf->profile_startup = !!b;
+                break;
+
             case ARG_LOG_META:
                 if ((b = optarg ? pa_parse_boolean(optarg) : 1) < 0) {
                     pa_log(_("--log-meta expects boolean argument"));
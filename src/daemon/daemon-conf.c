@@ -81,6 +81,8 @@ static const pa_daemon_conf default_conf = {
     .log_backtrace = 0,
     .log_meta = false,
     .log_time = false,
+    .log_async = false,
+    .profile_startup = false,
     .resample_method = PA_RESAMPLER_AUTO,
     .avoid_resampling = false,
     .disable_remixing = false,
@@ -619,7 +621,9 @@ int pa_daemon_conf_load(pa_daemon_conf *c, const char *filename) {
         { "shm-size-bytes",             pa_config_parse_size,     &c->shm_size, NULL },
         { "log-meta",                   pa_config_parse_bool,     &c->log_meta, NULL },
         { "log-time",                   pa_config_parse_bool,     &c->log_time, NULL },
+        { "log-async",                  pa_config_parse_bool,     &c->log_async, NULL },
         { "log-backtrace",              pa_config_parse_unsigned, &c->log_backtrace, NULL },
+        { "profile-startup",            pa_config_parse_bool,     &c->profile_startup, NULL },
 #ifdef HAVE_SYS_RESOURCE_H
         { "rlimit-fsize",               parse_rlimit,             &c->rlimit_fsize, NULL },
         { "rlimit-data",                parse_rlimit,             &c->rlimit_data, NULL },
@@ -837,7 +841,9 @@ char *pa_daemon_conf_dump(pa_daemon_conf *c) {
     pa_strbuf_printf(s, "shm-size-bytes = %lu\n", (unsigned long) c->shm_size);
     pa_strbuf_printf(s, "log-meta = %s\n", pa_yes_no(c->log_meta));
     pa_strbuf_printf(s, "log-time = %s\n", pa_yes_no(c->log_time));
+    pa_strbuf_printf(s, "log-async = %s\n", pa_yes_no(c->log_async));
     pa_strbuf_printf(s, "log-backtrace = %u\n", c->log_backtrace);
+    pa_strbuf_printf(s, "profile-startup = %s\n", pa_yes_no(c->profile_startup));
 #ifdef HAVE_SYS_RESOURCE_H
     pa_strbuf_printf(s, "rlimit-fsize = %li\n", c->rlimit_fsize.is_set ? (long int) c->rlimit_fsize.value : -1);
     pa_strbuf_printf(s, "rlimit-data = %li\n", c->rlimit_data.is_set ? (long int) c->rlimit_data.value : -1);
@@ -69,6 +69,7 @@
 #include <pulse/client-conf.h>
 #include <pulse/mainloop.h>
 #include <pulse/mainloop-signal.h>
+#include <pulse/rtclock.h>
 #include <pulse/timeval.h>
 #include <pulse/xmalloc.h>
 
@@ -527,6 +528,7 @@ int main(int argc, char *argv[]) {
 #endif
     int autospawn_fd = -1;
     bool autospawn_locked = false;
+    pa_usec_t startup_time, config_done_time, core_new_time, phase_time;
 #ifdef HAVE_DBUS
     pa_dbusobj_server_lookup *server_lookup = NULL; /* /org/pulseaudio/server_lookup */
     pa_dbus_connection *lookup_service_bus = NULL; /* Always the user bus. */
@@ -638,6 +640,8 @@ int main(int argc, char *argv[]) {
 
     pa_init_i18n();
 
+    startup_time = pa_rtclock_now();
+
     conf = pa_daemon_conf_new();
 
     if (pa_daemon_conf_load(conf, NULL) < 0)
@@ -651,6 +655,8 @@ int main(int argc, char *argv[]) {
         goto finish;
     }
 
+    config_done_time = pa_rtclock_now();
+
     if (conf->log_target)
         pa_log_set_target(conf->log_target);
     else {
@@ -1185,8 +1191,14 @@ int main(int argc, char *argv[]) {
 
     pa_memtrap_install();
 
+    /* Only now, since the logging thread would not survive the forks above */
+    if (conf->log_async && pa_log_set_async(true) < 0)
+        pa_log_warn("Failed to enable asynchronous logging.");
+
     pa_assert_se(mainloop = pa_mainloop_new());
 
+    core_new_time = pa_rtclock_now();
+
     if (!(c = pa_core_new(pa_mainloop_get_api(mainloop), !conf->disable_shm,
                           !conf->disable_shm && !conf->disable_memfd && pa_memfd_is_locally_supported(),
                           conf->shm_size))) {
@@ -1194,6 +1206,13 @@ int main(int argc, char *argv[]) {
         goto finish;
     }
 
+    if (conf->profile_startup) {
+        pa_core_startup_profile_begin(c);
+        pa_core_startup_profile_add(c, "config", NULL, NULL, config_done_time - startup_time);
+        pa_core_startup_profile_add(c, "setup", NULL, NULL, core_new_time - config_done_time);
+        pa_core_startup_profile_add(c, "core", NULL, NULL, pa_rtclock_now() - core_new_time);
+    }
+
     c->default_sample_spec = conf->default_sample_spec;
     c->alternate_sample_rate = conf->alternate_sample_rate;
     c->default_channel_map = conf->default_channel_map;
@@ -1253,6 +1272,8 @@ int main(int argc, char *argv[]) {
     {
         const char *command_source = NULL;
 
+        phase_time = pa_rtclock_now();
+
         if (conf->load_default_script_file) {
             FILE *f;
 
@@ -1263,11 +1284,17 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        pa_core_startup_profile_add(c, "script", NULL, NULL, pa_rtclock_now() - phase_time);
+        phase_time = pa_rtclock_now();
+
         if (r >= 0) {
             r = pa_cli_command_execute(c, conf->script_commands, buf, &conf->fail);
             command_source = _("command line arguments");
         }
 
+        pa_core_startup_profile_add(c, "commands", NULL, NULL, pa_rtclock_now() - phase_time);
+        phase_time = pa_rtclock_now();
+
         pa_log_error("%s", s = pa_strbuf_to_string_free(buf));
         pa_xfree(s);
 
@@ -1317,6 +1344,9 @@ int main(int argc, char *argv[]) {
 
     pa_log_info("Daemon startup complete.");
 
+    pa_core_startup_profile_add(c, "finalize", NULL, NULL, pa_rtclock_now() - phase_time);
+    pa_core_startup_profile_end(c);
+
 #ifdef HAVE_SYSTEMD_DAEMON
     sd_notify(0, "READY=1");
 #endif
@@ -1387,6 +1417,8 @@ finish:
 
     pa_signal_done();
 
+    pa_log_set_async(false);
+
 #ifdef HAVE_FORK
     /* If we have daemon_pipe[1] still open, this means we've failed after
      * the first fork, but before the second. Therefore just write to it. */
@@ -23,6 +23,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <alsa/asoundlib.h>
 #include <math.h>
 
@@ -43,6 +44,8 @@
 #include <pulsecore/macro.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/conf-parser.h>
+#include <pulsecore/database.h>
+#include <pulsecore/mutex.h>
 #include <pulsecore/strbuf.h>
 
 #include "alsa-mixer.h"
@@ -3949,6 +3952,7 @@ void pa_alsa_profile_set_free(pa_alsa_profile_set *ps) {
     if (ps->decibel_fixes)
         pa_hashmap_free(ps->decibel_fixes);
 
+    pa_xfree(ps->probe_cache_id);
     pa_xfree(ps);
 }
 
@@ -4511,9 +4515,11 @@ static void profile_set_set_availability_groups(pa_alsa_profile_set *ps) {
     pa_dynarray_free(paths);
 }
 
+/* Without a PCM the mixer of the card is used, for mappings that are
+ * known to open on it from the probe cache */
 static void mapping_paths_probe(pa_alsa_mapping *m, pa_alsa_profile *profile,
                                 pa_alsa_direction_t direction, pa_hashmap *used_paths,
-                                pa_hashmap *mixers) {
+                                pa_hashmap *mixers, int card_index) {
 
     pa_alsa_path *p;
     void *state;
@@ -4536,9 +4542,13 @@ static void mapping_paths_probe(pa_alsa_mapping *m, pa_alsa_profile *profile,
     if (!ps)
         return; /* No paths */
 
-    pa_assert(pcm_handle);
+    if (pcm_handle)
+        mixer_handle = pa_alsa_open_mixer_for_pcm(mixers, pcm_handle, true);
+    else {
+        pa_assert(card_index >= 0);
+        mixer_handle = pa_alsa_open_mixer(mixers, card_index, true);
+    }
 
-    mixer_handle = pa_alsa_open_mixer_for_pcm(mixers, pcm_handle, true);
     if (!mixer_handle) {
         /* Cannot open mixer, remove all entries */
         pa_hashmap_remove_all(ps->paths);
@@ -4931,6 +4941,7 @@ pa_alsa_profile_set* pa_alsa_profile_set_new(const char *fname, const pa_channel
     pa_alsa_mapping *m;
     pa_alsa_decibel_fix *db_fix;
     char *fn;
+    struct stat st;
     int r;
     void *state;
 
@@ -4982,6 +4993,9 @@ pa_alsa_profile_set* pa_alsa_profile_set_new(const char *fname, const pa_channel
     pa_log_info("Loading profile set: %s", fn);
 
     r = pa_config_parse(fn, NULL, items, NULL, false, ps);
+
+    if (stat(fn, &st) == 0)
+        ps->probe_cache_id = pa_sprintf_malloc("%s:%llu", fn, (unsigned long long) st.st_mtime);
     pa_xfree(fn);
 
     if (r < 0)
@@ -5061,7 +5075,8 @@ static snd_pcm_t* mapping_open_pcm(pa_alsa_mapping *m,
                                    bool exact_channels,
                                    int mode,
                                    unsigned default_n_fragments,
-                                   unsigned default_fragment_size_msec) {
+                                   unsigned default_fragment_size_msec,
+                                   int *err) {
 
     snd_pcm_t* handle;
     pa_sample_spec try_ss = *ss;
@@ -5078,7 +5093,7 @@ static snd_pcm_t* mapping_open_pcm(pa_alsa_mapping *m,
     handle = pa_alsa_open_by_template(
                               m->device_strings, dev_id, NULL, &try_ss,
                               &try_map, mode, &try_period_size,
-                              &try_buffer_size, 0, NULL, NULL, NULL, NULL, exact_channels);
+                              &try_buffer_size, 0, NULL, NULL, NULL, NULL, exact_channels, err);
     if (handle && !exact_channels && m->channel_map.channels != try_map.channels) {
         char buf[PA_CHANNEL_MAP_SNPRINT_MAX];
         pa_log_debug("Channel map for mapping '%s' permanently changed to '%s'", m->name,
@@ -5142,6 +5157,338 @@ static void mapping_query_hw_device(pa_alsa_mapping *mapping, snd_pcm_t *pcm) {
     mapping->hw_device_index = snd_pcm_info_get_device(pcm_info);
 }
 
+/* Probing opens the PCMs of all mappings of all profiles, which takes
+ * long, especially for the ones that cannot be opened. The outcome is
+ * remembered in a database, keyed by everything that may change it: the
+ * card, the configuration files involved and the parameters the PCMs are
+ * opened with.
+ *
+ * For a supported profile the channel map and the hw device index of its
+ * mappings are remembered, which is all that opening them provides, so
+ * its PCMs are not opened again. Their mixer paths are still probed, on
+ * the mixer of the card. A profile that failed is only remembered if the
+ * failure is permanent, so a busy device is probed again the next time.
+ *
+ * An entry has one line per profile and per mapping:
+ *   s <profile>                          supported
+ *   u <profile>                          unsupported
+ *   o|i <mapping> <hw device> <map>      mapping opens for output|input
+ * The fields are separated by tabs. */
+
+#define PROBE_CACHE_DB "alsa-probe-cache"
+#define PROBE_CACHE_VERSION "2\n"
+
+#define PROBE_CACHE_SUPPORTED 's'
+#define PROBE_CACHE_UNSUPPORTED 'u'
+
+typedef struct probe_cache_mapping {
+    int hw_device_index;
+    pa_channel_map channel_map;
+} probe_cache_mapping;
+
+typedef struct probe_cache {
+    /* Profile name -> PROBE_CACHE_SUPPORTED or PROBE_CACHE_UNSUPPORTED */
+    pa_hashmap *profiles;
+    /* "o" or "i", tab, mapping name -> probe_cache_mapping */
+    pa_hashmap *mappings;
+} probe_cache;
+
+/* pa_database is not safe to use from several threads, and cards may be
+ * probed in parallel */
+static pa_static_mutex probe_cache_mutex = PA_STATIC_MUTEX_INIT;
+
+static probe_cache *probe_cache_new(void) {
+    probe_cache *c;
+
+    c = pa_xnew0(probe_cache, 1);
+    c->profiles = pa_hashmap_new_full(pa_idxset_string_hash_func, pa_idxset_string_compare_func, pa_xfree, NULL);
+    c->mappings = pa_hashmap_new_full(pa_idxset_string_hash_func, pa_idxset_string_compare_func, pa_xfree, pa_xfree);
+
+    return c;
+}
+
+static void probe_cache_free(probe_cache *c) {
+    pa_assert(c);
+
+    pa_hashmap_free(c->profiles);
+    pa_hashmap_free(c->mappings);
+    pa_xfree(c);
+}
+
+static char *probe_cache_mapping_key(pa_alsa_mapping *m, pa_alsa_direction_t direction) {
+    return pa_sprintf_malloc("%c\t%s", direction == PA_ALSA_DIRECTION_OUTPUT ? 'o' : 'i', m->name);
+}
+
+static void probe_cache_set_profile(probe_cache *c, pa_alsa_profile *p, char result) {
+    pa_hashmap_remove_and_free(c->profiles, p->name);
+    pa_hashmap_put(c->profiles, pa_xstrdup(p->name), PA_INT_TO_PTR(result));
+}
+
+static char probe_cache_get_profile(probe_cache *c, pa_alsa_profile *p) {
+    return (char) PA_PTR_TO_INT(pa_hashmap_get(c->profiles, p->name));
+}
+
+/* Only mappings that open on the card itself are remembered, as the
+ * mixer paths of the others cannot be probed without their PCM */
+static void probe_cache_set_mapping(probe_cache *c, pa_alsa_mapping *m, pa_alsa_direction_t direction,
+                                    snd_pcm_t *pcm, int card_index) {
+    probe_cache_mapping *cm;
+    char *key;
+
+    if (pcm) {
+        snd_pcm_info_t *info;
+        snd_pcm_info_alloca(&info);
+
+        if (snd_pcm_info(pcm, info) < 0 || snd_pcm_info_get_card(info) != card_index)
+            return;
+    }
+
+    key = probe_cache_mapping_key(m, direction);
+    if (pa_hashmap_get(c->mappings, key)) {
+        pa_xfree(key);
+        return;
+    }
+
+    cm = pa_xnew0(probe_cache_mapping, 1);
+    cm->hw_device_index = m->hw_device_index;
+    cm->channel_map = m->channel_map;
+    pa_hashmap_put(c->mappings, key, cm);
+}
+
+static probe_cache_mapping *probe_cache_get_mapping(probe_cache *c, pa_alsa_mapping *m, pa_alsa_direction_t direction) {
+    probe_cache_mapping *cm;
+    char *key;
+
+    key = probe_cache_mapping_key(m, direction);
+    cm = pa_hashmap_get(c->mappings, key);
+    pa_xfree(key);
+
+    return cm;
+}
+
+/* Whether the profile is known to be supported and all its mappings are
+ * known to open */
+static bool probe_cache_has_supported(probe_cache *c, pa_alsa_profile *p) {
+    pa_alsa_mapping *m;
+    uint32_t idx;
+
+    if (probe_cache_get_profile(c, p) != PROBE_CACHE_SUPPORTED)
+        return false;
+
+    if (p->output_mappings)
+        PA_IDXSET_FOREACH(m, p->output_mappings, idx)
+            if (!probe_cache_get_mapping(c, m, PA_ALSA_DIRECTION_OUTPUT))
+                return false;
+
+    if (p->input_mappings)
+        PA_IDXSET_FOREACH(m, p->input_mappings, idx)
+            if (!probe_cache_get_mapping(c, m, PA_ALSA_DIRECTION_INPUT))
+                return false;
+
+    return true;
+}
+
+/* Does for a supported profile what opening its mappings would do */
+static void probe_cache_apply(probe_cache *c, pa_alsa_profile *p) {
+    probe_cache_mapping *cm;
+    pa_alsa_mapping *m;
+    uint32_t idx;
+
+    if (p->output_mappings)
+        PA_IDXSET_FOREACH(m, p->output_mappings, idx) {
+            pa_assert_se(cm = probe_cache_get_mapping(c, m, PA_ALSA_DIRECTION_OUTPUT));
+
+            m->channel_map = cm->channel_map;
+            if (m->hw_device_index < 0)
+                m->hw_device_index = cm->hw_device_index;
+            m->supported++;
+        }
+
+    if (p->input_mappings)
+        PA_IDXSET_FOREACH(m, p->input_mappings, idx) {
+            pa_assert_se(cm = probe_cache_get_mapping(c, m, PA_ALSA_DIRECTION_INPUT));
+
+            m->channel_map = cm->channel_map;
+            if (m->hw_device_index < 0)
+                m->hw_device_index = cm->hw_device_index;
+            m->supported++;
+        }
+}
+
+static bool probe_cache_parse(probe_cache *c, const char *s) {
+    const char *state = NULL;
+    char *line;
+    bool ok = true;
+
+    if (!pa_startswith(s, PROBE_CACHE_VERSION))
+        return false;
+
+    while (ok && (line = pa_split(s + strlen(PROBE_CACHE_VERSION), "\n", &state))) {
+        const char *field_state = NULL;
+        char *type, *name, *hw_device, *map;
+
+        type = pa_split(line, "\t", &field_state);
+        name = pa_split(line, "\t", &field_state);
+        hw_device = pa_split(line, "\t", &field_state);
+        map = pa_split(line, "\t", &field_state);
+
+        if (!type || !name || strlen(type) != 1)
+            ok = false;
+        else if (type[0] == PROBE_CACHE_SUPPORTED || type[0] == PROBE_CACHE_UNSUPPORTED)
+            pa_hashmap_put(c->profiles, pa_xstrdup(name), PA_INT_TO_PTR(type[0]));
+        else if ((type[0] == 'o' || type[0] == 'i') && hw_device && map) {
+            probe_cache_mapping *cm;
+
+            cm = pa_xnew0(probe_cache_mapping, 1);
+
+            if (pa_atoi(hw_device, &cm->hw_device_index) < 0 || !pa_channel_map_parse(&cm->channel_map, map)) {
+                pa_xfree(cm);
+                ok = false;
+            } else
+                pa_hashmap_put(c->mappings, pa_sprintf_malloc("%s\t%s", type, name), cm);
+        } else
+            ok = false;
+
+        pa_xfree(type);
+        pa_xfree(name);
+        pa_xfree(hw_device);
+        pa_xfree(map);
+        pa_xfree(line);
+    }
+
+    return ok;
+}
+
+static char *probe_cache_to_string(probe_cache *c) {
+    pa_strbuf *buf;
+    probe_cache_mapping *cm;
+    const char *key;
+    void *result, *state;
+
+    buf = pa_strbuf_new();
+    pa_strbuf_puts(buf, PROBE_CACHE_VERSION);
+
+    PA_HASHMAP_FOREACH_KV(key, result, c->profiles, state)
+        pa_strbuf_printf(buf, "%c\t%s\n", (char) PA_PTR_TO_INT(result), key);
+
+    PA_HASHMAP_FOREACH_KV(key, cm, c->mappings, state) {
+        char map[PA_CHANNEL_MAP_SNPRINT_MAX];
+
+        pa_strbuf_printf(buf, "%s\t%i\t%s\n", key, cm->hw_device_index,
+                         pa_channel_map_snprint(map, sizeof(map), &cm->channel_map));
+    }
+
+    return pa_strbuf_to_string_free(buf);
+}
+
+static void probe_cache_key_add_mtime(pa_strbuf *buf, const char *fn) {
+    struct stat st;
+
+    if (stat(fn, &st) == 0)
+        pa_strbuf_printf(buf, "|%s:%llu", fn, (unsigned long long) st.st_mtime);
+}
+
+static char *probe_cache_key(pa_alsa_profile_set *ps, int card_index, const pa_sample_spec *ss,
+                             unsigned default_n_fragments, unsigned default_fragment_size_msec) {
+    pa_strbuf *buf;
+    char *identity, *fn;
+
+    if (!(identity = pa_alsa_get_card_identity(card_index)))
+        return NULL;
+
+    buf = pa_strbuf_new();
+
+    pa_strbuf_printf(buf, "%s|%s|%s|%s|%u|%u|%u|%u|%s",
+                     PACKAGE_VERSION,
+                     identity,
+                     pa_sample_format_to_string(ss->format),
+                     pa_yes_no(ps->ignore_dB),
+                     ss->rate,
+                     ss->channels,
+                     default_n_fragments,
+                     default_fragment_size_msec,
+                     ps->probe_cache_id);
+
+    pa_xfree(identity);
+
+    /* The device strings of the mappings are resolved by ALSA's own
+     * configuration */
+    fn = pa_sprintf_malloc("%s/alsa.conf", snd_config_topdir());
+    probe_cache_key_add_mtime(buf, fn);
+    pa_xfree(fn);
+    fn = pa_sprintf_malloc("%s/cards", snd_config_topdir());
+    probe_cache_key_add_mtime(buf, fn);
+    pa_xfree(fn);
+    probe_cache_key_add_mtime(buf, "/etc/asound.conf");
+
+    return pa_strbuf_to_string_free(buf);
+}
+
+static pa_database *probe_cache_open(bool for_write) {
+    pa_database *db;
+    char *state_path;
+
+    if (!(state_path = pa_state_path(NULL, true)))
+        return NULL;
+
+    db = pa_database_open(state_path, PROBE_CACHE_DB, true, for_write);
+    pa_xfree(state_path);
+
+    return db;
+}
+
+/* Returns the entry saved for the key, or NULL if there is none */
+static char *probe_cache_load(const char *key) {
+    pa_database *db;
+    pa_datum k, data;
+    char *s = NULL;
+    pa_mutex *mutex;
+
+    pa_assert_se(mutex = pa_static_mutex_get(&probe_cache_mutex, false, false));
+    pa_mutex_lock(mutex);
+
+    if (!(db = probe_cache_open(false)))
+        goto finish;
+
+    k.data = (void *) key;
+    k.size = strlen(key);
+
+    if (pa_database_get(db, &k, &data)) {
+        s = pa_xstrndup(data.data, data.size);
+        pa_datum_free(&data);
+    }
+
+    pa_database_close(db);
+
+finish:
+    pa_mutex_unlock(mutex);
+
+    return s;
+}
+
+static void probe_cache_save(const char *key, const char *s) {
+    pa_database *db;
+    pa_datum k, data;
+    pa_mutex *mutex;
+
+    pa_assert_se(mutex = pa_static_mutex_get(&probe_cache_mutex, false, false));
+    pa_mutex_lock(mutex);
+
+    if ((db = probe_cache_open(true))) {
+        k.data = (void *) key;
+        k.size = strlen(key);
+        data.data = (void *) s;
+        data.size = strlen(s);
+
+        if (pa_database_set(db, &k, &data, true) < 0 || pa_database_sync(db) < 0)
+            pa_log_warn("Failed to save ALSA probe results.");
+
+        pa_database_close(db);
+    }
+
+    pa_mutex_unlock(mutex);
+}
+
 void pa_alsa_profile_set_probe(
         pa_alsa_profile_set *ps,
         pa_hashmap *mixers,
@@ -5157,6 +5504,9 @@ void pa_alsa_profile_set_probe(
     pa_alsa_mapping *m;
     pa_hashmap *broken_inputs, *broken_outputs, *used_paths;
     pa_alsa_mapping *selected_fallback_input = NULL, *selected_fallback_output = NULL;
+    char *cache_key = NULL, *cache_loaded = NULL;
+    probe_cache *cached = NULL, *results = NULL;
+    int card_index = -1;
 
     pa_assert(ps);
     pa_assert(dev_id);
@@ -5165,6 +5515,25 @@ void pa_alsa_profile_set_probe(
     if (ps->probed)
         return;
 
+    if (ps->probe_cache && ps->probe_cache_id &&
+        (card_index = snd_card_get_index(dev_id)) >= 0 &&
+        (cache_key = probe_cache_key(ps, card_index, ss, default_n_fragments, default_fragment_size_msec))) {
+
+        if ((cache_loaded = probe_cache_load(cache_key))) {
+            cached = probe_cache_new();
+
+            if (probe_cache_parse(cached, cache_loaded))
+                pa_log_debug("Using cached probe results for %s.", dev_id);
+            else {
+                probe_cache_free(cached);
+                cached = NULL;
+            }
+        }
+
+        results = probe_cache_new();
+    }
+
+    /* The values are the errors the mappings failed to open with */
     broken_inputs = pa_hashmap_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
     broken_outputs = pa_hashmap_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
     used_paths = pa_hashmap_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
@@ -5177,6 +5546,7 @@ void pa_alsa_profile_set_probe(
 
     for (pp = probe_order; *pp; pp++) {
         uint32_t idx;
+        bool probed = false, from_cache = false;
         p = *pp;
 
         /* Skip if fallback and already found something, but still probe already selected fallbacks.
@@ -5190,17 +5560,37 @@ void pa_alsa_profile_set_probe(
             if (selected_fallback_output == NULL || pa_idxset_get_by_index(p->output_mappings, 0) != selected_fallback_output)
                 continue;
 
-        /* Skip if this is already marked that it is supported (i.e. from the config file) */
-        if (!p->supported) {
+        /* Skip if this is already marked that it is supported (i.e. from the config file),
+         * and don't open anything if it is known to be supported from the probe cache */
+        if (!p->supported && cached && probe_cache_has_supported(cached, p)) {
+            pa_log_debug("Profile %s known to be supported", p->name);
+
+            profile_finalize_probing(last, NULL);
+            last = NULL;
+
+            probe_cache_apply(cached, p);
+            p->supported = true;
+            probed = from_cache = true;
+
+        } else if (!p->supported) {
+            bool transient = false;
+            int err;
 
             profile_finalize_probing(last, p);
             p->supported = true;
+            probed = true;
+
+            if (cached && probe_cache_get_profile(cached, p) == PROBE_CACHE_UNSUPPORTED) {
+                pa_log_debug("Skipping profile %s - known to be unsupported", p->name);
+                p->supported = false;
+            }
 
-            if (p->output_mappings) {
+            if (p->output_mappings && p->supported) {
                 PA_IDXSET_FOREACH(m, p->output_mappings, idx) {
-                    if (pa_hashmap_get(broken_outputs, m) == m) {
+                    if ((err = PA_PTR_TO_INT(pa_hashmap_get(broken_outputs, m)))) {
                         pa_log_debug("Skipping profile %s - will not be able to open output:%s", p->name, m->name);
                         p->supported = false;
+                        transient = !pa_alsa_open_error_is_permanent(err);
                         break;
                     }
                 }
@@ -5208,9 +5598,10 @@ void pa_alsa_profile_set_probe(
 
             if (p->input_mappings && p->supported) {
                 PA_IDXSET_FOREACH(m, p->input_mappings, idx) {
-                    if (pa_hashmap_get(broken_inputs, m) == m) {
+                    if ((err = PA_PTR_TO_INT(pa_hashmap_get(broken_inputs, m)))) {
                         pa_log_debug("Skipping profile %s - will not be able to open input:%s", p->name, m->name);
                         p->supported = false;
+                        transient = !pa_alsa_open_error_is_permanent(err);
                         break;
                     }
                 }
@@ -5230,12 +5621,14 @@ void pa_alsa_profile_set_probe(
                     if (!(m->output_pcm = mapping_open_pcm(m, ss, dev_id, m->exact_channels,
                                                            SND_PCM_STREAM_PLAYBACK,
                                                            default_n_fragments,
-                                                           default_fragment_size_msec))) {
+                                                           default_fragment_size_msec,
+                                                           &err))) {
                         p->supported = false;
+                        transient = !pa_alsa_open_error_is_permanent(err);
                         if (pa_idxset_size(p->output_mappings) == 1 &&
                             ((!p->input_mappings) || pa_idxset_size(p->input_mappings) == 0)) {
                             pa_log_debug("Caching failure to open output:%s", m->name);
-                            pa_hashmap_put(broken_outputs, m, m);
+                            pa_hashmap_put(broken_outputs, m, PA_INT_TO_PTR(err));
                         }
                         break;
                     }
@@ -5254,12 +5647,14 @@ void pa_alsa_profile_set_probe(
                     if (!(m->input_pcm = mapping_open_pcm(m, ss, dev_id, m->exact_channels,
                                                           SND_PCM_STREAM_CAPTURE,
                                                           default_n_fragments,
-                                                          default_fragment_size_msec))) {
+                                                          default_fragment_size_msec,
+                                                          &err))) {
                         p->supported = false;
+                        transient = !pa_alsa_open_error_is_permanent(err);
                         if (pa_idxset_size(p->input_mappings) == 1 &&
                             ((!p->output_mappings) || pa_idxset_size(p->output_mappings) == 0)) {
                             pa_log_debug("Caching failure to open input:%s", m->name);
-                            pa_hashmap_put(broken_inputs, m, m);
+                            pa_hashmap_put(broken_inputs, m, PA_INT_TO_PTR(err));
                         }
                         break;
                     }
@@ -5270,36 +5665,65 @@ void pa_alsa_profile_set_probe(
 
             last = p;
 
-            if (!p->supported)
+            if (!p->supported) {
+                if (results && !transient)
+                    probe_cache_set_profile(results, p, PROBE_CACHE_UNSUPPORTED);
                 continue;
+            }
         }
 
         pa_log_debug("Profile %s supported.", p->name);
 
+        if (results && probed)
+            probe_cache_set_profile(results, p, PROBE_CACHE_SUPPORTED);
+
         if (p->output_mappings)
             PA_IDXSET_FOREACH(m, p->output_mappings, idx)
-                if (m->output_pcm) {
+                if (m->output_pcm || from_cache) {
                     found_output = true;
                     if (p->fallback_output && selected_fallback_output == NULL) {
                         selected_fallback_output = m;
                     }
-                    mapping_paths_probe(m, p, PA_ALSA_DIRECTION_OUTPUT, used_paths, mixers);
+                    if (results)
+                        probe_cache_set_mapping(results, m, PA_ALSA_DIRECTION_OUTPUT, m->output_pcm, card_index);
+                    mapping_paths_probe(m, p, PA_ALSA_DIRECTION_OUTPUT, used_paths, mixers, card_index);
                 }
 
         if (p->input_mappings)
             PA_IDXSET_FOREACH(m, p->input_mappings, idx)
-                if (m->input_pcm) {
+                if (m->input_pcm || from_cache) {
                     found_input = true;
                     if (p->fallback_input && selected_fallback_input == NULL) {
                         selected_fallback_input = m;
                     }
-                    mapping_paths_probe(m, p, PA_ALSA_DIRECTION_INPUT, used_paths, mixers);
+                    if (results)
+                        probe_cache_set_mapping(results, m, PA_ALSA_DIRECTION_INPUT, m->input_pcm, card_index);
+                    mapping_paths_probe(m, p, PA_ALSA_DIRECTION_INPUT, used_paths, mixers, card_index);
                 }
     }
 
     /* Clean up */
     profile_finalize_probing(last, NULL);
 
+    /* Done before the unsupported profiles are dropped, as their names
+     * are needed */
+    if (results) {
+        char *s;
+
+        s = probe_cache_to_string(results);
+        if (!pa_safe_streq(s, cache_loaded))
+            probe_cache_save(cache_key, s);
+        pa_xfree(s);
+
+        probe_cache_free(results);
+    }
+
+    if (cached)
+        probe_cache_free(cached);
+
+    pa_xfree(cache_loaded);
+    pa_xfree(cache_key);
+
     pa_alsa_profile_set_drop_unsupported(ps);
 
     paths_drop_unused(ps->input_paths, used_paths);
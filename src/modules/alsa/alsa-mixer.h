@@ -373,8 +373,13 @@ struct pa_alsa_profile_set {
     pa_hashmap *input_paths;
     pa_hashmap *output_paths;
 
+    /* Identifies the configuration file the set was loaded from, for
+     * the probe cache. NULL if the set cannot be cached. */
+    char *probe_cache_id;
+
     bool auto_profiles;
     bool ignore_dB:1;
+    bool probe_cache:1;
     bool probed:1;
 };
 
@@ -40,6 +40,8 @@
 
 #include <pulsecore/core.h>
 #include <pulsecore/i18n.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 #include <pulsecore/module.h>
 #include <pulsecore/memchunk.h>
 #include <pulsecore/sink.h>
@@ -100,6 +102,14 @@
 
 #define DEFAULT_WRITE_ITERATION_THRESHOLD 0.03 /* don't iterate write if < 3% of the buffer is available */
 
+/* How long it took to get the device going again after a suspend */
+struct resume_stats {
+    unsigned count;
+    pa_usec_t last_usec;
+    pa_usec_t max_usec;
+    pa_usec_t total_usec;
+};
+
 struct userdata {
     pa_core *core;
     pa_module *module;
@@ -187,10 +197,25 @@ struct userdata {
 
     /* ucm context */
     pa_alsa_ucm_mapping_context *ucm_context;
+
+    /* With standby the PCM is only stopped, not closed, while the sink is
+     * suspended because it is idle, so that resuming does not need to open
+     * and configure it again. Any other suspend cause closes it. */
+    bool use_standby;
+
+    /* Only accessed from the IO thread */
+    bool in_standby;
+    bool standby_passthrough;
+    pa_sample_spec standby_sample_spec;
+    struct resume_stats standby_resumes;
+    struct resume_stats full_resumes;
+
+    char *message_handler_path;
 };
 
 enum {
-    SINK_MESSAGE_SYNC_MIXER = PA_SINK_MESSAGE_MAX
+    SINK_MESSAGE_SYNC_MIXER = PA_SINK_MESSAGE_MAX,
+    SINK_MESSAGE_GET_RESUME_STATS,
 };
 
 static void userdata_free(struct userdata *u);
@@ -1062,7 +1087,9 @@ static int build_pollfd(struct userdata *u) {
 }
 
 /* Called from IO context */
-static void suspend(struct userdata *u) {
+static void suspend(struct userdata *u, bool standby) {
+    int err;
+
     pa_assert(u);
 
     /* Handle may have been invalidated due to a device failure.
@@ -1076,8 +1103,24 @@ static void suspend(struct userdata *u) {
     pa_smoother_pause(u->smoother, pa_rtclock_now());
 #endif
 
-    /* Close PCM device */
-    close_pcm(u);
+    if (standby && (err = snd_pcm_drop(u->pcm_handle)) < 0) {
+        pa_log_debug("snd_pcm_drop() failed, closing the device instead: %s", pa_alsa_strerror(err));
+        standby = false;
+    }
+
+    if (standby) {
+        /* Stop the PCM but keep it open and configured */
+        if (u->alsa_rtpoll_item) {
+            pa_rtpoll_item_free(u->alsa_rtpoll_item);
+            u->alsa_rtpoll_item = NULL;
+        }
+
+        u->in_standby = true;
+        u->standby_sample_spec = u->sink->sample_spec;
+        u->standby_passthrough = pa_sink_is_passthrough(u->sink);
+    } else
+        /* Close PCM device */
+        close_pcm(u);
 
     /* We reset max_rewind/max_request here to make sure that while we
      * are suspended the old max_request/max_rewind values set before
@@ -1087,7 +1130,10 @@ static void suspend(struct userdata *u) {
     pa_sink_set_max_rewind_within_thread(u->sink, 0);
     pa_sink_set_max_request_within_thread(u->sink, 0);
 
-    pa_log_info("Device suspended...");
+    if (standby)
+        pa_log_info("Device in standby...");
+    else
+        pa_log_info("Device suspended...");
 }
 
 /* Called from IO context */
@@ -1187,6 +1233,70 @@ static void update_size(struct userdata *u, pa_sample_spec *ss) {
                 u->frame_size, (unsigned long) u->frames_per_block, u->fragment_size, u->hwbuf_size, u->tsched_size, u->tsched_watermark, u->rewind_safeguard);
 }
 
+/* Called from IO context */
+static void leave_standby(struct userdata *u) {
+    pa_assert(u);
+    pa_assert(u->in_standby);
+
+    u->in_standby = false;
+
+    if (u->pcm_handle) {
+        close_pcm(u);
+        pa_log_info("Device suspended...");
+    }
+}
+
+/* Called from IO context */
+static int resume_from_standby(struct userdata *u) {
+    int err;
+
+    pa_assert(u);
+    pa_assert(u->pcm_handle);
+
+    u->in_standby = false;
+
+    /* The hardware parameters are still those of the sample spec at the
+     * time of the suspend, and a passthrough stream needs the device to be
+     * opened in another mode */
+    if (!pa_sample_spec_equal(&u->sink->sample_spec, &u->standby_sample_spec) ||
+        pa_sink_is_passthrough(u->sink) != u->standby_passthrough) {
+        pa_log_info("Configuration changed during standby, reopening the device.");
+        return -1;
+    }
+
+    if ((err = snd_pcm_prepare(u->pcm_handle)) < 0) {
+        pa_log_info("Failed to prepare the device after standby: %s", pa_alsa_strerror(err));
+        return -1;
+    }
+
+    if (update_sw_params(u, false) < 0)
+        return -1;
+
+    if (build_pollfd(u) < 0)
+        return -1;
+
+    reset_vars(u);
+
+    /* reset the watermark to the value defined when sink was created */
+    if (u->use_tsched)
+        reset_watermark(u, u->tsched_watermark_ref, &u->sink->sample_spec, true);
+
+    return 0;
+}
+
+/* Called from IO context */
+static void resume_done(struct userdata *u, bool standby, pa_usec_t start) {
+    struct resume_stats *stats = standby ? &u->standby_resumes : &u->full_resumes;
+    pa_usec_t usec = pa_rtclock_now() - start;
+
+    stats->count++;
+    stats->last_usec = usec;
+    stats->max_usec = PA_MAX(stats->max_usec, usec);
+    stats->total_usec += usec;
+
+    pa_log_info("Resuming %s took %0.2f ms.", standby ? "from standby" : "the device", (double) usec / PA_USEC_PER_MSEC);
+}
+
 /* Called from IO context */
 static int unsuspend(struct userdata *u, bool recovering) {
     pa_sample_spec ss;
@@ -1196,8 +1306,19 @@ static int unsuspend(struct userdata *u, bool recovering) {
     snd_pcm_uframes_t tsched_frames = 0;
     char *device_name = NULL;
     bool frame_size_changed = false;
+    pa_usec_t start = pa_rtclock_now();
 
     pa_assert(u);
+
+    if (u->in_standby) {
+        if (resume_from_standby(u) >= 0) {
+            resume_done(u, true, start);
+            return 0;
+        }
+
+        close_pcm(u);
+    }
+
     pa_assert(!u->pcm_handle);
 
     pa_log_info("Trying resume...");
@@ -1287,6 +1408,9 @@ static int unsuspend(struct userdata *u, bool recovering) {
 
     pa_log_info("Resumed successfully...");
 
+    if (!recovering)
+        resume_done(u, false, start);
+
     pa_xfree(device_name);
     return 0;
 
@@ -1347,7 +1471,7 @@ static int sink_process_msg(pa_msgobject *o, int code, void *data, int64_t offse
         case PA_SINK_MESSAGE_GET_LATENCY: {
             int64_t r = 0;
 
-            if (u->pcm_handle)
+            if (u->pcm_handle && !u->in_standby)
                 r = sink_get_latency(u);
 
             *((int64_t*) data) = r;
@@ -1361,11 +1485,24 @@ static int sink_process_msg(pa_msgobject *o, int code, void *data, int64_t offse
             sync_mixer(u, port);
             return 0;
         }
+
+        case SINK_MESSAGE_GET_RESUME_STATS: {
+            struct resume_stats *stats = data;
+
+            stats[0] = u->standby_resumes;
+            stats[1] = u->full_resumes;
+            return 0;
+        }
     }
 
     return pa_sink_process_msg(o, code, data, offset, chunk);
 }
 
+/* Called from main and IO context */
+static bool use_standby(struct userdata *u, pa_suspend_cause_t suspend_cause) {
+    return u->use_standby && suspend_cause == PA_SUSPEND_IDLE;
+}
+
 /* Called from main context */
 static int sink_set_state_in_main_thread_cb(pa_sink *s, pa_sink_state_t new_state, pa_suspend_cause_t new_suspend_cause) {
     pa_sink_state_t old_state;
@@ -1386,9 +1523,11 @@ static int sink_set_state_in_main_thread_cb(pa_sink *s, pa_sink_state_t new_stat
 
     old_state = u->sink->state;
 
-    if (PA_SINK_IS_OPENED(old_state) && new_state == PA_SINK_SUSPENDED)
-        reserve_done(u);
-    else if (old_state == PA_SINK_SUSPENDED && PA_SINK_IS_OPENED(new_state))
+    /* The device stays reserved while it is in standby */
+    if ((PA_SINK_IS_OPENED(old_state) || old_state == PA_SINK_SUSPENDED) && new_state == PA_SINK_SUSPENDED) {
+        if (!use_standby(u, new_suspend_cause))
+            reserve_done(u);
+    } else if (old_state == PA_SINK_SUSPENDED && PA_SINK_IS_OPENED(new_state))
         if (reserve_init(u, u->device_name) < 0)
             return -PA_ERR_BUSY;
 
@@ -1413,16 +1552,20 @@ static int sink_set_state_in_io_thread_cb(pa_sink *s, pa_sink_state_t new_state,
         sync_mixer(u, s->active_port);
 
     /* It may be that only the suspend cause is changing, in which case there's
-     * nothing more to do. */
-    if (new_state == s->thread_info.state)
+     * nothing more to do, unless the device has to be closed now. */
+    if (new_state == s->thread_info.state) {
+        if (u->in_standby && !use_standby(u, new_suspend_cause))
+            leave_standby(u);
+
         return 0;
+    }
 
     switch (new_state) {
 
         case PA_SINK_SUSPENDED: {
             pa_assert(PA_SINK_IS_OPENED(s->thread_info.state));
 
-            suspend(u);
+            suspend(u, use_standby(u, new_suspend_cause));
 
             break;
         }
@@ -1757,7 +1900,7 @@ static void sink_update_requested_latency_cb(pa_sink *s) {
                                * we can dynamically adjust the
                                * latency */
 
-    if (!u->pcm_handle)
+    if (!u->pcm_handle || u->in_standby)
         return;
 
     update_sw_params(u, true);
@@ -2325,6 +2468,53 @@ static int setup_mixer(struct userdata *u, bool ignore_dB) {
     return 0;
 }
 
+static void add_resume_stats(pa_json_encoder *encoder, const char *name, const struct resume_stats *stats) {
+    pa_json_encoder_begin_member_object(encoder, name);
+    pa_json_encoder_add_member_int(encoder, "count", stats->count);
+    pa_json_encoder_add_member_int(encoder, "last_usec", (int64_t) stats->last_usec);
+    pa_json_encoder_add_member_int(encoder, "max_usec", (int64_t) stats->max_usec);
+    pa_json_encoder_add_member_int(encoder, "average_usec", stats->count ? (int64_t) (stats->total_usec / stats->count) : 0);
+    pa_json_encoder_end_object(encoder);
+}
+
+/* Called from main context */
+static char *get_resume_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct resume_stats stats[2];
+
+    pa_assert_se(pa_asyncmsgq_send(u->sink->asyncmsgq, PA_MSGOBJECT(u->sink), SINK_MESSAGE_GET_RESUME_STATS, stats, 0, NULL) == 0);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_bool(encoder, "standby", u->use_standby);
+    add_resume_stats(encoder, "standby_resumes", &stats[0]);
+    add_resume_stats(encoder, "full_resumes", &stats[1]);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int alsa_sink_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* How often the device was resumed from standby and how often it had to
+     * be opened again, and how long that took in usec */
+    if (pa_streq(message, "get-resume-stats")) {
+        *response = get_resume_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 pa_sink *pa_alsa_sink_new(pa_module *m, pa_modargs *ma, const char*driver, pa_card *card, pa_alsa_mapping *mapping) {
 
     struct userdata *u = NULL;
@@ -2343,6 +2533,7 @@ pa_sink *pa_alsa_sink_new(pa_module *m, pa_modargs *ma, const char*driver, pa_ca
     bool deferred_volume = false;
     bool set_formats = false;
     bool fixed_latency_range = false;
+    bool use_standby = false;
     bool b;
     bool d;
     bool avoid_resampling;
@@ -2443,6 +2634,11 @@ pa_sink *pa_alsa_sink_new(pa_module *m, pa_modargs *ma, const char*driver, pa_ca
         goto fail;
     }
 
+    if (pa_modargs_get_value_boolean(ma, "standby", &use_standby) < 0) {
+        pa_log("Failed to parse standby argument.");
+        goto fail;
+    }
+
     use_tsched = pa_alsa_may_tsched(use_tsched);
 
     u = pa_xnew0(struct userdata, 1);
@@ -2458,6 +2654,7 @@ pa_sink *pa_alsa_sink_new(pa_module *m, pa_modargs *ma, const char*driver, pa_ca
     u->initial_info.rewind_safeguard = (size_t) rewind_safeguard;
     u->deferred_volume = deferred_volume;
     u->fixed_latency_range = fixed_latency_range;
+    u->use_standby = use_standby;
     u->first = true;
     u->rewind_safeguard = rewind_safeguard;
     u->rtpoll = pa_rtpoll_new();
@@ -2558,7 +2755,7 @@ pa_sink *pa_alsa_sink_new(pa_module *m, pa_modargs *ma, const char*driver, pa_ca
                       &period_frames, &buffer_frames, tsched_frames,
                       &b, &d,
                       &u->supported_formats, &u->supported_rates,
-                      false)))
+                      false, NULL)))
             goto fail;
     }
 
@@ -2836,6 +3033,9 @@ pa_sink *pa_alsa_sink_new(pa_module *m, pa_modargs *ma, const char*driver, pa_ca
 
     pa_sink_put(u->sink);
 
+    u->message_handler_path = pa_sprintf_malloc("/sink/%s/alsa", u->sink->name);
+    pa_message_handler_register(m->core, u->message_handler_path, "ALSA sink message handler", alsa_sink_message_handler, u);
+
     if (profile_set)
         pa_alsa_profile_set_free(profile_set);
 
@@ -2873,6 +3073,11 @@ fail:
 static void userdata_free(struct userdata *u) {
     pa_assert(u);
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(u->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     if (u->sink)
         pa_sink_unlink(u->sink);
 
@@ -2243,7 +2243,7 @@ pa_source *pa_alsa_source_new(pa_module *m, pa_modargs *ma, const char*driver, p
                       &ss, &map,
                       SND_PCM_STREAM_CAPTURE,
                       &period_frames, &buffer_frames, tsched_frames,
-                      &b, &d, &u->supported_formats, &u->supported_rates, false)))
+                      &b, &d, &u->supported_formats, &u->supported_rates, false, NULL)))
             goto fail;
     }
 
@@ -25,7 +25,10 @@
 #endif
 
 #include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <alsa/asoundlib.h>
 
@@ -47,6 +50,9 @@
 #include <pulsecore/thread.h>
 #include <pulsecore/conf-parser.h>
 #include <pulsecore/strbuf.h>
+#include <pulsecore/database.h>
+#include <pulsecore/mutex.h>
+#include <pulsecore/hashmap.h>
 
 #include "alsa-mixer.h"
 #include "alsa-util.h"
@@ -86,6 +92,7 @@ static void device_set_jack(pa_alsa_ucm_device *device, pa_alsa_jack *jack);
 static void device_add_hw_mute_jack(pa_alsa_ucm_device *device, pa_alsa_jack *jack);
 
 static pa_alsa_ucm_device *verb_find_device(pa_alsa_ucm_verb *verb, const char *device_name);
+static void free_verb(pa_alsa_ucm_verb *verb);
 
 
 static void ucm_port_data_init(pa_alsa_ucm_port_data *port, pa_alsa_ucm_config *ucm, pa_device_port *core_port,
@@ -167,14 +174,494 @@ static struct ucm_info dev_info[] = {
 };
 
 
+/* Reading the verbs of a card means switching to every one of them,
+ * which runs its enable sequence, and then querying all values of its
+ * devices and modifiers. This is slow on platforms with large UCM
+ * trees. The answers to these queries are recorded and saved in a
+ * database, keyed by the card, and replayed instead of querying UCM as
+ * long as the UCM configuration on disk does not change. The use case
+ * manager itself is still opened, as it is needed to switch verbs
+ * later on. */
+
+#define UCM_CACHE_DB "alsa-ucm-cache"
+#define UCM_CACHE_MAGIC "PAUCM1"
+#define UCM_CACHE_MAX_DEPTH 8
+
+enum {
+    UCM_ANSWER_ERROR,
+    UCM_ANSWER_VALUE,
+    UCM_ANSWER_LIST,
+};
+
+typedef struct ucm_answer {
+    uint8_t type;
+    int32_t error;
+    char *value;
+    uint32_t n_list;
+    char **list; /* Entries may be NULL */
+} ucm_answer;
+
+typedef struct ucm_query {
+    snd_use_case_mgr_t *uc_mgr;
+
+    /* Most identifiers are relative to the current verb, so answers
+     * are stored as "<verb>\n<id>" */
+    char *verb;
+
+    /* key -> ucm_answer, NULL if the answers are not cached */
+    pa_hashmap *answers;
+
+    /* Answer from the answers recorded earlier instead of UCM */
+    bool replay;
+    /* Set if something was asked that was not recorded */
+    bool replay_failed;
+} ucm_query;
+
+static int ucm_get_verb(ucm_query *q, const char *verb_name, const char *verb_desc, pa_alsa_ucm_verb **p_verb);
+
+typedef struct ucm_cache_buf {
+    uint8_t *data;
+    size_t length, allocated;
+} ucm_cache_buf;
+
+/* pa_database is not safe to use from several threads, and cards may be
+ * prepared in parallel */
+static pa_static_mutex ucm_cache_mutex = PA_STATIC_MUTEX_INIT;
+
+static void ucm_answer_free(ucm_answer *a) {
+    uint32_t i;
+
+    pa_xfree(a->value);
+
+    for (i = 0; i < a->n_list; i++)
+        pa_xfree(a->list[i]);
+    pa_xfree(a->list);
+
+    pa_xfree(a);
+}
+
+static char *ucm_query_key(ucm_query *q, const char *id) {
+    return pa_sprintf_malloc("%s\n%s", pa_strempty(q->verb), id);
+}
+
+static void ucm_query_record(ucm_query *q, const char *id, ucm_answer *a) {
+    char *key;
+
+    key = ucm_query_key(q, id);
+    pa_hashmap_remove_and_free(q->answers, key);
+    pa_hashmap_put(q->answers, key, a);
+}
+
+static ucm_answer *ucm_query_lookup(ucm_query *q, const char *id) {
+    ucm_answer *a;
+    char *key;
+
+    key = ucm_query_key(q, id);
+
+    if (!(a = pa_hashmap_get(q->answers, key))) {
+        pa_log_debug("UCM query %s for verb %s not in cache", id, pa_strnull(q->verb));
+        q->replay_failed = true;
+    }
+
+    pa_xfree(key);
+
+    return a;
+}
+
+/* Same as snd_use_case_get(), the value has to be freed with free() */
+static int ucm_query_get(ucm_query *q, const char *id, const char **value) {
+    ucm_answer *a;
+    int err;
+
+    if (q->replay) {
+        if (!(a = ucm_query_lookup(q, id)) || a->type == UCM_ANSWER_LIST)
+            return -ENOENT;
+
+        if (a->type == UCM_ANSWER_ERROR)
+            return a->error;
+
+        if (!(*value = strdup(pa_strempty(a->value))))
+            return -ENOMEM;
+
+        return 0;
+    }
+
+    err = snd_use_case_get(q->uc_mgr, id, value);
+
+    if (q->answers) {
+        a = pa_xnew0(ucm_answer, 1);
+
+        if (err < 0) {
+            a->type = UCM_ANSWER_ERROR;
+            a->error = err;
+        } else {
+            a->type = UCM_ANSWER_VALUE;
+            a->value = pa_xstrdup(*value);
+        }
+
+        ucm_query_record(q, id, a);
+    }
+
+    return err;
+}
+
+/* Same as snd_use_case_get_list(), the list has to be freed with
+ * snd_use_case_free_list() */
+static int ucm_query_get_list(ucm_query *q, const char *id, const char **list[]) {
+    ucm_answer *a;
+    const char **l;
+    uint32_t i;
+    int n;
+
+    if (q->replay) {
+        if (!(a = ucm_query_lookup(q, id)) || a->type == UCM_ANSWER_VALUE)
+            return -ENOENT;
+
+        if (a->type == UCM_ANSWER_ERROR)
+            return a->error;
+
+        /* alsa-lib frees lists with free(), so don't use pa_xmalloc() */
+        if (!(l = calloc(a->n_list + 1, sizeof(char *))))
+            return -ENOMEM;
+
+        for (i = 0; i < a->n_list; i++)
+            if (a->list[i] && !(l[i] = strdup(a->list[i]))) {
+                snd_use_case_free_list(l, (int) i);
+                return -ENOMEM;
+            }
+
+        *list = l;
+        return (int) a->n_list;
+    }
+
+    n = snd_use_case_get_list(q->uc_mgr, id, list);
+
+    if (q->answers) {
+        a = pa_xnew0(ucm_answer, 1);
+
+        if (n < 0) {
+            a->type = UCM_ANSWER_ERROR;
+            a->error = n;
+        } else {
+            a->type = UCM_ANSWER_LIST;
+            a->n_list = (uint32_t) n;
+            a->list = pa_xnew0(char *, n + 1);
+
+            for (i = 0; i < (uint32_t) n; i++)
+                a->list[i] = pa_xstrdup((*list)[i]);
+        }
+
+        ucm_query_record(q, id, a);
+    }
+
+    return n;
+}
+
+static int ucm_query_set_verb(ucm_query *q, const char *verb_name) {
+    int err = 0;
+
+    /* The verb only matters for what is queried, nothing is read from
+     * the hardware */
+    if (!q->replay)
+        err = snd_use_case_set(q->uc_mgr, "_verb", verb_name);
+
+    pa_xfree(q->verb);
+    q->verb = err < 0 ? NULL : pa_xstrdup(verb_name);
+
+    return err;
+}
+
+static void ucm_cache_append(ucm_cache_buf *b, const void *data, size_t length) {
+    if (b->length + length > b->allocated) {
+        b->allocated = PA_MAX(b->allocated * 2, b->length + length);
+        b->data = pa_xrealloc(b->data, b->allocated);
+    }
+
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+}
+
+static void ucm_cache_append_string(ucm_cache_buf *b, const char *s) {
+    ucm_cache_append(b, s, strlen(s) + 1);
+}
+
+static void ucm_cache_append_u32(ucm_cache_buf *b, uint32_t u) {
+    ucm_cache_append(b, &u, sizeof(u));
+}
+
+static const void *ucm_cache_read(const uint8_t **p, const uint8_t *end, size_t length) {
+    const uint8_t *r = *p;
+
+    if ((size_t) (end - r) < length)
+        return NULL;
+
+    *p += length;
+    return r;
+}
+
+static const char *ucm_cache_read_string(const uint8_t **p, const uint8_t *end) {
+    const uint8_t *nul;
+    const char *s = (const char *) *p;
+
+    if (!(nul = memchr(*p, 0, end - *p)))
+        return NULL;
+
+    *p = nul + 1;
+    return s;
+}
+
+static bool ucm_cache_read_u32(const uint8_t **p, const uint8_t *end, uint32_t *u) {
+    const void *r;
+
+    if (!(r = ucm_cache_read(p, end, sizeof(*u))))
+        return false;
+
+    memcpy(u, r, sizeof(*u));
+    return true;
+}
+
+/* Summarizes the UCM configuration on disk. Which files a card uses is
+ * only known to alsa-lib, so all of them are taken into account. */
+static void ucm_cache_stamp_dir(const char *path, unsigned depth, unsigned *n_files, time_t *newest) {
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+
+    if (depth > UCM_CACHE_MAX_DEPTH || !(d = opendir(path)))
+        return;
+
+    while ((de = readdir(d))) {
+        char *fn;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        fn = pa_sprintf_malloc("%s/%s", path, de->d_name);
+
+        if (stat(fn, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                ucm_cache_stamp_dir(fn, depth + 1, n_files, newest);
+            else {
+                (*n_files)++;
+                *newest = PA_MAX(*newest, st.st_mtime);
+            }
+        }
+
+        pa_xfree(fn);
+    }
+
+    closedir(d);
+}
+
+static char *ucm_cache_stamp(void) {
+    static const char * const dirs[] = { "ucm2", "ucm" };
+    pa_strbuf *buf;
+    unsigned i;
+
+    buf = pa_strbuf_new();
+    pa_strbuf_printf(buf, "%s|%s", PACKAGE_VERSION, snd_asoundlib_version());
+
+    for (i = 0; i < PA_ELEMENTSOF(dirs); i++) {
+        unsigned n_files = 0;
+        time_t newest = 0;
+        char *path;
+
+        path = pa_sprintf_malloc("%s/%s", snd_config_topdir(), dirs[i]);
+        ucm_cache_stamp_dir(path, 0, &n_files, &newest);
+        pa_strbuf_printf(buf, "|%s:%u:%llu", path, n_files, (unsigned long long) newest);
+        pa_xfree(path);
+    }
+
+    /* These override where alsa-lib looks for the configuration */
+    pa_strbuf_printf(buf, "|%s|%s", pa_strempty(getenv("ALSA_CONFIG_UCM2")), pa_strempty(getenv("ALSA_CONFIG_UCM")));
+
+    return pa_strbuf_to_string_free(buf);
+}
+
+static pa_database *ucm_cache_open(bool for_write) {
+    pa_database *db;
+    char *state_path;
+
+    if (!(state_path = pa_state_path(NULL, true)))
+        return NULL;
+
+    db = pa_database_open(state_path, UCM_CACHE_DB, true, for_write);
+    pa_xfree(state_path);
+
+    return db;
+}
+
+static bool ucm_cache_parse(pa_hashmap *answers, const char *stamp, const uint8_t *p, const uint8_t *end) {
+    const char *s;
+    uint32_t n, i;
+
+    if (!(s = ucm_cache_read_string(&p, end)) || !pa_streq(s, UCM_CACHE_MAGIC))
+        return false;
+
+    if (!(s = ucm_cache_read_string(&p, end)) || !pa_streq(s, stamp)) {
+        pa_log_debug("UCM configuration changed, not using cached UCM data.");
+        return false;
+    }
+
+    if (!ucm_cache_read_u32(&p, end, &n))
+        return false;
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *type;
+        const char *id;
+        ucm_answer *a;
+        uint32_t j;
+
+        if (!(type = ucm_cache_read(&p, end, 1)) || !(id = ucm_cache_read_string(&p, end)))
+            return false;
+
+        a = pa_xnew0(ucm_answer, 1);
+        a->type = *type;
+        pa_hashmap_put(answers, pa_xstrdup(id), a);
+
+        switch (a->type) {
+            case UCM_ANSWER_ERROR: {
+                uint32_t u;
+
+                if (!ucm_cache_read_u32(&p, end, &u))
+                    return false;
+                a->error = (int32_t) u;
+                break;
+            }
+
+            case UCM_ANSWER_VALUE:
+                if (!(s = ucm_cache_read_string(&p, end)))
+                    return false;
+                a->value = pa_xstrdup(s);
+                break;
+
+            case UCM_ANSWER_LIST:
+                if (!ucm_cache_read_u32(&p, end, &a->n_list) || a->n_list > (size_t) (end - p))
+                    return false;
+
+                a->list = pa_xnew0(char *, a->n_list + 1);
+
+                for (j = 0; j < a->n_list; j++) {
+                    const uint8_t *present;
+
+                    if (!(present = ucm_cache_read(&p, end, 1)))
+                        return false;
+
+                    if (!*present)
+                        continue;
+
+                    if (!(s = ucm_cache_read_string(&p, end)))
+                        return false;
+                    a->list[j] = pa_xstrdup(s);
+                }
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    return p == end;
+}
+
+static bool ucm_cache_load(pa_hashmap *answers, const char *key, const char *stamp) {
+    pa_database *db;
+    pa_datum k, data;
+    pa_mutex *mutex;
+    bool loaded = false;
+
+    pa_assert_se(mutex = pa_static_mutex_get(&ucm_cache_mutex, false, false));
+    pa_mutex_lock(mutex);
+
+    if ((db = ucm_cache_open(false))) {
+        k.data = (void *) key;
+        k.size = strlen(key);
+
+        if (pa_database_get(db, &k, &data)) {
+            loaded = ucm_cache_parse(answers, stamp, data.data, (const uint8_t *) data.data + data.size);
+            pa_datum_free(&data);
+        }
+
+        pa_database_close(db);
+    }
+
+    pa_mutex_unlock(mutex);
+
+    if (!loaded)
+        pa_hashmap_remove_all(answers);
+
+    return loaded;
+}
+
+static void ucm_cache_save(pa_hashmap *answers, const char *key, const char *stamp) {
+    ucm_cache_buf b = { NULL, 0, 0 };
+    pa_database *db;
+    pa_datum k, data;
+    pa_mutex *mutex;
+    const char *id;
+    ucm_answer *a;
+    void *state;
+    uint32_t i;
+
+    ucm_cache_append_string(&b, UCM_CACHE_MAGIC);
+    ucm_cache_append_string(&b, stamp);
+    ucm_cache_append_u32(&b, pa_hashmap_size(answers));
+
+    PA_HASHMAP_FOREACH_KV(id, a, answers, state) {
+        ucm_cache_append(&b, &a->type, 1);
+        ucm_cache_append_string(&b, id);
+
+        switch (a->type) {
+            case UCM_ANSWER_ERROR:
+                ucm_cache_append_u32(&b, (uint32_t) a->error);
+                break;
+
+            case UCM_ANSWER_VALUE:
+                ucm_cache_append_string(&b, pa_strempty(a->value));
+                break;
+
+            case UCM_ANSWER_LIST:
+                ucm_cache_append_u32(&b, a->n_list);
+
+                for (i = 0; i < a->n_list; i++) {
+                    uint8_t present = !!a->list[i];
+
+                    ucm_cache_append(&b, &present, 1);
+                    if (present)
+                        ucm_cache_append_string(&b, a->list[i]);
+                }
+                break;
+        }
+    }
+
+    pa_assert_se(mutex = pa_static_mutex_get(&ucm_cache_mutex, false, false));
+    pa_mutex_lock(mutex);
+
+    if ((db = ucm_cache_open(true))) {
+        k.data = (void *) key;
+        k.size = strlen(key);
+        data.data = b.data;
+        data.size = b.length;
+
+        if (pa_database_set(db, &k, &data, true) < 0 || pa_database_sync(db) < 0)
+            pa_log_warn("Failed to save UCM data to cache.");
+
+        pa_database_close(db);
+    }
+
+    pa_mutex_unlock(mutex);
+
+    pa_xfree(b.data);
+}
+
 static char *ucm_verb_value(
-    snd_use_case_mgr_t *uc_mgr,
+    ucm_query *q,
     const char *verb_name,
     const char *id) {
 
     const char *value;
     char *_id = pa_sprintf_malloc("=%s//%s", id, verb_name);
-    int err = snd_use_case_get(uc_mgr, _id, &value);
+    int err = ucm_query_get(q, _id, &value);
     pa_xfree(_id);
     if (err < 0)
          return NULL;
@@ -346,7 +833,7 @@ static const char *get_jack_mixer_device(pa_alsa_ucm_device *dev, bool is_sink)
 /* Create a property list for this ucm device */
 static int ucm_get_device_property(
         pa_alsa_ucm_device *device,
-        snd_use_case_mgr_t *uc_mgr,
+        ucm_query *q,
         pa_alsa_ucm_verb *verb,
         const char *device_name) {
 
@@ -375,7 +862,7 @@ static int ucm_get_device_property(
     /* set properties */
     for (i = 0; item[i].id; i++) {
         id = pa_sprintf_malloc("%s/%s", item[i].id, device_name);
-        err = snd_use_case_get(uc_mgr, id, &value);
+        err = ucm_query_get(q, id, &value);
         pa_xfree(id);
         if (err < 0)
             continue;
@@ -508,7 +995,7 @@ static int ucm_get_device_property(
     }
 
     id = pa_sprintf_malloc("%s/%s", "_conflictingdevs", device_name);
-    n_confdev = snd_use_case_get_list(uc_mgr, id, &devices);
+    n_confdev = ucm_query_get_list(q, id, &devices);
     pa_xfree(id);
 
     device->conflicting_devices = pa_idxset_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
@@ -520,7 +1007,7 @@ static int ucm_get_device_property(
     }
 
     id = pa_sprintf_malloc("%s/%s", "_supporteddevs", device_name);
-    n_suppdev = snd_use_case_get_list(uc_mgr, id, &devices);
+    n_suppdev = ucm_query_get_list(q, id, &devices);
     pa_xfree(id);
 
     device->supported_devices = pa_idxset_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
@@ -537,7 +1024,7 @@ static int ucm_get_device_property(
 /* Create a property list for this ucm modifier */
 static int ucm_get_modifier_property(
         pa_alsa_ucm_modifier *modifier,
-        snd_use_case_mgr_t *uc_mgr,
+        ucm_query *q,
         pa_alsa_ucm_verb *verb,
         const char *modifier_name) {
     const char *value;
@@ -550,7 +1037,7 @@ static int ucm_get_modifier_property(
         int err;
 
         id = pa_sprintf_malloc("=%s/%s", item[i].id, modifier_name);
-        err = snd_use_case_get(uc_mgr, id, &value);
+        err = ucm_query_get(q, id, &value);
         pa_xfree(id);
         if (err < 0)
             continue;
@@ -561,7 +1048,7 @@ static int ucm_get_modifier_property(
     }
 
     id = pa_sprintf_malloc("%s/%s", "_conflictingdevs", modifier_name);
-    n_confdev = snd_use_case_get_list(uc_mgr, id, &devices);
+    n_confdev = ucm_query_get_list(q, id, &devices);
     pa_xfree(id);
 
     modifier->conflicting_devices = pa_idxset_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
@@ -573,7 +1060,7 @@ static int ucm_get_modifier_property(
     }
 
     id = pa_sprintf_malloc("%s/%s", "_supporteddevs", modifier_name);
-    n_suppdev = snd_use_case_get_list(uc_mgr, id, &devices);
+    n_suppdev = ucm_query_get_list(q, id, &devices);
     pa_xfree(id);
 
     modifier->supported_devices = pa_idxset_new(pa_idxset_trivial_hash_func, pa_idxset_trivial_compare_func);
@@ -588,11 +1075,11 @@ static int ucm_get_modifier_property(
 };
 
 /* Create a list of devices for this verb */
-static int ucm_get_devices(pa_alsa_ucm_verb *verb, snd_use_case_mgr_t *uc_mgr) {
+static int ucm_get_devices(pa_alsa_ucm_verb *verb, ucm_query *q) {
     const char **dev_list;
     int num_dev, i;
 
-    num_dev = snd_use_case_get_list(uc_mgr, "_devices", &dev_list);
+    num_dev = ucm_query_get_list(q, "_devices", &dev_list);
     if (num_dev < 0)
         return num_dev;
 
@@ -687,11 +1174,11 @@ static int ucm_device_enable(pa_alsa_ucm_config *ucm, pa_alsa_ucm_device *dev) {
     return 0;
 }
 
-static int ucm_get_modifiers(pa_alsa_ucm_verb *verb, snd_use_case_mgr_t *uc_mgr) {
+static int ucm_get_modifiers(pa_alsa_ucm_verb *verb, ucm_query *q) {
     const char **mod_list;
     int num_mod, i;
 
-    num_mod = snd_use_case_get_list(uc_mgr, "_modifiers", &mod_list);
+    num_mod = ucm_query_get_list(q, "_modifiers", &mod_list);
     if (num_mod < 0)
         return num_mod;
 
@@ -881,11 +1368,49 @@ static void append_lost_relationship(pa_alsa_ucm_device *dev) {
                     pa_proplist_gets(d->proplist, PA_ALSA_PROP_UCM_NAME));
 }
 
-int pa_alsa_ucm_query_profiles(pa_alsa_ucm_config *ucm, int card_index) {
-    char *card_name;
-    const char **verb_list, *value;
+static int ucm_query_verbs(pa_alsa_ucm_config *ucm, ucm_query *q, const char *card_name) {
+    const char **verb_list;
     int num_verbs, i, err = 0;
 
+    /* get a list of all UCM verbs for this card */
+    num_verbs = ucm_query_get_list(q, "_verbs", &verb_list);
+    if (num_verbs < 0) {
+        pa_log("UCM verb list not found for %s", card_name);
+        return -PA_ALSA_ERR_UNSPECIFIED;
+    }
+
+    /* get the properties of each UCM verb */
+    for (i = 0; i < num_verbs; i += 2) {
+        pa_alsa_ucm_verb *verb;
+
+        /* Get devices and modifiers for each verb */
+        err = ucm_get_verb(q, verb_list[i], verb_list[i+1], &verb);
+        if (err < 0) {
+            pa_log("Failed to get the verb %s", verb_list[i]);
+            continue;
+        }
+
+        PA_LLIST_PREPEND(pa_alsa_ucm_verb, ucm->verbs, verb);
+    }
+
+    if (!ucm->verbs) {
+        pa_log("No UCM verb is valid for %s", card_name);
+        err = -PA_ALSA_ERR_UCM_NO_VERB;
+    }
+
+    snd_use_case_free_list(verb_list, num_verbs);
+
+    return err;
+}
+
+int pa_alsa_ucm_query_profiles(pa_alsa_ucm_config *ucm, int card_index) {
+    char *card_name, *key = NULL, *stamp = NULL;
+    const char *value;
+    ucm_query q;
+    int err = 0;
+
+    pa_zero(q);
+
     /* support multiple card instances, address card directly by index */
     card_name = pa_sprintf_malloc("hw:%i", card_index);
     err = snd_use_case_mgr_open(&ucm->ucm_mgr, card_name);
@@ -928,34 +1453,47 @@ int pa_alsa_ucm_query_profiles(pa_alsa_ucm_config *ucm, int card_index) {
         free((void *)value);
     }
 
-    /* get a list of all UCM verbs for this card */
-    num_verbs = snd_use_case_verb_list(ucm->ucm_mgr, &verb_list);
-    if (num_verbs < 0) {
-        pa_log("UCM verb list not found for %s", card_name);
-        err = -PA_ALSA_ERR_UNSPECIFIED;
-        goto ucm_verb_fail;
+    q.uc_mgr = ucm->ucm_mgr;
+
+    if (ucm->use_cache && (key = pa_alsa_get_card_identity(card_index))) {
+        stamp = ucm_cache_stamp();
+        q.answers = pa_hashmap_new_full(pa_idxset_string_hash_func, pa_idxset_string_compare_func,
+                                        pa_xfree, (pa_free_cb_t) ucm_answer_free);
+
+        if ((q.replay = ucm_cache_load(q.answers, key, stamp)))
+            pa_log_info("Using cached UCM data for card %s", card_name);
     }
 
-    /* get the properties of each UCM verb */
-    for (i = 0; i < num_verbs; i += 2) {
-        pa_alsa_ucm_verb *verb;
+    err = ucm_query_verbs(ucm, &q, card_name);
 
-        /* Get devices and modifiers for each verb */
-        err = pa_alsa_ucm_get_verb(ucm->ucm_mgr, verb_list[i], verb_list[i+1], &verb);
-        if (err < 0) {
-            pa_log("Failed to get the verb %s", verb_list[i]);
-            continue;
+    if (q.replay && q.replay_failed) {
+        pa_alsa_ucm_verb *vi, *vn;
+
+        pa_log_info("Cached UCM data for card %s is incomplete, querying UCM.", card_name);
+
+        PA_LLIST_FOREACH_SAFE(vi, vn, ucm->verbs) {
+            PA_LLIST_REMOVE(pa_alsa_ucm_verb, ucm->verbs, vi);
+            free_verb(vi);
         }
 
-        PA_LLIST_PREPEND(pa_alsa_ucm_verb, ucm->verbs, verb);
+        pa_hashmap_remove_all(q.answers);
+        pa_xfree(q.verb);
+        q.verb = NULL;
+        q.replay = q.replay_failed = false;
+
+        err = ucm_query_verbs(ucm, &q, card_name);
     }
 
-    if (!ucm->verbs) {
-        pa_log("No UCM verb is valid for %s", card_name);
-        err = -PA_ALSA_ERR_UCM_NO_VERB;
+    if (q.answers) {
+        if (!q.replay && err >= 0)
+            ucm_cache_save(q.answers, key, stamp);
+
+        pa_hashmap_free(q.answers);
     }
 
-    snd_use_case_free_list(verb_list, num_verbs);
+    pa_xfree(q.verb);
+    pa_xfree(key);
+    pa_xfree(stamp);
 
 ucm_verb_fail:
     if (err < 0) {
@@ -970,7 +1508,7 @@ name_fail:
     return err;
 }
 
-int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, const char *verb_desc, pa_alsa_ucm_verb **p_verb) {
+static int ucm_get_verb(ucm_query *q, const char *verb_name, const char *verb_desc, pa_alsa_ucm_verb **p_verb) {
     pa_alsa_ucm_device *d;
     pa_alsa_ucm_modifier *mod;
     pa_alsa_ucm_verb *verb;
@@ -980,7 +1518,7 @@ int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, cons
 
     *p_verb = NULL;
     pa_log_info("Set UCM verb to %s", verb_name);
-    err = snd_use_case_set(uc_mgr, "_verb", verb_name);
+    err = ucm_query_set_verb(q, verb_name);
     if (err < 0)
         return err;
 
@@ -990,16 +1528,16 @@ int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, cons
     pa_proplist_sets(verb->proplist, PA_ALSA_PROP_UCM_NAME, pa_strnull(verb_name));
     pa_proplist_sets(verb->proplist, PA_ALSA_PROP_UCM_DESCRIPTION, pa_strna(verb_desc));
 
-    value = ucm_verb_value(uc_mgr, verb_name, "Priority");
+    value = ucm_verb_value(q, verb_name, "Priority");
     if (value && !pa_atou(value, &ui))
         verb->priority = ui > 10000 ? 10000 : ui;
     free(value);
 
-    err = ucm_get_devices(verb, uc_mgr);
+    err = ucm_get_devices(verb, q);
     if (err < 0)
         pa_log("No UCM devices for verb %s", verb_name);
 
-    err = ucm_get_modifiers(verb, uc_mgr);
+    err = ucm_get_modifiers(verb, q);
     if (err < 0)
         pa_log("No UCM modifiers for verb %s", verb_name);
 
@@ -1007,7 +1545,7 @@ int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, cons
         const char *dev_name = pa_proplist_gets(d->proplist, PA_ALSA_PROP_UCM_NAME);
 
         /* Devices properties */
-        ucm_get_device_property(d, uc_mgr, verb, dev_name);
+        ucm_get_device_property(d, q, verb, dev_name);
     }
     /* make conflicting or supported device mutual */
     PA_LLIST_FOREACH(d, verb->devices)
@@ -1017,7 +1555,7 @@ int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, cons
         const char *mod_name = pa_proplist_gets(mod->proplist, PA_ALSA_PROP_UCM_NAME);
 
         /* Modifier properties */
-        ucm_get_modifier_property(mod, uc_mgr, verb, mod_name);
+        ucm_get_modifier_property(mod, q, verb, mod_name);
 
         /* Set PA_PROP_DEVICE_INTENDED_ROLES property to devices */
         pa_log_debug("Set media roles for verb %s, modifier %s", verb_name, mod_name);
@@ -1028,6 +1566,19 @@ int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, cons
     return 0;
 }
 
+int pa_alsa_ucm_get_verb(snd_use_case_mgr_t *uc_mgr, const char *verb_name, const char *verb_desc, pa_alsa_ucm_verb **p_verb) {
+    ucm_query q;
+    int err;
+
+    pa_zero(q);
+    q.uc_mgr = uc_mgr;
+
+    err = ucm_get_verb(&q, verb_name, verb_desc, p_verb);
+    pa_xfree(q.verb);
+
+    return err;
+}
+
 static int pa_alsa_ucm_device_cmp(const void *a, const void *b) {
     const pa_alsa_ucm_device *d1 = *(pa_alsa_ucm_device **)a;
     const pa_alsa_ucm_device *d2 = *(pa_alsa_ucm_device **)b;
@@ -2148,7 +2699,7 @@ static snd_pcm_t* mapping_open_pcm(pa_alsa_ucm_config *ucm, pa_alsa_mapping *m,
     try_buffer_size = ucm->core->default_n_fragments * try_period_size;
 
     pcm = pa_alsa_open_by_device_string(m->device_strings[0], NULL, &try_ss,
-            &try_map, mode, &try_period_size, &try_buffer_size, 0, NULL, NULL, NULL, NULL, exact_channels);
+            &try_map, mode, &try_period_size, &try_buffer_size, 0, NULL, NULL, NULL, NULL, exact_channels, NULL);
 
     if (pcm) {
         if (!exact_channels)
@@ -253,6 +253,9 @@ struct pa_alsa_ucm_config {
     pa_alsa_ucm_verb *active_verb;
     char *alib_prefix;
 
+    /* Replay UCM answers saved by an earlier query of the same card */
+    bool use_cache;
+
     pa_hashmap *mixers;
     PA_LLIST_HEAD(pa_alsa_ucm_verb, verbs);
     PA_LLIST_HEAD(pa_alsa_jack, jacks);
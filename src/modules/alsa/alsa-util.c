@@ -620,7 +620,8 @@ snd_pcm_t *pa_alsa_open_by_device_id_auto(
             use_tsched,
             query_supported_formats,
             query_supported_rates,
-            false);
+            false,
+            NULL);
     pa_xfree(d);
 
     if (pcm_handle && mapping)
@@ -673,7 +674,8 @@ snd_pcm_t *pa_alsa_open_by_device_id_mapping(
             use_tsched,
             query_supported_formats,
             query_supported_rates,
-            pa_channel_map_valid(&m->channel_map) /* Query the channel count if we don't know what we want */);
+            pa_channel_map_valid(&m->channel_map) /* Query the channel count if we don't know what we want */,
+            NULL);
 
     if (!pcm_handle)
         return NULL;
@@ -698,7 +700,8 @@ snd_pcm_t *pa_alsa_open_by_device_string(
         bool *use_tsched,
         pa_sample_format_t **query_supported_formats,
         unsigned int **query_supported_rates,
-        bool require_exact_channel_number) {
+        bool require_exact_channel_number,
+        int *ret_err) {
 
     int err;
     char *d;
@@ -772,6 +775,7 @@ snd_pcm_t *pa_alsa_open_by_device_string(
             pa_log("Device %s has %u channels, but PulseAudio supports only %u channels. Unable to use the device.",
                    d, ss->channels, PA_CHANNELS_MAX);
             snd_pcm_close(pcm_handle);
+            err = -EINVAL;
             goto fail;
         }
 
@@ -789,6 +793,9 @@ snd_pcm_t *pa_alsa_open_by_device_string(
 fail:
     pa_xfree(d);
 
+    if (ret_err)
+        *ret_err = err;
+
     return NULL;
 }
 
@@ -806,13 +813,16 @@ snd_pcm_t *pa_alsa_open_by_template(
         bool *use_tsched,
         pa_sample_format_t **query_supported_formats,
         unsigned int **query_supported_rates,
-        bool require_exact_channel_number) {
+        bool require_exact_channel_number,
+        int *ret_err) {
 
     snd_pcm_t *pcm_handle;
     char **i;
+    int err = -ENOENT;
 
     for (i = template; *i; i++) {
         char *d;
+        int e;
 
         d = pa_replace(*i, "%f", dev_id);
 
@@ -829,17 +839,30 @@ snd_pcm_t *pa_alsa_open_by_template(
                 use_tsched,
                 query_supported_formats,
                 query_supported_rates,
-                require_exact_channel_number);
+                require_exact_channel_number,
+                &e);
 
         pa_xfree(d);
 
         if (pcm_handle)
             return pcm_handle;
+
+        /* Report a failure that may go away rather than one that won't,
+         * a busy device must not be taken for a missing one */
+        if (pa_alsa_open_error_is_permanent(err))
+            err = e;
     }
 
+    if (ret_err)
+        *ret_err = err;
+
     return NULL;
 }
 
+bool pa_alsa_open_error_is_permanent(int err) {
+    return err == -ENOENT || err == -ENODEV || err == -EINVAL;
+}
+
 void pa_alsa_dump(pa_log_level_t level, snd_pcm_t *pcm) {
     int err;
     snd_output_t *out;
@@ -1394,6 +1417,38 @@ char *pa_alsa_get_driver_name(int card) {
     return n;
 }
 
+char *pa_alsa_get_card_identity(int card) {
+    snd_ctl_t *ctl;
+    snd_ctl_card_info_t *info;
+    char *t, *n = NULL;
+
+    pa_assert(card >= 0);
+
+    t = pa_sprintf_malloc("hw:%i", card);
+
+    if (snd_ctl_open(&ctl, t, 0) < 0) {
+        pa_xfree(t);
+        return NULL;
+    }
+
+    pa_xfree(t);
+
+    snd_ctl_card_info_alloca(&info);
+
+    /* The long name includes the bus address */
+    if (snd_ctl_card_info(ctl, info) >= 0)
+        n = pa_sprintf_malloc("%s|%s|%s|%s|%s",
+                              snd_ctl_card_info_get_id(info),
+                              snd_ctl_card_info_get_driver(info),
+                              snd_ctl_card_info_get_longname(info),
+                              snd_ctl_card_info_get_mixername(info),
+                              snd_ctl_card_info_get_components(info));
+
+    snd_ctl_close(ctl);
+
+    return n;
+}
+
 char *pa_alsa_get_driver_name_by_pcm(snd_pcm_t *pcm) {
     int card;
     snd_pcm_info_t* info;
@@ -102,7 +102,8 @@ snd_pcm_t *pa_alsa_open_by_device_string(
         bool *use_tsched,                 /* modified at return */
         pa_sample_format_t **query_supported_formats, /* modified at return */
         unsigned int **query_supported_rates,         /* modified at return */
-        bool require_exact_channel_number);
+        bool require_exact_channel_number,
+        int *ret_err);                    /* modified at return, may be NULL */
 
 /* Opens the explicit ALSA device with a fallback list */
 snd_pcm_t *pa_alsa_open_by_template(
@@ -119,7 +120,13 @@ snd_pcm_t *pa_alsa_open_by_template(
         bool *use_tsched,                 /* modified at return */
         pa_sample_format_t **query_supported_formats, /* modified at return */
         unsigned int **query_supported_rates,        /* modified at return */
-        bool require_exact_channel_number);
+        bool require_exact_channel_number,
+        int *ret_err);                    /* modified at return, may be NULL */
+
+/* Whether opening a PCM that failed with err will fail again as long as
+ * the hardware and the configuration do not change. A busy device, for
+ * example, may open fine the next time. */
+bool pa_alsa_open_error_is_permanent(int err);
 
 void pa_alsa_dump(pa_log_level_t level, snd_pcm_t *pcm);
 void pa_alsa_dump_status(snd_pcm_t *pcm);
@@ -142,6 +149,10 @@ int pa_alsa_safe_delay(snd_pcm_t *pcm, snd_pcm_status_t *status, snd_pcm_sframes
 int pa_alsa_safe_mmap_begin(snd_pcm_t *pcm, const snd_pcm_channel_area_t **areas, snd_pcm_uframes_t *offset, snd_pcm_uframes_t *frames, size_t hwbuf_size, const pa_sample_spec *ss);
 
 char *pa_alsa_get_driver_name(int card);
+
+/* Returns a string that identifies the card (and tells apart cards of
+ * the same model), for keying cached data. NULL on failure. */
+char *pa_alsa_get_card_identity(int card);
 char *pa_alsa_get_driver_name_by_pcm(snd_pcm_t *pcm);
 
 char *pa_alsa_get_reserve_name(const char *device);
@@ -66,10 +66,13 @@ PA_MODULE_USAGE(
         "ignore_dB=<ignore dB information from the device?> "
         "deferred_volume=<Synchronize software and hardware volume changes to avoid momentary jumps?> "
         "profile_set=<profile set configuration file> "
+        "probe_cache=<remember the results of probing the profiles?> "
+        "ucm_cache=<remember UCM query results?> "
         "paths_dir=<directory containing the path configuration files> "
         "use_ucm=<load use case manager> "
         "avoid_resampling=<use stream original sample rate if possible?> "
         "control=<name of mixer control> "
+        "standby=<keep the playback device open while suspended because of idleness?> "
 );
 
 static const char* const valid_modargs[] = {
@@ -95,10 +98,13 @@ static const char* const valid_modargs[] = {
     "ignore_dB",
     "deferred_volume",
     "profile_set",
+    "probe_cache",
+    "ucm_cache",
     "paths_dir",
     "use_ucm",
     "avoid_resampling",
     "control",
+    "standby",
     NULL
 };
 
@@ -847,15 +853,177 @@ static pa_hook_result_t source_output_unlink_hook_callback(pa_core *c, pa_source
     return PA_HOOK_OK;
 }
 
+/* Replaces *ma with the module arguments from the udev database, with
+ * the original arguments taking precedence */
+static int apply_udev_modargs(pa_modargs **ma, int alsa_card_index) {
+    char *udev_args = NULL;
+    bool udev_modargs_success = true;
+    pa_modargs *temp_ma;
+
+#ifdef HAVE_UDEV
+    udev_args = pa_udev_get_property(alsa_card_index, PULSE_MODARGS);
+#endif
+
+    if (!udev_args)
+        return 0;
+
+    temp_ma = pa_modargs_new(udev_args, valid_modargs);
+
+    if (temp_ma) {
+        /* do not try to replace device_id */
+
+        if (pa_modargs_remove_key(temp_ma, "device_id") == 0) {
+            pa_log_warn("Unexpected 'device_id' module argument override ignored from udev " PULSE_MODARGS "='%s'", udev_args);
+        }
+
+        /* Implement modargs override by copying original module arguments
+         * over udev entry arguments ignoring duplicates. */
+
+        if (pa_modargs_merge_missing(temp_ma, *ma, valid_modargs) == 0) {
+            /* swap module arguments */
+            pa_modargs *old_ma = *ma;
+            *ma = temp_ma;
+            temp_ma = old_ma;
+
+            pa_log_info("Applied module arguments override from udev " PULSE_MODARGS "='%s'", udev_args);
+        } else {
+            pa_log("Failed to apply module arguments override from udev " PULSE_MODARGS "='%s'", udev_args);
+            udev_modargs_success = false;
+        }
+
+        pa_modargs_free(temp_ma);
+    } else {
+        pa_log("Failed to parse module arguments from udev " PULSE_MODARGS "='%s'", udev_args);
+        udev_modargs_success = false;
+    }
+    pa_xfree(udev_args);
+
+    return udev_modargs_success ? 0 : -1;
+}
+
+/* Picks the profile set configuration file like pa__init() does when
+ * UCM is not used */
+static char *get_profile_set_fn(pa_modargs *ma, int alsa_card_index) {
+    char *fn = NULL;
+
+#ifdef HAVE_UDEV
+    fn = pa_udev_get_property(alsa_card_index, "PULSE_PROFILE_SET");
+#endif
+
+    if (pa_modargs_get_value(ma, "profile_set", NULL)) {
+        pa_xfree(fn);
+        fn = pa_xstrdup(pa_modargs_get_value(ma, "profile_set", NULL));
+    }
+
+    return fn;
+}
+
+/* The probed profile set of a card that does not use UCM, created by
+ * pa__prepare() in a worker thread */
+struct prepared_card {
+    char *device_id;
+    pa_hashmap *mixers;
+    pa_alsa_profile_set *profile_set;
+};
+
+void pa__free_prepared(void *prepared) {
+    struct prepared_card *p = prepared;
+
+    pa_assert(p);
+
+    if (p->profile_set)
+        pa_alsa_profile_set_free(p->profile_set);
+    if (p->mixers)
+        pa_hashmap_free(p->mixers);
+
+    pa_xfree(p->device_id);
+    pa_xfree(p);
+
+    /* Dropped here rather than in pa__prepare(), since dropping the last
+     * reference resets ALSA's global configuration */
+    pa_alsa_refcnt_dec();
+}
+
+/* Probing all mappings of a card opens every PCM device of it, which
+ * may take a long time. Do it in parallel for all cards listed in a
+ * .parallel block. Cards that use UCM are left to pa__init(). */
+int pa__prepare(pa_core *c, const char *argument, void **prepared) {
+    struct prepared_card *p;
+    pa_modargs *ma;
+    pa_alsa_ucm_config ucm;
+    bool use_ucm = true, ignore_dB = false, probe_cache = true, ucm_cache = true;
+    int alsa_card_index, rval;
+    char *fn;
+    int ret = -1;
+
+    pa_assert(c);
+    pa_assert(prepared);
+
+    pa_alsa_refcnt_inc();
+
+    *prepared = p = pa_xnew0(struct prepared_card, 1);
+
+    if (!(ma = pa_modargs_new(argument, valid_modargs)))
+        return -1;
+
+    p->device_id = pa_xstrdup(pa_modargs_get_value(ma, "device_id", DEFAULT_DEVICE_ID));
+
+    if ((alsa_card_index = snd_card_get_index(p->device_id)) < 0)
+        goto finish;
+
+    if (apply_udev_modargs(&ma, alsa_card_index) < 0 ||
+        pa_modargs_get_value_boolean(ma, "ignore_dB", &ignore_dB) < 0 ||
+        pa_modargs_get_value_boolean(ma, "probe_cache", &probe_cache) < 0 ||
+        pa_modargs_get_value_boolean(ma, "ucm_cache", &ucm_cache) < 0 ||
+        pa_modargs_get_value_boolean(ma, "use_ucm", &use_ucm) < 0)
+        goto finish;
+
+    if (use_ucm) {
+        pa_zero(ucm);
+        ucm.core = c;
+        ucm.use_cache = ucm_cache;
+
+        rval = pa_alsa_ucm_query_profiles(&ucm, alsa_card_index);
+        pa_alsa_ucm_free(&ucm);
+
+        if (rval == 0 || rval == -PA_ALSA_ERR_UCM_LINKED) {
+            ret = 0;
+            goto finish;
+        }
+    }
+
+    fn = get_profile_set_fn(ma, alsa_card_index);
+    p->profile_set = pa_alsa_profile_set_new(fn, &c->default_channel_map);
+    pa_xfree(fn);
+
+    if (!p->profile_set)
+        goto finish;
+
+    p->profile_set->ignore_dB = ignore_dB;
+    p->profile_set->probe_cache = probe_cache;
+
+    p->mixers = pa_hashmap_new_full(pa_idxset_string_hash_func, pa_idxset_string_compare_func,
+                                    pa_xfree, (pa_free_cb_t) pa_alsa_mixer_free);
+
+    pa_alsa_profile_set_probe(p->profile_set, p->mixers, p->device_id, &c->default_sample_spec, c->default_n_fragments, c->default_fragment_size_msec);
+
+    ret = 0;
+
+finish:
+    pa_modargs_free(ma);
+
+    return ret;
+}
+
 int pa__init(pa_module *m) {
     pa_card_new_data data;
-    bool ignore_dB = false;
+    bool ignore_dB = false, probe_cache = true, ucm_cache = true;
     struct userdata *u;
     pa_reserve_wrapper *reserve = NULL;
     const char *description;
     const char *profile_str = NULL;
     char *fn = NULL;
-    char *udev_args = NULL;
+    struct prepared_card *prepared = NULL;
     bool namereg_fail = false;
     int err = -PA_MODULE_ERR_UNSPECIFIED, rval;
 
@@ -885,45 +1053,15 @@ int pa__init(pa_module *m) {
         goto fail;
     }
 
-#ifdef HAVE_UDEV
-    udev_args = pa_udev_get_property(u->alsa_card_index, PULSE_MODARGS);
-#endif
-
-    if (udev_args) {
-        bool udev_modargs_success = true;
-        pa_modargs *temp_ma = pa_modargs_new(udev_args, valid_modargs);
-
-        if (temp_ma) {
-            /* do not try to replace device_id */
-
-            if (pa_modargs_remove_key(temp_ma, "device_id") == 0) {
-                pa_log_warn("Unexpected 'device_id' module argument override ignored from udev " PULSE_MODARGS "='%s'", udev_args);
-            }
-
-            /* Implement modargs override by copying original module arguments
-             * over udev entry arguments ignoring duplicates. */
-
-            if (pa_modargs_merge_missing(temp_ma, u->modargs, valid_modargs) == 0) {
-                /* swap module arguments */
-                pa_modargs *old_ma = u->modargs;
-                u->modargs = temp_ma;
-                temp_ma = old_ma;
-
-                pa_log_info("Applied module arguments override from udev " PULSE_MODARGS "='%s'", udev_args);
-            } else {
-                pa_log("Failed to apply module arguments override from udev " PULSE_MODARGS "='%s'", udev_args);
-                udev_modargs_success = false;
-            }
+    if (apply_udev_modargs(&u->modargs, u->alsa_card_index) < 0)
+        goto fail;
 
-            pa_modargs_free(temp_ma);
-        } else {
-            pa_log("Failed to parse module arguments from udev " PULSE_MODARGS "='%s'", udev_args);
-            udev_modargs_success = false;
-        }
-        pa_xfree(udev_args);
+    if (m->prepared) {
+        prepared = m->prepared;
 
-        if (!udev_modargs_success)
-            goto fail;
+        /* Only use what was probed for this very card */
+        if (!prepared->profile_set || !pa_streq(prepared->device_id, u->device_id))
+            prepared = NULL;
     }
 
     if (pa_modargs_get_value_boolean(u->modargs, "ignore_dB", &ignore_dB) < 0) {
@@ -931,6 +1069,16 @@ int pa__init(pa_module *m) {
         goto fail;
     }
 
+    if (pa_modargs_get_value_boolean(u->modargs, "probe_cache", &probe_cache) < 0) {
+        pa_log("Failed to parse probe_cache argument.");
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_boolean(u->modargs, "ucm_cache", &ucm_cache) < 0) {
+        pa_log("Failed to parse ucm_cache argument.");
+        goto fail;
+    }
+
     if (!pa_in_system_mode()) {
         char *rname;
 
@@ -955,7 +1103,8 @@ int pa__init(pa_module *m) {
 
     snd_config_update_free_global();
 
-    rval = u->use_ucm ? pa_alsa_ucm_query_profiles(&u->ucm, u->alsa_card_index) : -1;
+    u->ucm.use_cache = ucm_cache;
+    rval = u->use_ucm && !prepared ? pa_alsa_ucm_query_profiles(&u->ucm, u->alsa_card_index) : -1;
     if (rval == -PA_ALSA_ERR_UCM_LINKED) {
         err = -PA_MODULE_ERR_SKIP;
         goto fail;
@@ -979,17 +1128,21 @@ int pa__init(pa_module *m) {
         pa_module_hook_connect(m, &m->core->hooks[PA_CORE_HOOK_SOURCE_OUTPUT_UNLINK], PA_HOOK_LATE+10,
                 (pa_hook_cb_t) source_output_unlink_hook_callback, u);
     }
-    else {
+    else if (prepared) {
         u->use_ucm = false;
-#ifdef HAVE_UDEV
-        fn = pa_udev_get_property(u->alsa_card_index, "PULSE_PROFILE_SET");
-#endif
 
-        if (pa_modargs_get_value(u->modargs, "profile_set", NULL)) {
-            pa_xfree(fn);
-            fn = pa_xstrdup(pa_modargs_get_value(u->modargs, "profile_set", NULL));
-        }
+        /* Take over the mixers and the profile set probed by
+         * pa__prepare() */
+        pa_hashmap_free(u->mixers);
+        u->mixers = u->ucm.mixers = prepared->mixers;
+        u->profile_set = prepared->profile_set;
+        prepared->mixers = NULL;
+        prepared->profile_set = NULL;
+    }
+    else {
+        u->use_ucm = false;
 
+        fn = get_profile_set_fn(u->modargs, u->alsa_card_index);
         u->profile_set = pa_alsa_profile_set_new(fn, &u->core->default_channel_map);
         pa_xfree(fn);
     }
@@ -997,9 +1150,12 @@ int pa__init(pa_module *m) {
     if (!u->profile_set)
         goto fail;
 
-    u->profile_set->ignore_dB = ignore_dB;
+    if (!prepared) {
+        u->profile_set->ignore_dB = ignore_dB;
+        u->profile_set->probe_cache = probe_cache;
 
-    pa_alsa_profile_set_probe(u->profile_set, u->mixers, u->device_id, &m->core->default_sample_spec, m->core->default_n_fragments, m->core->default_fragment_size_msec);
+        pa_alsa_profile_set_probe(u->profile_set, u->mixers, u->device_id, &m->core->default_sample_spec, m->core->default_n_fragments, m->core->default_fragment_size_msec);
+    }
     pa_alsa_profile_set_dump(u->profile_set);
 
     pa_card_new_data_init(&data);
@@ -66,6 +66,7 @@ PA_MODULE_USAGE(
     "autodetect_mtu=<boolean>"
     "output_rate_refresh_interval_ms=<interval between attempts to improve output rate in milliseconds>"
     "avrcp_absolute_volume=<synchronize volume with peer, true by default>"
+    "encode_ahead=<boolean, encode the next block before it is due, false by default>"
 );
 
 #define FIXED_LATENCY_PLAYBACK_A2DP (25 * PA_USEC_PER_MSEC)
@@ -78,6 +79,7 @@ static const char* const valid_modargs[] = {
     "autodetect_mtu",
     "output_rate_refresh_interval_ms",
     "avrcp_absolute_volume",
+    "encode_ahead",
     NULL
 };
 
@@ -162,6 +164,12 @@ struct userdata {
     size_t encoder_buffer_size;                  /* Size of the buffer */
     size_t encoder_buffer_used;                  /* Used space in the buffer */
 
+    bool encode_ahead;
+    void *lookahead_buffer;                      /* The next block, encoded ahead of time */
+    size_t lookahead_buffer_size;                /* Size of the buffer */
+    size_t lookahead_used;                       /* Encoded size of the next block */
+    size_t lookahead_length;                     /* Size of the next block before encoding, 0 if there is none */
+
     void *decoder_info;
     pa_sample_spec decoder_sample_spec;
     void *decoder_buffer;                        /* Codec transfer buffer */
@@ -271,6 +279,20 @@ static void connect_ports(struct userdata *u, void *new_data, pa_direction_t dir
     }
 }
 
+/* Run from IO thread */
+static size_t bt_get_encoded_block_size(struct userdata *u) {
+    if (u->bt_codec->get_encoded_block_size)
+        return u->bt_codec->get_encoded_block_size(u->encoder_info, u->write_block_size);
+    else
+        return u->write_block_size;
+}
+
+/* Run from IO thread */
+static void bt_drop_lookahead(struct userdata *u) {
+    u->lookahead_used = 0;
+    u->lookahead_length = 0;
+}
+
 static bool bt_prepare_encoder_buffer(struct userdata *u)
 {
     size_t encoded_size, reserved_size, encoded_frames;
@@ -304,10 +326,7 @@ static bool bt_prepare_encoder_buffer(struct userdata *u)
      * See also https://gitlab.freedesktop.org/pulseaudio/pulseaudio/-/merge_requests/254#note_779802
      */
 
-    if (u->bt_codec->get_encoded_block_size)
-        encoded_size = u->bt_codec->get_encoded_block_size(u->encoder_info, u->write_block_size);
-    else
-        encoded_size = u->write_block_size;
+    encoded_size = bt_get_encoded_block_size(u);
 
     encoded_frames = u->write_link_mtu / u->write_block_size + 1;
 
@@ -358,25 +377,19 @@ static int bt_write_buffer(struct userdata *u) {
         /* Reset encoder sequence number and buffer positions */
         u->bt_codec->reset(u->encoder_info);
         u->encoder_buffer_used = 0;
+        bt_drop_lookahead(u);
         return -1;
     }
 }
 
-/* Run from IO thread */
-static int bt_process_render(struct userdata *u) {
-    int ret;
-
+/* Run from IO thread. Renders one block and encodes it into buffer, returns
+ * the encoded size or a negative value on failure and sets rendered to the
+ * size of the block. */
+static ssize_t bt_encode_block(struct userdata *u, uint8_t *buffer, size_t size, size_t *rendered) {
     const uint8_t *ptr;
     size_t processed;
     size_t length;
 
-    pa_assert(u);
-    pa_assert(u->sink);
-    pa_assert(u->bt_codec);
-
-    if (!bt_prepare_encoder_buffer(u))
-        return false;
-
     /* First, render some data */
     if (!u->write_memchunk.memblock)
         pa_sink_render_full(u->sink, u->write_block_size, &u->write_memchunk);
@@ -387,7 +400,7 @@ static int bt_process_render(struct userdata *u) {
 
     length = u->bt_codec->encode_buffer(u->encoder_info, u->write_index / pa_frame_size(&u->encoder_sample_spec),
             ptr, u->write_memchunk.length,
-            u->encoder_buffer + u->encoder_buffer_used, u->encoder_buffer_size - u->encoder_buffer_used,
+            buffer, size,
             &processed);
 
     pa_memblock_release(u->write_memchunk.memblock);
@@ -399,20 +412,83 @@ static int bt_process_render(struct userdata *u) {
         return -1;
     }
 
+    *rendered = u->write_memchunk.length;
+    pa_memblock_unref(u->write_memchunk.memblock);
+    pa_memchunk_reset(&u->write_memchunk);
+
+    return (ssize_t) length;
+}
+
+/* Run from IO thread. Encodes the next block while there is time to spare,
+ * so that a slow encoder call does not delay the write when the block is
+ * due. Returns a negative value on failure. */
+static int bt_encode_ahead(struct userdata *u) {
+    size_t encoded_size, rendered;
+    ssize_t length;
+
+    pa_assert(u);
+    pa_assert(u->sink);
+    pa_assert(u->bt_codec);
+
+    if (u->lookahead_length > 0)
+        return 0;
+
+    encoded_size = bt_get_encoded_block_size(u);
+
+    if (u->lookahead_buffer_size < encoded_size) {
+        u->lookahead_buffer = pa_xrealloc(u->lookahead_buffer, encoded_size);
+        u->lookahead_buffer_size = encoded_size;
+    }
+
+    if ((length = bt_encode_block(u, u->lookahead_buffer, u->lookahead_buffer_size, &rendered)) < 0)
+        return -1;
+
+    u->lookahead_used = (size_t) length;
+    u->lookahead_length = rendered;
+
+    return 0;
+}
+
+/* Run from IO thread */
+static int bt_process_render(struct userdata *u) {
+    int ret;
+
+    size_t rendered;
+    ssize_t length;
+
+    pa_assert(u);
+    pa_assert(u->sink);
+    pa_assert(u->bt_codec);
+
+    if (!bt_prepare_encoder_buffer(u))
+        return false;
+
+    if (u->lookahead_length > 0) {
+        /* The block has already been encoded, it only needs to be queued.
+         * The lookahead is dropped whenever the block size changes, so it
+         * fits into the space reserved for a block. */
+        pa_assert(u->lookahead_used <= u->encoder_buffer_size - u->encoder_buffer_used);
+
+        memcpy((uint8_t *) u->encoder_buffer + u->encoder_buffer_used, u->lookahead_buffer, u->lookahead_used);
+        length = (ssize_t) u->lookahead_used;
+        rendered = u->lookahead_length;
+        bt_drop_lookahead(u);
+    } else if ((length = bt_encode_block(u, (uint8_t *) u->encoder_buffer + u->encoder_buffer_used,
+                                         u->encoder_buffer_size - u->encoder_buffer_used, &rendered)) < 0)
+        return -1;
+
     /* Encoder function of BT codec may provide empty buffer, in this case do
      * not post any empty buffer via BT socket. It may be because of codec
      * internal state, e.g. encoder is waiting for more samples so it can
      * provide encoded data. */
 
     if (PA_LIKELY(length)) {
-        u->encoder_buffer_used += length;
+        u->encoder_buffer_used += (size_t) length;
         ret = 1;
     } else
         ret = 0;
 
-    u->write_index += (uint64_t) u->write_memchunk.length;
-    pa_memblock_unref(u->write_memchunk.memblock);
-    pa_memchunk_reset(&u->write_memchunk);
+    u->write_index += (uint64_t) rendered;
 
     return ret;
 }
@@ -623,6 +699,8 @@ static void teardown_stream(struct userdata *u) {
         pa_memchunk_reset(&u->write_memchunk);
     }
 
+    bt_drop_lookahead(u);
+
     pa_log_debug("Audio stream torn down");
     u->stream_setup_done = false;
 }
@@ -684,12 +762,15 @@ static void handle_sink_block_size_change(struct userdata *u) {
                                             pa_bytes_to_usec(u->write_block_size, &u->encoder_sample_spec));
 
     /* If there is still data in the memchunk, we have to discard it
-     * because the write_block_size may have changed. */
+     * because the write_block_size may have changed. The same goes for a
+     * block encoded ahead. */
     if (u->write_memchunk.memblock) {
         pa_memblock_unref(u->write_memchunk.memblock);
         pa_memchunk_reset(&u->write_memchunk);
     }
 
+    bt_drop_lookahead(u);
+
     update_sink_buffer_size(u);
 }
 
@@ -1105,8 +1186,9 @@ static int sink_process_msg(pa_msgobject *o, int code, void *data, int64_t offse
                 delay = wi - ri;
 #endif
             } else if (u->started_at) {
+                /* A block encoded ahead has been rendered already */
                 ri = pa_rtclock_now() - u->started_at;
-                wi = pa_bytes_to_usec(u->write_index, &u->encoder_sample_spec);
+                wi = pa_bytes_to_usec(u->write_index + u->lookahead_length, &u->encoder_sample_spec);
                 delay = wi - ri;
             }
 
@@ -1356,6 +1438,7 @@ static int transport_config(struct userdata *u) {
 
     /* reset encoder buffer contents */
     u->encoder_buffer_used = 0;
+    bt_drop_lookahead(u);
 
     /* forward encoding direction */
     reverse_backchannel = u->bt_codec->support_backchannel && !(get_profile_direction(u->profile) & PA_DIRECTION_OUTPUT);
@@ -1617,6 +1700,14 @@ static void thread_func(void *userdata) {
                                         (unsigned long long) skip_usec,
                                         (unsigned long long) skip_bytes);
 
+                            /* A block encoded ahead is older than anything
+                             * rendered now, so it is skipped first */
+                            if (u->lookahead_length > 0) {
+                                u->write_index += u->lookahead_length;
+                                skip_bytes -= PA_MIN(skip_bytes, (uint64_t) u->lookahead_length);
+                                bt_drop_lookahead(u);
+                            }
+
                             while (skip_bytes > 0) {
                                 size_t bytes_to_render;
 
@@ -1688,8 +1779,11 @@ static void thread_func(void *userdata) {
                             sleep_for = time_passed < next_write_at ? next_write_at - time_passed : 0;
                             /* pa_log("Sleeping for %lu; time passed %lu, next write at %lu", (unsigned long) sleep_for, (unsigned long) time_passed, (unsigned long)next_write_at); */
 
-                            if ((get_profile_direction(u->profile) & PA_DIRECTION_OUTPUT || u->bt_codec->support_backchannel) && u->write_memchunk.memblock == NULL) {
-                                /* bt_write_buffer() is keeping up with input, try increasing bitrate */
+                            if ((get_profile_direction(u->profile) & PA_DIRECTION_OUTPUT || u->bt_codec->support_backchannel) && u->write_memchunk.memblock == NULL &&
+                                u->lookahead_length == 0) {
+                                /* bt_write_buffer() is keeping up with input, try increasing bitrate.
+                                 * Changing the block size drops a block encoded ahead, so this is
+                                 * only done before encoding the next one. */
                                 if (u->bt_codec->increase_encoder_bitrate
                                     && pa_timeval_age(&tv_last_output_rate_change) >= u->device->output_rate_refresh_interval_ms * PA_USEC_PER_MSEC) {
                                     size_t new_write_block_size = u->bt_codec->increase_encoder_bitrate(u->encoder_info, u->write_link_mtu);
@@ -1700,6 +1794,10 @@ static void thread_func(void *userdata) {
                                     pa_gettimeofday(&tv_last_output_rate_change);
                                 }
                             }
+
+                            /* Use the time until the next block is due to encode it */
+                            if (u->encode_ahead && bt_encode_ahead(u) < 0)
+                                goto fail;
                         } else
                             /* We could not write because the stream was not ready. Let's try
                              * again in 500 ms and drop audio if we still can't write. The
@@ -1901,6 +1999,14 @@ static void stop_thread(struct userdata *u) {
     u->encoder_buffer_size = 0;
     u->encoder_buffer_used = 0;
 
+    if (u->lookahead_buffer) {
+        pa_xfree(u->lookahead_buffer);
+        u->lookahead_buffer = NULL;
+    }
+
+    u->lookahead_buffer_size = 0;
+    bt_drop_lookahead(u);
+
     if (u->decoder_buffer) {
         pa_xfree(u->decoder_buffer);
         u->decoder_buffer = NULL;
@@ -2864,6 +2970,12 @@ int pa__init(pa_module* m) {
 
     u->device->avrcp_absolute_volume = avrcp_absolute_volume;
 
+    u->encode_ahead = false;
+    if (pa_modargs_get_value_boolean(ma, "encode_ahead", &u->encode_ahead) < 0) {
+        pa_log("Invalid boolean value for encode_ahead parameter");
+        goto fail_free_modargs;
+    }
+
     pa_modargs_free(ma);
 
     u->device_connection_changed_slot =
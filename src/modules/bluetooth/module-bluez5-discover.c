@@ -42,6 +42,7 @@ PA_MODULE_USAGE(
     "enable_native_hsp_hs=<boolean, enable HSP support in native backend>"
     "enable_native_hfp_hf=<boolean, enable HFP support in native backend>"
     "avrcp_absolute_volume=<synchronize volume with peer, true by default>"
+    "encode_ahead=<boolean, encode the next block before it is due, false by default>"
 );
 
 static const char* const valid_modargs[] = {
@@ -52,6 +53,7 @@ static const char* const valid_modargs[] = {
     "enable_native_hsp_hs",
     "enable_native_hfp_hf",
     "avrcp_absolute_volume",
+    "encode_ahead",
     NULL
 };
 
@@ -63,6 +65,7 @@ struct userdata {
     pa_bluetooth_discovery *discovery;
     bool autodetect_mtu;
     bool avrcp_absolute_volume;
+    bool encode_ahead;
     uint32_t output_rate_refresh_interval_ms;
 };
 
@@ -87,11 +90,12 @@ static pa_hook_result_t device_connection_changed_cb(pa_bluetooth_discovery *y,
         /* a new device has been connected */
         pa_module *m;
         char *args = pa_sprintf_malloc("path=%s autodetect_mtu=%i output_rate_refresh_interval_ms=%u"
-                                       " avrcp_absolute_volume=%i",
+                                       " avrcp_absolute_volume=%i encode_ahead=%i",
                                        d->path,
                                        (int)u->autodetect_mtu,
                                        u->output_rate_refresh_interval_ms,
-                                       (int)u->avrcp_absolute_volume);
+                                       (int)u->avrcp_absolute_volume,
+                                       (int)u->encode_ahead);
 
         pa_log_debug("Loading module-bluez5-device %s", args);
         pa_module_load(&m, u->module->core, "module-bluez5-device", args);
@@ -124,6 +128,7 @@ int pa__init(pa_module *m) {
     bool autodetect_mtu;
     bool enable_msbc;
     bool avrcp_absolute_volume;
+    bool encode_ahead;
     uint32_t output_rate_refresh_interval_ms;
     bool enable_native_hsp_hs;
     bool enable_native_hfp_hf;
@@ -175,6 +180,12 @@ int pa__init(pa_module *m) {
         goto fail;
     }
 
+    encode_ahead = false;
+    if (pa_modargs_get_value_boolean(ma, "encode_ahead", &encode_ahead) < 0) {
+        pa_log("encode_ahead must be true or false");
+        goto fail;
+    }
+
     output_rate_refresh_interval_ms = DEFAULT_OUTPUT_RATE_REFRESH_INTERVAL_MS;
     if (pa_modargs_get_value_u32(ma, "output_rate_refresh_interval_ms", &output_rate_refresh_interval_ms) < 0) {
         pa_log("Invalid value for output_rate_refresh_interval parameter.");
@@ -186,6 +197,7 @@ int pa__init(pa_module *m) {
     u->core = m->core;
     u->autodetect_mtu = autodetect_mtu;
     u->avrcp_absolute_volume = avrcp_absolute_volume;
+    u->encode_ahead = encode_ahead;
     u->output_rate_refresh_interval_ms = output_rate_refresh_interval_ms;
     u->loaded_device_paths = pa_hashmap_new(pa_idxset_string_hash_func, pa_idxset_string_compare_func);
 
@@ -71,6 +71,39 @@ static REAL dotp_sse(REAL a[], REAL b[])
 #endif
 }
 
+/* Tap weight update (filter learning), w += mikro_ef * xf */
+static void update_w(REAL w[], REAL xf[], REAL mikro_ef)
+{
+#ifdef DISABLE_ORC
+  int i;
+
+  for (i = 0; i < NLMS_LEN; i += 2) {
+    // optimize: partial loop unrolling
+    w[i] += mikro_ef * xf[i];
+    w[i + 1] += mikro_ef * xf[i + 1];
+  }
+#else
+  update_tap_weights(w, xf, mikro_ef, NLMS_LEN);
+#endif
+}
+
+static void update_w_sse(REAL w[], REAL xf[], REAL mikro_ef)
+{
+#ifdef __SSE__
+  /* w is aligned, xf moves by one sample for every call */
+  int j;
+  __m128 m = _mm_set1_ps(mikro_ef);
+
+  for (j=0;j<NLMS_LEN;j+=8)
+  {
+    _mm_store_ps(w+j, _mm_add_ps(_mm_load_ps(w+j), _mm_mul_ps(m, _mm_loadu_ps(xf+j))));
+    _mm_store_ps(w+j+4, _mm_add_ps(_mm_load_ps(w+j+4), _mm_mul_ps(m, _mm_loadu_ps(xf+j+4))));
+  }
+#else
+  update_w(w, xf, mikro_ef);
+#endif
+}
+
 
 AEC* AEC_init(int RATE, int have_vector)
 {
@@ -94,10 +127,12 @@ AEC* AEC_init(int RATE, int have_vector)
       /* Get a 16-byte aligned location */
       a->w = (REAL *) (((uintptr_t) a->w_arr) - (((uintptr_t) a->w_arr) % 16) + 16);
       a->dotp = dotp_sse;
+      a->update_w = update_w_sse;
   } else {
       /* We don't care about alignment, just use the array as-is */
       a->w = a->w_arr;
       a->dotp = dotp;
+      a->update_w = update_w;
   }
 
   return a;
@@ -207,17 +242,8 @@ static REAL AEC_nlms_pw(AEC *a, REAL d, REAL x_, float stepsize)
     // calculate variable step size
     REAL mikro_ef = stepsize * ef / a->dotp_xf_xf;
 
-#ifdef DISABLE_ORC
     // update tap weights (filter learning)
-    int i;
-    for (i = 0; i < NLMS_LEN; i += 2) {
-      // optimize: partial loop unrolling
-      a->w[i] += mikro_ef * a->xf[i + a->j];
-      a->w[i + 1] += mikro_ef * a->xf[i + a->j + 1];
-    }
-#else
-    update_tap_weights(a->w, &a->xf[a->j], mikro_ef, NLMS_LEN);
-#endif
+    a->update_w(a->w, &a->xf[a->j], mikro_ef);
   }
 
   if (--(a->j) < 0) {
@@ -328,6 +328,7 @@ struct AEC {
 
   // vfuncs that are picked based on processor features available
   REAL (*dotp) (REAL[], REAL[]);
+  void (*update_w) (REAL[], REAL[], REAL);
 };
 
 /* Double-Talk Detector
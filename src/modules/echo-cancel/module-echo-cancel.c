@@ -32,6 +32,7 @@
 #include <math.h>
 
 #include "echo-cancel.h"
+#include "pool.h"
 
 #include <pulse/xmalloc.h>
 #include <pulse/timeval.h>
@@ -39,7 +40,10 @@
 
 #include <pulsecore/i18n.h>
 #include <pulsecore/atomic.h>
+#include <pulsecore/flist.h>
+#include <pulsecore/json.h>
 #include <pulsecore/macro.h>
+#include <pulsecore/message-handler.h>
 #include <pulsecore/namereg.h>
 #include <pulsecore/sink.h>
 #include <pulsecore/module.h>
@@ -74,6 +78,9 @@ PA_MODULE_USAGE(
           "autoloaded=<set if this module is being loaded automatically> "
           "use_volume_sharing=<yes or no> "
           "use_master_format=<yes or no> "
+          "use_worker_thread=<yes or no> "
+          "worker_max_blocks=<maximum number of capture blocks queued to the worker thread> "
+          "worker_threads=<number of threads shared by all echo cancellers, 0 for one per CPU> "
         ));
 
 /* NOTE: Make sure the enum and ec_table are maintained in the correct order */
@@ -140,6 +147,8 @@ static const pa_echo_canceller ec_table[] = {
 #define DEFAULT_SAVE_AEC false
 #define DEFAULT_AUTOLOADED false
 #define DEFAULT_USE_MASTER_FORMAT false
+#define DEFAULT_USE_WORKER_THREAD false
+#define DEFAULT_WORKER_MAX_BLOCKS 2
 
 #define MEMBLOCKQ_MAXLENGTH (16*1024*1024)
 
@@ -176,6 +185,18 @@ static const pa_echo_canceller ec_table[] = {
  *    be before capture and the difference should not be bigger than one frame
  *    size. We would ideally like to resample the sink_input but most driver
  *    don't give enough accuracy to be able to do that right now.
+ *
+ * With use_worker_thread=yes the canceller itself runs in a worker thread,
+ * so that a slow canceller does not delay the other outputs of the master
+ * source. The worker threads are a pool shared by all instances of the
+ * module, see pool.h, its size is set by the first instance that uses it.
+ * The source I/O thread still does all the buffering and alignment
+ * described above, but instead of calling the canceller it hands each
+ * block to the worker and posts the result to the virtual source when it
+ * comes back. At most worker_max_blocks capture blocks are in flight, if
+ * the worker falls behind further, capture data is passed through
+ * unprocessed, so the added latency stays bounded. The in-flight blocks are
+ * included in the latency reported by the source.
  */
 
 struct userdata;
@@ -189,6 +210,37 @@ struct pa_echo_canceller_msg {
 PA_DEFINE_PRIVATE_CLASS(pa_echo_canceller_msg, pa_msgobject);
 #define PA_ECHO_CANCELLER_MSG(o) (pa_echo_canceller_msg_cast(o))
 
+typedef enum {
+    AEC_JOB_RUN,        /* ec->run() on a capture and a playback block */
+    AEC_JOB_PLAY,       /* ec->play() on a playback block */
+    AEC_JOB_RECORD,     /* ec->record() on a capture block */
+    AEC_JOB_PASS,       /* forward capture data without processing */
+} aec_job_type_t;
+
+/* A block of work for the canceller worker thread. The chunks are owned by
+ * the job. */
+struct aec_job {
+    aec_job_type_t type;
+    pa_memchunk rec, play, out;
+    float drift;
+
+    pa_usec_t submit_time;
+    pa_usec_t process_time;
+};
+
+PA_STATIC_FLIST_DECLARE(aec_jobs, 0, pa_xfree);
+
+struct worker_stats {
+    pa_usec_t start_time;
+    unsigned in_flight;
+    uint64_t frames;
+    uint64_t skipped;
+    pa_usec_t process_time_sum;
+    pa_usec_t process_time_max;
+    pa_usec_t latency_sum;
+    pa_usec_t latency_max;
+};
+
 struct snapshot {
     pa_usec_t sink_now;
     pa_usec_t sink_latency;
@@ -255,6 +307,26 @@ struct userdata {
     struct {
         pa_cvolume current_volume;
     } thread_info;
+
+    /* Canceller worker thread, only used with use_worker_thread=yes */
+    struct {
+        pa_echo_canceller_pool *pool;
+        pa_echo_canceller_pool_client *client;  /* source I/O thread -> worker */
+        pa_asyncmsgq *outq;                     /* worker -> source I/O thread */
+        pa_source_output *source_output;        /* receiver of the results */
+        pa_rtpoll_item *rtpoll_item_read;
+        unsigned max_blocks;
+
+        /* The canceller may query and change the capture volume, which
+         * is source I/O thread state, so it is passed through these */
+        pa_atomic_t capture_volume;
+        pa_atomic_t requested_volume;
+
+        /* Only accessed from the source I/O thread */
+        struct worker_stats stats;
+    } worker;
+
+    char *message_handler_path;
 };
 
 static void source_output_snapshot_within_thread(struct userdata *u, struct snapshot *snapshot);
@@ -278,6 +350,9 @@ static const char* const valid_modargs[] = {
     "autoloaded",
     "use_volume_sharing",
     "use_master_format",
+    "use_worker_thread",
+    "worker_max_blocks",
+    "worker_threads",
     NULL
 };
 
@@ -285,7 +360,9 @@ enum {
     SOURCE_OUTPUT_MESSAGE_POST = PA_SOURCE_OUTPUT_MESSAGE_MAX,
     SOURCE_OUTPUT_MESSAGE_REWIND,
     SOURCE_OUTPUT_MESSAGE_LATENCY_SNAPSHOT,
-    SOURCE_OUTPUT_MESSAGE_APPLY_DIFF_TIME
+    SOURCE_OUTPUT_MESSAGE_APPLY_DIFF_TIME,
+    SOURCE_OUTPUT_MESSAGE_WORKER_DONE,
+    SOURCE_OUTPUT_MESSAGE_GET_WORKER_STATS
 };
 
 enum {
@@ -425,6 +502,9 @@ static int source_process_msg_cb(pa_msgobject *o, int code, void *data, int64_t
             /* Add resampler delay */
             *((int64_t*) data) += pa_resampler_get_delay_usec(u->source_output->thread_info.resampler);
 
+            /* and the blocks that are still in the worker thread */
+            *((int64_t*) data) += pa_bytes_to_usec(u->worker.stats.in_flight * u->source_output_blocksize, &u->source_output->sample_spec);
+
             return 0;
 
         case PA_SOURCE_MESSAGE_SET_VOLUME_SYNCED:
@@ -726,6 +806,174 @@ static void do_resync(struct userdata *u) {
     apply_diff_time(u, diff_time);
 }
 
+/* Called from any thread context. Used as free callback for the worker's
+ * result queue. */
+static void aec_job_free(void *p) {
+    struct aec_job *job = p;
+
+    if (job->rec.memblock)
+        pa_memblock_unref(job->rec.memblock);
+    if (job->play.memblock)
+        pa_memblock_unref(job->play.memblock);
+    if (job->out.memblock)
+        pa_memblock_unref(job->out.memblock);
+
+    if (pa_flist_push(PA_STATIC_FLIST_GET(aec_jobs), job) < 0)
+        pa_xfree(job);
+}
+
+/* Hands a block to the worker thread. The job takes over the references of
+ * the given chunks.
+ *
+ * Called from source I/O thread context. */
+static void worker_submit(struct userdata *u, aec_job_type_t type, const pa_memchunk *rchunk, const pa_memchunk *pchunk, float drift) {
+    struct aec_job *job;
+
+    if (!(job = pa_flist_pop(PA_STATIC_FLIST_GET(aec_jobs))))
+        job = pa_xnew(struct aec_job, 1);
+
+    job->type = type;
+    job->drift = drift;
+    job->process_time = 0;
+    pa_memchunk_reset(&job->rec);
+    pa_memchunk_reset(&job->play);
+    pa_memchunk_reset(&job->out);
+
+    if (rchunk)
+        job->rec = *rchunk;
+    if (pchunk)
+        job->play = *pchunk;
+
+    if ((type == AEC_JOB_RUN || type == AEC_JOB_RECORD) && u->worker.stats.in_flight >= u->worker.max_blocks) {
+        /* The worker does not keep up. Pass the capture data through
+         * unprocessed, so that the latency stays bounded. */
+        job->type = AEC_JOB_PASS;
+        u->worker.stats.skipped++;
+    }
+
+    switch (job->type) {
+        case AEC_JOB_RUN:
+        case AEC_JOB_RECORD:
+            job->out.index = 0;
+            job->out.length = type == AEC_JOB_RUN ? u->source_blocksize : u->source_output_blocksize;
+            job->out.memblock = pa_memblock_new(u->source->core->mempool, job->out.length);
+            break;
+
+        case AEC_JOB_PASS:
+            job->out = job->rec;
+            pa_memblock_ref(job->out.memblock);
+            break;
+
+        case AEC_JOB_PLAY:
+            break;
+    }
+
+    if (job->type != AEC_JOB_PLAY)
+        u->worker.stats.in_flight++;
+
+    pa_atomic_store(&u->worker.capture_volume, (int) pa_cvolume_avg(&u->thread_info.current_volume));
+
+    job->submit_time = pa_rtclock_now();
+    pa_echo_canceller_pool_client_submit(u->worker.client, job);
+}
+
+/* Called from pool thread context. */
+static void worker_process_job(struct userdata *u, struct aec_job *job) {
+    uint8_t *rdata = NULL, *pdata = NULL, *cdata = NULL;
+    pa_usec_t start;
+
+    if (job->type == AEC_JOB_PASS)
+        return;
+
+    if (job->rec.memblock)
+        rdata = (uint8_t *) pa_memblock_acquire(job->rec.memblock) + job->rec.index;
+    if (job->play.memblock)
+        pdata = (uint8_t *) pa_memblock_acquire(job->play.memblock) + job->play.index;
+    if (job->out.memblock)
+        cdata = pa_memblock_acquire(job->out.memblock);
+
+    start = pa_rtclock_now();
+
+    switch (job->type) {
+        case AEC_JOB_RUN:
+            u->ec->run(u->ec, rdata, pdata, cdata);
+            break;
+
+        case AEC_JOB_PLAY:
+            u->ec->play(u->ec, pdata);
+            break;
+
+        case AEC_JOB_RECORD:
+            u->ec->set_drift(u->ec, job->drift);
+            u->ec->record(u->ec, rdata, cdata);
+            break;
+
+        case AEC_JOB_PASS:
+            pa_assert_not_reached();
+    }
+
+    job->process_time = pa_rtclock_now() - start;
+
+    if (cdata)
+        pa_memblock_release(job->out.memblock);
+    if (pdata)
+        pa_memblock_release(job->play.memblock);
+    if (rdata)
+        pa_memblock_release(job->rec.memblock);
+}
+
+/* Called from pool thread context. */
+static void worker_process_cb(void *data, void *userdata) {
+    struct userdata *u = userdata;
+    struct aec_job *job = data;
+
+    worker_process_job(u, job);
+
+    /* Playback blocks don't produce anything */
+    if (job->type == AEC_JOB_PLAY)
+        aec_job_free(job);
+    else
+        pa_asyncmsgq_post(u->worker.outq, PA_MSGOBJECT(u->worker.source_output), SOURCE_OUTPUT_MESSAGE_WORKER_DONE, job, 0, NULL, aec_job_free);
+}
+
+/* Posts the result of a job to the virtual source. The job is freed by the
+ * message queue afterwards.
+ *
+ * Called from source I/O thread context. */
+static void worker_job_done(struct userdata *u, struct aec_job *job) {
+    pa_volume_t v;
+    pa_usec_t latency;
+    int unused PA_GCC_UNUSED;
+
+    pa_assert(u->worker.stats.in_flight > 0);
+    u->worker.stats.in_flight--;
+
+    if (job->type != AEC_JOB_PASS) {
+        latency = pa_rtclock_now() - job->submit_time;
+
+        u->worker.stats.frames++;
+        u->worker.stats.process_time_sum += job->process_time;
+        u->worker.stats.process_time_max = PA_MAX(u->worker.stats.process_time_max, job->process_time);
+        u->worker.stats.latency_sum += latency;
+        u->worker.stats.latency_max = PA_MAX(u->worker.stats.latency_max, latency);
+
+        if (u->save_aec && u->canceled_file) {
+            unused = fwrite((uint8_t *) pa_memblock_acquire(job->out.memblock) + job->out.index, 1, job->out.length, u->canceled_file);
+            pa_memblock_release(job->out.memblock);
+        }
+    }
+
+    /* Forward volume changes requested by the canceller */
+    v = (pa_volume_t) pa_atomic_load(&u->worker.requested_volume);
+    if (v != PA_VOLUME_INVALID && pa_atomic_cmpxchg(&u->worker.requested_volume, (int) v, (int) PA_VOLUME_INVALID) &&
+        pa_cvolume_avg(&u->thread_info.current_volume) != v)
+        pa_asyncmsgq_post(pa_thread_mq_get()->outq, PA_MSGOBJECT(u->ec->msg), ECHO_CANCELLER_MESSAGE_SET_VOLUME, PA_UINT_TO_PTR(v),
+                0, NULL, NULL);
+
+    if (PA_SOURCE_IS_LINKED(u->source->thread_info.state))
+        pa_source_post(u->source, &job->out);
+}
+
 /* 1. Calculate drift at this point, pass to canceller
  * 2. Push out playback samples in blocksize chunks
  * 3. Push out capture samples in blocksize chunks
@@ -769,7 +1017,8 @@ static void do_push_drift_comp(struct userdata *u) {
         pdata = pa_memblock_acquire(pchunk.memblock);
         pdata += pchunk.index;
 
-        u->ec->play(u->ec, pdata);
+        if (!u->worker.client)
+            u->ec->play(u->ec, pdata);
 
         if (u->save_aec) {
             if (u->drift_file)
@@ -780,7 +1029,11 @@ static void do_push_drift_comp(struct userdata *u) {
 
         pa_memblock_release(pchunk.memblock);
         pa_memblockq_drop(u->sink_memblockq, u->sink_blocksize);
-        pa_memblock_unref(pchunk.memblock);
+
+        if (u->worker.client)
+            worker_submit(u, AEC_JOB_PLAY, NULL, &pchunk, 0);
+        else
+            pa_memblock_unref(pchunk.memblock);
 
         plen -= u->sink_blocksize;
     }
@@ -789,6 +1042,23 @@ static void do_push_drift_comp(struct userdata *u) {
     while (rlen >= u->source_output_blocksize) {
         pa_memblockq_peek_fixed_size(u->source_memblockq, u->source_output_blocksize, &rchunk);
 
+        if (u->worker.client) {
+            if (u->save_aec) {
+                if (u->drift_file)
+                    fprintf(u->drift_file, "c %d\n", u->source_output_blocksize);
+                if (u->captured_file) {
+                    unused = fwrite((uint8_t *) pa_memblock_acquire(rchunk.memblock) + rchunk.index, 1, u->source_output_blocksize, u->captured_file);
+                    pa_memblock_release(rchunk.memblock);
+                }
+            }
+
+            worker_submit(u, AEC_JOB_RECORD, &rchunk, NULL, drift);
+
+            pa_memblockq_drop(u->source_memblockq, u->source_output_blocksize);
+            rlen -= u->source_output_blocksize;
+            continue;
+        }
+
         rdata = pa_memblock_acquire(rchunk.memblock);
         rdata += rchunk.index;
 
@@ -846,6 +1116,28 @@ static void do_push(struct userdata *u) {
         if (plen < u->sink_blocksize)
             pa_memblockq_seek(u->sink_memblockq, u->sink_blocksize - plen, PA_SEEK_RELATIVE, true);
 
+        if (u->worker.client) {
+            if (u->save_aec) {
+                if (u->captured_file) {
+                    unused = fwrite((uint8_t *) pa_memblock_acquire(rchunk.memblock) + rchunk.index, 1, u->source_output_blocksize, u->captured_file);
+                    pa_memblock_release(rchunk.memblock);
+                }
+                if (u->played_file) {
+                    unused = fwrite((uint8_t *) pa_memblock_acquire(pchunk.memblock) + pchunk.index, 1, u->sink_blocksize, u->played_file);
+                    pa_memblock_release(pchunk.memblock);
+                }
+            }
+
+            /* perform echo cancellation in the worker thread */
+            worker_submit(u, AEC_JOB_RUN, &rchunk, &pchunk, 0);
+
+            pa_memblockq_drop(u->source_memblockq, u->source_output_blocksize);
+            rlen -= u->source_output_blocksize;
+            pa_memblockq_drop(u->sink_memblockq, u->sink_blocksize);
+            plen = plen >= u->sink_blocksize ? plen - u->sink_blocksize : 0;
+            continue;
+        }
+
         rdata = pa_memblock_acquire(rchunk.memblock);
         rdata += rchunk.index;
         pdata = pa_memblock_acquire(pchunk.memblock);
@@ -943,9 +1235,15 @@ static void source_output_push_cb(pa_source_output *o, const pa_memchunk *chunk)
 
         if (to_skip) {
             pa_memblockq_peek_fixed_size(u->source_memblockq, to_skip, &rchunk);
-            pa_source_post(u->source, &rchunk);
 
-            pa_memblock_unref(rchunk.memblock);
+            /* Keep the order with the blocks that are still in the worker */
+            if (u->worker.client)
+                worker_submit(u, AEC_JOB_PASS, &rchunk, NULL, 0);
+            else {
+                pa_source_post(u->source, &rchunk);
+                pa_memblock_unref(rchunk.memblock);
+            }
+
             pa_memblockq_drop(u->source_memblockq, to_skip);
 
             rlen -= to_skip;
@@ -1118,6 +1416,14 @@ static int source_output_process_msg_cb(pa_msgobject *obj, int code, void *data,
             apply_diff_time(u, offset);
             return 0;
 
+        case SOURCE_OUTPUT_MESSAGE_WORKER_DONE:
+            worker_job_done(u, data);
+            return 0;
+
+        case SOURCE_OUTPUT_MESSAGE_GET_WORKER_STATS:
+            *((struct worker_stats *) data) = u->worker.stats;
+            return 0;
+
     }
 
     return pa_source_output_process_msg(obj, code, data, offset, chunk);
@@ -1297,6 +1603,12 @@ static void source_output_attach_cb(pa_source_output *o) {
             o->source->thread_info.rtpoll,
             PA_RTPOLL_LATE,
             u->asyncmsgq);
+
+    if (u->worker.outq)
+        u->worker.rtpoll_item_read = pa_rtpoll_item_new_asyncmsgq_read(
+                o->source->thread_info.rtpoll,
+                PA_RTPOLL_LATE,
+                u->worker.outq);
 }
 
 /* Called from sink I/O thread context. */
@@ -1351,6 +1663,11 @@ static void source_output_detach_cb(pa_source_output *o) {
         pa_rtpoll_item_free(u->rtpoll_item_read);
         u->rtpoll_item_read = NULL;
     }
+
+    if (u->worker.rtpoll_item_read) {
+        pa_rtpoll_item_free(u->worker.rtpoll_item_read);
+        u->worker.rtpoll_item_read = NULL;
+    }
 }
 
 /* Called from sink I/O thread context. */
@@ -1616,19 +1933,33 @@ static int canceller_process_msg_cb(pa_msgobject *o, int code, void *userdata, i
     return 0;
 }
 
-/* Called by the canceller, so source I/O thread context. */
+/* Called by the canceller, so source I/O thread or worker thread context. */
 pa_volume_t pa_echo_canceller_get_capture_volume(pa_echo_canceller *ec) {
 #ifndef ECHO_CANCEL_TEST
-    return pa_cvolume_avg(&ec->msg->userdata->thread_info.current_volume);
+    struct userdata *u = ec->msg->userdata;
+
+    if (u->worker.client)
+        return (pa_volume_t) pa_atomic_load(&u->worker.capture_volume);
+
+    return pa_cvolume_avg(&u->thread_info.current_volume);
 #else
     return PA_VOLUME_NORM;
 #endif
 }
 
-/* Called by the canceller, so source I/O thread context. */
+/* Called by the canceller, so source I/O thread or worker thread context. */
 void pa_echo_canceller_set_capture_volume(pa_echo_canceller *ec, pa_volume_t v) {
 #ifndef ECHO_CANCEL_TEST
-    if (pa_cvolume_avg(&ec->msg->userdata->thread_info.current_volume) != v) {
+    struct userdata *u = ec->msg->userdata;
+
+    /* The worker has no message queue to the main thread, the source I/O
+     * thread forwards the request with the next result */
+    if (u->worker.client) {
+        pa_atomic_store(&u->worker.requested_volume, (int) v);
+        return;
+    }
+
+    if (pa_cvolume_avg(&u->thread_info.current_volume) != v) {
         pa_asyncmsgq_post(pa_thread_mq_get()->outq, PA_MSGOBJECT(ec->msg), ECHO_CANCELLER_MESSAGE_SET_VOLUME, PA_UINT_TO_PTR(v),
                 0, NULL, NULL);
     }
@@ -1668,6 +1999,58 @@ static pa_echo_canceller_method_t get_ec_method_from_string(const char *method)
     return PA_ECHO_CANCELLER_INVALID;
 }
 
+/* Called from main context. */
+static char *get_worker_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct worker_stats stats;
+
+    pa_zero(stats);
+    if (u->worker.client && PA_SOURCE_OUTPUT_IS_LINKED(u->source_output->state))
+        pa_asyncmsgq_send(u->source_output->source->asyncmsgq, PA_MSGOBJECT(u->source_output), SOURCE_OUTPUT_MESSAGE_GET_WORKER_STATS, &stats, 0, NULL);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_bool(encoder, "enabled", !!u->worker.client);
+    pa_json_encoder_add_member_int(encoder, "block_usec", (int64_t) pa_bytes_to_usec(u->source_output_blocksize, &u->source_output->sample_spec));
+    pa_json_encoder_add_member_int(encoder, "max_blocks", u->worker.max_blocks);
+    pa_json_encoder_add_member_int(encoder, "pool_threads", u->worker.pool ? pa_echo_canceller_pool_get_n_threads(u->worker.pool) : 0);
+    pa_json_encoder_add_member_int(encoder, "pool_thread", u->worker.client ? pa_echo_canceller_pool_client_get_thread(u->worker.client) : 0);
+    pa_json_encoder_add_member_int(encoder, "in_flight", stats.in_flight);
+    pa_json_encoder_add_member_int(encoder, "frames", (int64_t) stats.frames);
+    pa_json_encoder_add_member_int(encoder, "skipped", (int64_t) stats.skipped);
+    pa_json_encoder_add_member_int(encoder, "process_usec_avg", stats.frames ? (int64_t) (stats.process_time_sum / stats.frames) : 0);
+    pa_json_encoder_add_member_int(encoder, "process_usec_max", (int64_t) stats.process_time_max);
+    pa_json_encoder_add_member_int(encoder, "latency_usec_avg", stats.frames ? (int64_t) (stats.latency_sum / stats.frames) : 0);
+    pa_json_encoder_add_member_int(encoder, "latency_usec_max", (int64_t) stats.latency_max);
+    pa_json_encoder_add_member_double(encoder, "cpu_load", stats.start_time ? (double) stats.process_time_sum / (pa_rtclock_now() - stats.start_time) : 0, 4);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context. */
+static int echo_cancel_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* Process time is the time the canceller needed for one block, latency
+     * the time from handing the block to the worker until the result was
+     * posted, both in usec. cpu_load is the share of one CPU used by this
+     * canceller since it was loaded. */
+    if (pa_streq(message, "get-worker-stats")) {
+        *response = get_worker_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 /* Common initialisation bits between module-echo-cancel and the standalone
  * test program.
  *
@@ -1725,6 +2108,8 @@ int pa__init(pa_module*m) {
     uint32_t temp;
     uint32_t nframes = 0;
     bool use_master_format;
+    bool use_worker_thread;
+    uint32_t worker_threads;
     pa_usec_t blocksize_usec;
 
     pa_assert(m);
@@ -1792,6 +2177,24 @@ int pa__init(pa_module*m) {
         goto fail;
     }
 
+    use_worker_thread = DEFAULT_USE_WORKER_THREAD;
+    if (pa_modargs_get_value_boolean(ma, "use_worker_thread", &use_worker_thread) < 0) {
+        pa_log("use_worker_thread= expects a boolean argument");
+        goto fail;
+    }
+
+    worker_threads = 0;
+    if (pa_modargs_get_value_u32(ma, "worker_threads", &worker_threads) < 0) {
+        pa_log("Failed to parse worker_threads value");
+        goto fail;
+    }
+
+    u->worker.max_blocks = DEFAULT_WORKER_MAX_BLOCKS;
+    if (pa_modargs_get_value_u32(ma, "worker_max_blocks", &u->worker.max_blocks) < 0 || u->worker.max_blocks < 1) {
+        pa_log("Failed to parse worker_max_blocks value");
+        goto fail;
+    }
+
     temp = DEFAULT_ADJUST_TIME_USEC / PA_USEC_PER_SEC;
     if (pa_modargs_get_value_u32(ma, "adjust_time", &temp) < 0) {
         pa_log("Failed to parse adjust_time value");
@@ -2090,6 +2493,28 @@ int pa__init(pa_module*m) {
 
     u->thread_info.current_volume = u->source->reference_volume;
 
+    if (use_worker_thread) {
+        pa_atomic_store(&u->worker.capture_volume, (int) pa_cvolume_avg(&u->thread_info.current_volume));
+        pa_atomic_store(&u->worker.requested_volume, (int) PA_VOLUME_INVALID);
+
+        u->worker.outq = pa_asyncmsgq_new(0);
+        if (!u->worker.outq) {
+            pa_log("pa_asyncmsgq_new() failed.");
+            goto fail;
+        }
+
+        if (!(u->worker.pool = pa_echo_canceller_pool_get(u->core, worker_threads))) {
+            pa_log("Failed to create echo canceller pool.");
+            goto fail;
+        }
+
+        /* Our own reference, the source output may be killed while the
+         * worker is still busy */
+        u->worker.source_output = pa_source_output_ref(u->source_output);
+        u->worker.client = pa_echo_canceller_pool_client_new(u->worker.pool, worker_process_cb, u);
+        u->worker.stats.start_time = pa_rtclock_now();
+    }
+
     /* We don't want to deal with too many chunks at a time */
     blocksize_usec = pa_bytes_to_usec(u->source_blocksize, &u->source->sample_spec);
     if (u->source->flags & PA_SOURCE_DYNAMIC_LATENCY)
@@ -2113,6 +2538,9 @@ int pa__init(pa_module*m) {
     pa_source_output_cork(u->source_output, false);
     pa_sink_input_cork(u->sink_input, false);
 
+    u->message_handler_path = pa_sprintf_malloc("/source/%s/echo-cancel", u->source->name);
+    pa_message_handler_register(m->core, u->message_handler_path, "Echo canceller message handler", echo_cancel_message_handler, u);
+
     pa_modargs_free(ma);
 
     return 0;
@@ -2147,6 +2575,11 @@ void pa__done(pa_module*m) {
 
     u->dead = true;
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     /* See comments in source_output_kill_cb() above regarding
      * destruction order! */
 
@@ -2183,6 +2616,18 @@ void pa__done(pa_module*m) {
     if (u->sink_memblockq)
         pa_memblockq_free(u->sink_memblockq);
 
+    /* The source output is gone, so no new jobs can arrive. Results that
+     * were not picked up anymore are freed with the queue. */
+    if (u->worker.client)
+        pa_echo_canceller_pool_client_free(u->worker.client);
+    if (u->worker.pool)
+        pa_echo_canceller_pool_unref(u->worker.pool);
+    if (u->worker.source_output)
+        pa_source_output_unref(u->worker.source_output);
+
+    if (u->worker.outq)
+        pa_asyncmsgq_unref(u->worker.outq);
+
     if (u->ec) {
         if (u->ec->done)
             u->ec->done(u->ec);
@@ -0,0 +1,307 @@
+/***
+    This file is part of PulseAudio.
+
+    PulseAudio is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation; either version 2.1 of the License,
+    or (at your option) any later version.
+
+    PulseAudio is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pulse/util.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/asyncmsgq.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/msgobject.h>
+#include <pulsecore/refcnt.h>
+#include <pulsecore/shared.h>
+#include <pulsecore/thread.h>
+
+#include "pool.h"
+
+#define MAX_THREADS 16
+
+/* Maximum number of jobs taken from the queue at once */
+#define MAX_BATCH 64
+
+enum {
+    POOL_MESSAGE_PROCESS,
+    POOL_MESSAGE_SYNC,
+    POOL_MESSAGE_SHUTDOWN
+};
+
+struct pool_thread {
+    pa_echo_canceller_pool *pool;
+    unsigned index;
+    pa_thread *thread;
+    pa_asyncmsgq *inq;
+
+    /* Only accessed from main context */
+    unsigned n_clients;
+};
+
+struct pa_echo_canceller_pool {
+    PA_REFCNT_DECLARE;
+
+    pa_core *core;
+    unsigned n_threads;
+    struct pool_thread threads[MAX_THREADS];
+};
+
+struct pa_echo_canceller_pool_client {
+    pa_msgobject parent;
+
+    pa_echo_canceller_pool *pool;
+    struct pool_thread *thread;
+
+    pa_echo_canceller_pool_process_cb_t process_cb;
+    void *userdata;
+};
+
+PA_DEFINE_PRIVATE_CLASS(pa_echo_canceller_pool_client, pa_msgobject);
+#define POOL_CLIENT(o) (pa_echo_canceller_pool_client_cast(o))
+
+struct batch_item {
+    pa_echo_canceller_pool_client *client;
+    void *job;
+};
+
+/* Processes the jobs of one client after each other, in the order they
+ * were queued. Drops the references taken in thread_func().
+ *
+ * Called from pool thread context. */
+static void process_batch(struct batch_item *batch, unsigned n) {
+    unsigned i, j;
+
+    for (i = 0; i < n; i++) {
+        pa_echo_canceller_pool_client *c = batch[i].client;
+
+        if (!c)
+            continue;
+
+        for (j = i; j < n; j++) {
+            if (batch[j].client != c)
+                continue;
+
+            c->process_cb(batch[j].job, c->userdata);
+
+            if (j > i) {
+                pa_echo_canceller_pool_client_unref(c);
+                batch[j].client = NULL;
+            }
+        }
+
+        pa_echo_canceller_pool_client_unref(c);
+        batch[i].client = NULL;
+    }
+}
+
+static void thread_func(void *userdata) {
+    struct pool_thread *t = userdata;
+    struct batch_item batch[MAX_BATCH];
+    unsigned n = 0;
+    bool quit = false;
+
+    pa_log_debug("Echo canceller pool thread %u starting up", t->index);
+
+    if (t->pool->core->realtime_scheduling)
+        pa_thread_make_realtime(t->pool->core->realtime_priority);
+
+    while (!quit) {
+        pa_msgobject *object;
+        int code;
+        void *data;
+
+        /* Wait for the first job of a batch, then take everything else
+         * that is already queued */
+        if (pa_asyncmsgq_get(t->inq, &object, &code, &data, NULL, NULL, n == 0) < 0) {
+            process_batch(batch, n);
+            n = 0;
+            continue;
+        }
+
+        switch (code) {
+            case POOL_MESSAGE_PROCESS:
+                batch[n].client = pa_echo_canceller_pool_client_ref(POOL_CLIENT(object));
+                batch[n].job = data;
+                n++;
+
+                pa_asyncmsgq_done(t->inq, 0);
+
+                if (n == MAX_BATCH) {
+                    process_batch(batch, n);
+                    n = 0;
+                }
+                break;
+
+            case POOL_MESSAGE_SYNC:
+            case POOL_MESSAGE_SHUTDOWN:
+                /* Everything that was queued before has to be done when
+                 * the sender continues */
+                process_batch(batch, n);
+                n = 0;
+
+                quit = code == POOL_MESSAGE_SHUTDOWN;
+                pa_asyncmsgq_done(t->inq, 0);
+                break;
+
+            default:
+                pa_assert_not_reached();
+        }
+    }
+
+    pa_log_debug("Echo canceller pool thread %u shutting down", t->index);
+}
+
+static void pool_free(pa_echo_canceller_pool *p) {
+    unsigned i;
+
+    for (i = 0; i < p->n_threads; i++) {
+        struct pool_thread *t = &p->threads[i];
+
+        if (t->thread) {
+            pa_assert(t->n_clients == 0);
+            pa_asyncmsgq_send(t->inq, NULL, POOL_MESSAGE_SHUTDOWN, NULL, 0, NULL);
+            pa_thread_free(t->thread);
+        }
+
+        if (t->inq)
+            pa_asyncmsgq_unref(t->inq);
+    }
+
+    pa_xfree(p);
+}
+
+/* Called from main context. */
+pa_echo_canceller_pool *pa_echo_canceller_pool_get(pa_core *c, unsigned n_threads) {
+    pa_echo_canceller_pool *p;
+    unsigned i;
+
+    pa_assert(c);
+
+    if ((p = pa_shared_get(c, "echo-cancel-pool"))) {
+        PA_REFCNT_INC(p);
+        return p;
+    }
+
+    if (n_threads == 0)
+        n_threads = pa_ncpus();
+    n_threads = PA_CLAMP(n_threads, 1U, MAX_THREADS);
+
+    p = pa_xnew0(pa_echo_canceller_pool, 1);
+    PA_REFCNT_INIT(p);
+    p->core = c;
+    p->n_threads = n_threads;
+
+    for (i = 0; i < n_threads; i++) {
+        struct pool_thread *t = &p->threads[i];
+        char name[16];
+
+        t->pool = p;
+        t->index = i;
+
+        if (!(t->inq = pa_asyncmsgq_new(0))) {
+            pa_log("pa_asyncmsgq_new() failed.");
+            goto fail;
+        }
+
+        pa_snprintf(name, sizeof(name), "echo-cancel-%u", i);
+        if (!(t->thread = pa_thread_new(name, thread_func, t))) {
+            pa_log("Failed to create echo canceller pool thread.");
+            goto fail;
+        }
+    }
+
+    pa_log_info("Created echo canceller pool with %u threads", n_threads);
+
+    pa_shared_set(c, "echo-cancel-pool", p);
+
+    return p;
+
+fail:
+    p->n_threads = i + 1;
+    pool_free(p);
+
+    return NULL;
+}
+
+/* Called from main context. */
+void pa_echo_canceller_pool_unref(pa_echo_canceller_pool *p) {
+    pa_assert(p);
+    pa_assert(PA_REFCNT_VALUE(p) > 0);
+
+    if (PA_REFCNT_DEC(p) > 0)
+        return;
+
+    pa_shared_remove(p->core, "echo-cancel-pool");
+    pool_free(p);
+}
+
+unsigned pa_echo_canceller_pool_get_n_threads(pa_echo_canceller_pool *p) {
+    pa_assert(p);
+
+    return p->n_threads;
+}
+
+/* Called from main context. */
+pa_echo_canceller_pool_client *pa_echo_canceller_pool_client_new(pa_echo_canceller_pool *p, pa_echo_canceller_pool_process_cb_t process_cb, void *userdata) {
+    pa_echo_canceller_pool_client *c;
+    struct pool_thread *t;
+    unsigned i;
+
+    pa_assert(p);
+    pa_assert(process_cb);
+
+    t = &p->threads[0];
+    for (i = 1; i < p->n_threads; i++)
+        if (p->threads[i].n_clients < t->n_clients)
+            t = &p->threads[i];
+
+    c = pa_msgobject_new(pa_echo_canceller_pool_client);
+    c->pool = p;
+    c->thread = t;
+    c->process_cb = process_cb;
+    c->userdata = userdata;
+
+    t->n_clients++;
+
+    return c;
+}
+
+/* Called from main context. */
+void pa_echo_canceller_pool_client_free(pa_echo_canceller_pool_client *c) {
+    pa_assert(c);
+
+    pa_asyncmsgq_send(c->thread->inq, PA_MSGOBJECT(c), POOL_MESSAGE_SYNC, NULL, 0, NULL);
+
+    pa_assert(c->thread->n_clients > 0);
+    c->thread->n_clients--;
+
+    pa_echo_canceller_pool_client_unref(c);
+}
+
+void pa_echo_canceller_pool_client_submit(pa_echo_canceller_pool_client *c, void *job) {
+    pa_assert(c);
+
+    pa_asyncmsgq_post(c->thread->inq, PA_MSGOBJECT(c), POOL_MESSAGE_PROCESS, job, 0, NULL, NULL);
+}
+
+unsigned pa_echo_canceller_pool_client_get_thread(pa_echo_canceller_pool_client *c) {
+    pa_assert(c);
+
+    return c->thread->index;
+}
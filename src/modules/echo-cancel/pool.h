@@ -0,0 +1,56 @@
+/***
+    This file is part of PulseAudio.
+
+    PulseAudio is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation; either version 2.1 of the License,
+    or (at your option) any later version.
+
+    PulseAudio is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef fooechocancelpoolhfoo
+#define fooechocancelpoolhfoo
+
+#include <pulsecore/core.h>
+
+/* A fixed set of worker threads that is shared by all echo canceller
+ * instances of a core. Every instance is a client of the pool and is
+ * bound to one of the threads, so that the jobs of one canceller are
+ * always processed in order and never concurrently. Each thread takes
+ * all jobs that are queued at once and processes them grouped by client,
+ * which keeps the state of one canceller in the cache for a whole batch
+ * instead of switching between instances for every block. */
+
+typedef struct pa_echo_canceller_pool pa_echo_canceller_pool;
+typedef struct pa_echo_canceller_pool_client pa_echo_canceller_pool_client;
+
+/* Called from a pool thread for every job */
+typedef void (*pa_echo_canceller_pool_process_cb_t)(void *job, void *userdata);
+
+/* Returns the pool of the core, creating it with n_threads threads if it
+ * does not exist yet. 0 means one thread per CPU. */
+pa_echo_canceller_pool *pa_echo_canceller_pool_get(pa_core *c, unsigned n_threads);
+void pa_echo_canceller_pool_unref(pa_echo_canceller_pool *p);
+
+unsigned pa_echo_canceller_pool_get_n_threads(pa_echo_canceller_pool *p);
+
+/* Adds a client to the least used thread of the pool */
+pa_echo_canceller_pool_client *pa_echo_canceller_pool_client_new(pa_echo_canceller_pool *p, pa_echo_canceller_pool_process_cb_t process_cb, void *userdata);
+/* Waits until all jobs of the client were processed and removes it */
+void pa_echo_canceller_pool_client_free(pa_echo_canceller_pool_client *c);
+
+/* Queues a job, may be called from any thread, but only from one thread
+ * per client at a time */
+void pa_echo_canceller_pool_client_submit(pa_echo_canceller_pool_client *c, void *job);
+
+/* Index of the pool thread the client is bound to */
+unsigned pa_echo_canceller_pool_client_get_thread(pa_echo_canceller_pool_client *c);
+
+#endif
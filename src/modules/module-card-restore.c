@@ -41,7 +41,7 @@
 #include <pulsecore/core-subscribe.h>
 #include <pulsecore/card.h>
 #include <pulsecore/namereg.h>
-#include <pulsecore/database.h>
+#include <pulsecore/database-async.h>
 #include <pulsecore/tagstruct.h>
 
 PA_MODULE_AUTHOR("Lennart Poettering");
@@ -63,7 +63,7 @@ struct userdata {
     pa_core *core;
     pa_module *module;
     pa_time_event *save_time_event;
-    pa_database *database;
+    pa_database_async *database;
     bool restore_bluetooth_profile;
 };
 
@@ -94,7 +94,7 @@ static void save_time_callback(pa_mainloop_api*a, pa_time_event* e, const struct
     u->core->mainloop->time_free(u->save_time_event);
     u->save_time_event = NULL;
 
-    pa_database_sync(u->database);
+    pa_database_async_sync(u->database, NULL, NULL);
     pa_log_info("Synced.");
 }
 
@@ -234,7 +234,7 @@ static bool entry_write(struct userdata *u, const char *name, const struct entry
 
     data.data = (void*)pa_tagstruct_data(t, &data.size);
 
-    r = (pa_database_set(u->database, &key, &data, true) == 0);
+    r = (pa_database_async_set(u->database, &key, &data, true) == 0);
 
     pa_tagstruct_free(t);
 
@@ -293,7 +293,7 @@ static struct entry* entry_read(struct userdata *u, const char *name) {
 
     pa_zero(data);
 
-    if (!pa_database_get(u->database, &key, &data)) {
+    if (!pa_database_async_get(u->database, &key, &data)) {
         pa_log_debug("Database contains no data for key: %s", name);
         return NULL;
     }
@@ -678,7 +678,7 @@ int pa__init(pa_module*m) {
     if (!(state_path = pa_state_path(NULL, true)))
         goto fail;
 
-    if (!(u->database = pa_database_open(state_path, "card-database", true, true))) {
+    if (!(u->database = pa_database_async_open(u->core, state_path, "card-database", true, true))) {
         pa_xfree(state_path);
         goto fail;
     }
@@ -707,11 +707,11 @@ void pa__done(pa_module*m) {
 
     if (u->save_time_event) {
         u->core->mainloop->time_free(u->save_time_event);
-        pa_database_sync(u->database);
+        pa_database_async_sync(u->database, NULL, NULL);
     }
 
     if (u->database)
-        pa_database_close(u->database);
+        pa_database_async_close(u->database);
 
     pa_xfree(u);
 }
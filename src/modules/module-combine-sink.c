@@ -44,6 +44,9 @@
 #include <pulsecore/thread.h>
 #include <pulsecore/thread-mq.h>
 #include <pulsecore/rtpoll.h>
+#include <pulsecore/drift-controller.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 
 #ifdef USE_SMOOTHER_2
 #include <pulsecore/time-smoother_2.h>
@@ -66,8 +69,10 @@ PA_MODULE_USAGE(
         "format=<sample format> "
         "rate=<sample rate> "
         "channels=<number of channels> "
-        "channel_map=<channel map>"
-        "remix=<boolean>");
+        "channel_map=<channel map> "
+        "remix=<boolean> "
+        "fanout=<don't resample outputs that share the clock and rate of the first one?> "
+        "rate_control=<timer or pi>");
 
 #define DEFAULT_SINK_NAME "combined"
 
@@ -88,6 +93,8 @@ static const char* const valid_modargs[] = {
     "channels",
     "channel_map",
     "remix",
+    "fanout",
+    "rate_control",
     NULL
 };
 
@@ -98,6 +105,11 @@ struct output {
     pa_sink_input *sink_input;
     bool ignore_state_change;
 
+    /* In fan-out mode, the sink input of a direct output has no
+     * resampler and its rate is never adjusted. The rendered chunks
+     * reach the slave sink as they are. */
+    bool direct;
+
     /* This message queue is only for POST messages, i.e. the messages that
      * carry audio data from the sink thread to the output thread. The POST
      * messages need to be handled in a separate queue, because the queue is
@@ -125,6 +137,8 @@ struct output {
 
     /* For communication of the stream latencies to the main thread */
     pa_usec_t total_latency;
+    /* Difference to the target latency at the last adjustment */
+    int64_t lag;
     struct {
         pa_usec_t timestamp;
         pa_usec_t sink_latency;
@@ -139,6 +153,14 @@ struct output {
     pa_atomic_t max_latency;
     pa_atomic_t min_latency;
 
+    /* With rate_control=pi, the rate is adjusted in the output thread
+     * towards the target latency set by the main thread. If the resampler
+     * does not support fractional rates, the main thread adjusts the rate
+     * as with rate_control=timer. */
+    pa_drift_controller *drift_controller;
+    pa_atomic_t target_latency;
+    pa_atomic_t drift_control_failed;
+
     PA_LLIST_FIELDS(struct output);
 };
 
@@ -170,6 +192,13 @@ struct userdata {
     pa_idxset* outputs; /* managed in main context */
 
     bool remix;
+    bool fanout;
+    bool pi_control;
+
+    /* Target latency of the outputs at the last adjustment */
+    pa_usec_t target_latency;
+
+    char *message_handler_path;
 
     struct {
         PA_LLIST_HEAD(struct output, active_outputs); /* managed in IO thread context */
@@ -253,9 +282,10 @@ static void adjust_rates(struct userdata *u) {
     pa_usec_t target_latency = 0;
     pa_usec_t max_sink_latency = 0;
     pa_usec_t min_total_latency = (pa_usec_t)-1;
+    pa_usec_t direct_latency = 0;
     uint32_t base_rate;
     uint32_t idx;
-    unsigned n = 0;
+    unsigned n = 0, n_direct = 0;
     pa_usec_t now;
     struct output *o_max;
 
@@ -316,6 +346,11 @@ static void adjust_rates(struct userdata *u) {
             o_max = o;
         }
 
+        if (o->direct) {
+            direct_latency += o->total_latency;
+            n_direct++;
+        }
+
         /* Debug output */
         pa_log_debug("[%s] Snapshot sink latency = %0.2fms, total snapshot latency = %0.2fms", o->sink->name, (double) o->latency_snapshot.sink_latency / PA_USEC_PER_MSEC, (double) snapshot_latency / PA_USEC_PER_MSEC);
 
@@ -333,12 +368,17 @@ static void adjust_rates(struct userdata *u) {
 
     /* The target selection ensures, that at least one of the
      * sinks will use the base rate and all other sinks are set
-     * relative to it. */
-    if (max_sink_latency > min_total_latency)
+     * relative to it. The rate of direct outputs cannot be changed,
+     * so if there are any, they define the target. */
+    if (n_direct > 0)
+        target_latency = direct_latency / n_direct;
+    else if (max_sink_latency > min_total_latency)
         target_latency = o_max->total_latency;
     else
         target_latency = min_total_latency;
 
+    u->target_latency = target_latency;
+
     pa_log_info("[%s] avg total latency is %0.2f msec.", u->sink->name, (double) avg_total_latency / PA_USEC_PER_MSEC);
     pa_log_info("[%s] target latency for all slaves is %0.2f msec.", u->sink->name, (double) target_latency / PA_USEC_PER_MSEC);
 
@@ -352,6 +392,25 @@ static void adjust_rates(struct userdata *u) {
         if (!o->sink_input || !PA_SINK_IS_OPENED(o->sink->state))
             continue;
 
+        o->lag = (int64_t) o->total_latency - (int64_t) target_latency;
+
+        if (o->direct) {
+            /* The slave sink was switched to a different rate, so the
+             * output needs a resampler after all. */
+            if (o->sink->sample_spec.rate != base_rate) {
+                pa_log_info("[%s] Rate changed to %u Hz, output is no longer direct.", o->sink->name, o->sink->sample_spec.rate);
+                output_disable(o);
+                output_enable(o);
+            }
+
+            continue;
+        }
+
+        if (o->drift_controller && !pa_atomic_load(&o->drift_control_failed)) {
+            pa_atomic_store(&o->target_latency, (int) target_latency);
+            continue;
+        }
+
         latency_difference = (int64_t)o->total_latency - (int64_t)target_latency;
         new_rate = rate_controller(o, base_rate, o->sink_input->sample_spec.rate, latency_difference);
 
@@ -548,6 +607,29 @@ static void request_memblock(struct output *o, size_t length) {
         pa_asyncmsgq_send(o->outq, PA_MSGOBJECT(o->userdata->sink), SINK_MESSAGE_NEED, o, (int64_t) length, NULL);
 }
 
+/* Called from I/O thread context */
+static void update_rate_adjustment(struct output *o) {
+    int64_t latency, target;
+    double factor;
+
+    if (!(target = pa_atomic_load(&o->target_latency)) || pa_atomic_load(&o->drift_control_failed))
+        return;
+
+    /* Same as the latency snapshot, the data in flight from the sink
+     * thread has just been processed by request_memblock() */
+    latency = pa_sink_get_latency_within_thread(o->sink, true) +
+              pa_bytes_to_usec(pa_memblockq_get_length(o->sink_input->thread_info.render_memblockq), &o->sink->sample_spec) +
+              pa_resampler_get_delay_usec(o->sink_input->thread_info.resampler) +
+              pa_bytes_to_usec(pa_memblockq_get_length(o->memblockq), &o->sink_input->sample_spec);
+
+    factor = pa_drift_controller_update(o->drift_controller, pa_rtclock_now(), latency - target);
+
+    if (!pa_sink_input_set_rate_adjustment_within_thread(o->sink_input, factor)) {
+        pa_log_info("[%s] Resampler does not support fractional rates, adjusting the rate from the main thread.", o->sink->name);
+        pa_atomic_store(&o->drift_control_failed, 1);
+    }
+}
+
 /* Called from I/O thread context */
 static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes, pa_memchunk *chunk) {
     struct output *o;
@@ -558,6 +640,9 @@ static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes, pa_memchunk *chunk
     /* If necessary, get some new data */
     request_memblock(o, nbytes);
 
+    if (o->drift_controller && !o->direct)
+        update_rate_adjustment(o);
+
     /* pa_log("%s q size is %u + %u (%u/%u)", */
     /*        i->sink->name, */
     /*        pa_memblockq_get_nblocks(o->memblockq), */
@@ -668,6 +753,9 @@ static void sink_input_attach_cb(pa_sink_input *i) {
 
     pa_sink_input_request_rewind(i, 0, false, true, true);
 
+    if (o->drift_controller)
+        pa_drift_controller_reset(o->drift_controller);
+
     nbytes = pa_sink_input_get_max_request(i);
     pa_atomic_store(&o->max_request, (int) nbytes);
     pa_log_debug("attach max request %lu", (unsigned long) nbytes);
@@ -1152,6 +1240,32 @@ static void update_description(struct userdata *u) {
     pa_xfree(t);
 }
 
+/* Called from main context */
+static bool outputs_share_clock(struct output *a, struct output *b) {
+    return a->sink == b->sink || (a->sink->card && a->sink->card == b->sink->card);
+}
+
+/* Called from main context. In fan-out mode, the first output that runs
+ * at the rate of the combined sink becomes direct, and so does every
+ * other output at that rate which is driven by the same clock. */
+static bool output_can_be_direct(struct output *o) {
+    struct userdata *u = o->userdata;
+    struct output *j;
+    uint32_t idx;
+
+    if (!u->fanout || o->sink->sample_spec.rate != u->sink->sample_spec.rate)
+        return false;
+
+    PA_IDXSET_FOREACH(j, u->outputs, idx) {
+        if (j == o || !j->sink_input || !j->direct)
+            continue;
+
+        return outputs_share_clock(o, j);
+    }
+
+    return true;
+}
+
 static int output_create_sink_input(struct output *o) {
     struct userdata *u;
     pa_sink_input_new_data data;
@@ -1172,9 +1286,13 @@ static int output_create_sink_input(struct output *o) {
     pa_sink_input_new_data_set_channel_map(&data, &u->sink->channel_map);
     data.module = u->module;
     data.resample_method = u->resample_method;
-    data.flags = PA_SINK_INPUT_VARIABLE_RATE|PA_SINK_INPUT_DONT_MOVE|PA_SINK_INPUT_NO_CREATE_ON_SUSPEND;
+    data.flags = PA_SINK_INPUT_DONT_MOVE|PA_SINK_INPUT_NO_CREATE_ON_SUSPEND;
     data.origin_sink = u->sink;
 
+    o->direct = output_can_be_direct(o);
+    if (!o->direct)
+        data.flags |= PA_SINK_INPUT_VARIABLE_RATE;
+
     if (!u->remix)
         data.flags |= PA_SINK_INPUT_NO_REMIX;
 
@@ -1198,6 +1316,9 @@ static int output_create_sink_input(struct output *o) {
 
     pa_sink_input_set_requested_latency(o->sink_input, pa_sink_get_requested_latency(u->sink));
 
+    if (o->direct)
+        pa_log_info("[%s] Output is direct, not resampling.", o->sink->name);
+
     return 0;
 }
 
@@ -1242,6 +1363,9 @@ static struct output *output_new(struct userdata *u, pa_sink *sink) {
             0,
             &u->sink->silence);
 
+    if (u->pi_control)
+        o->drift_controller = pa_drift_controller_new(PA_DRIFT_CONTROLLER_DEFAULT_TIME_CONSTANT, 0.01);
+
     pa_assert_se(pa_idxset_put(u->outputs, o, NULL) == 0);
     update_description(u);
 
@@ -1287,6 +1411,9 @@ static void output_free(struct output *o) {
     if (o->memblockq)
         pa_memblockq_free(o->memblockq);
 
+    if (o->drift_controller)
+        pa_drift_controller_free(o->drift_controller);
+
     pa_xfree(o);
 }
 
@@ -1330,6 +1457,8 @@ static void output_disable(struct output *o) {
     pa_sink_input_unref(o->sink_input);
     o->sink_input = NULL;
 
+    pa_atomic_store(&o->target_latency, 0);
+
     /* Finally, drop all queued data */
     pa_memblockq_flush_write(o->memblockq, true);
     pa_asyncmsgq_flush(o->audio_inq, false);
@@ -1462,10 +1591,60 @@ static pa_hook_result_t sink_state_changed_hook_cb(pa_core *c, pa_sink *s, struc
     return PA_HOOK_OK;
 }
 
+/* Called from main context */
+static char *get_metrics(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct output *o;
+    uint32_t idx;
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_bool(encoder, "fanout", u->fanout);
+    pa_json_encoder_add_member_int(encoder, "target_latency", (int64_t) u->target_latency);
+    pa_json_encoder_begin_member_array(encoder, "outputs");
+
+    PA_IDXSET_FOREACH(o, u->outputs, idx) {
+        pa_json_encoder_begin_element_object(encoder);
+        pa_json_encoder_add_member_string(encoder, "sink", o->sink->name);
+        pa_json_encoder_add_member_bool(encoder, "active", !!o->sink_input);
+        pa_json_encoder_add_member_bool(encoder, "direct", o->sink_input && o->direct);
+        pa_json_encoder_add_member_int(encoder, "rate", o->sink_input ? o->sink_input->sample_spec.rate : 0);
+        pa_json_encoder_add_member_int(encoder, "total_latency", (int64_t) o->total_latency);
+        pa_json_encoder_add_member_int(encoder, "lag", o->lag);
+        pa_json_encoder_end_object(encoder);
+    }
+
+    pa_json_encoder_end_array(encoder);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int combine_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* Latencies are in usec, lag is positive if an output is behind the
+     * target latency */
+    if (pa_streq(message, "get-metrics")) {
+        *response = get_metrics(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module*m) {
     struct userdata *u;
     pa_modargs *ma = NULL;
-    const char *slaves, *rm;
+    const char *slaves, *rm, *rc;
     int resample_method;
     pa_sample_spec ss;
     pa_channel_map map;
@@ -1506,6 +1685,20 @@ int pa__init(pa_module*m) {
         goto fail;
     }
 
+    if (pa_modargs_get_value_boolean(ma, "fanout", &u->fanout) < 0) {
+        pa_log("Invalid boolean fanout parameter");
+        goto fail;
+    }
+
+    if ((rc = pa_modargs_get_value(ma, "rate_control", NULL))) {
+        if (pa_streq(rc, "pi"))
+            u->pi_control = true;
+        else if (!pa_streq(rc, "timer")) {
+            pa_log("Invalid rate_control value '%s'", rc);
+            goto fail;
+        }
+    }
+
     u->resample_method = resample_method;
     u->outputs = pa_idxset_new(NULL, NULL);
 #ifndef USE_SMOOTHER_2
@@ -1711,6 +1904,9 @@ int pa__init(pa_module*m) {
     PA_IDXSET_FOREACH(o, u->outputs, idx)
         output_verify(o);
 
+    u->message_handler_path = pa_sprintf_malloc("/sink/%s/combine", u->sink->name);
+    pa_message_handler_register(m->core, u->message_handler_path, "Combine sink message handler", combine_message_handler, u);
+
     pa_modargs_free(ma);
 
     return 0;
@@ -1733,6 +1929,11 @@ void pa__done(pa_module*m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     if (u->sink && PA_SINK_IS_LINKED(u->sink->state))
         pa_sink_suspend(u->sink, true, PA_SUSPEND_UNAVAILABLE);
 
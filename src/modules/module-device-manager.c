@@ -46,7 +46,7 @@
 #include <pulsecore/protocol-native.h>
 #include <pulsecore/pstream.h>
 #include <pulsecore/pstream-util.h>
-#include <pulsecore/database.h>
+#include <pulsecore/database-async.h>
 #include <pulsecore/tagstruct.h>
 
 PA_MODULE_AUTHOR("Colin Guthrie");
@@ -111,7 +111,7 @@ struct userdata {
         *source_unlink_hook_slot,
         *connection_unlink_hook_slot;
     pa_time_event *save_time_event;
-    pa_database *database;
+    pa_database_async *database;
 
     pa_native_protocol *protocol;
     pa_idxset *subscribed;
@@ -162,7 +162,7 @@ static void save_time_callback(pa_mainloop_api*a, pa_time_event* e, const struct
     u->core->mainloop->time_free(u->save_time_event);
     u->save_time_event = NULL;
 
-    pa_database_sync(u->database);
+    pa_database_async_sync(u->database, NULL, NULL);
     pa_log_info("Synced.");
 
 #ifdef DUMP_DATABASE
@@ -218,7 +218,7 @@ static bool entry_write(struct userdata *u, const char *name, const struct entry
 
     data.data = (void*)pa_tagstruct_data(t, &data.size);
 
-    r = (pa_database_set(u->database, &key, &data, true) == 0);
+    r = (pa_database_async_set(u->database, &key, &data, true) == 0);
 
     pa_tagstruct_free(t);
 
@@ -290,7 +290,7 @@ static struct entry* entry_read(struct userdata *u, const char *name) {
 
     pa_zero(data);
 
-    if (!pa_database_get(u->database, &key, &data)) {
+    if (!pa_database_async_get(u->database, &key, &data)) {
         pa_log_debug("Database contains no data for key: %s", name);
         return NULL;
     }
@@ -383,7 +383,7 @@ static void dump_database(struct userdata *u) {
 
     pa_assert(u);
 
-    done = !pa_database_first(u->database, &key, NULL);
+    done = !pa_database_async_first(u->database, &key, NULL);
 
     pa_log_debug("Dumping database");
     while (!done) {
@@ -391,7 +391,7 @@ static void dump_database(struct userdata *u) {
         struct entry *e;
         pa_datum next_key;
 
-        done = !pa_database_next(u->database, &key, &next_key, NULL);
+        done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
         name = pa_xstrndup(key.data, key.size);
 
@@ -506,13 +506,13 @@ static inline struct entry *load_or_initialize_entry(struct userdata *u, struct
         bool done;
 
         pa_zero(max_priority);
-        done = !pa_database_first(u->database, &key, NULL);
+        done = !pa_database_async_first(u->database, &key, NULL);
 
         /* Find all existing devices with the same prefix so we calculate the current max priority for each role */
         while (!done) {
             pa_datum next_key;
 
-            done = !pa_database_next(u->database, &key, &next_key, NULL);
+            done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
             if (key.size > strlen(prefix) && strncmp(key.data, prefix, strlen(prefix)) == 0) {
                 char *name2;
@@ -574,13 +574,13 @@ static void update_highest_priority_device_indexes(struct userdata *u, const cha
     }
     pa_zero(highest_priority_available);
 
-    done = !pa_database_first(u->database, &key, NULL);
+    done = !pa_database_async_first(u->database, &key, NULL);
 
     /* Find all existing devices with the same prefix so we find the highest priority device for each role */
     while (!done) {
         pa_datum next_key;
 
-        done = !pa_database_next(u->database, &key, &next_key, NULL);
+        done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
         if (key.size > strlen(prefix) && strncmp(key.data, prefix, strlen(prefix)) == 0) {
             char *name, *device_name;
@@ -1178,14 +1178,14 @@ static int extension_cb(pa_native_protocol *p, pa_module *m, pa_native_connectio
       if (!pa_tagstruct_eof(t))
         goto fail;
 
-      done = !pa_database_first(u->database, &key, NULL);
+      done = !pa_database_async_first(u->database, &key, NULL);
 
       while (!done) {
         pa_datum next_key;
         struct entry *e;
         char *name;
 
-        done = !pa_database_next(u->database, &key, &next_key, NULL);
+        done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
         name = pa_xstrndup(key.data, key.size);
         pa_datum_free(&key);
@@ -1283,7 +1283,7 @@ static int extension_cb(pa_native_protocol *p, pa_module *m, pa_native_connectio
         key.size = strlen(name);
 
         /** @todo: Reindex the priorities */
-        pa_database_unset(u->database, &key);
+        pa_database_async_unset(u->database, &key);
       }
 
       trigger_save(u);
@@ -1395,12 +1395,12 @@ static int extension_cb(pa_native_protocol *p, pa_module *m, pa_native_connectio
            not specified in the device list (and thus will be
            tacked on at the end) */
         offset = idx;
-        done = !pa_database_first(u->database, &key, NULL);
+        done = !pa_database_async_first(u->database, &key, NULL);
 
         while (!done && idx < 256) {
             pa_datum next_key;
 
-            done = !pa_database_next(u->database, &key, &next_key, NULL);
+            done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
             device = pa_xnew(struct device_t, 1);
             device->device = pa_xstrndup(key.data, key.size);
@@ -1604,7 +1604,7 @@ int pa__init(pa_module*m) {
     if (!(state_path = pa_state_path(NULL, true)))
         goto fail;
 
-    if (!(u->database = pa_database_open(state_path, "device-manager", true, true))) {
+    if (!(u->database = pa_database_async_open(u->core, state_path, "device-manager", true, true))) {
         pa_xfree(state_path);
         goto fail;
     }
@@ -1727,7 +1727,7 @@ void pa__done(pa_module*m) {
         u->core->mainloop->time_free(u->save_time_event);
 
     if (u->database)
-        pa_database_close(u->database);
+        pa_database_async_close(u->database);
 
     if (u->protocol) {
         pa_native_protocol_remove_ext(u->protocol, m);
@@ -49,7 +49,7 @@
 #include <pulsecore/protocol-native.h>
 #include <pulsecore/pstream.h>
 #include <pulsecore/pstream-util.h>
-#include <pulsecore/database.h>
+#include <pulsecore/database-async.h>
 #include <pulsecore/tagstruct.h>
 
 PA_MODULE_AUTHOR("Lennart Poettering");
@@ -77,7 +77,7 @@ struct userdata {
     pa_module *module;
     pa_subscription *subscription;
     pa_time_event *save_time_event;
-    pa_database *database;
+    pa_database_async *database;
 
     pa_native_protocol *protocol;
     pa_idxset *subscribed;
@@ -128,7 +128,7 @@ static void save_time_callback(pa_mainloop_api*a, pa_time_event* e, const struct
     u->core->mainloop->time_free(u->save_time_event);
     u->save_time_event = NULL;
 
-    pa_database_sync(u->database);
+    pa_database_async_sync(u->database, NULL, NULL);
     pa_log_info("Synced.");
 }
 
@@ -199,7 +199,7 @@ static bool entry_write(struct userdata *u, const char *name, const struct entry
 
     data.data = (void*)pa_tagstruct_data(t, &data.size);
 
-    r = (pa_database_set(u->database, &key, &data, true) == 0);
+    r = (pa_database_async_set(u->database, &key, &data, true) == 0);
 
     pa_tagstruct_free(t);
 
@@ -220,7 +220,7 @@ static struct entry* entry_read(struct userdata *u, const char *name) {
 
     pa_zero(data);
 
-    if (!pa_database_get(u->database, &key, &data)) {
+    if (!pa_database_async_get(u->database, &key, &data)) {
         pa_log_debug("Database contains no data for key: %s", name);
         return NULL;
     }
@@ -378,7 +378,7 @@ static bool perportentry_write(struct userdata *u, const char *basekeyname, cons
 
     data.data = (void*)pa_tagstruct_data(t, &data.size);
 
-    r = (pa_database_set(u->database, &key, &data, true) == 0);
+    r = (pa_database_async_set(u->database, &key, &data, true) == 0);
 
     pa_tagstruct_free(t);
     pa_xfree(name);
@@ -403,7 +403,7 @@ static struct perportentry* perportentry_read(struct userdata *u, const char *ba
 
     pa_zero(data);
 
-    if (!pa_database_get(u->database, &key, &data))
+    if (!pa_database_async_get(u->database, &key, &data))
         goto fail;
 
     t = pa_tagstruct_new_fixed(data.data, data.size);
@@ -1262,7 +1262,7 @@ int pa__init(pa_module*m) {
     if (!(state_path = pa_state_path(NULL, true)))
         goto fail;
 
-    if (!(u->database = pa_database_open(state_path, "device-volumes", true, true))) {
+    if (!(u->database = pa_database_async_open(u->core, state_path, "device-volumes", true, true))) {
         pa_xfree(state_path);
         goto fail;
     }
@@ -1300,11 +1300,11 @@ void pa__done(pa_module*m) {
 
     if (u->save_time_event) {
         u->core->mainloop->time_free(u->save_time_event);
-        pa_database_sync(u->database);
+        pa_database_async_sync(u->database, NULL, NULL);
     }
 
     if (u->database)
-        pa_database_close(u->database);
+        pa_database_async_close(u->database);
 
     if (u->protocol) {
         pa_native_protocol_remove_ext(u->protocol, m);
@@ -30,17 +30,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <float.h>
 #include <math.h>
 #include <string.h>
 #include <stdint.h>
 
-//#undef __SSE2__
-#ifdef __SSE2__
-#include <xmmintrin.h>
-#include <emmintrin.h>
-#endif
-
 #include <fftw3.h>
 
 #include <pulse/xmalloc.h>
@@ -48,7 +41,9 @@
 
 #include <pulsecore/core-rtclock.h>
 #include <pulsecore/i18n.h>
+#include <pulsecore/atomic.h>
 #include <pulsecore/aupdate.h>
+#include <pulsecore/convolver.h>
 #include <pulsecore/namereg.h>
 #include <pulsecore/sink.h>
 #include <pulsecore/module.h>
@@ -82,6 +77,7 @@ PA_MODULE_USAGE(
 
 #define MEMBLOCKQ_MAXLENGTH (16*1024*1024)
 #define DEFAULT_AUTOLOADED false
+#define BLOCK_SIZE 256
 
 struct userdata {
     pa_module *module;
@@ -91,24 +87,23 @@ struct userdata {
 
     size_t channels;
     size_t fft_size;//length (res) of fft
-    size_t window_size;/*
-                        *sliding window size
-                        *effectively chooses R
-                        */
-    size_t R;/* the hop size between overlapping windows
-              * the latency of the filter, calculated from window_size
-              * based on constraints of COLA and window function
+    size_t filter_length;/*
+                          *length of the linear phase impulse responses
+                          *the filters are turned into, odd
+                          */
+    size_t R;/* the block size of the convolution, samples are
+              * processed in multiples of it
               */
     //for twiddling with pulseaudio
-    size_t overlap_size;//window_size-R
     size_t samples_gathered;
     size_t input_buffer_max;
     //message
-    float *W;//windowing function (time domain)
-    float *work_buffer, **input, **overlap_accum;
-    fftwf_complex *output_window;
-    fftwf_plan forward_plan, inverse_plan;
-    //size_t samplings;
+    float *W;//windowing function for the impulse responses (time domain)
+    float *work_buffer, *ir, **input, **output;
+    fftwf_complex *filter_window;
+    fftwf_plan inverse_plan;//turns a filter into an impulse response
+    pa_convolver *convolver;
+    pa_atomic_t filters_changed;
 
     float **Xs;
     float ***Hs;//thread updatable copies of the freq response filters (magnitude based)
@@ -118,7 +113,6 @@ struct userdata {
     size_t output_buffer_length;
     size_t output_buffer_max_length;
     pa_memblockq *output_q;
-    bool first_iteration;
 
     pa_dbus_protocol *dbus_protocol;
     char *dbus_path;
@@ -154,7 +148,7 @@ static void dbus_init(struct userdata *u);
 static void dbus_done(struct userdata *u);
 
 static void hanning_window(float *W, size_t window_size) {
-    /* h=.5*(1-cos(2*pi*j/(window_size+1)), COLA for R=(M+1)/2 */
+    /* h=.5*(1-cos(2*pi*j/(window_size+1)) */
     for (size_t i = 0; i < window_size; ++i)
         W[i] = (float).5 * (1 - cos(2*M_PI*i / (window_size+1)));
 }
@@ -224,12 +218,10 @@ static void alloc_input_buffers(struct userdata *u, size_t min_buffer_length) {
     if (min_buffer_length <= u->input_buffer_max)
         return;
 
-    pa_assert(min_buffer_length >= u->window_size);
     for (size_t c = 0; c < u->channels; ++c) {
         float *tmp = alloc(min_buffer_length, sizeof(float));
         if (u->input[c]) {
-            if (!u->first_iteration)
-                memcpy(tmp, u->input[c], u->overlap_size * sizeof(float));
+            memcpy(tmp, u->input[c], u->samples_gathered * sizeof(float));
             fftwf_free(u->input[c]);
         }
         u->input[c] = tmp;
@@ -262,7 +254,10 @@ static int sink_process_msg_cb(pa_msgobject *o, int code, void *data, int64_t of
                 /* Add the latency internal to our sink input on top */
                 pa_bytes_to_usec(pa_memblockq_get_length(u->output_q) +
                                  pa_memblockq_get_length(u->input_q), &u->sink_input->sink->sample_spec) +
-                pa_bytes_to_usec(pa_memblockq_get_length(u->sink_input->thread_info.render_memblockq), &u->sink_input->sink->sample_spec);
+                pa_bytes_to_usec(pa_memblockq_get_length(u->sink_input->thread_info.render_memblockq), &u->sink_input->sink->sample_spec) +
+
+                /* The delay of the linear phase filters */
+                pa_bytes_to_usec(u->filter_length / 2 * pa_frame_size(&u->sink->sample_spec), &u->sink->sample_spec);
             //    pa_bytes_to_usec(u->samples_gathered * fs, &u->sink->sample_spec);
             //+ pa_bytes_to_usec(u->latency * fs, ss)
 
@@ -367,158 +362,43 @@ static void sink_set_mute_cb(pa_sink *s) {
     pa_sink_input_set_mute(u->sink_input, s->muted, s->save_muted);
 }
 
-#if 1
-//reference implementation
-static void dsp_logic(
-    float * restrict dst,//used as a temp array too, needs to be fft_length!
-    float * restrict src,/*input data w/ overlap at start,
-                               *automatically cycled in routine
-                               */
-    float * restrict overlap,
-    const float X,//multiplier
-    const float * restrict H,//The freq. magnitude scalers filter
-    const float * restrict W,//The windowing function
-    fftwf_complex * restrict output_window,//The transformed windowed src
-    struct userdata *u) {
-
-    //use a linear-phase sliding STFT and overlap-add method (for each channel)
-    //window the data
-    for(size_t j = 0; j < u->window_size; ++j) {
-        dst[j] = X * W[j] * src[j];
-    }
-    //zero pad the remaining fft window
-    memset(dst + u->window_size, 0, (u->fft_size - u->window_size) * sizeof(float));
-    //Processing is done here!
-    //do fft
-    fftwf_execute_dft_r2c(u->forward_plan, dst, output_window);
-    //perform filtering
+/* Turns the magnitude response of a channel into a linear phase impulse
+ * response for the convolver
+ *
+ * Called from I/O thread context */
+static void update_filter(struct userdata *u, size_t c) {
+    unsigned a_i;
+    float X;
+    const float *H;
+    size_t half = u->filter_length / 2;
+
+    a_i = pa_aupdate_read_begin(u->a_H[c]);
+    X = u->Xs[c][a_i];
+    H = u->Hs[c][a_i];
     for(size_t j = 0; j < FILTER_SIZE(u); ++j) {
-        u->output_window[j][0] *= H[j];
-        u->output_window[j][1] *= H[j];
-    }
-    //inverse fft
-    fftwf_execute_dft_c2r(u->inverse_plan, output_window, dst);
-    ////debug: tests overlapping add
-    ////and negates ALL PREVIOUS processing
-    ////yields a perfect reconstruction if COLA is held
-    //for(size_t j = 0; j < u->window_size; ++j) {
-    //    u->work_buffer[j] = u->W[j] * u->input[c][j];
-    //}
-
-    //overlap add and preserve overlap component from this window (linear phase)
-    for(size_t j = 0; j < u->overlap_size; ++j) {
-        u->work_buffer[j] += overlap[j];
-        overlap[j] = dst[u->R + j];
-    }
-    ////debug: tests if basic buffering works
-    ////shouldn't modify the signal AT ALL (beyond roundoff)
-    //for(size_t j = 0; j < u->window_size;++j) {
-    //    u->work_buffer[j] = u->input[c][j];
-    //}
-
-    //preserve the needed input for the next window's overlap
-    memmove(src, src + u->R,
-        (u->samples_gathered - u->R) * sizeof(float)
-    );
-}
-#else
-typedef float v4sf __attribute__ ((__aligned__(v_size * sizeof(float))));
-typedef union float_vector {
-    float f[v_size];
-    v4sf v;
-    __m128 m;
-} float_vector_t;
-
-//regardless of sse enabled, the loops in here assume
-//16 byte aligned addresses and memory allocations divisible by v_size
-static void dsp_logic(
-    float * restrict dst,//used as a temp array too, needs to be fft_length!
-    float * restrict src,/*input data w/ overlap at start,
-                               *automatically cycled in routine
-                               */
-    float * restrict overlap,//The size of the overlap
-    const float X,//multiplier
-    const float * restrict H,//The freq. magnitude scalers filter
-    const float * restrict W,//The windowing function
-    fftwf_complex * restrict output_window,//The transformed windowed src
-    struct userdata *u) {//Collection of constants
-    const size_t overlap_size = PA_ROUND_UP(u->overlap_size, v_size);
-    float_vector_t x;
-    x.f[0] = x.f[1] = x.f[2] = x.f[3] = X;
-
-    //assert(u->samples_gathered >= u->R);
-    //use a linear-phase sliding STFT and overlap-add method
-    for(size_t j = 0; j < u->window_size; j += v_size) {
-        //dst[j] = W[j] * src[j];
-        float_vector_t *d = (float_vector_t*) (dst + j);
-        float_vector_t *w = (float_vector_t*) (W + j);
-        float_vector_t *s = (float_vector_t*) (src + j);
-//#if __SSE2__
-        d->m = _mm_mul_ps(x.m, _mm_mul_ps(w->m, s->m));
-//        d->v = x->v * w->v * s->v;
-//#endif
-    }
-    //zero pad the remaining fft window
-    memset(dst + u->window_size, 0, (u->fft_size - u->window_size) * sizeof(float));
-
-    //Processing is done here!
-    //do fft
-    fftwf_execute_dft_r2c(u->forward_plan, dst, output_window);
-    //perform filtering - purely magnitude based
-    for(size_t j = 0; j < FILTER_SIZE; j += v_size / 2) {
-        //output_window[j][0]*=H[j];
-        //output_window[j][1]*=H[j];
-        float_vector_t *d = (float_vector_t*)( ((float *) output_window) + 2 * j);
-        float_vector_t h;
-        h.f[0] = h.f[1] = H[j];
-        h.f[2] = h.f[3] = H[j + 1];
-//#if __SSE2__
-        d->m = _mm_mul_ps(d->m, h.m);
-//#else
-//        d->v = d->v * h.v;
-//#endif
-    }
-
-    //inverse fft
-    fftwf_execute_dft_c2r(u->inverse_plan, output_window, dst);
-
-    ////debug: tests overlapping add
-    ////and negates ALL PREVIOUS processing
-    ////yields a perfect reconstruction if COLA is held
-    //for(size_t j = 0; j < u->window_size; ++j) {
-    //    dst[j] = W[j] * src[j];
-    //}
-
-    //overlap add and preserve overlap component from this window (linear phase)
-    for(size_t j = 0; j < overlap_size; j += v_size) {
-        //dst[j]+=overlap[j];
-        //overlap[j]+=dst[j+R];
-        float_vector_t *d = (float_vector_t*)(dst + j);
-        float_vector_t *o = (float_vector_t*)(overlap + j);
-//#if __SSE2__
-        d->m = _mm_add_ps(d->m, o->m);
-        o->m = ((float_vector_t*)(dst + u->R + j))->m;
-//#else
-//        d->v = d->v + o->v;
-//        o->v = ((float_vector_t*)(dst + u->R + j))->v;
-//#endif
-    }
-    //memcpy(overlap, dst+u->R, u->overlap_size * sizeof(float)); //overlap preserve (debug)
-    //zero out the bit beyond the real overlap so we don't add garbage next iteration
-    memset(overlap + u->overlap_size, 0, overlap_size - u->overlap_size);
-
-    ////debug: tests if basic buffering works
-    ////shouldn't modify the signal AT ALL (beyond roundoff)
-    //for(size_t j = 0; j < u->window_size; ++j) {
-    //    dst[j] = src[j];
-    //}
-
-    //preserve the needed input for the next window's overlap
-    memmove(src, src + u->R,
-        (u->samples_gathered - u->R) * sizeof(float)
-    );
+        u->filter_window[j][0] = H[j];
+        u->filter_window[j][1] = 0;
+    }
+    pa_aupdate_read_end(u->a_H[c]);
+
+    //the fft gain is already divided out of H, see fix_filter()
+    fftwf_execute(u->inverse_plan);
+
+    //the zero phase response is centered around 0, shift it by half the
+    //filter length to make it causal and window it to the filter length
+    for(size_t j = 0; j < u->filter_length; ++j) {
+        size_t k = (j + u->fft_size - half) % u->fft_size;
+        u->ir[j] = X * u->W[j] * u->work_buffer[k];
+    }
+
+    pa_convolver_set_ir(u->convolver, c, c, u->ir, u->filter_length);
+}
+
+/* Called from main context whenever one of the filters was written */
+static void filter_write_end(struct userdata *u, size_t c) {
+    pa_aupdate_write_end(u->a_H[c]);
+    pa_atomic_store(&u->filters_changed, 1);
 }
-#endif
 
 static void flatten_to_memblockq(struct userdata *u) {
     size_t mbs = pa_mempool_block_size_max(u->sink->core->mempool);
@@ -541,11 +421,10 @@ static void flatten_to_memblockq(struct userdata *u) {
 
 static void process_samples(struct userdata *u) {
     size_t fs = pa_frame_size(&(u->sink->sample_spec));
-    unsigned a_i;
-    float *H, X;
-    size_t iterations, offset;
-    pa_assert(u->samples_gathered >= u->window_size);
-    iterations = (u->samples_gathered - u->overlap_size) / u->R;
+    const float *in[PA_CHANNELS_MAX];
+    size_t iterations, offset, processed;
+    pa_assert(u->samples_gathered >= u->R);
+    iterations = u->samples_gathered / u->R;
     //make sure there is enough buffer memory allocated
     if (iterations * u->R * fs > u->output_buffer_max_length) {
         u->output_buffer_max_length = iterations * u->R * fs;
@@ -554,38 +433,26 @@ static void process_samples(struct userdata *u) {
     }
     u->output_buffer_length = iterations * u->R * fs;
 
+    if (pa_atomic_cmpxchg(&u->filters_changed, 1, 0)) {
+        for(size_t c = 0; c < u->channels; c++)
+            update_filter(u, c);
+    }
+
     for(size_t iter = 0; iter < iterations; ++iter) {
         offset = iter * u->R * fs;
-        for(size_t c = 0;c < u->channels; c++) {
-            a_i = pa_aupdate_read_begin(u->a_H[c]);
-            X = u->Xs[c][a_i];
-            H = u->Hs[c][a_i];
-            dsp_logic(
-                u->work_buffer,
-                u->input[c],
-                u->overlap_accum[c],
-                X,
-                H,
-                u->W,
-                u->output_window,
-                u
-            );
-            pa_aupdate_read_end(u->a_H[c]);
-            if (u->first_iteration) {
-                /* The windowing function will make the audio ramped in, as a cheap fix we can
-                 * undo the windowing (for non-zero window values)
-                 */
-                for(size_t i = 0; i < u->overlap_size; ++i) {
-                    u->work_buffer[i] = u->W[i] <= FLT_EPSILON ? u->work_buffer[i] : u->work_buffer[i] / u->W[i];
-                }
-            }
-            pa_sample_clamp(PA_SAMPLE_FLOAT32NE, (uint8_t *) (((float *)u->output_buffer) + c) + offset, fs, u->work_buffer, sizeof(float), u->R);
-        }
-        if (u->first_iteration) {
-            u->first_iteration = false;
-        }
-        u->samples_gathered -= u->R;
+        for(size_t c = 0; c < u->channels; c++)
+            in[c] = u->input[c] + iter * u->R;
+        pa_convolver_process(u->convolver, in, u->output);
+        for(size_t c = 0; c < u->channels; c++)
+            pa_sample_clamp(PA_SAMPLE_FLOAT32NE, (uint8_t *) (((float *)u->output_buffer) + c) + offset, fs, u->output[c], sizeof(float), u->R);
     }
+
+    //keep the samples that don't fill a block for the next time
+    processed = iterations * u->R;
+    for(size_t c = 0; c < u->channels; c++)
+        memmove(u->input[c], u->input[c] + processed, (u->samples_gathered - processed) * sizeof(float));
+    u->samples_gathered -= processed;
+
     flatten_to_memblockq(u);
 }
 
@@ -595,7 +462,7 @@ static void input_buffer(struct userdata *u, pa_memchunk *in) {
     float *src = pa_memblock_acquire_chunk(in);
     pa_assert(u->samples_gathered + samples <= u->input_buffer_max);
     for(size_t c = 0; c < u->channels; c++) {
-        //buffer with an offset after the overlap from previous
+        //buffer after the samples left over from previous
         //iterations
         pa_assert_se(
             u->input[c] + u->samples_gathered + samples <= u->input[c] + u->input_buffer_max
@@ -639,13 +506,6 @@ static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes, pa_memchunk *chunk
     //mbs = PA_MAX(mbs, u->R);
     //target_samples = PA_MAX(target_samples, mbs);
     //pa_log_debug("target samples: %ld", target_samples);
-    if (u->first_iteration) {
-        //allocate request_size
-        target_samples = PA_MAX(target_samples, u->window_size);
-    }else{
-        //allocate request_size + overlap
-        target_samples += u->overlap_size;
-    }
     alloc_input_buffers(u, target_samples);
     //pa_log_debug("post target samples: %ld", target_samples);
     chunk->memblock = NULL;
@@ -683,8 +543,6 @@ static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes, pa_memchunk *chunk
     //pa_rtclock_get(&end);
     //pa_log_debug("Took %0.6f seconds to get data", (double) pa_timeval_diff(&end, &start) / PA_USEC_PER_SEC);
 
-    pa_assert(u->fft_size >= u->window_size);
-    pa_assert(u->R < u->window_size);
     //pa_rtclock_get(&start);
     /* process a block */
     process_samples(u);
@@ -726,14 +584,10 @@ static void reset_filter(struct userdata *u) {
     size_t max_request;
 
     u->samples_gathered = 0;
+    pa_convolver_reset(u->convolver);
 
-    for(size_t i = 0; i < u->channels; ++i)
-        pa_memzero(u->overlap_accum[i], u->overlap_size * sizeof(float));
-
-    u->first_iteration = true;
-    //set buffer size to max request, no overlap copy
+    //set buffer size to max request
     max_request = PA_ROUND_UP(pa_sink_input_get_max_request(u->sink_input) / fs , u->R);
-    max_request = PA_MAX(max_request, u->window_size);
     pa_sink_set_max_request_within_thread(u->sink, max_request * fs);
 }
 #endif
@@ -843,9 +697,8 @@ static void sink_input_attach_cb(pa_sink_input *i) {
     pa_sink_set_fixed_latency_within_thread(u->sink, i->sink->thread_info.fixed_latency);
 
     fs = pa_frame_size(&u->sink_input->sample_spec);
-    /* set buffer size to max request, no overlap copy */
+    /* set buffer size to max request */
     max_request = PA_ROUND_UP(pa_sink_input_get_max_request(u->sink_input) / fs, u->R);
-    max_request = PA_MAX(max_request, u->window_size);
 
     pa_sink_set_max_request_within_thread(u->sink, max_request * fs);
 
@@ -1005,7 +858,7 @@ static const char* load_profile(struct userdata *u, size_t channel, char *name)
             u->Xs[channel][a_i] = profile[0];
             memcpy(u->Hs[channel][a_i], profile + 1, FILTER_SIZE(u) * sizeof(float));
             fix_filter(u->Hs[channel][a_i], u->fft_size);
-            pa_aupdate_write_end(u->a_H[channel]);
+            filter_write_end(u, channel);
             pa_xfree(u->base_profiles[channel]);
             u->base_profiles[channel] = pa_xstrdup(name);
         }else{
@@ -1045,7 +898,7 @@ static void load_state(struct userdata *u) {
                 H = state + c * CHANNEL_PROFILE_SIZE(u) + 1;
                 u->Xs[c][a_i] = state[c * CHANNEL_PROFILE_SIZE(u)];
                 memcpy(u->Hs[c][a_i], H, FILTER_SIZE(u) * sizeof(float));
-                pa_aupdate_write_end(u->a_H[c]);
+                filter_write_end(u, c);
             }
             unpack(((char *)value.data) + FILTER_STATE_SIZE(u) * sizeof(float), value.size - FILTER_STATE_SIZE(u) * sizeof(float), &names, &n_profs);
             n_profs = PA_MIN(n_profs, u->channels);
@@ -1155,11 +1008,10 @@ int pa__init(pa_module*m) {
     u->channels = ss.channels;
     u->fft_size = pow(2, ceil(log(ss.rate) / log(2)));//probably unstable near corner cases of powers of 2
     pa_log_debug("fft size: %zd", u->fft_size);
-    u->window_size = 15999;
-    if (u->window_size % 2 == 0)
-        u->window_size--;
-    u->R = (u->window_size + 1) / 2;
-    u->overlap_size = u->window_size - u->R;
+    u->filter_length = PA_MIN(15999, u->fft_size - 1);
+    if (u->filter_length % 2 == 0)
+        u->filter_length--;
+    u->R = BLOCK_SIZE;
     u->samples_gathered = 0;
     u->input_buffer_max = 0;
 
@@ -1174,21 +1026,35 @@ int pa__init(pa_module*m) {
             u->Hs[c][i] = alloc(FILTER_SIZE(u), sizeof(float));
     }
 
-    u->W = alloc(u->window_size, sizeof(float));
+    u->W = alloc(u->filter_length, sizeof(float));
     u->work_buffer = alloc(u->fft_size, sizeof(float));
+    u->ir = alloc(u->filter_length, sizeof(float));
     u->input = pa_xnew0(float *, u->channels);
-    u->overlap_accum = pa_xnew0(float *, u->channels);
+    u->output = pa_xnew0(float *, u->channels);
     for (c = 0; c < u->channels; ++c) {
         u->a_H[c] = pa_aupdate_new();
         u->input[c] = NULL;
-        u->overlap_accum[c] = alloc(u->overlap_size, sizeof(float));
+        u->output[c] = alloc(u->R, sizeof(float));
     }
-    u->output_window = alloc(FILTER_SIZE(u), sizeof(fftwf_complex));
-    u->forward_plan = fftwf_plan_dft_r2c_1d(u->fft_size, u->work_buffer, u->output_window, FFTW_ESTIMATE);
-    u->inverse_plan = fftwf_plan_dft_c2r_1d(u->fft_size, u->output_window, u->work_buffer, FFTW_ESTIMATE);
+    u->filter_window = alloc(FILTER_SIZE(u), sizeof(fftwf_complex));
+    u->inverse_plan = fftwf_plan_dft_c2r_1d(u->fft_size, u->filter_window, u->work_buffer, FFTW_ESTIMATE);
 
-    hanning_window(u->W, u->window_size);
-    u->first_iteration = true;
+    hanning_window(u->W, u->filter_length);
+
+    /* The filters are long, split them into partitions that grow with
+     * the offset */
+    if (!(u->convolver = pa_convolver_new(u->R, u->filter_length, u->channels, u->channels, PA_CONVOLVER_NON_UNIFORM))) {
+        pa_log("Failed to create convolver.");
+        goto fail;
+    }
+
+    /* Setting the impulse response of a pair for the first time allocates,
+     * so start with a flat response here rather than in update_filter(),
+     * which runs in the I/O thread. The delay matches the linear phase
+     * filters. */
+    u->ir[u->filter_length / 2] = 1.0f;
+    for (c = 0; c < u->channels; ++c)
+        pa_convolver_set_ir(u->convolver, c, c, u->ir, u->filter_length);
 
     u->base_profiles = pa_xnew0(char *, u->channels);
     for (c = 0; c < u->channels; ++c)
@@ -1305,7 +1171,7 @@ int pa__init(pa_module*m) {
             H[i] = 1.0 / sqrtf(2.0f);
 
         fix_filter(H, u->fft_size);
-        pa_aupdate_write_end(u->a_H[c]);
+        filter_write_end(u, c);
     }
 
     /* load old parameters */
@@ -1378,17 +1244,19 @@ void pa__done(pa_module*m) {
     pa_memblockq_free(u->output_q);
     pa_memblockq_free(u->input_q);
 
+    if (u->convolver)
+        pa_convolver_free(u->convolver);
     fftwf_destroy_plan(u->inverse_plan);
-    fftwf_destroy_plan(u->forward_plan);
-    fftwf_free(u->output_window);
+    fftwf_free(u->filter_window);
     for (c = 0; c < u->channels; ++c) {
         pa_aupdate_free(u->a_H[c]);
-        fftwf_free(u->overlap_accum[c]);
+        fftwf_free(u->output[c]);
         fftwf_free(u->input[c]);
     }
     pa_xfree(u->a_H);
-    pa_xfree(u->overlap_accum);
+    pa_xfree(u->output);
     pa_xfree(u->input);
+    fftwf_free(u->ir);
     fftwf_free(u->work_buffer);
     fftwf_free(u->W);
     for (c = 0; c < u->channels; ++c) {
@@ -1889,10 +1757,10 @@ void equalizer_handle_seed_filter(DBusConnection *conn, DBusMessage *msg, void *
             float *H_p = u->Hs[c][b_i];
             u->Xs[c][b_i] = preamp;
             memcpy(H_p, H, FILTER_SIZE(u) * sizeof(float));
-            pa_aupdate_write_end(u->a_H[c]);
+            filter_write_end(u, c);
         }
     }
-    pa_aupdate_write_end(u->a_H[r_channel]);
+    filter_write_end(u, r_channel);
     pa_xfree(ys);
 
     pa_dbus_send_empty_reply(conn, msg);
@@ -2039,10 +1907,10 @@ static void set_filter(struct userdata *u, size_t channel, double *H_, double pr
             unsigned b_i = pa_aupdate_write_begin(u->a_H[c]);
             u->Xs[c][b_i] = u->Xs[r_channel][a_i];
             memcpy(u->Hs[c][b_i], u->Hs[r_channel][a_i], FILTER_SIZE(u) * sizeof(float));
-            pa_aupdate_write_end(u->a_H[c]);
+            filter_write_end(u, c);
         }
     }
-    pa_aupdate_write_end(u->a_H[r_channel]);
+    filter_write_end(u, r_channel);
 }
 
 void equalizer_handle_set_filter(DBusConnection *conn, DBusMessage *msg, void *_u) {
@@ -0,0 +1,1281 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* A virtual sink that runs a chain of filters in a single pass. Stacking
+ * module-ladspa-sink, module-remap-sink and friends costs a sink, a sink
+ * input, a queue and an interleaved copy per filter. Here the audio is
+ * de-interleaved once into planar buffers, every stage of the chain works
+ * on those buffers and the result is interleaved once at the end.
+ *
+ * The chain is given as a list of stages separated by '|'. Every stage
+ * starts with its type, followed by its arguments in the usual key=value
+ * syntax:
+ *
+ *   ladspa plugin=<name> label=<label> control=<comma separated values>
+ *       Runs a LADSPA plugin. The plugin must have as many audio outputs
+ *       as inputs, and is instantiated as often as needed to cover all
+ *       channels. Empty or missing control values use the plugin default.
+ *
+ *   biquad type=lowpass|highpass freq=<Hz> channels=<list of indices>
+ *       Second order Butterworth filter.
+ *
+ *   crossover type=lowpass|highpass freq=<Hz> channels=<list of indices>
+ *       Fourth order Linkwitz-Riley filter, as used for crossovers.
+ *
+ *   remap map=<list of indices>
+ *       Output channel n is a copy of input channel map[n].
+ *
+ * The channels argument selects the channels a filter applies to, all
+ * others pass unchanged. It defaults to all channels.
+ *
+ * Example:
+ *   load-module module-filter-chain sink_master=alsa_output.0 channels=2
+ *       chain="biquad type=highpass freq=80 | ladspa plugin=sc4_1882 label=sc4 control=1,1.5,401,-30,20,5,12"
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/i18n.h>
+#include <pulsecore/namereg.h>
+#include <pulsecore/sink.h>
+#include <pulsecore/module.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/modargs.h>
+#include <pulsecore/log.h>
+#include <pulsecore/rtpoll.h>
+#include <pulsecore/sample-util.h>
+#include <pulsecore/ltdl-helper.h>
+#include <pulsecore/filter/biquad.h>
+#include <pulsecore/filter/crossover.h>
+
+#include "ladspa.h"
+
+PA_MODULE_DESCRIPTION(_("Virtual sink running a chain of filters"));
+PA_MODULE_VERSION(PACKAGE_VERSION);
+PA_MODULE_LOAD_ONCE(false);
+PA_MODULE_USAGE(
+    _("sink_name=<name for the sink> "
+      "sink_properties=<properties for the sink> "
+      "sink_input_properties=<properties for the sink input> "
+      "sink_master=<name of sink to filter> "
+      "rate=<sample rate> "
+      "channels=<number of channels> "
+      "channel_map=<input channel map> "
+      "chain=<list of filter stages separated by '|'> "
+      "autoloaded=<set if this module is being loaded automatically> "));
+
+#define MEMBLOCKQ_MAXLENGTH (16*1024*1024)
+#define DEFAULT_AUTOLOADED false
+
+enum stage_type {
+    STAGE_LADSPA,
+    STAGE_BIQUAD,
+    STAGE_CROSSOVER,
+    STAGE_REMAP,
+};
+
+struct ladspa_stage {
+    lt_dlhandle dl;
+    const LADSPA_Descriptor *descriptor;
+    LADSPA_Handle handle[PA_CHANNELS_MAX];
+    unsigned n_handles;
+
+    /* Audio ports, the plugin has the same number of inputs and outputs */
+    unsigned long input_port[PA_CHANNELS_MAX], output_port[PA_CHANNELS_MAX];
+    unsigned long n_ports;
+
+    LADSPA_Data *control;
+    unsigned long n_control;
+
+    /* Every port must be connected, all control outputs share this */
+    LADSPA_Data control_out;
+};
+
+struct biquad_stage {
+    struct biquad bq;
+    float x1[PA_CHANNELS_MAX], x2[PA_CHANNELS_MAX];
+    float y1[PA_CHANNELS_MAX], y2[PA_CHANNELS_MAX];
+};
+
+struct stage {
+    enum stage_type type;
+
+    /* Channels a biquad or crossover is applied to */
+    bool active[PA_CHANNELS_MAX];
+
+    union {
+        struct ladspa_stage ladspa;
+        struct biquad_stage biquad;
+        struct lr4 lr4[PA_CHANNELS_MAX];
+        unsigned map[PA_CHANNELS_MAX];
+    };
+};
+
+struct userdata {
+    pa_module *module;
+
+    pa_sink *sink;
+    pa_sink_input *sink_input;
+
+    pa_memblockq *memblockq;
+
+    struct stage *stages;
+    unsigned n_stages;
+
+    unsigned channels;
+
+    /* Planar buffers of block_size frames. Every stage reads from
+     * planes[c] and writes either in place or to spare[c], swapping the
+     * two afterwards, so untouched channels are never copied. */
+    size_t block_size;
+    float *planes[PA_CHANNELS_MAX];
+    float *spare[PA_CHANNELS_MAX];
+
+    bool auto_desc;
+    bool autoloaded;
+};
+
+static const char* const valid_modargs[] = {
+    "sink_name",
+    "sink_properties",
+    "sink_input_properties",
+    "sink_master",
+    "rate",
+    "channels",
+    "channel_map",
+    "chain",
+    "autoloaded",
+    NULL
+};
+
+static const char* const ladspa_stage_args[] = {
+    "plugin",
+    "label",
+    "control",
+    NULL
+};
+
+static const char* const filter_stage_args[] = {
+    "type",
+    "freq",
+    "channels",
+    NULL
+};
+
+static const char* const remap_stage_args[] = {
+    "map",
+    NULL
+};
+
+/* Called from I/O thread context */
+static void biquad_process(struct biquad_stage *s, unsigned c, float *samples, unsigned n) {
+    float b0 = s->bq.b0, b1 = s->bq.b1, b2 = s->bq.b2, a1 = s->bq.a1, a2 = s->bq.a2;
+    float x1 = s->x1[c], x2 = s->x2[c], y1 = s->y1[c], y2 = s->y2[c];
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        float x = samples[i];
+        float y = b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2;
+
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        samples[i] = y;
+    }
+
+    s->x1[c] = x1;
+    s->x2[c] = x2;
+    s->y1[c] = y1;
+    s->y2[c] = y2;
+}
+
+/* Called from I/O thread context */
+static void stage_process(struct userdata *u, struct stage *s, unsigned n) {
+    unsigned c, h, p;
+
+    switch (s->type) {
+
+    case STAGE_LADSPA: {
+        struct ladspa_stage *l = &s->ladspa;
+
+        /* Ports may be reconnected between runs, the buffers change
+         * whenever a previous stage swapped them */
+        for (h = 0; h < l->n_handles; h++) {
+            for (p = 0; p < l->n_ports; p++) {
+                c = h * l->n_ports + p;
+                l->descriptor->connect_port(l->handle[h], l->input_port[p], u->planes[c]);
+                l->descriptor->connect_port(l->handle[h], l->output_port[p], u->spare[c]);
+            }
+
+            l->descriptor->run(l->handle[h], n);
+        }
+
+        for (c = 0; c < u->channels; c++) {
+            float *t = u->planes[c];
+            u->planes[c] = u->spare[c];
+            u->spare[c] = t;
+        }
+        break;
+    }
+
+    case STAGE_BIQUAD:
+        for (c = 0; c < u->channels; c++)
+            if (s->active[c])
+                biquad_process(&s->biquad, c, u->planes[c], n);
+        break;
+
+    case STAGE_CROSSOVER:
+        for (c = 0; c < u->channels; c++)
+            if (s->active[c])
+                lr4_process_float32(&s->lr4[c], (int) n, 1, u->planes[c], u->planes[c]);
+        break;
+
+    case STAGE_REMAP:
+        for (c = 0; c < u->channels; c++)
+            memcpy(u->spare[c], u->planes[s->map[c]], n * sizeof(float));
+
+        for (c = 0; c < u->channels; c++) {
+            float *t = u->planes[c];
+            u->planes[c] = u->spare[c];
+            u->spare[c] = t;
+        }
+        break;
+    }
+}
+
+/* Forget the filter state, used after rewinds. Called from I/O thread
+ * context, and from main context before the sink is set up. */
+static void stage_reset(struct stage *s) {
+    unsigned c;
+
+    switch (s->type) {
+
+    case STAGE_LADSPA: {
+        struct ladspa_stage *l = &s->ladspa;
+
+        for (c = 0; c < l->n_handles; c++) {
+            if (l->descriptor->deactivate)
+                l->descriptor->deactivate(l->handle[c]);
+            if (l->descriptor->activate)
+                l->descriptor->activate(l->handle[c]);
+        }
+        break;
+    }
+
+    case STAGE_BIQUAD:
+        memset(s->biquad.x1, 0, sizeof(s->biquad.x1));
+        memset(s->biquad.x2, 0, sizeof(s->biquad.x2));
+        memset(s->biquad.y1, 0, sizeof(s->biquad.y1));
+        memset(s->biquad.y2, 0, sizeof(s->biquad.y2));
+        break;
+
+    case STAGE_CROSSOVER:
+        for (c = 0; c < PA_CHANNELS_MAX; c++) {
+            s->lr4[c].x1 = s->lr4[c].x2 = 0;
+            s->lr4[c].y1 = s->lr4[c].y2 = 0;
+            s->lr4[c].z1 = s->lr4[c].z2 = 0;
+        }
+        break;
+
+    case STAGE_REMAP:
+        break;
+    }
+}
+
+static void stage_done(struct stage *s) {
+    struct ladspa_stage *l;
+    unsigned c;
+
+    if (s->type != STAGE_LADSPA)
+        return;
+
+    l = &s->ladspa;
+
+    for (c = 0; c < l->n_handles; c++) {
+        if (l->descriptor->deactivate)
+            l->descriptor->deactivate(l->handle[c]);
+        l->descriptor->cleanup(l->handle[c]);
+    }
+
+    pa_xfree(l->control);
+
+    if (l->dl)
+        lt_dlclose(l->dl);
+}
+
+/* Parses a comma separated list of channel indices. Returns the number of
+ * entries, or -1 on error. */
+static int parse_channel_list(const char *list, unsigned channels, unsigned *indices) {
+    const char *state = NULL;
+    char *k;
+    int n = 0;
+
+    while ((k = pa_split(list, ",", &state))) {
+        uint32_t c;
+
+        if (pa_atou(k, &c) < 0 || c >= channels || n >= (int) channels) {
+            pa_log("Invalid channel index '%s'.", k);
+            pa_xfree(k);
+            return -1;
+        }
+
+        pa_xfree(k);
+        indices[n++] = c;
+    }
+
+    return n;
+}
+
+/* Computes the default value of a LADSPA control port from its hints,
+ * returns false if the plugin does not define one. */
+static bool ladspa_default_value(const LADSPA_PortRangeHint *range, unsigned rate, LADSPA_Data *value) {
+    LADSPA_PortRangeHintDescriptor hint = range->HintDescriptor;
+    LADSPA_Data lower = range->LowerBound, upper = range->UpperBound;
+
+    if (LADSPA_IS_HINT_SAMPLE_RATE(hint)) {
+        lower *= (LADSPA_Data) rate;
+        upper *= (LADSPA_Data) rate;
+    }
+
+    switch (hint & LADSPA_HINT_DEFAULT_MASK) {
+
+    case LADSPA_HINT_DEFAULT_MINIMUM:
+        *value = lower;
+        return true;
+
+    case LADSPA_HINT_DEFAULT_MAXIMUM:
+        *value = upper;
+        return true;
+
+    case LADSPA_HINT_DEFAULT_LOW:
+        if (LADSPA_IS_HINT_LOGARITHMIC(hint))
+            *value = (LADSPA_Data) exp(log(lower) * 0.75 + log(upper) * 0.25);
+        else
+            *value = (LADSPA_Data) (lower * 0.75 + upper * 0.25);
+        return true;
+
+    case LADSPA_HINT_DEFAULT_MIDDLE:
+        if (LADSPA_IS_HINT_LOGARITHMIC(hint))
+            *value = (LADSPA_Data) exp(log(lower) * 0.5 + log(upper) * 0.5);
+        else
+            *value = (LADSPA_Data) (lower * 0.5 + upper * 0.5);
+        return true;
+
+    case LADSPA_HINT_DEFAULT_HIGH:
+        if (LADSPA_IS_HINT_LOGARITHMIC(hint))
+            *value = (LADSPA_Data) exp(log(lower) * 0.25 + log(upper) * 0.75);
+        else
+            *value = (LADSPA_Data) (lower * 0.25 + upper * 0.75);
+        return true;
+
+    case LADSPA_HINT_DEFAULT_0:
+        *value = 0;
+        return true;
+
+    case LADSPA_HINT_DEFAULT_1:
+        *value = 1;
+        return true;
+
+    case LADSPA_HINT_DEFAULT_100:
+        *value = 100;
+        return true;
+
+    case LADSPA_HINT_DEFAULT_440:
+        *value = 440;
+        return true;
+    }
+
+    return false;
+}
+
+static int ladspa_stage_init(struct userdata *u, struct ladspa_stage *l, pa_modargs *ma, unsigned rate) {
+    LADSPA_Descriptor_Function descriptor_func;
+    const LADSPA_Descriptor *d;
+    const char *plugin, *label, *cdata, *e, *state = NULL;
+    unsigned long p, j, n_inputs = 0, n_outputs = 0, h;
+    char *t, *k;
+
+    if (!(plugin = pa_modargs_get_value(ma, "plugin", NULL))) {
+        pa_log("Missing LADSPA plugin name");
+        return -1;
+    }
+
+    if (!(label = pa_modargs_get_value(ma, "label", NULL))) {
+        pa_log("Missing LADSPA plugin label");
+        return -1;
+    }
+
+    if (!(e = getenv("LADSPA_PATH")))
+        /* See module-ladspa-sink.c for why this isn't a string literal */
+        e = PA_EXPAND_AND_STRINGIZE(LADSPA_PATH);
+
+    /* FIXME: This is not exactly thread safe */
+    t = pa_xstrdup(lt_dlgetsearchpath());
+    lt_dlsetsearchpath(e);
+    l->dl = lt_dlopenext(plugin);
+    lt_dlsetsearchpath(t);
+    pa_xfree(t);
+
+    if (!l->dl) {
+        pa_log("Failed to load LADSPA plugin: %s", lt_dlerror());
+        return -1;
+    }
+
+    if (!(descriptor_func = (LADSPA_Descriptor_Function) pa_load_sym(l->dl, NULL, "ladspa_descriptor"))) {
+        pa_log("LADSPA module lacks ladspa_descriptor() symbol.");
+        return -1;
+    }
+
+    for (j = 0;; j++) {
+
+        if (!(d = descriptor_func(j))) {
+            pa_log("Failed to find plugin label '%s' in plugin '%s'.", label, plugin);
+            return -1;
+        }
+
+        if (pa_streq(d->Label, label))
+            break;
+    }
+
+    l->descriptor = d;
+
+    for (p = 0; p < d->PortCount; p++) {
+        if (LADSPA_IS_PORT_AUDIO(d->PortDescriptors[p])) {
+            if (LADSPA_IS_PORT_INPUT(d->PortDescriptors[p])) {
+                if (n_inputs < PA_CHANNELS_MAX)
+                    l->input_port[n_inputs] = p;
+                n_inputs++;
+            } else if (LADSPA_IS_PORT_OUTPUT(d->PortDescriptors[p])) {
+                if (n_outputs < PA_CHANNELS_MAX)
+                    l->output_port[n_outputs] = p;
+                n_outputs++;
+            }
+        } else if (LADSPA_IS_PORT_CONTROL(d->PortDescriptors[p]) && LADSPA_IS_PORT_INPUT(d->PortDescriptors[p]))
+            l->n_control++;
+    }
+
+    if (n_inputs == 0 || n_inputs != n_outputs || u->channels % n_inputs) {
+        pa_log("Plugin %s has %lu inputs and %lu outputs, cannot use it on %u channels in a filter chain.",
+               d->Label, n_inputs, n_outputs, u->channels);
+        return -1;
+    }
+
+    l->n_ports = n_inputs;
+
+    /* Control values, empty or missing ones use the plugin defaults */
+    l->control = pa_xnew0(LADSPA_Data, l->n_control + 1);
+    cdata = pa_modargs_get_value(ma, "control", "");
+
+    for (p = 0, j = 0; p < d->PortCount; p++) {
+        const LADSPA_PortRangeHint *range = &d->PortRangeHints[p];
+        double f;
+
+        if (!LADSPA_IS_PORT_CONTROL(d->PortDescriptors[p]) || !LADSPA_IS_PORT_INPUT(d->PortDescriptors[p]))
+            continue;
+
+        k = pa_split(cdata, ",", &state);
+
+        if (!k || !*k) {
+            if (!ladspa_default_value(range, rate, &l->control[j])) {
+                pa_log("No value given for control port %s, and the plugin defines no default.", d->PortNames[p]);
+                pa_xfree(k);
+                return -1;
+            }
+        } else {
+            if (pa_atod(k, &f) < 0) {
+                pa_log("Failed to parse control value '%s'.", k);
+                pa_xfree(k);
+                return -1;
+            }
+
+            l->control[j] = LADSPA_IS_HINT_INTEGER(range->HintDescriptor) ? roundf(f) : f;
+        }
+
+        pa_xfree(k);
+        pa_log_debug("Control port %s of %s: %f", d->PortNames[p], d->Label, l->control[j]);
+        j++;
+    }
+
+    if ((k = pa_split(cdata, ",", &state))) {
+        pa_log("Too many control values for plugin %s, %lu expected.", d->Label, l->n_control);
+        pa_xfree(k);
+        return -1;
+    }
+
+    l->n_handles = u->channels / (unsigned) l->n_ports;
+
+    for (h = 0; h < l->n_handles; h++) {
+        if (!(l->handle[h] = d->instantiate(d, rate))) {
+            pa_log("Failed to instantiate plugin %s with label %s", plugin, d->Label);
+            l->n_handles = h;
+            return -1;
+        }
+
+        for (p = 0, j = 0; p < d->PortCount; p++) {
+            if (!LADSPA_IS_PORT_CONTROL(d->PortDescriptors[p]))
+                continue;
+
+            if (LADSPA_IS_PORT_OUTPUT(d->PortDescriptors[p]))
+                d->connect_port(l->handle[h], p, &l->control_out);
+            else
+                d->connect_port(l->handle[h], p, &l->control[j++]);
+        }
+
+        if (d->activate)
+            d->activate(l->handle[h]);
+    }
+
+    pa_log_debug("Using %u instances of LADSPA plugin %s (%s)", l->n_handles, d->Label, d->Name);
+
+    return 0;
+}
+
+static int filter_stage_init(struct userdata *u, struct stage *s, pa_modargs *ma, unsigned rate) {
+    const char *type, *channels;
+    enum biquad_type bq_type;
+    unsigned indices[PA_CHANNELS_MAX];
+    double freq;
+    unsigned c;
+    int n;
+
+    type = pa_modargs_get_value(ma, "type", "lowpass");
+
+    if (pa_streq(type, "lowpass"))
+        bq_type = BQ_LOWPASS;
+    else if (pa_streq(type, "highpass"))
+        bq_type = BQ_HIGHPASS;
+    else {
+        pa_log("Invalid filter type '%s'.", type);
+        return -1;
+    }
+
+    if (pa_modargs_get_value_double(ma, "freq", &freq) < 0 || freq <= 0 || freq >= rate / 2) {
+        pa_log("Missing or invalid filter frequency.");
+        return -1;
+    }
+
+    if ((channels = pa_modargs_get_value(ma, "channels", NULL))) {
+        if ((n = parse_channel_list(channels, u->channels, indices)) < 0)
+            return -1;
+
+        for (c = 0; c < (unsigned) n; c++)
+            s->active[indices[c]] = true;
+    } else
+        for (c = 0; c < u->channels; c++)
+            s->active[c] = true;
+
+    /* The filter code takes the frequency relative to the Nyquist
+     * frequency */
+    if (s->type == STAGE_BIQUAD)
+        biquad_set(&s->biquad.bq, bq_type, freq / (rate / 2.0));
+    else
+        for (c = 0; c < PA_CHANNELS_MAX; c++)
+            lr4_set(&s->lr4[c], bq_type, (float) (freq / (rate / 2.0)));
+
+    return 0;
+}
+
+static int remap_stage_init(struct userdata *u, struct stage *s, pa_modargs *ma) {
+    const char *map;
+
+    if (!(map = pa_modargs_get_value(ma, "map", NULL))) {
+        pa_log("Missing channel map for remap stage.");
+        return -1;
+    }
+
+    if (parse_channel_list(map, u->channels, s->map) != (int) u->channels) {
+        pa_log("The remap stage needs exactly one source channel for each of the %u channels.", u->channels);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_chain(struct userdata *u, const char *chain, unsigned rate) {
+    const char *state = NULL;
+    char *desc;
+
+    while ((desc = pa_split(chain, "|", &state))) {
+        const char *args = NULL;
+        struct stage *s;
+        pa_modargs *ma = NULL;
+        char *type;
+        int r = -1;
+
+        if (!(type = pa_split_spaces(desc, &args)) || !*type) {
+            pa_log("Empty filter chain stage.");
+            pa_xfree(type);
+            pa_xfree(desc);
+            return -1;
+        }
+
+        u->stages = pa_xrenew(struct stage, u->stages, u->n_stages + 1);
+        s = &u->stages[u->n_stages];
+        memset(s, 0, sizeof(*s));
+
+        if (pa_streq(type, "ladspa")) {
+            s->type = STAGE_LADSPA;
+            if ((ma = pa_modargs_new(args, ladspa_stage_args)))
+                r = ladspa_stage_init(u, &s->ladspa, ma, rate);
+        } else if (pa_streq(type, "biquad") || pa_streq(type, "crossover")) {
+            s->type = pa_streq(type, "biquad") ? STAGE_BIQUAD : STAGE_CROSSOVER;
+            if ((ma = pa_modargs_new(args, filter_stage_args)))
+                r = filter_stage_init(u, s, ma, rate);
+        } else if (pa_streq(type, "remap")) {
+            s->type = STAGE_REMAP;
+            if ((ma = pa_modargs_new(args, remap_stage_args)))
+                r = remap_stage_init(u, s, ma);
+        } else {
+            pa_log("Unknown filter chain stage type '%s'.", type);
+            pa_xfree(type);
+            pa_xfree(desc);
+            return -1;
+        }
+
+        /* A failed stage is freed along with the others */
+        u->n_stages++;
+
+        if (!ma)
+            pa_log("Failed to parse arguments of %s stage: %s", type, pa_strnull(args));
+        else
+            pa_modargs_free(ma);
+
+        pa_xfree(type);
+        pa_xfree(desc);
+
+        if (r < 0)
+            return -1;
+    }
+
+    if (u->n_stages == 0) {
+        pa_log("The filter chain is empty.");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Called from I/O thread context */
+static int sink_process_msg_cb(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
+    struct userdata *u = PA_SINK(o)->userdata;
+
+    switch (code) {
+
+    case PA_SINK_MESSAGE_GET_LATENCY:
+
+        /* The sink is _put() before the sink input is, so let's
+         * make sure we don't access it in that time. Also, the
+         * sink input is first shut down, the sink second. */
+        if (!PA_SINK_IS_LINKED(u->sink->thread_info.state) ||
+            !PA_SINK_INPUT_IS_LINKED(u->sink_input->thread_info.state)) {
+            *((int64_t*) data) = 0;
+            return 0;
+        }
+
+        *((int64_t*) data) =
+
+            /* Get the latency of the master sink */
+            pa_sink_get_latency_within_thread(u->sink_input->sink, true) +
+
+            /* Add the latency internal to our sink input on top */
+            pa_bytes_to_usec(pa_memblockq_get_length(u->sink_input->thread_info.render_memblockq), &u->sink_input->sink->sample_spec);
+
+            /* Add resampler latency */
+            *((int64_t*) data) += pa_resampler_get_delay_usec(u->sink_input->thread_info.resampler);
+
+        return 0;
+    }
+
+    return pa_sink_process_msg(o, code, data, offset, chunk);
+}
+
+/* Called from main context */
+static int sink_set_state_in_main_thread_cb(pa_sink *s, pa_sink_state_t state, pa_suspend_cause_t suspend_cause) {
+    struct userdata *u;
+
+    pa_sink_assert_ref(s);
+    pa_assert_se(u = s->userdata);
+
+    if (!PA_SINK_IS_LINKED(state) ||
+            !PA_SINK_INPUT_IS_LINKED(u->sink_input->state))
+        return 0;
+
+    pa_sink_input_cork(u->sink_input, state == PA_SINK_SUSPENDED);
+    return 0;
+}
+
+/* Called from the IO thread. */
+static int sink_set_state_in_io_thread_cb(pa_sink *s, pa_sink_state_t new_state, pa_suspend_cause_t new_suspend_cause) {
+    struct userdata *u;
+
+    pa_assert(s);
+    pa_assert_se(u = s->userdata);
+
+    /* When set to running or idle for the first time, request a rewind
+     * of the master sink to make sure we are heard immediately */
+    if (PA_SINK_IS_OPENED(new_state) && s->thread_info.state == PA_SINK_INIT) {
+        pa_log_debug("Requesting rewind due to state change.");
+        pa_sink_input_request_rewind(u->sink_input, 0, false, true, true);
+    }
+
+    return 0;
+}
+
+/* Called from I/O thread context */
+static void sink_request_rewind_cb(pa_sink *s) {
+    struct userdata *u;
+
+    pa_sink_assert_ref(s);
+    pa_assert_se(u = s->userdata);
+
+    if (!PA_SINK_IS_LINKED(u->sink->thread_info.state) ||
+            !PA_SINK_INPUT_IS_LINKED(u->sink_input->thread_info.state))
+        return;
+
+    /* Just hand this one over to the master sink */
+    pa_sink_input_request_rewind(u->sink_input,
+                                 s->thread_info.rewind_nbytes +
+                                 pa_memblockq_get_length(u->memblockq), true, false, false);
+}
+
+/* Called from I/O thread context */
+static void sink_update_requested_latency_cb(pa_sink *s) {
+    struct userdata *u;
+
+    pa_sink_assert_ref(s);
+    pa_assert_se(u = s->userdata);
+
+    if (!PA_SINK_IS_LINKED(u->sink->thread_info.state) ||
+            !PA_SINK_INPUT_IS_LINKED(u->sink_input->thread_info.state))
+        return;
+
+    /* Just hand this one over to the master sink */
+    pa_sink_input_set_requested_latency_within_thread(
+        u->sink_input,
+        pa_sink_get_requested_latency_within_thread(s));
+}
+
+/* Called from main context */
+static void sink_set_mute_cb(pa_sink *s) {
+    struct userdata *u;
+
+    pa_sink_assert_ref(s);
+    pa_assert_se(u = s->userdata);
+
+    if (!PA_SINK_IS_LINKED(s->state) ||
+            !PA_SINK_INPUT_IS_LINKED(u->sink_input->state))
+        return;
+
+    pa_sink_input_set_mute(u->sink_input, s->muted, s->save_muted);
+}
+
+/* Called from I/O thread context */
+static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes, pa_memchunk *chunk) {
+    struct userdata *u;
+    float *src, *dst;
+    size_t fs;
+    unsigned n, c, f, s;
+    pa_memchunk tchunk;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert(chunk);
+    pa_assert_se(u = i->userdata);
+
+    if (!PA_SINK_IS_LINKED(u->sink->thread_info.state))
+        return -1;
+
+    /* Hmm, process any rewind request that might be queued up */
+    pa_sink_process_rewind(u->sink, 0);
+
+    while (pa_memblockq_peek(u->memblockq, &tchunk) < 0) {
+        pa_memchunk nchunk;
+
+        pa_sink_render(u->sink, nbytes, &nchunk);
+        pa_memblockq_push(u->memblockq, &nchunk);
+        pa_memblock_unref(nchunk.memblock);
+    }
+
+    tchunk.length = PA_MIN(nbytes, tchunk.length);
+    pa_assert(tchunk.length > 0);
+
+    fs = pa_frame_size(&i->sample_spec);
+    n = (unsigned) PA_MIN(tchunk.length / fs, u->block_size);
+
+    pa_assert(n > 0);
+
+    chunk->index = 0;
+    chunk->length = n*fs;
+    chunk->memblock = pa_memblock_new(i->sink->core->mempool, chunk->length);
+
+    pa_memblockq_drop(u->memblockq, chunk->length);
+
+    src = pa_memblock_acquire_chunk(&tchunk);
+    dst = pa_memblock_acquire(chunk->memblock);
+
+    /* One pass to split the channels, the whole chain on planar data, and
+     * one pass to interleave them again */
+    for (c = 0; c < u->channels; c++) {
+        float *p = u->planes[c];
+
+        for (f = 0; f < n; f++)
+            p[f] = src[f * u->channels + c];
+    }
+
+    for (s = 0; s < u->n_stages; s++)
+        stage_process(u, &u->stages[s], n);
+
+    for (c = 0; c < u->channels; c++) {
+        const float *p = u->planes[c];
+
+        for (f = 0; f < n; f++)
+            dst[f * u->channels + c] = PA_CLAMP_UNLIKELY(p[f], -1.0f, 1.0f);
+    }
+
+    pa_memblock_release(tchunk.memblock);
+    pa_memblock_release(chunk->memblock);
+
+    pa_memblock_unref(tchunk.memblock);
+
+    return 0;
+}
+
+/* Called from I/O thread context */
+static void sink_input_process_rewind_cb(pa_sink_input *i, size_t nbytes) {
+    struct userdata *u;
+    size_t amount = 0;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    /* If the sink is not yet linked, there is nothing to rewind */
+    if (!PA_SINK_IS_LINKED(u->sink->thread_info.state))
+        return;
+
+    if (u->sink->thread_info.rewind_nbytes > 0) {
+        size_t max_rewrite;
+
+        max_rewrite = nbytes + pa_memblockq_get_length(u->memblockq);
+        amount = PA_MIN(u->sink->thread_info.rewind_nbytes, max_rewrite);
+        u->sink->thread_info.rewind_nbytes = 0;
+
+        if (amount > 0) {
+            unsigned s;
+
+            pa_memblockq_seek(u->memblockq, - (int64_t) amount, PA_SEEK_RELATIVE, true);
+
+            pa_log_debug("Resetting filter chain");
+
+            for (s = 0; s < u->n_stages; s++)
+                stage_reset(&u->stages[s]);
+        }
+    }
+
+    pa_sink_process_rewind(u->sink, amount);
+    pa_memblockq_rewind(u->memblockq, nbytes);
+}
+
+/* Called from I/O thread context */
+static void sink_input_update_max_rewind_cb(pa_sink_input *i, size_t nbytes) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    pa_memblockq_set_maxrewind(u->memblockq, nbytes);
+    pa_sink_set_max_rewind_within_thread(u->sink, nbytes);
+}
+
+/* Called from I/O thread context */
+static void sink_input_update_max_request_cb(pa_sink_input *i, size_t nbytes) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    pa_sink_set_max_request_within_thread(u->sink, nbytes);
+}
+
+/* Called from I/O thread context */
+static void sink_input_update_sink_latency_range_cb(pa_sink_input *i) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    pa_sink_set_latency_range_within_thread(u->sink, i->sink->thread_info.min_latency, i->sink->thread_info.max_latency);
+}
+
+/* Called from I/O thread context */
+static void sink_input_update_sink_fixed_latency_cb(pa_sink_input *i) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    pa_sink_set_fixed_latency_within_thread(u->sink, i->sink->thread_info.fixed_latency);
+}
+
+/* Called from I/O thread context */
+static void sink_input_detach_cb(pa_sink_input *i) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    if (PA_SINK_IS_LINKED(u->sink->thread_info.state))
+        pa_sink_detach_within_thread(u->sink);
+
+    pa_sink_set_rtpoll(u->sink, NULL);
+}
+
+/* Called from I/O thread context */
+static void sink_input_attach_cb(pa_sink_input *i) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    pa_sink_set_rtpoll(u->sink, i->sink->thread_info.rtpoll);
+    pa_sink_set_latency_range_within_thread(u->sink, i->sink->thread_info.min_latency, i->sink->thread_info.max_latency);
+    pa_sink_set_fixed_latency_within_thread(u->sink, i->sink->thread_info.fixed_latency);
+    pa_sink_set_max_request_within_thread(u->sink, pa_sink_input_get_max_request(i));
+    pa_sink_set_max_rewind_within_thread(u->sink, pa_sink_input_get_max_rewind(i));
+
+    if (PA_SINK_IS_LINKED(u->sink->thread_info.state))
+        pa_sink_attach_within_thread(u->sink);
+}
+
+/* Called from main context */
+static void sink_input_kill_cb(pa_sink_input *i) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    /* The order here matters! We first kill the sink so that streams
+     * can properly be moved away while the sink input is still connected
+     * to the master. */
+    pa_sink_input_cork(u->sink_input, true);
+    pa_sink_unlink(u->sink);
+    pa_sink_input_unlink(u->sink_input);
+
+    pa_sink_input_unref(u->sink_input);
+    u->sink_input = NULL;
+
+    pa_sink_unref(u->sink);
+    u->sink = NULL;
+
+    pa_module_unload_request(u->module, true);
+}
+
+/* Called from main context */
+static bool sink_input_may_move_to_cb(pa_sink_input *i, pa_sink *dest) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    if (u->autoloaded)
+        return false;
+
+    return u->sink != dest;
+}
+
+/* Called from main context */
+static void sink_input_moving_cb(pa_sink_input *i, pa_sink *dest) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    if (dest) {
+        pa_sink_set_asyncmsgq(u->sink, dest->asyncmsgq);
+        pa_sink_update_flags(u->sink, PA_SINK_LATENCY|PA_SINK_DYNAMIC_LATENCY, dest->flags);
+    } else
+        pa_sink_set_asyncmsgq(u->sink, NULL);
+
+    if (u->auto_desc && dest) {
+        const char *z;
+        pa_proplist *pl;
+
+        pl = pa_proplist_new();
+        z = pa_proplist_gets(dest->proplist, PA_PROP_DEVICE_DESCRIPTION);
+        pa_proplist_setf(pl, PA_PROP_DEVICE_DESCRIPTION, "Filter Chain on %s", z ? z : dest->name);
+
+        pa_sink_update_proplist(u->sink, PA_UPDATE_REPLACE, pl);
+        pa_proplist_free(pl);
+    }
+}
+
+/* Called from main context */
+static void sink_input_mute_changed_cb(pa_sink_input *i) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    pa_sink_mute_changed(u->sink, i->muted);
+}
+
+/* Called from main context */
+static void sink_input_suspend_cb(pa_sink_input *i, pa_sink_state_t old_state, pa_suspend_cause_t old_suspend_cause) {
+    struct userdata *u;
+
+    pa_sink_input_assert_ref(i);
+    pa_assert_se(u = i->userdata);
+
+    if (!PA_SINK_IS_LINKED(u->sink->state))
+        return;
+
+    if (i->sink->state != PA_SINK_SUSPENDED || i->sink->suspend_cause == PA_SUSPEND_IDLE)
+        pa_sink_suspend(u->sink, false, PA_SUSPEND_UNAVAILABLE);
+    else
+        pa_sink_suspend(u->sink, true, PA_SUSPEND_UNAVAILABLE);
+}
+
+int pa__init(pa_module*m) {
+    struct userdata *u;
+    pa_sample_spec ss;
+    pa_channel_map map;
+    pa_modargs *ma;
+    const char *chain;
+    pa_sink *master;
+    pa_sink_input_new_data sink_input_data;
+    pa_sink_new_data sink_data;
+    pa_memchunk silence;
+    unsigned c;
+
+    pa_assert(m);
+
+    pa_assert_cc(sizeof(LADSPA_Data) == sizeof(float));
+
+    if (!(ma = pa_modargs_new(m->argument, valid_modargs))) {
+        pa_log("Failed to parse module arguments.");
+        goto fail;
+    }
+
+    if (!(master = pa_namereg_get(m->core, pa_modargs_get_value(ma, "sink_master", NULL), PA_NAMEREG_SINK))) {
+        pa_log("Master sink not found.");
+        goto fail;
+    }
+
+    ss = master->sample_spec;
+    map = master->channel_map;
+    if (pa_modargs_get_sample_spec_and_channel_map(ma, &ss, &map, PA_CHANNEL_MAP_DEFAULT) < 0) {
+        pa_log("Invalid sample format specification or channel map");
+        goto fail;
+    }
+
+    /* All filters work on float samples */
+    ss.format = PA_SAMPLE_FLOAT32NE;
+
+    if (!(chain = pa_modargs_get_value(ma, "chain", NULL))) {
+        pa_log("Missing filter chain");
+        goto fail;
+    }
+
+    u = pa_xnew0(struct userdata, 1);
+    u->module = m;
+    m->userdata = u;
+    u->channels = ss.channels;
+
+    if (parse_chain(u, chain, ss.rate) < 0) {
+        pa_log("Failed to set up the filter chain.");
+        goto fail;
+    }
+
+    pa_log_debug("Filter chain with %u stages", u->n_stages);
+
+    u->block_size = pa_mempool_block_size_max(m->core->mempool) / pa_frame_size(&ss);
+    for (c = 0; c < u->channels; c++) {
+        u->planes[c] = pa_xnew(float, u->block_size);
+        u->spare[c] = pa_xnew(float, u->block_size);
+    }
+
+    /* Create sink */
+    pa_sink_new_data_init(&sink_data);
+    sink_data.driver = __FILE__;
+    sink_data.module = m;
+    if (!(sink_data.name = pa_xstrdup(pa_modargs_get_value(ma, "sink_name", NULL))))
+        sink_data.name = pa_sprintf_malloc("%s.filter-chain", master->name);
+    pa_sink_new_data_set_sample_spec(&sink_data, &ss);
+    pa_sink_new_data_set_channel_map(&sink_data, &map);
+    pa_proplist_sets(sink_data.proplist, PA_PROP_DEVICE_MASTER_DEVICE, master->name);
+    pa_proplist_sets(sink_data.proplist, PA_PROP_DEVICE_CLASS, "filter");
+    pa_proplist_sets(sink_data.proplist, "device.filter_chain", chain);
+
+    if (pa_modargs_get_proplist(ma, "sink_properties", sink_data.proplist, PA_UPDATE_REPLACE) < 0) {
+        pa_log("Invalid properties");
+        pa_sink_new_data_done(&sink_data);
+        goto fail;
+    }
+
+    u->autoloaded = DEFAULT_AUTOLOADED;
+    if (pa_modargs_get_value_boolean(ma, "autoloaded", &u->autoloaded) < 0) {
+        pa_log("Failed to parse autoloaded value");
+        pa_sink_new_data_done(&sink_data);
+        goto fail;
+    }
+
+    if ((u->auto_desc = !pa_proplist_contains(sink_data.proplist, PA_PROP_DEVICE_DESCRIPTION))) {
+        const char *z;
+
+        z = pa_proplist_gets(master->proplist, PA_PROP_DEVICE_DESCRIPTION);
+        pa_proplist_setf(sink_data.proplist, PA_PROP_DEVICE_DESCRIPTION, "Filter Chain on %s", z ? z : master->name);
+    }
+
+    u->sink = pa_sink_new(m->core, &sink_data,
+                          (master->flags & (PA_SINK_LATENCY|PA_SINK_DYNAMIC_LATENCY)) | PA_SINK_SHARE_VOLUME_WITH_MASTER);
+    pa_sink_new_data_done(&sink_data);
+
+    if (!u->sink) {
+        pa_log("Failed to create sink.");
+        goto fail;
+    }
+
+    u->sink->parent.process_msg = sink_process_msg_cb;
+    u->sink->set_state_in_main_thread = sink_set_state_in_main_thread_cb;
+    u->sink->set_state_in_io_thread = sink_set_state_in_io_thread_cb;
+    u->sink->update_requested_latency = sink_update_requested_latency_cb;
+    u->sink->request_rewind = sink_request_rewind_cb;
+    pa_sink_set_set_mute_callback(u->sink, sink_set_mute_cb);
+    u->sink->userdata = u;
+
+    pa_sink_set_asyncmsgq(u->sink, master->asyncmsgq);
+
+    /* Create sink input */
+    pa_sink_input_new_data_init(&sink_input_data);
+    sink_input_data.driver = __FILE__;
+    sink_input_data.module = m;
+    pa_sink_input_new_data_set_sink(&sink_input_data, master, false, true);
+    sink_input_data.origin_sink = u->sink;
+    pa_proplist_sets(sink_input_data.proplist, PA_PROP_MEDIA_NAME, "Filter Chain Stream");
+    pa_proplist_sets(sink_input_data.proplist, PA_PROP_MEDIA_ROLE, "filter");
+
+    if (pa_modargs_get_proplist(ma, "sink_input_properties", sink_input_data.proplist, PA_UPDATE_REPLACE) < 0) {
+        pa_log("Invalid properties");
+        pa_sink_input_new_data_done(&sink_input_data);
+        goto fail;
+    }
+
+    pa_sink_input_new_data_set_sample_spec(&sink_input_data, &ss);
+    pa_sink_input_new_data_set_channel_map(&sink_input_data, &map);
+    sink_input_data.flags |= PA_SINK_INPUT_START_CORKED;
+
+    pa_sink_input_new(&u->sink_input, m->core, &sink_input_data);
+    pa_sink_input_new_data_done(&sink_input_data);
+
+    if (!u->sink_input)
+        goto fail;
+
+    u->sink_input->pop = sink_input_pop_cb;
+    u->sink_input->process_rewind = sink_input_process_rewind_cb;
+    u->sink_input->update_max_rewind = sink_input_update_max_rewind_cb;
+    u->sink_input->update_max_request = sink_input_update_max_request_cb;
+    u->sink_input->update_sink_latency_range = sink_input_update_sink_latency_range_cb;
+    u->sink_input->update_sink_fixed_latency = sink_input_update_sink_fixed_latency_cb;
+    u->sink_input->kill = sink_input_kill_cb;
+    u->sink_input->attach = sink_input_attach_cb;
+    u->sink_input->detach = sink_input_detach_cb;
+    u->sink_input->may_move_to = sink_input_may_move_to_cb;
+    u->sink_input->moving = sink_input_moving_cb;
+    u->sink_input->mute_changed = sink_input_mute_changed_cb;
+    u->sink_input->suspend = sink_input_suspend_cb;
+    u->sink_input->userdata = u;
+
+    u->sink->input_to_master = u->sink_input;
+
+    pa_sink_input_get_silence(u->sink_input, &silence);
+    u->memblockq = pa_memblockq_new("module-filter-chain memblockq", 0, MEMBLOCKQ_MAXLENGTH, 0, &ss, 1, 1, 0, &silence);
+    pa_memblock_unref(silence.memblock);
+
+    /* The order here is important. The input must be put first,
+     * otherwise streams might attach to the sink before the sink
+     * input is attached to the master. */
+    pa_sink_input_put(u->sink_input);
+    pa_sink_put(u->sink);
+    pa_sink_input_cork(u->sink_input, false);
+
+    pa_modargs_free(ma);
+
+    return 0;
+
+fail:
+    if (ma)
+        pa_modargs_free(ma);
+
+    pa__done(m);
+
+    return -1;
+}
+
+int pa__get_n_used(pa_module *m) {
+    struct userdata *u;
+
+    pa_assert(m);
+    pa_assert_se(u = m->userdata);
+
+    return pa_sink_linked_by(u->sink);
+}
+
+void pa__done(pa_module*m) {
+    struct userdata *u;
+    unsigned c;
+
+    pa_assert(m);
+
+    if (!(u = m->userdata))
+        return;
+
+    /* See comments in sink_input_kill_cb() above regarding
+    * destruction order! */
+
+    if (u->sink_input)
+        pa_sink_input_cork(u->sink_input, true);
+
+    if (u->sink)
+        pa_sink_unlink(u->sink);
+
+    if (u->sink_input) {
+        pa_sink_input_unlink(u->sink_input);
+        pa_sink_input_unref(u->sink_input);
+    }
+
+    if (u->sink)
+        pa_sink_unref(u->sink);
+
+    for (c = 0; c < u->n_stages; c++)
+        stage_done(&u->stages[c]);
+    pa_xfree(u->stages);
+
+    for (c = 0; c < u->channels; c++) {
+        pa_xfree(u->planes[c]);
+        pa_xfree(u->spare[c]);
+    }
+
+    if (u->memblockq)
+        pa_memblockq_free(u->memblockq);
+
+    pa_xfree(u);
+}
@@ -32,6 +32,7 @@
 #include <pulsecore/namereg.h>
 #include <pulsecore/log.h>
 #include <pulsecore/core-util.h>
+#include <pulsecore/drift-controller.h>
 
 #include <pulse/rtclock.h>
 #include <pulse/timeval.h>
@@ -49,6 +50,7 @@ PA_MODULE_USAGE(
         "log_interval=<how often to log in s> "
         "fast_adjust_threshold_msec=<threshold for fast adjust in ms> "
         "adjust_threshold_usec=<threshold for latency adjustment in usec> "
+        "rate_control=<timer or pi> "
         "format=<sample format> "
         "rate=<sample rate> "
         "channels=<number of channels> "
@@ -57,7 +59,8 @@ PA_MODULE_USAGE(
         "source_output_properties=<proplist> "
         "source_dont_move=<boolean> "
         "sink_dont_move=<boolean> "
-        "remix=<remix channels?> ");
+        "remix=<remix channels?> "
+        "low_latency=<allow lower latencies? Source and sink only run in lockstep if they share an IO thread> ");
 
 #define DEFAULT_LATENCY_MSEC 200
 
@@ -69,6 +72,9 @@ PA_MODULE_USAGE(
 
 #define MIN_DEVICE_LATENCY (2.5*PA_USEC_PER_MSEC)
 
+/* Used instead of MIN_DEVICE_LATENCY with low_latency=true */
+#define LOW_LATENCY_MIN_DEVICE_LATENCY (0.5*PA_USEC_PER_MSEC)
+
 #define DEFAULT_ADJUST_TIME_USEC (1*PA_USEC_PER_SEC)
 
 typedef struct loopback_msg loopback_msg;
@@ -102,6 +108,7 @@ struct userdata {
     pa_usec_t fast_adjust_threshold;
     uint32_t adjust_threshold;
     uint32_t log_interval;
+    bool low_latency;
 
     /* Latency boundaries and current values */
     pa_usec_t min_source_latency;
@@ -130,6 +137,11 @@ struct userdata {
     double kalman_variance;
     double latency_error;
 
+    /* Continuous rate control in the output thread, only used with
+     * rate_control=pi */
+    pa_drift_controller *drift_controller;
+    pa_atomic_t drift_control_failed;
+
     /* lower latency limit found by underruns */
     pa_usec_t underrun_latency_limit;
 
@@ -163,6 +175,11 @@ struct userdata {
     /* Input thread variable */
     int64_t send_counter;
 
+    /* rtpoll of the sink the sink input is attached to, written by the
+     * output thread and compared by the input thread to find out if both
+     * run in the same thread */
+    pa_atomic_ptr_t sink_rtpoll;
+
     /* Output thread variables */
     struct {
         int64_t recv_counter;
@@ -198,6 +215,7 @@ static const char* const valid_modargs[] = {
     "log_interval",
     "fast_adjust_threshold_msec",
     "adjust_threshold_usec",
+    "rate_control",
     "format",
     "rate",
     "channels",
@@ -207,6 +225,7 @@ static const char* const valid_modargs[] = {
     "source_dont_move",
     "sink_dont_move",
     "remix",
+    "low_latency",
     NULL,
 };
 
@@ -535,6 +554,31 @@ static void adjust_rates(struct userdata *u) {
         return;
     }
 
+    /* With rate_control=pi the rate is adjusted in the output thread whenever
+     * new data arrives, so only keep track of the state here. */
+    if (u->drift_controller && !pa_atomic_load(&u->drift_control_failed)) {
+        if (u->log_interval != 0) {
+            u->log_counter--;
+            if (u->log_counter == 0) {
+                pa_log_debug("Loopback status %s to %s:\n    End-to-end latency: %0.2f ms\n    Deviation from target latency: %0.2f usec\n    Rate factor: %0.6f",
+                            u->source_output->source->name,
+                            u->sink_input->sink->name,
+                            (double) current_latency / PA_USEC_PER_MSEC,
+                            (double) latency_difference,
+                            pa_drift_controller_get_rate_factor(u->drift_controller));
+                u->log_counter = u->log_interval;
+            }
+        }
+
+        u->source_sink_changed = false;
+        u->underrun_occured = false;
+        u->last_source_latency_offset = u->source_latency_offset;
+        u->last_sink_latency_offset = u->sink_latency_offset;
+        u->source_latency_offset_changed = false;
+        u->sink_latency_offset_changed = false;
+        return;
+    }
+
     /* Calculate new rate */
     new_rate = rate_controller(u, base_rate, old_rate, (int32_t)(filtered_latency - final_latency), latency_difference);
 
@@ -656,6 +700,12 @@ static void update_adjust_timer(struct userdata *u) {
  * Calculates minimum and maximum possible latency for source and sink */
 static void update_latency_boundaries(struct userdata *u, pa_source *source, pa_sink *sink) {
     const char *s;
+    pa_usec_t min_device_latency;
+
+    /* Latencies below 2.5 ms cause problems with most devices. With
+     * low_latency the user asked for smaller values, so only keep
+     * a minimal floor. */
+    min_device_latency = u->low_latency ? LOW_LATENCY_MIN_DEVICE_LATENCY : MIN_DEVICE_LATENCY;
 
     if (source) {
         /* Source latencies */
@@ -673,9 +723,9 @@ static void update_latency_boundaries(struct userdata *u, pa_source *source, pa_
         /* Source offset */
         u->source_latency_offset = source->port_latency_offset;
 
-        /* Latencies below 2.5 ms cause problems, limit source latency if possible */
-        if (u->max_source_latency >= MIN_DEVICE_LATENCY)
-            u->min_source_latency = PA_MAX(u->min_source_latency, MIN_DEVICE_LATENCY);
+        /* Limit source latency if possible */
+        if (u->max_source_latency >= min_device_latency)
+            u->min_source_latency = PA_MAX(u->min_source_latency, min_device_latency);
         else
             u->min_source_latency = u->max_source_latency;
     }
@@ -691,9 +741,9 @@ static void update_latency_boundaries(struct userdata *u, pa_source *source, pa_
         /* Sink offset */
         u->sink_latency_offset = sink->port_latency_offset;
 
-        /* Latencies below 2.5 ms cause problems, limit sink latency if possible */
-        if (u->max_sink_latency >= MIN_DEVICE_LATENCY)
-            u->min_sink_latency = PA_MAX(u->min_sink_latency, MIN_DEVICE_LATENCY);
+        /* Limit sink latency if possible */
+        if (u->max_sink_latency >= min_device_latency)
+            u->min_sink_latency = PA_MAX(u->min_sink_latency, min_device_latency);
         else
             u->min_sink_latency = u->max_sink_latency;
     }
@@ -737,6 +787,32 @@ static void memblockq_adjust(struct userdata *u, int64_t latency_offset_usec, bo
     }
 }
 
+/* Called from input thread context
+ * With low_latency, checks if the sink input is attached to a sink that
+ * is driven by the same thread as the source. In that case the sink input
+ * can be called directly and source and sink run in lockstep. A shared
+ * card or master device is not enough: ALSA sources and sinks have their
+ * own IO threads even on the same card, and they keep using the queue. */
+static bool output_in_same_thread(struct userdata *u, pa_source_output *o) {
+
+    if (!u->low_latency)
+        return false;
+
+    /* An rtpoll is only ever used by a single thread, and the output
+     * thread clears the pointer on detach before the sink input can be
+     * moved. So if the pointers match, the sink input is attached and
+     * we are running in the output thread. */
+    if (pa_atomic_ptr_load(&u->sink_rtpoll) != o->source->thread_info.rtpoll)
+        return false;
+
+    /* Process anything that was queued before, e.g. while the sink
+     * input was attached to another sink, to keep the order */
+    while (pa_asyncmsgq_process_one(u->asyncmsgq) > 0)
+        ;
+
+    return true;
+}
+
 /* Called from input thread context */
 static void source_output_push_cb(pa_source_output *o, const pa_memchunk *chunk) {
     struct userdata *u;
@@ -752,7 +828,13 @@ static void source_output_push_cb(pa_source_output *o, const pa_memchunk *chunk)
     current_source_latency = pa_source_get_latency_within_thread(u->source_output->source, true);
     current_source_latency += pa_resampler_get_delay_usec(u->source_output->thread_info.resampler);
 
-    pa_asyncmsgq_post(u->asyncmsgq, PA_MSGOBJECT(u->sink_input), SINK_INPUT_MESSAGE_POST, PA_INT_TO_PTR(current_source_latency), push_time, chunk, NULL);
+    if (output_in_same_thread(u, o)) {
+        pa_memchunk c = *chunk;
+
+        /* No need to queue, pass the chunk to the sink input right away */
+        PA_MSGOBJECT(u->sink_input)->process_msg(PA_MSGOBJECT(u->sink_input), SINK_INPUT_MESSAGE_POST, PA_INT_TO_PTR(current_source_latency), push_time, &c);
+    } else
+        pa_asyncmsgq_post(u->asyncmsgq, PA_MSGOBJECT(u->sink_input), SINK_INPUT_MESSAGE_POST, PA_INT_TO_PTR(current_source_latency), push_time, chunk, NULL);
     u->send_counter += (int64_t) chunk->length;
 }
 
@@ -764,7 +846,10 @@ static void source_output_process_rewind_cb(pa_source_output *o, size_t nbytes)
     pa_source_output_assert_io_context(o);
     pa_assert_se(u = o->userdata);
 
-    pa_asyncmsgq_post(u->asyncmsgq, PA_MSGOBJECT(u->sink_input), SINK_INPUT_MESSAGE_REWIND, NULL, (int64_t) nbytes, NULL, NULL);
+    if (output_in_same_thread(u, o))
+        PA_MSGOBJECT(u->sink_input)->process_msg(PA_MSGOBJECT(u->sink_input), SINK_INPUT_MESSAGE_REWIND, NULL, (int64_t) nbytes, NULL);
+    else
+        pa_asyncmsgq_post(u->asyncmsgq, PA_MSGOBJECT(u->sink_input), SINK_INPUT_MESSAGE_REWIND, NULL, (int64_t) nbytes, NULL, NULL);
     u->send_counter -= (int64_t) nbytes;
 }
 
@@ -1057,6 +1142,64 @@ static void sink_input_process_rewind_cb(pa_sink_input *i, size_t nbytes) {
     pa_memblockq_rewind(u->memblockq, nbytes);
 }
 
+/* Called from output thread context
+ * Returns the end to end latency of the chunk that was just pushed to
+ * the memblockq, not including the memblockq itself */
+static int64_t get_push_latency(struct userdata *u, int64_t source_latency, pa_usec_t push_time, const pa_memchunk *chunk) {
+    int64_t time_delta;
+
+    /* This is the source latency at the time push was called */
+    time_delta = source_latency;
+    /* Add the time between push and post */
+    time_delta += pa_rtclock_now() - push_time;
+    /* Add the sink and resampler latency */
+    time_delta += pa_sink_get_latency_within_thread(u->sink_input->sink, true);
+    time_delta += pa_resampler_get_delay_usec(u->sink_input->thread_info.resampler);
+
+    /* The source latency report includes the audio in the chunk,
+     * but since we already pushed the chunk to the memblockq, we need
+     * to subtract the chunk size from the source latency so that it
+     * won't be counted towards both the memblockq latency and the
+     * source latency.
+     *
+     * Sometimes the alsa source reports way too low latency (might
+     * be a bug in the alsa source code). This seems to happen when
+     * there's an overrun. As an attempt to detect overruns, we
+     * check if the chunk size is larger than the configured source
+     * latency. If so, we assume that the source should have pushed
+     * a chunk whose size equals the configured latency, so we
+     * modify time_delta only by that amount, which makes
+     * memblockq_adjust() drop more data than it would otherwise.
+     * This seems to work quite well, but it's possible that the
+     * next push also contains too much data, and in that case the
+     * resulting latency will be wrong. */
+    if (pa_bytes_to_usec(chunk->length, &u->sink_input->sample_spec) > u->output_thread_info.effective_source_latency)
+        time_delta -= (int64_t)u->output_thread_info.effective_source_latency;
+    else
+        time_delta -= (int64_t)pa_bytes_to_usec(chunk->length, &u->sink_input->sample_spec);
+
+    return time_delta;
+}
+
+/* Called from output thread context */
+static void update_rate_adjustment(struct userdata *u, int64_t latency) {
+    pa_usec_t final_latency;
+    double factor;
+
+    if (pa_atomic_load(&u->drift_control_failed))
+        return;
+
+    final_latency = PA_MAX(u->latency, u->output_thread_info.minimum_latency);
+    latency += pa_bytes_to_usec(pa_memblockq_get_length(u->memblockq), &u->sink_input->sample_spec);
+
+    factor = pa_drift_controller_update(u->drift_controller, pa_rtclock_now(), latency - (int64_t) final_latency);
+
+    if (!pa_sink_input_set_rate_adjustment_within_thread(u->sink_input, factor)) {
+        pa_log_info("Resampler does not support fractional rate adjustment, falling back to rate_control=timer");
+        pa_atomic_store(&u->drift_control_failed, 1);
+    }
+}
+
 /* Called from output thread context */
 static int sink_input_process_msg_cb(pa_msgobject *obj, int code, void *data, int64_t offset, pa_memchunk *chunk) {
     struct userdata *u = PA_SINK_INPUT(obj)->userdata;
@@ -1085,35 +1228,7 @@ static int sink_input_process_msg_cb(pa_msgobject *obj, int code, void *data, in
             if (u->output_thread_info.pop_called && (!u->output_thread_info.push_called || u->output_thread_info.pop_adjust)) {
                 int64_t time_delta;
 
-                /* This is the source latency at the time push was called */
-                time_delta = PA_PTR_TO_INT(data);
-                /* Add the time between push and post */
-                time_delta += pa_rtclock_now() - (pa_usec_t) offset;
-                /* Add the sink and resampler latency */
-                time_delta += pa_sink_get_latency_within_thread(u->sink_input->sink, true);
-                time_delta += pa_resampler_get_delay_usec(u->sink_input->thread_info.resampler);
-
-                /* The source latency report includes the audio in the chunk,
-                 * but since we already pushed the chunk to the memblockq, we need
-                 * to subtract the chunk size from the source latency so that it
-                 * won't be counted towards both the memblockq latency and the
-                 * source latency.
-                 *
-                 * Sometimes the alsa source reports way too low latency (might
-                 * be a bug in the alsa source code). This seems to happen when
-                 * there's an overrun. As an attempt to detect overruns, we
-                 * check if the chunk size is larger than the configured source
-                 * latency. If so, we assume that the source should have pushed
-                 * a chunk whose size equals the configured latency, so we
-                 * modify time_delta only by that amount, which makes
-                 * memblockq_adjust() drop more data than it would otherwise.
-                 * This seems to work quite well, but it's possible that the
-                 * next push also contains too much data, and in that case the
-                 * resulting latency will be wrong. */
-                if (pa_bytes_to_usec(chunk->length, &u->sink_input->sample_spec) > u->output_thread_info.effective_source_latency)
-                    time_delta -= (int64_t)u->output_thread_info.effective_source_latency;
-                else
-                    time_delta -= (int64_t)pa_bytes_to_usec(chunk->length, &u->sink_input->sample_spec);
+                time_delta = get_push_latency(u, PA_PTR_TO_INT(data), (pa_usec_t) offset, chunk);
 
                 /* FIXME: We allow pushing silence here to fix up the latency. This
                  * might lead to a gap in the stream */
@@ -1125,7 +1240,10 @@ static int sink_input_process_msg_cb(pa_msgobject *obj, int code, void *data, in
 
                 u->output_thread_info.pop_adjust = false;
                 u->output_thread_info.push_called = true;
-            }
+
+            } else if (u->drift_controller && u->output_thread_info.push_called && u->sink_input->thread_info.underrun_for == 0)
+                /* Steady state, feed the latency measurement to the rate controller */
+                update_rate_adjustment(u, get_push_latency(u, PA_PTR_TO_INT(data), (pa_usec_t) offset, chunk));
 
             /* If pop has not been called yet, make sure the latency does not grow too much.
              * Don't push any silence here, because we already have new data in the queue */
@@ -1185,6 +1303,9 @@ static int sink_input_process_msg_cb(pa_msgobject *obj, int code, void *data, in
 
             u->output_thread_info.push_called = false;
 
+            if (u->drift_controller)
+                pa_drift_controller_reset(u->drift_controller);
+
             return 0;
 
         case SINK_INPUT_MESSAGE_SET_EFFECTIVE_SOURCE_LATENCY:
@@ -1255,6 +1376,11 @@ static void sink_input_attach_cb(pa_sink_input *i) {
 
     pa_memblockq_set_prebuf(u->memblockq, pa_sink_input_get_max_request(i)*2);
     pa_memblockq_set_maxrewind(u->memblockq, pa_sink_input_get_max_rewind(i));
+
+    pa_atomic_ptr_store(&u->sink_rtpoll, i->sink->thread_info.rtpoll);
+
+    if (u->drift_controller)
+        pa_drift_controller_reset(u->drift_controller);
 }
 
 /* Called from output thread context */
@@ -1265,6 +1391,8 @@ static void sink_input_detach_cb(pa_sink_input *i) {
     pa_sink_input_assert_io_context(i);
     pa_assert_se(u = i->userdata);
 
+    pa_atomic_ptr_store(&u->sink_rtpoll, NULL);
+
     if (u->rtpoll_item_read) {
         pa_rtpoll_item_free(u->rtpoll_item_read);
         u->rtpoll_item_read = NULL;
@@ -1569,6 +1697,7 @@ int pa__init(pa_module *m) {
     double log_interval_sec;
     const char *n;
     bool remix = true;
+    bool low_latency = false;
 
     pa_assert(m);
 
@@ -1594,6 +1723,11 @@ int pa__init(pa_module *m) {
         goto fail;
     }
 
+    if (pa_modargs_get_value_boolean(ma, "low_latency", &low_latency) < 0) {
+        pa_log("Invalid boolean low_latency parameter");
+        goto fail;
+    }
+
     if (source) {
         ss = source->sample_spec;
         map = source->channel_map;
@@ -1689,6 +1823,7 @@ int pa__init(pa_module *m) {
     u->adjust_threshold = adjust_threshold;
     u->target_latency_cross_counter = 0;
     u->initial_adjust_pending = true;
+    u->low_latency = low_latency;
 
     adjust_time_sec = DEFAULT_ADJUST_TIME_USEC / PA_USEC_PER_SEC;
     if (pa_modargs_get_value_double(ma, "adjust_time", &adjust_time_sec) < 0) {
@@ -1707,6 +1842,16 @@ int pa__init(pa_module *m) {
     u->adjust_time = adjust_time_sec * PA_USEC_PER_SEC;
     u->real_adjust_time = u->adjust_time;
 
+    n = pa_modargs_get_value(ma, "rate_control", "timer");
+    if (pa_streq(n, "pi")) {
+        /* There is nothing to control if adjustment is disabled */
+        if (u->adjust_time > 0)
+            u->drift_controller = pa_drift_controller_new(PA_DRIFT_CONTROLLER_DEFAULT_TIME_CONSTANT, 0.01);
+    } else if (!pa_streq(n, "timer")) {
+        pa_log("Invalid rate_control value, expected timer or pi.");
+        goto fail;
+    }
+
     pa_source_output_new_data_init(&source_output_data);
     source_output_data.driver = __FILE__;
     source_output_data.module = m;
@@ -1857,6 +2002,13 @@ int pa__init(pa_module *m) {
     set_sink_input_latency(u, u->sink_input->sink);
     set_source_output_latency(u, u->source_output->source);
 
+    if (u->low_latency) {
+        if (u->source_output->source->thread_info.rtpoll == u->sink_input->sink->thread_info.rtpoll)
+            pa_log_info("Source and sink share an IO thread, passing data directly.");
+        else
+            pa_log_info("Source and sink use different IO threads, data will be queued between them.");
+    }
+
     pa_sink_input_get_silence(u->sink_input, &silence);
     u->memblockq = pa_memblockq_new(
             "module-loopback memblockq",
@@ -1951,5 +2103,8 @@ void pa__done(pa_module*m) {
     if (u->msg)
         loopback_msg_unref(u->msg);
 
+    if (u->drift_controller)
+        pa_drift_controller_free(u->drift_controller);
+
     pa_xfree(u);
 }
@@ -25,14 +25,18 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <pulse/rtclock.h>
 #include <pulse/timeval.h>
 #include <pulse/util.h>
 #include <pulse/xmalloc.h>
 
+#include <pulsecore/core-rtclock.h>
 #include <pulsecore/i18n.h>
+#include <pulsecore/json.h>
 #include <pulsecore/macro.h>
+#include <pulsecore/message-handler.h>
 #include <pulsecore/sink.h>
 #include <pulsecore/module.h>
 #include <pulsecore/core-util.h>
@@ -54,12 +58,31 @@ PA_MODULE_USAGE(
         "channels=<number of channels> "
         "channel_map=<channel map>"
         "formats=<semi-colon separated sink formats>"
-        "norewinds=<disable rewinds>");
+        "norewinds=<disable rewinds> "
+        "freewheel=<render as fast as possible while playing?> "
+        "freewheel_msec=<audio time to render as fast as possible, 0 until the inputs drain>");
 
 #define DEFAULT_SINK_NAME "null"
 #define BLOCK_USEC (2 * PA_USEC_PER_SEC)
 #define BLOCK_USEC_NOREWINDS (50 * PA_USEC_PER_MSEC)
 
+/* The time spent in each part of a freewheel run. Render is the mixing of
+ * the inputs including their resampling and volume, poll the handling of
+ * messages, for example audio the clients have sent, and waiting for them.
+ * Underrun is the silence rendered while no input had data, it is not
+ * included in audio. */
+struct freewheel_stats {
+    pa_usec_t audio;
+    pa_usec_t underrun;
+    pa_usec_t wall;
+    pa_usec_t cpu;
+    pa_usec_t render;
+    pa_usec_t rewind;
+    pa_usec_t poll;
+    uint64_t blocks;
+    bool running;
+};
+
 struct userdata {
     pa_core *core;
     pa_module *module;
@@ -75,6 +98,23 @@ struct userdata {
     pa_idxset *formats;
 
     bool norewinds;
+
+    /* In freewheel mode the sink renders back to back instead of following
+     * the clock while it is running, until all inputs are drained or corked
+     * or until freewheel_usec of audio have been rendered. */
+    bool freewheel;
+    pa_usec_t freewheel_usec;
+    bool freewheeling;
+    bool freewheel_done;
+    pa_usec_t freewheel_start;
+    pa_usec_t freewheel_start_cpu;
+    struct freewheel_stats freewheel_stats;
+
+    char *message_handler_path;
+};
+
+enum {
+    SINK_MESSAGE_GET_FREEWHEEL_STATS = PA_SINK_MESSAGE_MAX,
 };
 
 static const char* const valid_modargs[] = {
@@ -86,6 +126,8 @@ static const char* const valid_modargs[] = {
     "channel_map",
     "formats",
     "norewinds",
+    "freewheel",
+    "freewheel_msec",
     NULL
 };
 
@@ -102,11 +144,29 @@ static int sink_process_msg(
         case PA_SINK_MESSAGE_GET_LATENCY: {
             pa_usec_t now;
 
+            /* Nothing is kept back when freewheeling */
+            if (u->freewheeling) {
+                *((int64_t*) data) = 0;
+                return 0;
+            }
+
             now = pa_rtclock_now();
             *((int64_t*) data) = (int64_t)u->timestamp - (int64_t)now;
 
             return 0;
         }
+
+        case SINK_MESSAGE_GET_FREEWHEEL_STATS: {
+            struct freewheel_stats *stats = data;
+
+            *stats = u->freewheel_stats;
+
+            /* Include the running run up to now */
+            if (u->freewheeling)
+                stats->wall = pa_rtclock_now() - u->freewheel_start;
+
+            return 0;
+        }
     }
 
     return pa_sink_process_msg(o, code, data, offset, chunk);
@@ -261,6 +321,95 @@ static void process_render(struct userdata *u, pa_usec_t now) {
 /*     pa_log_debug("Ate in sum %lu bytes (of %lu)", (unsigned long) ate, (unsigned long) nbytes); */
 }
 
+/* CPU time of the calling thread, 0 if that is not available */
+static pa_usec_t thread_cpu_time(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return pa_timespec_load(&ts);
+#endif
+
+    return 0;
+}
+
+static void freewheel_start(struct userdata *u) {
+    pa_assert(u);
+
+    pa_log_info("Starting to freewheel.");
+
+    pa_zero(u->freewheel_stats);
+    u->freewheel_stats.running = true;
+    u->freewheeling = true;
+    u->freewheel_start = pa_rtclock_now();
+    u->freewheel_start_cpu = thread_cpu_time();
+}
+
+static void freewheel_stop(struct userdata *u) {
+    struct freewheel_stats *stats = &u->freewheel_stats;
+    pa_usec_t cpu;
+
+    pa_assert(u);
+
+    stats->wall = pa_rtclock_now() - u->freewheel_start;
+    cpu = thread_cpu_time();
+    stats->cpu = cpu > 0 ? cpu - u->freewheel_start_cpu : 0;
+    stats->running = false;
+
+    pa_log_info("Freewheeled %0.3f s of audio in %0.3f s, %0.1f times real time, in %llu blocks.",
+                (double) stats->audio / PA_USEC_PER_SEC, (double) stats->wall / PA_USEC_PER_SEC,
+                stats->wall > 0 ? (double) stats->audio / stats->wall : 0.0, (unsigned long long) stats->blocks);
+    pa_log_info("CPU %0.3f s, render %0.3f s, rewind %0.3f s, poll %0.3f s, underrun %0.3f s.",
+                (double) stats->cpu / PA_USEC_PER_SEC, (double) stats->render / PA_USEC_PER_SEC,
+                (double) stats->rewind / PA_USEC_PER_SEC, (double) stats->poll / PA_USEC_PER_SEC,
+                (double) stats->underrun / PA_USEC_PER_SEC);
+
+    u->freewheeling = false;
+
+    /* Continue in real time from here */
+    u->timestamp = pa_rtclock_now();
+}
+
+/* True if none of the inputs had data for the last block */
+static bool inputs_underrun(struct userdata *u) {
+    pa_sink_input *i;
+    void *state = NULL;
+
+    PA_HASHMAP_FOREACH(i, u->sink->thread_info.inputs, state)
+        if (i->thread_info.state != PA_SINK_INPUT_CORKED && i->thread_info.underrun_for == 0)
+            return false;
+
+    return true;
+}
+
+/* Renders one block and drops it immediately, without waiting for the
+ * clock. Returns false if all inputs are out of data. */
+static bool freewheel_render(struct userdata *u) {
+    pa_usec_t start, length;
+    pa_memchunk chunk;
+
+    pa_assert(u);
+
+    start = pa_rtclock_now();
+    pa_sink_render(u->sink, u->sink->thread_info.max_request, &chunk);
+    u->freewheel_stats.render += pa_rtclock_now() - start;
+
+    pa_memblock_unref(chunk.memblock);
+
+    length = pa_bytes_to_usec(chunk.length, &u->sink->sample_spec);
+    u->timestamp += length;
+
+    if (inputs_underrun(u)) {
+        u->freewheel_stats.underrun += length;
+        return false;
+    }
+
+    u->freewheel_stats.audio += length;
+    u->freewheel_stats.blocks++;
+
+    return true;
+}
+
 static void thread_func(void *userdata) {
     struct userdata *u = userdata;
 
@@ -268,7 +417,9 @@ static void thread_func(void *userdata) {
 
     pa_log_debug("Thread starting up");
 
-    if (u->core->realtime_scheduling)
+    /* A freewheeling thread never sleeps, it must not starve the rest of the
+     * system */
+    if (u->core->realtime_scheduling && !u->freewheel)
         pa_thread_make_realtime(u->core->realtime_priority);
 
     pa_thread_mq_install(&u->thread_mq);
@@ -276,17 +427,45 @@ static void thread_func(void *userdata) {
     u->timestamp = pa_rtclock_now();
 
     for (;;) {
-        pa_usec_t now = 0;
+        pa_usec_t now = 0, start = 0;
         int ret;
 
+        if (u->freewheel) {
+            bool running = u->sink->thread_info.state == PA_SINK_RUNNING;
+
+            if (u->freewheeling && (!running || (u->freewheel_usec > 0 && u->freewheel_stats.audio >= u->freewheel_usec))) {
+                freewheel_stop(u);
+                u->freewheel_done = running;
+            } else if (!u->freewheeling && running && !u->freewheel_done)
+                freewheel_start(u);
+
+            if (!running)
+                u->freewheel_done = false;
+        }
+
+        /* When freewheeling, the clock is the audio rendered so far */
         if (PA_SINK_IS_OPENED(u->sink->thread_info.state))
-            now = pa_rtclock_now();
+            now = u->freewheeling ? u->timestamp : pa_rtclock_now();
+
+        if (PA_UNLIKELY(u->sink->thread_info.rewind_requested)) {
+            if (u->freewheeling)
+                start = pa_rtclock_now();
 
-        if (PA_UNLIKELY(u->sink->thread_info.rewind_requested))
             process_rewind(u, now);
 
-        /* Render some data and drop it immediately */
-        if (PA_SINK_IS_OPENED(u->sink->thread_info.state)) {
+            if (u->freewheeling)
+                u->freewheel_stats.rewind += pa_rtclock_now() - start;
+        }
+
+        /* Render some data and drop it immediately. If the inputs have
+         * nothing to play, wait until a message, for example new data from
+         * a client, arrives instead of rendering silence back to back. */
+        if (u->freewheeling) {
+            if (freewheel_render(u))
+                pa_rtpoll_set_timer_relative(u->rtpoll, 0);
+            else
+                pa_rtpoll_set_timer_disabled(u->rtpoll);
+        } else if (PA_SINK_IS_OPENED(u->sink->thread_info.state)) {
             if (u->timestamp <= now)
                 process_render(u, now);
 
@@ -294,10 +473,16 @@ static void thread_func(void *userdata) {
         } else
             pa_rtpoll_set_timer_disabled(u->rtpoll);
 
+        if (u->freewheeling)
+            start = pa_rtclock_now();
+
         /* Hmm, nothing to do. Let's sleep */
         if ((ret = pa_rtpoll_run(u->rtpoll)) < 0)
             goto fail;
 
+        if (u->freewheeling)
+            u->freewheel_stats.poll += pa_rtclock_now() - start;
+
         if (ret == 0)
             goto finish;
     }
@@ -312,6 +497,54 @@ finish:
     pa_log_debug("Thread shutting down");
 }
 
+/* Called from main context */
+static char *get_freewheel_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct freewheel_stats stats;
+
+    pa_assert_se(pa_asyncmsgq_send(u->sink->asyncmsgq, PA_MSGOBJECT(u->sink), SINK_MESSAGE_GET_FREEWHEEL_STATS, &stats, 0, NULL) == 0);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_bool(encoder, "running", stats.running);
+    pa_json_encoder_add_member_int(encoder, "audio", (int64_t) stats.audio);
+    pa_json_encoder_add_member_int(encoder, "underrun", (int64_t) stats.underrun);
+    pa_json_encoder_add_member_int(encoder, "wall", (int64_t) stats.wall);
+    pa_json_encoder_add_member_double(encoder, "real_time_factor", stats.wall > 0 ? (double) stats.audio / stats.wall : 0.0, 2);
+    pa_json_encoder_add_member_int(encoder, "blocks", (int64_t) stats.blocks);
+    pa_json_encoder_add_member_int(encoder, "cpu", (int64_t) stats.cpu);
+    pa_json_encoder_add_member_int(encoder, "render", (int64_t) stats.render);
+    pa_json_encoder_add_member_int(encoder, "rewind", (int64_t) stats.rewind);
+    pa_json_encoder_add_member_int(encoder, "poll", (int64_t) stats.poll);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int null_sink_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* The last or the current freewheel run, all times in usec. CPU time
+     * is only counted when a run finishes. */
+    if (pa_streq(message, "get-freewheel-stats")) {
+        if (!u->freewheel)
+            return -PA_ERR_BADSTATE;
+
+        *response = get_freewheel_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module*m) {
     struct userdata *u = NULL;
     pa_sample_spec ss;
@@ -321,6 +554,7 @@ int pa__init(pa_module*m) {
     pa_format_info *format;
     const char *formats;
     size_t nbytes;
+    uint32_t freewheel_msec = 0;
 
     pa_assert(m);
 
@@ -411,6 +645,17 @@ int pa__init(pa_module*m) {
     if (u->norewinds)
         u->block_usec = BLOCK_USEC_NOREWINDS;
 
+    if (pa_modargs_get_value_boolean(ma, "freewheel", &u->freewheel) < 0) {
+        pa_log("Invalid argument, freewheel expects a boolean value.");
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_u32(ma, "freewheel_msec", &freewheel_msec) < 0) {
+        pa_log("Invalid freewheel_msec argument.");
+        goto fail;
+    }
+    u->freewheel_usec = freewheel_msec * PA_USEC_PER_MSEC;
+
     nbytes = pa_usec_to_bytes(u->block_usec, &u->sink->sample_spec);
 
     if(u->norewinds){
@@ -430,6 +675,9 @@ int pa__init(pa_module*m) {
 
     pa_sink_put(u->sink);
 
+    u->message_handler_path = pa_sprintf_malloc("/module/%u/null-sink", m->index);
+    pa_message_handler_register(m->core, u->message_handler_path, "Null sink message handler", null_sink_message_handler, u);
+
     pa_modargs_free(ma);
 
     return 0;
@@ -460,6 +708,11 @@ void pa__done(pa_module*m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     if (u->sink)
         pa_sink_unlink(u->sink);
 
@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>
@@ -39,6 +40,8 @@
 #include <pulse/rtclock.h>
 
 #include <pulsecore/core-error.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 #include <pulsecore/sink.h>
 #include <pulsecore/module.h>
 #include <pulsecore/core-util.h>
@@ -62,11 +65,42 @@ PA_MODULE_USAGE(
         "channels=<number of channels> "
         "channel_map=<channel map> "
         "use_system_clock_for_timing=<yes or no> "
+        "use_vmsplice=<yes or no> "
 );
 
 #define DEFAULT_FILE_NAME "fifo_output"
 #define DEFAULT_SINK_NAME "fifo_output"
 
+#if defined(HAVE_VMSPLICE) && defined(FIONREAD)
+#define USE_VMSPLICE
+
+/* The most blocks that may be in the FIFO at the same time. Each block
+ * needs at least one pipe buffer, a pipe has 16 by default. Further blocks
+ * are copied into the FIFO. */
+#define SPLICED_MAX 256
+
+/* A block that has been spliced into the FIFO. Its memory must not be
+ * reused until the reader has consumed it, end is the number of bytes
+ * spliced up to and including it. */
+struct spliced_block {
+    pa_memblock *memblock;
+    uint64_t end;
+};
+#endif
+
+/* What it costs to get the audio into the FIFO */
+struct pipe_stats {
+    uint64_t bytes;
+    uint64_t calls;
+    pa_usec_t usec;
+    uint64_t dropped;
+    uint64_t copied;
+};
+
+enum {
+    SINK_MESSAGE_GET_STATS = PA_SINK_MESSAGE_MAX,
+};
+
 struct userdata {
     pa_core *core;
     pa_module *module;
@@ -92,6 +126,18 @@ struct userdata {
     pa_usec_t timestamp;
 
     bool use_system_clock_for_timing;
+
+    /* With vmsplice() the rendered blocks are handed to the FIFO without
+     * copying them, and kept until the reader has consumed them */
+    bool use_vmsplice;
+#ifdef USE_VMSPLICE
+    struct spliced_block spliced[SPLICED_MAX];
+    unsigned spliced_index, n_spliced;
+    uint64_t spliced_bytes;
+#endif
+
+    struct pipe_stats stats;
+    char *message_handler_path;
 };
 
 static const char* const valid_modargs[] = {
@@ -103,6 +149,7 @@ static const char* const valid_modargs[] = {
     "channels",
     "channel_map",
     "use_system_clock_for_timing",
+    "use_vmsplice",
     NULL
 };
 
@@ -130,6 +177,10 @@ static int sink_process_msg(pa_msgobject *o, int code, void *data, int64_t offse
                 *((int64_t*) data) = pa_bytes_to_usec(n, &u->sink->sample_spec);
             }
             return 0;
+
+        case SINK_MESSAGE_GET_STATS:
+            *((struct pipe_stats*) data) = u->stats;
+            return 0;
     }
 
     return pa_sink_process_msg(o, code, data, offset, chunk);
@@ -177,22 +228,138 @@ static void sink_update_requested_latency_cb(pa_sink *s) {
     pa_sink_set_max_request_within_thread(s, nbytes);
 }
 
+#ifdef USE_VMSPLICE
+/* Drops the blocks the reader has consumed */
+static void release_spliced(struct userdata *u) {
+    uint64_t consumed;
+    int l;
+
+    pa_assert(u);
+
+    if (u->n_spliced <= 0)
+        return;
+
+    if (ioctl(u->fd, FIONREAD, &l) < 0)
+        return;
+
+    consumed = u->spliced_bytes - (uint64_t) PA_MAX(l, 0);
+
+    while (u->n_spliced > 0 && u->spliced[u->spliced_index].end <= consumed) {
+        pa_memblock_unref(u->spliced[u->spliced_index].memblock);
+        u->spliced_index = (u->spliced_index + 1) % SPLICED_MAX;
+        u->n_spliced--;
+    }
+}
+
+/* The FIFO still references the memory of the blocks, which will be reused
+ * once they are released. Whatever the reader has not consumed yet is
+ * dropped from the FIFO first. */
+static void release_all_spliced(struct userdata *u) {
+    pa_assert(u);
+
+    if (u->n_spliced > 0) {
+        uint8_t buf[4096];
+
+        while (pa_read(u->fd, buf, sizeof(buf), NULL) > 0)
+            ;
+    }
+
+    while (u->n_spliced > 0) {
+        pa_memblock_unref(u->spliced[u->spliced_index].memblock);
+        u->spliced_index = (u->spliced_index + 1) % SPLICED_MAX;
+        u->n_spliced--;
+    }
+}
+
+/* Maps the memory of the block into the FIFO. Gifting the pages is not
+ * possible, the blocks are neither page aligned nor owned by us alone. */
+static ssize_t splice_block(struct userdata *u, pa_memblock *memblock, size_t index, size_t length) {
+    struct iovec iov;
+    ssize_t l;
+
+    release_spliced(u);
+
+    /* There may still be room in the FIFO, and it is polled for that, so
+     * the block must not be refused */
+    if (u->n_spliced >= SPLICED_MAX) {
+        void *p = pa_memblock_acquire(memblock);
+
+        l = pa_write(u->fd, (uint8_t*) p + index, length, &u->write_type);
+
+        pa_memblock_release(memblock);
+
+        if (l > 0)
+            u->stats.copied += (uint64_t) l;
+
+        return l;
+    }
+
+    iov.iov_base = (uint8_t*) pa_memblock_acquire(memblock) + index;
+    iov.iov_len = length;
+
+    l = vmsplice(u->fd, &iov, 1, SPLICE_F_NONBLOCK);
+
+    pa_memblock_release(memblock);
+
+    if (l > 0) {
+        struct spliced_block *b = &u->spliced[(u->spliced_index + u->n_spliced) % SPLICED_MAX];
+
+        u->spliced_bytes += (uint64_t) l;
+        b->memblock = pa_memblock_ref(memblock);
+        b->end = u->spliced_bytes;
+        u->n_spliced++;
+    }
+
+    return l;
+}
+#endif
+
+/* Writes as much of the block to the FIFO as fits with a single call */
+static ssize_t write_block(struct userdata *u, pa_memblock *memblock, size_t index, size_t length) {
+    pa_usec_t start;
+    ssize_t l;
+
+    pa_assert(u);
+    pa_assert(memblock);
+
+    start = pa_rtclock_now();
+
+#ifdef USE_VMSPLICE
+    if (u->use_vmsplice)
+        l = splice_block(u, memblock, index, length);
+    else
+#endif
+    {
+        void *p = pa_memblock_acquire(memblock);
+
+        l = pa_write(u->fd, (uint8_t*) p + index, length, &u->write_type);
+
+        pa_memblock_release(memblock);
+    }
+
+    u->stats.usec += pa_rtclock_now() - start;
+    u->stats.calls++;
+
+    if (l > 0)
+        u->stats.bytes += (uint64_t) l;
+
+    return l;
+}
+
 static ssize_t pipe_sink_write(struct userdata *u, pa_memchunk *pchunk) {
     size_t index, length;
     ssize_t count = 0;
-    void *p;
 
     pa_assert(u);
     pa_assert(pchunk);
 
     index = pchunk->index;
     length = pchunk->length;
-    p = pa_memblock_acquire(pchunk->memblock);
 
     for (;;) {
         ssize_t l;
 
-        l = pa_write(u->fd, (uint8_t*) p + index, length, &u->write_type);
+        l = write_block(u, pchunk->memblock, index, length);
 
         pa_assert(l != 0);
 
@@ -221,8 +388,6 @@ static ssize_t pipe_sink_write(struct userdata *u, pa_memchunk *pchunk) {
         }
     }
 
-    pa_memblock_release(pchunk->memblock);
-
     return count;
 }
 
@@ -259,6 +424,7 @@ static void process_render_use_timing(struct userdata *u, pa_usec_t now) {
             pa_log_debug("Pipe-sink just dropped %zu bytes", dropped);
 
         u->bytes_dropped += dropped;
+        u->stats.dropped += dropped;
 
         consumed += chunk.length;
 
@@ -277,11 +443,8 @@ static int process_render(struct userdata *u) {
 
     for (;;) {
         ssize_t l;
-        void *p;
 
-        p = pa_memblock_acquire(u->memchunk.memblock);
-        l = pa_write(u->fd, (uint8_t*) p + u->memchunk.index, u->memchunk.length, &u->write_type);
-        pa_memblock_release(u->memchunk.memblock);
+        l = write_block(u, u->memchunk.memblock, u->memchunk.index, u->memchunk.length);
 
         pa_assert(l != 0);
 
@@ -412,6 +575,50 @@ finish:
     pa_log_debug("Thread shutting down");
 }
 
+/* Called from main context */
+static char *get_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct pipe_stats stats;
+
+    pa_assert_se(pa_asyncmsgq_send(u->sink->asyncmsgq, PA_MSGOBJECT(u->sink), SINK_MESSAGE_GET_STATS, &stats, 0, NULL) == 0);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_string(encoder, "mode", u->use_vmsplice ? "vmsplice" : "write");
+    pa_json_encoder_add_member_int(encoder, "bytes", (int64_t) stats.bytes);
+    pa_json_encoder_add_member_int(encoder, "calls", (int64_t) stats.calls);
+    pa_json_encoder_add_member_int(encoder, "usec", (int64_t) stats.usec);
+    pa_json_encoder_add_member_int(encoder, "dropped", (int64_t) stats.dropped);
+    pa_json_encoder_add_member_int(encoder, "copied", (int64_t) stats.copied);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int pipe_sink_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* The bytes written to the FIFO, the number of write() or vmsplice()
+     * calls and the time spent in them in usec. Dropped bytes are only
+     * counted with use_system_clock_for_timing. Copied bytes were written
+     * with write() in vmsplice mode because too many blocks were in the
+     * FIFO. */
+    if (pa_streq(message, "get-stats")) {
+        *response = get_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module *m) {
     struct userdata *u;
     struct stat st;
@@ -448,6 +655,18 @@ int pa__init(pa_module *m) {
         goto fail;
     }
 
+    if (pa_modargs_get_value_boolean(ma, "use_vmsplice", &u->use_vmsplice) < 0) {
+        pa_log("Failed to parse use_vmsplice argument.");
+        goto fail;
+    }
+
+#ifndef USE_VMSPLICE
+    if (u->use_vmsplice) {
+        pa_log("vmsplice() is not supported on this system.");
+        goto fail;
+    }
+#endif
+
     if (pa_thread_mq_init(&u->thread_mq, m->core->mainloop, u->rtpoll) < 0) {
         pa_log("pa_thread_mq_init() failed.");
         goto fail;
@@ -549,6 +768,9 @@ int pa__init(pa_module *m) {
 
     pa_sink_put(u->sink);
 
+    u->message_handler_path = pa_sprintf_malloc("/module/%u/pipe-sink", m->index);
+    pa_message_handler_register(m->core, u->message_handler_path, "Pipe sink message handler", pipe_sink_message_handler, u);
+
     pa_modargs_free(ma);
 
     return 0;
@@ -579,6 +801,11 @@ void pa__done(pa_module *m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     if (u->sink)
         pa_sink_unlink(u->sink);
 
@@ -595,6 +822,10 @@ void pa__done(pa_module *m) {
     if (u->memchunk.memblock)
         pa_memblock_unref(u->memchunk.memblock);
 
+#ifdef USE_VMSPLICE
+    release_all_spliced(u);
+#endif
+
     if (u->rtpoll_item)
         pa_rtpoll_item_free(u->rtpoll_item);
 
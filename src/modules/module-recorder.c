@@ -0,0 +1,660 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sndfile.h>
+
+#include <pulse/rtclock.h>
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/asyncq.h>
+#include <pulsecore/atomic.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/flist.h>
+#include <pulsecore/idxset.h>
+#include <pulsecore/json.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/message-handler.h>
+#include <pulsecore/modargs.h>
+#include <pulsecore/module.h>
+#include <pulsecore/namereg.h>
+#include <pulsecore/poll.h>
+#include <pulsecore/rtpoll.h>
+#include <pulsecore/sndfile-util.h>
+#include <pulsecore/source.h>
+#include <pulsecore/source-output.h>
+#include <pulsecore/thread.h>
+#include <pulsecore/thread-mq.h>
+
+PA_MODULE_DESCRIPTION("Record sources to files");
+PA_MODULE_VERSION(PACKAGE_VERSION);
+PA_MODULE_LOAD_ONCE(false);
+PA_MODULE_USAGE(
+        "sources=<comma separated list of sources or monitor sources> "
+        "directory=<directory for the files> "
+        "file_format=<file format, e.g. wav, flac> "
+        "queue_length=<number of blocks to queue for each source> "
+);
+
+#define DEFAULT_FILE_FORMAT "wav"
+#define DEFAULT_QUEUE_LENGTH 1024
+
+/* The sources push their audio into a queue for each track, which is
+ * emptied by a writer thread. The source IO threads only take a reference
+ * to the memory blocks and never wait for the writer: if it falls behind so
+ * far that the queue is full, the blocks are dropped and counted. */
+
+static const char* const valid_modargs[] = {
+    "sources",
+    "directory",
+    "file_format",
+    "queue_length",
+    NULL
+};
+
+PA_STATIC_FLIST_DECLARE(recorder_blocks, 0, pa_xfree);
+
+/* A block of audio on its way to the file */
+struct block {
+    pa_memchunk chunk;
+    pa_usec_t timestamp;
+};
+
+/* Write lag and throughput of a track. The lag is the time a block spent in
+ * the queue before it was written. */
+struct track_stats {
+    uint64_t bytes;
+    uint64_t blocks;
+    pa_usec_t lag_usec;
+    pa_usec_t max_lag_usec;
+    pa_usec_t write_usec;
+    pa_usec_t max_write_usec;
+    bool failed;
+};
+
+struct track {
+    struct userdata *userdata;
+    char *source_name;
+    char *filename;
+
+    pa_source_output *source_output;
+    SNDFILE *sndfile;
+    pa_sndfile_writef_t writef_function;
+    size_t frame_size;
+
+    pa_asyncq *queue;
+    pa_atomic_t queued;
+    pa_atomic_t dropped;
+
+    /* Only accessed from the writer thread */
+    pa_rtpoll_item *rtpoll_item;
+    struct track_stats stats;
+};
+
+typedef struct recorder_msg {
+    pa_msgobject parent;
+    struct userdata *userdata;
+} recorder_msg;
+
+PA_DEFINE_PRIVATE_CLASS(recorder_msg, pa_msgobject);
+#define RECORDER_MSG(o) (recorder_msg_cast(o))
+
+enum {
+    RECORDER_MESSAGE_ADD_TRACK,
+    RECORDER_MESSAGE_REMOVE_TRACK,
+    RECORDER_MESSAGE_GET_STATS,
+};
+
+struct stats_request {
+    struct track *track;
+    struct track_stats stats;
+};
+
+struct userdata {
+    pa_core *core;
+    pa_module *module;
+
+    pa_idxset *tracks;
+    unsigned queue_length;
+
+    pa_thread *thread;
+    pa_thread_mq thread_mq;
+    pa_rtpoll *rtpoll;
+    recorder_msg *msg;
+
+    char *message_handler_path;
+};
+
+/* Called from the IO thread of the source */
+static void source_output_push_cb(pa_source_output *o, const pa_memchunk *chunk) {
+    struct track *t;
+    struct block *b;
+
+    pa_source_output_assert_ref(o);
+    pa_assert_se(t = o->userdata);
+
+    if (!(b = pa_flist_pop(PA_STATIC_FLIST_GET(recorder_blocks))))
+        b = pa_xnew(struct block, 1);
+
+    b->chunk = *chunk;
+    pa_memblock_ref(b->chunk.memblock);
+    b->timestamp = pa_rtclock_now();
+
+    pa_atomic_inc(&t->queued);
+
+    if (pa_asyncq_push(t->queue, b, false) < 0) {
+        pa_atomic_dec(&t->queued);
+        pa_atomic_inc(&t->dropped);
+
+        pa_memblock_unref(b->chunk.memblock);
+        if (pa_flist_push(PA_STATIC_FLIST_GET(recorder_blocks), b) < 0)
+            pa_xfree(b);
+    }
+}
+
+/* Called from the writer thread */
+static void write_block(struct track *t, struct block *b) {
+    pa_usec_t start, lag, time;
+    size_t length = b->chunk.length;
+    sf_count_t written;
+    void *p;
+
+    start = pa_rtclock_now();
+    lag = start > b->timestamp ? start - b->timestamp : 0;
+
+    t->stats.lag_usec = lag;
+    t->stats.max_lag_usec = PA_MAX(t->stats.max_lag_usec, lag);
+
+    if (t->stats.failed)
+        goto finish;
+
+    p = pa_memblock_acquire_chunk(&b->chunk);
+
+    if (t->writef_function)
+        written = t->writef_function(t->sndfile, p, (sf_count_t) (length / t->frame_size)) * (sf_count_t) t->frame_size;
+    else
+        written = sf_write_raw(t->sndfile, p, (sf_count_t) length);
+
+    pa_memblock_release(b->chunk.memblock);
+
+    if (written != (sf_count_t) length) {
+        pa_log("Failed to write to %s: %s", t->filename, sf_strerror(t->sndfile));
+        t->stats.failed = true;
+        goto finish;
+    }
+
+    time = pa_rtclock_now() - start;
+
+    t->stats.bytes += length;
+    t->stats.blocks++;
+    t->stats.write_usec += time;
+    t->stats.max_write_usec = PA_MAX(t->stats.max_write_usec, time);
+
+finish:
+    pa_memblock_unref(b->chunk.memblock);
+    if (pa_flist_push(PA_STATIC_FLIST_GET(recorder_blocks), b) < 0)
+        pa_xfree(b);
+}
+
+/* Called from the writer thread */
+static void flush_queue(struct track *t) {
+    struct block *b;
+
+    while ((b = pa_asyncq_pop(t->queue, false))) {
+        pa_atomic_dec(&t->queued);
+        write_block(t, b);
+    }
+}
+
+/* Called from the writer thread */
+static int queue_work(pa_rtpoll_item *i) {
+    struct track *t;
+
+    pa_assert_se(t = pa_rtpoll_item_get_work_userdata(i));
+
+    flush_queue(t);
+    return 0;
+}
+
+/* Called from the writer thread */
+static int queue_before(pa_rtpoll_item *i) {
+    struct track *t;
+
+    pa_assert_se(t = pa_rtpoll_item_get_work_userdata(i));
+
+    /* 1 means immediate restart of the loop */
+    if (pa_asyncq_read_before_poll(t->queue) < 0)
+        return 1;
+
+    return 0;
+}
+
+/* Called from the writer thread */
+static void queue_after(pa_rtpoll_item *i) {
+    struct track *t;
+
+    pa_assert_se(t = pa_rtpoll_item_get_work_userdata(i));
+
+    pa_asyncq_read_after_poll(t->queue);
+}
+
+/* Called from the writer thread */
+static int recorder_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
+    recorder_msg *msg = RECORDER_MSG(o);
+    struct track *t;
+    struct pollfd *pollfd;
+
+    pa_assert(msg);
+
+    switch (code) {
+        case RECORDER_MESSAGE_ADD_TRACK:
+            t = data;
+
+            t->rtpoll_item = pa_rtpoll_item_new(msg->userdata->rtpoll, PA_RTPOLL_NORMAL, 1);
+            pollfd = pa_rtpoll_item_get_pollfd(t->rtpoll_item, NULL);
+            pollfd->fd = pa_asyncq_read_fd(t->queue);
+            pollfd->events = POLLIN;
+
+            pa_rtpoll_item_set_work_callback(t->rtpoll_item, queue_work, t);
+            pa_rtpoll_item_set_before_callback(t->rtpoll_item, queue_before, t);
+            pa_rtpoll_item_set_after_callback(t->rtpoll_item, queue_after, t);
+
+            return 0;
+
+        case RECORDER_MESSAGE_REMOVE_TRACK:
+            t = data;
+
+            /* The source output is unlinked already, nothing can be
+             * queued anymore */
+            flush_queue(t);
+
+            pa_rtpoll_item_free(t->rtpoll_item);
+            t->rtpoll_item = NULL;
+
+            return 0;
+
+        case RECORDER_MESSAGE_GET_STATS: {
+            struct stats_request *request = data;
+
+            request->stats = request->track->stats;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void thread_func(void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+
+    pa_log_debug("Writer thread starting up");
+
+    pa_thread_mq_install(&u->thread_mq);
+
+    for (;;) {
+        int ret;
+
+        if ((ret = pa_rtpoll_run(u->rtpoll)) < 0)
+            goto fail;
+
+        if (ret == 0)
+            goto finish;
+    }
+
+fail:
+    /* If this was no regular exit from the loop we have to continue
+     * processing messages until we received PA_MESSAGE_SHUTDOWN */
+    pa_asyncmsgq_post(u->thread_mq.outq, PA_MSGOBJECT(u->core), PA_CORE_MESSAGE_UNLOAD_MODULE, u->module, 0, NULL, NULL);
+    pa_asyncmsgq_wait_for(u->thread_mq.inq, PA_MESSAGE_SHUTDOWN);
+
+finish:
+    pa_log_debug("Writer thread shutting down");
+}
+
+/* Called from main context */
+static void track_free(struct track *t) {
+    struct userdata *u;
+
+    pa_assert(t);
+    pa_assert_se(u = t->userdata);
+
+    if (t->source_output) {
+        pa_source_output_unlink(t->source_output);
+
+        if (t->rtpoll_item)
+            pa_asyncmsgq_send(u->thread_mq.inq, PA_MSGOBJECT(u->msg), RECORDER_MESSAGE_REMOVE_TRACK, t, 0, NULL);
+
+        pa_source_output_unref(t->source_output);
+    }
+
+    if (t->queue)
+        pa_asyncq_free(t->queue, NULL);
+
+    if (t->sndfile) {
+        if (pa_atomic_load(&t->dropped) > 0)
+            pa_log_warn("%i blocks of %s were dropped because the writer did not keep up.",
+                        pa_atomic_load(&t->dropped), t->source_name);
+
+        if (sf_close(t->sndfile) != 0)
+            pa_log("Failed to close %s.", t->filename);
+    }
+
+    pa_xfree(t->filename);
+    pa_xfree(t->source_name);
+    pa_xfree(t);
+}
+
+/* Called from main context */
+static void source_output_kill_cb(pa_source_output *o) {
+    struct track *t;
+
+    pa_source_output_assert_ref(o);
+    pa_assert_se(t = o->userdata);
+
+    pa_log_info("Source %s went away, stopping to record it.", t->source_name);
+
+    pa_idxset_remove_by_data(t->userdata->tracks, t, NULL);
+    track_free(t);
+}
+
+static const char *file_extension(int major_format) {
+    SF_FORMAT_INFO fi;
+
+    pa_zero(fi);
+    fi.format = major_format;
+
+    if (sf_command(NULL, SFC_GET_FORMAT_INFO, &fi, sizeof(fi)) != 0 || !fi.extension)
+        return "raw";
+
+    return fi.extension;
+}
+
+/* Called from main context */
+static struct track *track_new(struct userdata *u, pa_source *source, const char *directory, int major_format) {
+    struct track *t;
+    pa_source_output_new_data data;
+    const char *description;
+    pa_sample_spec ss;
+    pa_channel_map map;
+    SF_INFO sfi;
+
+    t = pa_xnew0(struct track, 1);
+    t->userdata = u;
+    t->source_name = pa_xstrdup(source->name);
+    t->filename = pa_sprintf_malloc("%s" PA_PATH_SEP "%s.%s", directory, source->name, file_extension(major_format));
+
+    /* Let the source output convert to what the file can store */
+    ss = source->sample_spec;
+    map = source->channel_map;
+
+    pa_zero(sfi);
+    if (pa_sndfile_write_sample_spec(&sfi, &ss) < 0) {
+        pa_log("Cannot record %s in a file.", source->name);
+        goto fail;
+    }
+
+    sfi.format |= major_format;
+
+    if (!sf_format_check(&sfi)) {
+        pa_log("The file format cannot store the samples of %s.", source->name);
+        goto fail;
+    }
+
+    if (!(t->sndfile = sf_open(t->filename, SFM_WRITE, &sfi))) {
+        pa_log("Failed to open %s: %s", t->filename, sf_strerror(NULL));
+        goto fail;
+    }
+
+    if (pa_sndfile_write_channel_map(t->sndfile, &map) < 0)
+        pa_log_debug("The channel map of %s cannot be stored in the file.", source->name);
+
+    t->writef_function = pa_sndfile_writef_function(&ss);
+    t->frame_size = pa_frame_size(&ss);
+    t->queue = pa_asyncq_new(u->queue_length);
+
+    pa_source_output_new_data_init(&data);
+    description = pa_proplist_gets(source->proplist, PA_PROP_DEVICE_DESCRIPTION);
+    pa_proplist_setf(data.proplist, PA_PROP_MEDIA_NAME, "Recording of %s", description ? description : source->name);
+    pa_proplist_sets(data.proplist, PA_PROP_MEDIA_FILENAME, t->filename);
+    pa_proplist_sets(data.proplist, PA_PROP_MEDIA_ROLE, "production");
+    data.driver = __FILE__;
+    data.module = u->module;
+    pa_source_output_new_data_set_source(&data, source, false, true);
+    pa_source_output_new_data_set_sample_spec(&data, &ss);
+    pa_source_output_new_data_set_channel_map(&data, &map);
+    data.flags |= PA_SOURCE_OUTPUT_DONT_MOVE;
+
+    pa_source_output_new(&t->source_output, u->core, &data);
+    pa_source_output_new_data_done(&data);
+
+    if (!t->source_output) {
+        pa_log("Failed to create source output for %s.", source->name);
+        goto fail;
+    }
+
+    t->source_output->push = source_output_push_cb;
+    t->source_output->kill = source_output_kill_cb;
+    t->source_output->userdata = t;
+
+    pa_asyncmsgq_send(u->thread_mq.inq, PA_MSGOBJECT(u->msg), RECORDER_MESSAGE_ADD_TRACK, t, 0, NULL);
+
+    pa_log_info("Recording %s to %s.", source->name, t->filename);
+
+    return t;
+
+fail:
+    track_free(t);
+    return NULL;
+}
+
+/* Called from main context */
+static char *get_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct track *t;
+    uint32_t idx;
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_begin_member_array(encoder, "tracks");
+
+    PA_IDXSET_FOREACH(t, u->tracks, idx) {
+        struct stats_request request;
+
+        request.track = t;
+        pa_assert_se(pa_asyncmsgq_send(u->thread_mq.inq, PA_MSGOBJECT(u->msg), RECORDER_MESSAGE_GET_STATS, &request, 0, NULL) == 0);
+
+        pa_json_encoder_begin_element_object(encoder);
+        pa_json_encoder_add_member_string(encoder, "source", t->source_name);
+        pa_json_encoder_add_member_string(encoder, "file", t->filename);
+        pa_json_encoder_add_member_int(encoder, "bytes", (int64_t) request.stats.bytes);
+        pa_json_encoder_add_member_int(encoder, "blocks", (int64_t) request.stats.blocks);
+        pa_json_encoder_add_member_int(encoder, "queued", pa_atomic_load(&t->queued));
+        pa_json_encoder_add_member_int(encoder, "dropped", pa_atomic_load(&t->dropped));
+        pa_json_encoder_add_member_int(encoder, "lag_usec", (int64_t) request.stats.lag_usec);
+        pa_json_encoder_add_member_int(encoder, "max_lag_usec", (int64_t) request.stats.max_lag_usec);
+        pa_json_encoder_add_member_int(encoder, "write_usec", (int64_t) request.stats.write_usec);
+        pa_json_encoder_add_member_int(encoder, "max_write_usec", (int64_t) request.stats.max_write_usec);
+        pa_json_encoder_add_member_bool(encoder, "failed", request.stats.failed);
+        pa_json_encoder_end_object(encoder);
+    }
+
+    pa_json_encoder_end_array(encoder);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int recorder_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* For each track the bytes and blocks written, the blocks waiting in the
+     * queue and those dropped because it was full, the time the last block
+     * waited to be written and the longest wait, and the time spent
+     * writing. */
+    if (pa_streq(message, "get-stats")) {
+        *response = get_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
+int pa__init(pa_module *m) {
+    struct userdata *u;
+    pa_modargs *ma;
+    const char *sources, *directory, *file_format, *state = NULL;
+    char *name;
+    int major_format;
+    struct track *t;
+    uint32_t idx;
+
+    pa_assert(m);
+
+    if (!(ma = pa_modargs_new(m->argument, valid_modargs))) {
+        pa_log("Failed to parse module arguments.");
+        goto fail;
+    }
+
+    if (!(sources = pa_modargs_get_value(ma, "sources", NULL)) || !*sources) {
+        pa_log("No sources to record given.");
+        goto fail;
+    }
+
+    if (!(directory = pa_modargs_get_value(ma, "directory", NULL)) || !*directory) {
+        pa_log("No directory for the files given.");
+        goto fail;
+    }
+
+    file_format = pa_modargs_get_value(ma, "file_format", DEFAULT_FILE_FORMAT);
+    if ((major_format = pa_sndfile_format_from_string(file_format)) < 0) {
+        pa_log("Unknown file format %s.", file_format);
+        goto fail;
+    }
+
+    m->userdata = u = pa_xnew0(struct userdata, 1);
+    u->core = m->core;
+    u->module = m;
+    u->tracks = pa_idxset_new(NULL, NULL);
+
+    u->queue_length = DEFAULT_QUEUE_LENGTH;
+    if (pa_modargs_get_value_u32(ma, "queue_length", &u->queue_length) < 0 || u->queue_length < 1) {
+        pa_log("Invalid queue length.");
+        goto fail;
+    }
+    u->queue_length = pa_make_power_of_two(u->queue_length);
+
+    u->rtpoll = pa_rtpoll_new();
+
+    if (pa_thread_mq_init(&u->thread_mq, m->core->mainloop, u->rtpoll) < 0) {
+        pa_log("pa_thread_mq_init() failed.");
+        goto fail;
+    }
+
+    u->msg = pa_msgobject_new(recorder_msg);
+    u->msg->parent.process_msg = recorder_process_msg;
+    u->msg->userdata = u;
+
+    if (!(u->thread = pa_thread_new("recorder", thread_func, u))) {
+        pa_log("Failed to create thread.");
+        goto fail;
+    }
+
+    while ((name = pa_split(sources, ",", &state))) {
+        pa_source *source;
+
+        if (!(source = pa_namereg_get(m->core, name, PA_NAMEREG_SOURCE))) {
+            pa_log("Invalid source %s.", name);
+            pa_xfree(name);
+            goto fail;
+        }
+
+        pa_xfree(name);
+
+        if (!(t = track_new(u, source, directory, major_format)))
+            goto fail;
+
+        pa_idxset_put(u->tracks, t, NULL);
+    }
+
+    /* Only start recording once all files could be opened */
+    PA_IDXSET_FOREACH(t, u->tracks, idx)
+        pa_source_output_put(t->source_output);
+
+    u->message_handler_path = pa_sprintf_malloc("/module/%u/recorder", m->index);
+    pa_message_handler_register(m->core, u->message_handler_path, "Recorder message handler", recorder_message_handler, u);
+
+    pa_modargs_free(ma);
+
+    return 0;
+
+fail:
+    if (ma)
+        pa_modargs_free(ma);
+
+    pa__done(m);
+
+    return -1;
+}
+
+void pa__done(pa_module *m) {
+    struct userdata *u;
+
+    pa_assert(m);
+
+    if (!(u = m->userdata))
+        return;
+
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
+    /* The tracks are removed while the writer is still running, so that it
+     * writes what is left in the queues */
+    if (u->tracks)
+        pa_idxset_free(u->tracks, (pa_free_cb_t) track_free);
+
+    if (u->thread) {
+        pa_asyncmsgq_send(u->thread_mq.inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
+        pa_thread_free(u->thread);
+    }
+
+    pa_thread_mq_done(&u->thread_mq);
+
+    if (u->msg)
+        pa_msgobject_unref(PA_MSGOBJECT(u->msg));
+
+    if (u->rtpoll)
+        pa_rtpoll_free(u->rtpoll);
+
+    pa_xfree(u);
+}
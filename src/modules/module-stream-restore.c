@@ -47,7 +47,7 @@
 #include <pulsecore/protocol-native.h>
 #include <pulsecore/pstream.h>
 #include <pulsecore/pstream-util.h>
-#include <pulsecore/database.h>
+#include <pulsecore/database-async.h>
 #include <pulsecore/tagstruct.h>
 #include <pulsecore/proplist-util.h>
 
@@ -97,7 +97,7 @@ struct userdata {
         *source_output_fixate_hook_slot,
         *connection_unlink_hook_slot;
     pa_time_event *save_time_event;
-    pa_database* database;
+    pa_database_async *database;
 
     bool restore_device:1;
     bool restore_volume:1;
@@ -938,7 +938,7 @@ static void handle_entry_remove(DBusConnection *conn, DBusMessage *msg, void *us
     key.data = de->entry_name;
     key.size = strlen(de->entry_name);
 
-    pa_assert_se(pa_database_unset(de->userdata->database, &key) == 0);
+    pa_assert_se(pa_database_async_unset(de->userdata->database, &key) == 0);
 
     send_entry_removed_signal(de);
     trigger_save(de->userdata);
@@ -961,7 +961,7 @@ static void save_time_callback(pa_mainloop_api*a, pa_time_event* e, const struct
     u->core->mainloop->time_free(u->save_time_event);
     u->save_time_event = NULL;
 
-    pa_database_sync(u->database);
+    pa_database_async_sync(u->database, NULL, NULL);
     pa_log_info("Synced.");
 }
 
@@ -1004,7 +1004,7 @@ static bool entry_write(struct userdata *u, const char *name, const struct entry
 
     data.data = (void*)pa_tagstruct_data(t, &data.size);
 
-    r = (pa_database_set(u->database, &key, &data, replace) == 0);
+    r = (pa_database_async_set(u->database, &key, &data, replace) == 0);
 
     pa_tagstruct_free(t);
 
@@ -1040,7 +1040,7 @@ static struct entry *legacy_entry_read(struct userdata *u, const char *name) {
 
     pa_zero(data);
 
-    if (!pa_database_get(u->database, &key, &data))
+    if (!pa_database_async_get(u->database, &key, &data))
         goto fail;
 
     if (data.size != sizeof(struct legacy_entry)) {
@@ -1124,7 +1124,7 @@ static struct entry *entry_read(struct userdata *u, const char *name) {
 
     pa_zero(data);
 
-    if (!pa_database_get(u->database, &key, &data))
+    if (!pa_database_async_get(u->database, &key, &data))
         goto fail;
 
     t = pa_tagstruct_new_fixed(data.data, data.size);
@@ -1917,14 +1917,14 @@ PA_GCC_UNUSED static void stream_restore_dump_database(struct userdata *u) {
     pa_datum key;
     bool done;
 
-    done = !pa_database_first(u->database, &key, NULL);
+    done = !pa_database_async_first(u->database, &key, NULL);
 
     while (!done) {
         pa_datum next_key;
         struct entry *e;
         char *name;
 
-        done = !pa_database_next(u->database, &key, &next_key, NULL);
+        done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
         name = pa_xstrndup(key.data, key.size);
         pa_datum_free(&key);
@@ -1985,14 +1985,14 @@ static int extension_cb(pa_native_protocol *p, pa_module *m, pa_native_connectio
             if (!pa_tagstruct_eof(t))
                 goto fail;
 
-            done = !pa_database_first(u->database, &key, NULL);
+            done = !pa_database_async_first(u->database, &key, NULL);
 
             while (!done) {
                 pa_datum next_key;
                 struct entry *e;
                 char *name;
 
-                done = !pa_database_next(u->database, &key, &next_key, NULL);
+                done = !pa_database_async_next(u->database, &key, &next_key, NULL);
 
                 name = pa_xstrndup(key.data, key.size);
                 pa_datum_free(&key);
@@ -2041,7 +2041,7 @@ static int extension_cb(pa_native_protocol *p, pa_module *m, pa_native_connectio
                     pa_hashmap_remove_and_free(u->dbus_entries, de->entry_name);
                 }
 #endif
-                pa_database_clear(u->database);
+                pa_database_async_clear(u->database);
             }
 
             while (!pa_tagstruct_eof(t)) {
@@ -2172,7 +2172,7 @@ static int extension_cb(pa_native_protocol *p, pa_module *m, pa_native_connectio
                 key.data = (char*) name;
                 key.size = strlen(name);
 
-                pa_database_unset(u->database, &key);
+                pa_database_async_unset(u->database, &key);
             }
 
             trigger_save(u);
@@ -2247,7 +2247,7 @@ static void clean_up_db(struct userdata *u) {
     PA_LLIST_HEAD_INIT(struct clean_up_item, to_be_converted);
 #endif
 
-    done = !pa_database_first(u->database, &key, NULL);
+    done = !pa_database_async_first(u->database, &key, NULL);
     while (!done) {
         pa_datum next_key;
         char *entry_name = NULL;
@@ -2280,7 +2280,7 @@ static void clean_up_db(struct userdata *u) {
             entry_free(e);
         }
 
-        done = !pa_database_next(u->database, &key, &next_key, NULL);
+        done = !pa_database_async_next(u->database, &key, &next_key, NULL);
         pa_datum_free(&key);
         key = next_key;
     }
@@ -2291,7 +2291,7 @@ static void clean_up_db(struct userdata *u) {
 
         pa_log_debug("Removing an invalid entry: %s", item->entry_name);
 
-        pa_assert_se(pa_database_unset(u->database, &key) >= 0);
+        pa_assert_se(pa_database_async_unset(u->database, &key) >= 0);
         trigger_save(u);
 
         PA_LLIST_REMOVE(struct clean_up_item, to_be_removed, item);
@@ -2383,7 +2383,7 @@ int pa__init(pa_module*m) {
     if (!(state_path = pa_state_path(NULL, true)))
         goto fail;
 
-    if (!(u->database = pa_database_open(state_path, "stream-volumes", true, true))) {
+    if (!(u->database = pa_database_async_open(u->core, state_path, "stream-volumes", true, true))) {
         pa_xfree(state_path);
         goto fail;
     }
@@ -2403,7 +2403,7 @@ int pa__init(pa_module*m) {
     pa_assert_se(pa_dbus_protocol_register_extension(u->dbus_protocol, INTERFACE_STREAM_RESTORE) >= 0);
 
     /* Create the initial dbus entries. */
-    done = !pa_database_first(u->database, &key, NULL);
+    done = !pa_database_async_first(u->database, &key, NULL);
     while (!done) {
         pa_datum next_key;
         char *name;
@@ -2414,7 +2414,7 @@ int pa__init(pa_module*m) {
         pa_assert_se(pa_hashmap_put(u->dbus_entries, de->entry_name, de) == 0);
         pa_xfree(name);
 
-        done = !pa_database_next(u->database, &key, &next_key, NULL);
+        done = !pa_database_async_next(u->database, &key, &next_key, NULL);
         pa_datum_free(&key);
         key = next_key;
     }
@@ -2466,7 +2466,7 @@ void pa__done(pa_module*m) {
         u->core->mainloop->time_free(u->save_time_event);
 
     if (u->database)
-        pa_database_close(u->database);
+        pa_database_async_close(u->database);
 
     if (u->protocol) {
         pa_native_protocol_remove_ext(u->protocol, m);
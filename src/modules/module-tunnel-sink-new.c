@@ -22,25 +22,24 @@
 #endif
 
 #include "restart-module.h"
+#include "tunnel-connection.h"
 
 #include <pulse/context.h>
 #include <pulse/timeval.h>
 #include <pulse/xmalloc.h>
 #include <pulse/stream.h>
-#include <pulse/mainloop.h>
 #include <pulse/introspect.h>
 #include <pulse/error.h>
 
 #include <pulsecore/core.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/i18n.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 #include <pulsecore/sink.h>
 #include <pulsecore/modargs.h>
 #include <pulsecore/log.h>
-#include <pulsecore/thread.h>
 #include <pulsecore/thread-mq.h>
-#include <pulsecore/poll.h>
-#include <pulsecore/rtpoll.h>
 #include <pulsecore/proplist-util.h>
 
 PA_MODULE_AUTHOR("Alexander Couzens");
@@ -57,26 +56,30 @@ PA_MODULE_USAGE(
         "channels=<number of channels> "
         "rate=<sample rate> "
         "channel_map=<channel map> "
-        "cookie=<cookie file path>"
+        "cookie=<cookie file path> "
+        "shared_connection=<share one connection with the other tunnel sinks to the same server?>"
         );
 
 #define MAX_LATENCY_USEC (200 * PA_USEC_PER_MSEC)
-#define TUNNEL_THREAD_FAILED_MAINLOOP 1
 
 static int do_init(pa_module *m);
 static void do_done(pa_module *m);
 static void stream_state_cb(pa_stream *stream, void *userdata);
 static void stream_changed_buffer_attr_cb(pa_stream *stream, void *userdata);
 static void stream_set_buffer_attr_cb(pa_stream *stream, int success, void *userdata);
-static void context_state_cb(pa_context *c, void *userdata);
 static void sink_update_requested_latency_cb(pa_sink *s);
 
 struct tunnel_msg {
     pa_msgobject parent;
+
+    /* Messages may still be queued when the module goes away, then this is
+     * NULL */
+    struct userdata *userdata;
 };
 
 typedef struct tunnel_msg tunnel_msg;
 PA_DEFINE_PRIVATE_CLASS(tunnel_msg, pa_msgobject);
+#define TUNNEL_MSG(o) (tunnel_msg_cast(o))
 
 enum {
     TUNNEL_MESSAGE_CREATE_SINK_REQUEST,
@@ -90,18 +93,16 @@ enum {
 struct userdata {
     pa_module *module;
     pa_sink *sink;
-    pa_thread *thread;
-    pa_thread_mq *thread_mq;
-    pa_mainloop *thread_mainloop;
-    pa_mainloop_api *thread_mainloop_api;
+    pa_tunnel_connection *connection;
+    pa_tunnel_client *client;
 
     pa_context *context;
     pa_stream *stream;
-    pa_rtpoll *rtpoll;
 
     bool update_stream_bufferattr_after_connect;
 
     bool connected;
+    bool failed;
     bool shutting_down;
 
     char *cookie_file;
@@ -121,6 +122,7 @@ struct userdata {
 struct module_restart_data {
     struct userdata *userdata;
     pa_restart_data *restart_data;
+    char *message_handler_path;
 };
 
 static const char* const valid_modargs[] = {
@@ -134,6 +136,7 @@ static const char* const valid_modargs[] = {
     "channel_map",
     "cookie",
     "reconnect_interval_ms",
+    "shared_connection",
     NULL,
 };
 
@@ -176,115 +179,125 @@ static pa_proplist* tunnel_new_proplist(struct userdata *u) {
     return proplist;
 }
 
-static void thread_func(void *userdata) {
+/* Called from IO thread. Asks the ctl thread to either terminate or restart
+ * the module, the connection and the other tunnels on it are left alone. */
+static void tunnel_fail(struct userdata *u) {
+    pa_assert(u);
+
+    u->connected = false;
+
+    if (u->failed)
+        return;
+
+    u->failed = true;
+    pa_asyncmsgq_post(pa_thread_mq_get()->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_MAYBE_RESTART, NULL, 0, NULL, NULL);
+}
+
+/* Called from IO thread */
+static void tunnel_ready_cb(pa_context *context, void *userdata) {
     struct userdata *u = userdata;
-    pa_proplist *proplist;
 
     pa_assert(u);
 
-    pa_log_debug("Thread starting up");
-    pa_thread_mq_install(u->thread_mq);
+    /* now that we're connected, ask the control thread to create a sink for
+     * us, and wait for that to complete before proceeding, we'll
+     * receive TUNNEL_MESSAGE_SINK_CREATED in response when the sink is
+     * created (see sink_process_msg_cb()) */
+    pa_log_debug("Connection successful. Creating stream.");
+    pa_assert(!u->stream);
+    pa_assert(!u->sink);
 
-    proplist = tunnel_new_proplist(u);
-    u->context = pa_context_new_with_proplist(u->thread_mainloop_api,
-                                              "PulseAudio",
-                                              proplist);
-    pa_proplist_free(proplist);
+    u->context = context;
 
-    if (!u->context) {
-        pa_log("Failed to create libpulse context");
-        goto fail;
-    }
+    pa_log_debug("Asking ctl thread to create sink.");
+    pa_asyncmsgq_post(pa_thread_mq_get()->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_CREATE_SINK_REQUEST, NULL, 0, NULL, NULL);
+}
 
-    if (u->cookie_file && pa_context_load_cookie_from_file(u->context, u->cookie_file) != 0) {
-        pa_log_error("Can not load cookie file!");
-        goto fail;
-    }
+/* Called from IO thread */
+static void tunnel_failed_cb(void *userdata) {
+    struct userdata *u = userdata;
 
-    pa_context_set_state_callback(u->context, context_state_cb, u);
-    if (pa_context_connect(u->context,
-                           u->remote_server,
-                           PA_CONTEXT_NOAUTOSPAWN,
-                           NULL) < 0) {
-        pa_log("Failed to connect libpulse context: %s", pa_strerror(pa_context_errno(u->context)));
-        goto fail;
-    }
+    pa_assert(u);
 
-    for (;;) {
-        int ret;
+    tunnel_fail(u);
+}
 
-        if (pa_mainloop_iterate(u->thread_mainloop, 1, &ret) < 0) {
-            if (ret == 0)
-                goto finish;
-            else
-                goto fail;
-        }
+/* Called from IO thread */
+static void tunnel_iterate_cb(void *userdata) {
+    struct userdata *u = userdata;
 
-        if (u->sink && PA_UNLIKELY(u->sink->thread_info.rewind_requested))
-            pa_sink_process_rewind(u->sink, 0);
-
-        if (u->connected &&
-                pa_stream_get_state(u->stream) == PA_STREAM_READY &&
-                PA_SINK_IS_LINKED(u->sink->thread_info.state)) {
-            size_t writable;
-
-            writable = pa_stream_writable_size(u->stream);
-            if (writable > 0) {
-                pa_memchunk memchunk;
-                const void *p;
-
-                pa_sink_render_full(u->sink, writable, &memchunk);
-
-                pa_assert(memchunk.length > 0);
-
-                /* we have new data to write */
-                p = pa_memblock_acquire(memchunk.memblock);
-                /* TODO: Use pa_stream_begin_write() to reduce copying. */
-                ret = pa_stream_write(u->stream,
-                                      (uint8_t*) p + memchunk.index,
-                                      memchunk.length,
-                                      NULL,     /**< A cleanup routine for the data or NULL to request an internal copy */
-                                      0,        /** offset */
-                                      PA_SEEK_RELATIVE);
-                pa_memblock_release(memchunk.memblock);
-                pa_memblock_unref(memchunk.memblock);
-
-                if (ret != 0) {
-                    pa_log_error("Could not write data into the stream ... ret = %i", ret);
-                    u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
-                }
-            }
-        }
+    pa_assert(u);
 
-        /* Run the rtpoll to process messages that other modules (module-combine-sink,
-         * module-loopback and module-rtp-recv) may have placed in the queue. */
-        pa_rtpoll_set_timer_relative(u->rtpoll, 0);
-        if (pa_rtpoll_run(u->rtpoll) < 0)
-            goto fail;
+    if (u->sink && PA_UNLIKELY(u->sink->thread_info.rewind_requested))
+        pa_sink_process_rewind(u->sink, 0);
+
+    if (u->connected &&
+            pa_stream_get_state(u->stream) == PA_STREAM_READY &&
+            PA_SINK_IS_LINKED(u->sink->thread_info.state)) {
+        size_t writable;
+
+        writable = pa_stream_writable_size(u->stream);
+        if (writable > 0) {
+            pa_memchunk memchunk;
+            const void *p;
+            int ret;
+
+            pa_sink_render_full(u->sink, writable, &memchunk);
+
+            pa_assert(memchunk.length > 0);
+
+            /* we have new data to write */
+            p = pa_memblock_acquire(memchunk.memblock);
+            /* TODO: Use pa_stream_begin_write() to reduce copying. */
+            ret = pa_stream_write(u->stream,
+                                  (uint8_t*) p + memchunk.index,
+                                  memchunk.length,
+                                  NULL,     /**< A cleanup routine for the data or NULL to request an internal copy */
+                                  0,        /** offset */
+                                  PA_SEEK_RELATIVE);
+            pa_memblock_release(memchunk.memblock);
+            pa_memblock_unref(memchunk.memblock);
+
+            if (ret != 0) {
+                pa_log_error("Could not write data into the stream ... ret = %i", ret);
+                tunnel_fail(u);
+            } else
+                pa_tunnel_client_get_stats(u->client)->bytes += memchunk.length;
+        }
     }
-fail:
-    /* send a message to the ctl thread to ask it to either terminate us, or
-     * restart us, but either way this thread will exit, so then wait for the
-     * shutdown message */
-    pa_asyncmsgq_post(u->thread_mq->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_MAYBE_RESTART, u, 0, NULL, NULL);
-    pa_asyncmsgq_wait_for(u->thread_mq->inq, PA_MESSAGE_SHUTDOWN);
+}
+
+/* Called from IO thread */
+static void tunnel_detach_cb(void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+
+    u->connected = false;
 
-finish:
     if (u->stream) {
+        /* On a shared context the stream outlives us until the server
+         * acknowledges the disconnect, so make sure none of our callbacks
+         * fire on a freed userdata in the meantime. */
+        pa_stream_set_state_callback(u->stream, NULL, NULL);
+        pa_stream_set_buffer_attr_callback(u->stream, NULL, NULL);
+        pa_stream_set_underflow_callback(u->stream, NULL, NULL);
+        pa_stream_set_overflow_callback(u->stream, NULL, NULL);
         pa_stream_disconnect(u->stream);
         pa_stream_unref(u->stream);
         u->stream = NULL;
     }
 
-    if (u->context) {
-        pa_context_disconnect(u->context);
-        pa_context_unref(u->context);
-        u->context = NULL;
-    }
-
-    pa_log_debug("Thread shutting down");
+    u->context = NULL;
 }
 
+static const pa_tunnel_client_callbacks client_callbacks = {
+    .ready = tunnel_ready_cb,
+    .failed = tunnel_failed_cb,
+    .iterate = tunnel_iterate_cb,
+    .detach = tunnel_detach_cb,
+};
+
 static void stream_state_cb(pa_stream *stream, void *userdata) {
     struct userdata *u = userdata;
 
@@ -293,8 +306,7 @@ static void stream_state_cb(pa_stream *stream, void *userdata) {
     switch (pa_stream_get_state(stream)) {
         case PA_STREAM_FAILED:
             pa_log_error("Stream failed.");
-            u->connected = false;
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+            tunnel_fail(u);
             break;
         case PA_STREAM_TERMINATED:
             pa_log_debug("Stream terminated.");
@@ -337,12 +349,18 @@ static void stream_set_buffer_attr_cb(pa_stream *stream, int success, void *user
 
 /* called when the server experiences an underrun of our buffer */
 static void stream_underflow_callback(pa_stream *stream, void *userdata) {
+    struct userdata *u = userdata;
+
     pa_log_info("Server signalled buffer underrun.");
+    pa_tunnel_client_get_stats(u->client)->underflows++;
 }
 
 /* called when the server experiences an overrun of our buffer */
 static void stream_overflow_callback(pa_stream *stream, void *userdata) {
+    struct userdata *u = userdata;
+
     pa_log_info("Server signalled buffer overrun.");
+    pa_tunnel_client_get_stats(u->client)->overflows++;
 }
 
 /* Do a reinit of the module.  Note that u will be freed as a result of this
@@ -382,7 +400,7 @@ static void on_sink_created(struct userdata *u) {
      * kill this io thread */
     if (!u->sink) {
         pa_log_error("Could not create a sink.");
-        u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+        tunnel_fail(u);
         return;
     }
 
@@ -397,7 +415,7 @@ static void on_sink_created(struct userdata *u) {
 
     if (!u->stream) {
         pa_log_error("Could not create a stream.");
-        u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+        tunnel_fail(u);
         return;
     }
 
@@ -421,46 +439,12 @@ static void on_sink_created(struct userdata *u) {
                                    NULL,
                                    NULL) < 0) {
         pa_log_error("Could not connect stream.");
-        u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+        tunnel_fail(u);
+        return;
     }
     u->connected = true;
 }
 
-static void context_state_cb(pa_context *c, void *userdata) {
-    struct userdata *u = userdata;
-    pa_assert(u);
-
-    switch (pa_context_get_state(c)) {
-        case PA_CONTEXT_UNCONNECTED:
-        case PA_CONTEXT_CONNECTING:
-        case PA_CONTEXT_AUTHORIZING:
-        case PA_CONTEXT_SETTING_NAME:
-            break;
-        case PA_CONTEXT_READY:
-            /* now that we're connected, ask the control thread to create a sink for
-             * us, and wait for that to complete before proceeding, we'll
-             * receive TUNNEL_MESSAGE_SINK_CREATED in response when the sink is
-             * created (see sink_process_msg_cb()) */
-            pa_log_debug("Connection successful. Creating stream.");
-            pa_assert(!u->stream);
-            pa_assert(!u->sink);
-
-            pa_log_debug("Asking ctl thread to create sink.");
-            pa_asyncmsgq_post(u->thread_mq->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_CREATE_SINK_REQUEST, u, 0, NULL, NULL);
-            break;
-        case PA_CONTEXT_FAILED:
-            pa_log_debug("Context failed: %s.", pa_strerror(pa_context_errno(u->context)));
-            u->connected = false;
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
-            break;
-        case PA_CONTEXT_TERMINATED:
-            pa_log_debug("Context terminated.");
-            u->connected = false;
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
-            break;
-    }
-}
-
 static void sink_update_requested_latency_cb(pa_sink *s) {
     struct userdata *u;
     pa_operation *operation;
@@ -609,8 +593,8 @@ static void create_sink(struct userdata *u) {
     pa_sink_set_latency_range(u->sink, 0, MAX_LATENCY_USEC);
 
     /* set thread message queue */
-    pa_sink_set_asyncmsgq(u->sink, u->thread_mq->inq);
-    pa_sink_set_rtpoll(u->sink, u->rtpoll);
+    pa_sink_set_asyncmsgq(u->sink, pa_tunnel_connection_get_thread_mq(u->connection)->inq);
+    pa_sink_set_rtpoll(u->sink, pa_tunnel_connection_get_rtpoll(u->connection));
 
     pa_sink_put(u->sink);
 
@@ -626,12 +610,11 @@ finish:
 
 /* Runs in PA mainloop context */
 static int tunnel_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
-    struct userdata *u = (struct userdata *) data;
+    struct userdata *u = TUNNEL_MSG(o)->userdata;
 
-    pa_assert(u);
     pa_assert_ctl_context();
 
-    if (u->shutting_down)
+    if (!u || u->shutting_down)
         return 0;
 
     switch (code) {
@@ -653,6 +636,7 @@ static int do_init(pa_module *m) {
     const char *remote_server = NULL;
     char *default_sink_name = NULL;
     uint32_t reconnect_interval_ms = 0;
+    bool shared_connection = false;
 
     pa_assert(m);
     pa_assert(m->userdata);
@@ -682,33 +666,17 @@ static int do_init(pa_module *m) {
     }
 
     u->remote_server = pa_xstrdup(remote_server);
-    u->thread_mainloop = pa_mainloop_new();
-    if (u->thread_mainloop == NULL) {
-        pa_log("Failed to create mainloop");
-        goto fail;
-    }
-    u->thread_mainloop_api = pa_mainloop_get_api(u->thread_mainloop);
     u->cookie_file = pa_xstrdup(pa_modargs_get_value(ma, "cookie", NULL));
     u->remote_sink_name = pa_xstrdup(pa_modargs_get_value(ma, "sink", NULL));
 
-    u->thread_mq = pa_xnew0(pa_thread_mq, 1);
-
-    if (pa_thread_mq_init_thread_mainloop(u->thread_mq, m->core->mainloop, u->thread_mainloop_api) < 0) {
-        pa_log("pa_thread_mq_init_thread_mainloop() failed.");
+    if (pa_modargs_get_value_boolean(ma, "shared_connection", &shared_connection) < 0) {
+        pa_log("Failed to parse shared_connection argument.");
         goto fail;
     }
 
     u->msg = pa_msgobject_new(tunnel_msg);
     u->msg->parent.process_msg = tunnel_process_msg;
-
-    /* The rtpoll created here is only run for the sake of module-combine-sink. It must
-     * exist to avoid crashes when module-tunnel-sink-new is used together with
-     * module-loopback or module-combine-sink. Both modules base their asyncmsgq on the
-     * rtpoll provided by the sink. module-loopback and combine-sink only work because
-     * they call pa_asyncmsq_process_one() themselves. module-combine-sink does this
-     * however only for the audio_inq, so without running the rtpoll, messages placed
-     * in control_inq would never be executed. */
-    u->rtpoll = pa_rtpoll_new();
+    u->msg->userdata = u;
 
     default_sink_name = pa_sprintf_malloc("tunnel-sink-new.%s", remote_server);
     u->sink_name = pa_xstrdup(pa_modargs_get_value(ma, "sink_name", default_sink_name));
@@ -729,10 +697,10 @@ static int do_init(pa_module *m) {
     pa_modargs_get_value_u32(ma, "reconnect_interval_ms", &reconnect_interval_ms);
     u->reconnect_interval_us = reconnect_interval_ms * PA_USEC_PER_MSEC;
 
-    if (!(u->thread = pa_thread_new("tunnel-sink", thread_func, u))) {
-        pa_log("Failed to create thread.");
+    if (!(u->connection = pa_tunnel_connection_get(m->core, "sink", u->remote_server, u->cookie_file, shared_connection)))
         goto fail;
-    }
+
+    u->client = pa_tunnel_connection_add_client(u->connection, &client_callbacks, u);
 
     /* If the module is restarting and do_init() finishes successfully, the
      * restart data is no longer needed. If do_init() fails, don't touch the
@@ -775,18 +743,14 @@ static void do_done(pa_module *m) {
     if (u->sink)
         pa_sink_unlink(u->sink);
 
-    if (u->thread) {
-        pa_asyncmsgq_send(u->thread_mq->inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
-        pa_thread_free(u->thread);
-    }
+    if (u->client)
+        pa_tunnel_connection_remove_client(u->connection, u->client);
 
-    if (u->thread_mq) {
-        pa_thread_mq_done(u->thread_mq);
-        pa_xfree(u->thread_mq);
-    }
+    if (u->sink)
+        pa_sink_unref(u->sink);
 
-    if (u->thread_mainloop)
-        pa_mainloop_free(u->thread_mainloop);
+    if (u->connection)
+        pa_tunnel_connection_unref(u->connection);
 
     if (u->cookie_file)
         pa_xfree(u->cookie_file);
@@ -797,31 +761,77 @@ static void do_done(pa_module *m) {
     if (u->remote_server)
         pa_xfree(u->remote_server);
 
-    if (u->sink)
-        pa_sink_unref(u->sink);
-
-    if (u->rtpoll)
-        pa_rtpoll_free(u->rtpoll);
-
     if (u->sink_proplist)
         pa_proplist_free(u->sink_proplist);
 
     if (u->sink_name)
         pa_xfree(u->sink_name);
 
-    pa_xfree(u->msg);
+    /* A shared connection may still have messages for us queued */
+    if (u->msg) {
+        u->msg->userdata = NULL;
+        pa_msgobject_unref(PA_MSGOBJECT(u->msg));
+    }
 
     pa_xfree(u);
 
     rd->userdata = NULL;
 }
 
+/* Called from main context */
+static char *get_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    pa_tunnel_stats stats;
+
+    pa_tunnel_connection_get_stats(u->connection, &stats);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_string(encoder, "server", u->remote_server);
+    pa_json_encoder_add_member_bool(encoder, "shared", pa_tunnel_connection_is_shared(u->connection));
+    pa_json_encoder_add_member_int(encoder, "streams", stats.streams);
+    pa_json_encoder_add_member_int(encoder, "bytes", (int64_t) stats.bytes);
+    pa_json_encoder_add_member_int(encoder, "underflows", (int64_t) stats.underflows);
+    pa_json_encoder_add_member_int(encoder, "overflows", (int64_t) stats.overflows);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int tunnel_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct module_restart_data *rd = userdata;
+
+    pa_assert(rd);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, rd->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* The counters of the connection, summed up over all tunnels that use
+     * it, so for a shared connection they are the same for all of them */
+    if (pa_streq(message, "get-stats")) {
+        if (!rd->userdata || !rd->userdata->connection)
+            return -PA_ERR_BADSTATE;
+
+        *response = get_stats(rd->userdata);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module *m) {
+    struct module_restart_data *rd;
     int ret;
 
     pa_assert(m);
 
-    m->userdata = pa_xnew0(struct module_restart_data, 1);
+    m->userdata = rd = pa_xnew0(struct module_restart_data, 1);
+
+    rd->message_handler_path = pa_sprintf_malloc("/module/%u/tunnel", m->index);
+    pa_message_handler_register(m->core, rd->message_handler_path, "Tunnel message handler", tunnel_message_handler, rd);
 
     ret = do_init(m);
 
@@ -842,6 +852,11 @@ void pa__done(pa_module *m) {
         if (rd->restart_data)
             pa_restart_free(rd->restart_data);
 
+        if (rd->message_handler_path) {
+            pa_message_handler_unregister(m->core, rd->message_handler_path);
+            pa_xfree(rd->message_handler_path);
+        }
+
         pa_xfree(m->userdata);
     }
 }
@@ -22,25 +22,24 @@
 #endif
 
 #include "restart-module.h"
+#include "tunnel-connection.h"
 
 #include <pulse/context.h>
 #include <pulse/timeval.h>
 #include <pulse/xmalloc.h>
 #include <pulse/stream.h>
-#include <pulse/mainloop.h>
 #include <pulse/introspect.h>
 #include <pulse/error.h>
 
 #include <pulsecore/core.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/i18n.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 #include <pulsecore/source.h>
 #include <pulsecore/modargs.h>
 #include <pulsecore/log.h>
-#include <pulsecore/thread.h>
 #include <pulsecore/thread-mq.h>
-#include <pulsecore/poll.h>
-#include <pulsecore/rtpoll.h>
 #include <pulsecore/proplist-util.h>
 
 PA_MODULE_AUTHOR("Alexander Couzens");
@@ -57,24 +56,27 @@ PA_MODULE_USAGE(
         "channels=<number of channels> "
         "rate=<sample rate> "
         "channel_map=<channel map> "
-        "cookie=<cookie file path>"
+        "cookie=<cookie file path> "
+        "shared_connection=<share one connection with the other tunnel sources to the same server?>"
         );
 
-#define TUNNEL_THREAD_FAILED_MAINLOOP 1
-
 static int do_init(pa_module *m);
 static void do_done(pa_module *m);
 static void stream_state_cb(pa_stream *stream, void *userdata);
 static void stream_read_cb(pa_stream *s, size_t length, void *userdata);
-static void context_state_cb(pa_context *c, void *userdata);
 static void source_update_requested_latency_cb(pa_source *s);
 
 struct tunnel_msg {
     pa_msgobject parent;
+
+    /* Messages may still be queued when the module goes away, then this is
+     * NULL */
+    struct userdata *userdata;
 };
 
 typedef struct tunnel_msg tunnel_msg;
 PA_DEFINE_PRIVATE_CLASS(tunnel_msg, pa_msgobject);
+#define TUNNEL_MSG(o) (tunnel_msg_cast(o))
 
 enum {
     TUNNEL_MESSAGE_CREATE_SOURCE_REQUEST,
@@ -88,17 +90,15 @@ enum {
 struct userdata {
     pa_module *module;
     pa_source *source;
-    pa_thread *thread;
-    pa_thread_mq *thread_mq;
-    pa_mainloop *thread_mainloop;
-    pa_mainloop_api *thread_mainloop_api;
+    pa_tunnel_connection *connection;
+    pa_tunnel_client *client;
 
     pa_context *context;
     pa_stream *stream;
-    pa_rtpoll *rtpoll;
 
     bool update_stream_bufferattr_after_connect;
     bool connected;
+    bool failed;
     bool shutting_down;
     bool new_data;
 
@@ -119,6 +119,7 @@ struct userdata {
 struct module_restart_data {
     struct userdata *userdata;
     pa_restart_data *restart_data;
+    char *message_handler_path;
 };
 
 static const char* const valid_modargs[] = {
@@ -132,6 +133,7 @@ static const char* const valid_modargs[] = {
     "channel_map",
     "cookie",
     "reconnect_interval_ms",
+    "shared_connection",
     NULL,
 };
 
@@ -165,6 +167,20 @@ static pa_proplist* tunnel_new_proplist(struct userdata *u) {
     return proplist;
 }
 
+/* Called from IO thread. Asks the ctl thread to either terminate or restart
+ * the module, the connection and the other tunnels on it are left alone. */
+static void tunnel_fail(struct userdata *u) {
+    pa_assert(u);
+
+    u->connected = false;
+
+    if (u->failed)
+        return;
+
+    u->failed = true;
+    pa_asyncmsgq_post(pa_thread_mq_get()->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_MAYBE_RESTART, NULL, 0, NULL, NULL);
+}
+
 static void stream_read_cb(pa_stream *s, size_t length, void *userdata) {
     struct userdata *u = userdata;
     u->new_data = true;
@@ -189,7 +205,7 @@ static void read_new_samples(struct userdata *u) {
         size_t nbytes = 0;
         if (PA_UNLIKELY(pa_stream_peek(u->stream, &p, &nbytes) != 0)) {
             pa_log("pa_stream_peek() failed: %s", pa_strerror(pa_context_errno(u->context)));
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+            tunnel_fail(u);
             return;
         }
 
@@ -221,84 +237,75 @@ static void read_new_samples(struct userdata *u) {
 
         pa_stream_drop(u->stream);
         readable -= nbytes;
+
+        pa_tunnel_client_get_stats(u->client)->bytes += nbytes;
     }
 }
 
-static void thread_func(void *userdata) {
+/* Called from IO thread */
+static void tunnel_ready_cb(pa_context *context, void *userdata) {
     struct userdata *u = userdata;
-    pa_proplist *proplist;
 
     pa_assert(u);
 
-    pa_log_debug("Thread starting up");
-    pa_thread_mq_install(u->thread_mq);
+    pa_log_debug("Connection successful. Creating stream.");
+    pa_assert(!u->stream);
+    pa_assert(!u->source);
 
-    proplist = tunnel_new_proplist(u);
-    u->context = pa_context_new_with_proplist(u->thread_mainloop_api,
-                                              "PulseAudio",
-                                              proplist);
-    pa_proplist_free(proplist);
+    u->context = context;
 
-    if (!u->context) {
-        pa_log("Failed to create libpulse context");
-        goto fail;
-    }
+    pa_log_debug("Asking ctl thread to create source.");
+    pa_asyncmsgq_post(pa_thread_mq_get()->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_CREATE_SOURCE_REQUEST, NULL, 0, NULL, NULL);
+}
 
-    if (u->cookie_file && pa_context_load_cookie_from_file(u->context, u->cookie_file) != 0) {
-        pa_log_error("Can not load cookie file!");
-        goto fail;
-    }
+/* Called from IO thread */
+static void tunnel_failed_cb(void *userdata) {
+    struct userdata *u = userdata;
 
-    pa_context_set_state_callback(u->context, context_state_cb, u);
-    if (pa_context_connect(u->context,
-                           u->remote_server,
-                           PA_CONTEXT_NOAUTOSPAWN,
-                           NULL) < 0) {
-        pa_log("Failed to connect libpulse context: %s", pa_strerror(pa_context_errno(u->context)));
-        goto fail;
-    }
+    pa_assert(u);
 
-    for (;;) {
-        int ret;
+    tunnel_fail(u);
+}
 
-        if (pa_mainloop_iterate(u->thread_mainloop, 1, &ret) < 0) {
-            if (ret == 0)
-                goto finish;
-            else
-                goto fail;
-        }
+/* Called from IO thread */
+static void tunnel_iterate_cb(void *userdata) {
+    struct userdata *u = userdata;
 
-        if (u->new_data)
-            read_new_samples(u);
+    pa_assert(u);
 
-        /* Run the rtpoll to process messages that other modules may have placed in the queue. */
-        pa_rtpoll_set_timer_relative(u->rtpoll, 0);
-        if (pa_rtpoll_run(u->rtpoll) < 0)
-            goto fail;
-    }
-fail:
-    /* send a message to the ctl thread to ask it to either terminate us, or
-     * restart us, but either way this thread will exit, so then wait for the
-     * shutdown message */
-    pa_asyncmsgq_post(u->thread_mq->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_MAYBE_RESTART, u, 0, NULL, NULL);
-    pa_asyncmsgq_wait_for(u->thread_mq->inq, PA_MESSAGE_SHUTDOWN);
+    if (u->new_data)
+        read_new_samples(u);
+}
+
+/* Called from IO thread */
+static void tunnel_detach_cb(void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+
+    u->connected = false;
 
-finish:
     if (u->stream) {
+        /* On a shared context the stream outlives us until the server
+         * acknowledges the disconnect, so make sure none of our callbacks
+         * fire on a freed userdata in the meantime. */
+        pa_stream_set_state_callback(u->stream, NULL, NULL);
+        pa_stream_set_read_callback(u->stream, NULL, NULL);
         pa_stream_disconnect(u->stream);
         pa_stream_unref(u->stream);
         u->stream = NULL;
     }
 
-    if (u->context) {
-        pa_context_disconnect(u->context);
-        pa_context_unref(u->context);
-        u->context = NULL;
-    }
-
-    pa_log_debug("Thread shutting down");
+    u->context = NULL;
 }
 
+static const pa_tunnel_client_callbacks client_callbacks = {
+    .ready = tunnel_ready_cb,
+    .failed = tunnel_failed_cb,
+    .iterate = tunnel_iterate_cb,
+    .detach = tunnel_detach_cb,
+};
+
 static void stream_state_cb(pa_stream *stream, void *userdata) {
     struct userdata *u = userdata;
 
@@ -307,8 +314,7 @@ static void stream_state_cb(pa_stream *stream, void *userdata) {
     switch (pa_stream_get_state(stream)) {
         case PA_STREAM_FAILED:
             pa_log_error("Stream failed: %s", pa_strerror(pa_context_errno(u->context)));
-            u->connected = false;
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+            tunnel_fail(u);
             break;
         case PA_STREAM_TERMINATED:
             pa_log_debug("Stream terminated.");
@@ -366,7 +372,7 @@ static void on_source_created(struct userdata *u) {
      * should kill this io thread */
     if (!u->source) {
         pa_log_error("Could not create a source.");
-        u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+        tunnel_fail(u);
         return;
     }
 
@@ -381,7 +387,7 @@ static void on_source_created(struct userdata *u) {
 
     if (!u->stream) {
         pa_log_error("Could not create a stream: %s", pa_strerror(pa_context_errno(u->context)));
-        u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+        tunnel_fail(u);
         return;
     }
 
@@ -399,42 +405,12 @@ static void on_source_created(struct userdata *u) {
                                  &bufferattr,
                                  PA_STREAM_INTERPOLATE_TIMING|PA_STREAM_DONT_MOVE|PA_STREAM_AUTO_TIMING_UPDATE|PA_STREAM_START_CORKED|PA_STREAM_ADJUST_LATENCY) < 0) {
         pa_log_debug("Could not create stream: %s", pa_strerror(pa_context_errno(u->context)));
-        u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+        tunnel_fail(u);
+        return;
     }
     u->connected = true;
 }
 
-static void context_state_cb(pa_context *c, void *userdata) {
-    struct userdata *u = userdata;
-    pa_assert(u);
-
-    switch (pa_context_get_state(c)) {
-        case PA_CONTEXT_UNCONNECTED:
-        case PA_CONTEXT_CONNECTING:
-        case PA_CONTEXT_AUTHORIZING:
-        case PA_CONTEXT_SETTING_NAME:
-            break;
-        case PA_CONTEXT_READY:
-            pa_log_debug("Connection successful. Creating stream.");
-            pa_assert(!u->stream);
-            pa_assert(!u->source);
-
-            pa_log_debug("Asking ctl thread to create source.");
-            pa_asyncmsgq_post(u->thread_mq->outq, PA_MSGOBJECT(u->msg), TUNNEL_MESSAGE_CREATE_SOURCE_REQUEST, u, 0, NULL, NULL);
-            break;
-        case PA_CONTEXT_FAILED:
-            pa_log_debug("Context failed with err %s.", pa_strerror(pa_context_errno(u->context)));
-            u->connected = false;
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
-            break;
-        case PA_CONTEXT_TERMINATED:
-            pa_log_debug("Context terminated.");
-            u->connected = false;
-            u->thread_mainloop_api->quit(u->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
-            break;
-    }
-}
-
 static void source_update_requested_latency_cb(pa_source *s) {
     struct userdata *u;
     pa_operation *operation;
@@ -581,8 +557,8 @@ static void create_source(struct userdata *u) {
     u->source->set_state_in_io_thread = source_set_state_in_io_thread_cb;
     u->source->update_requested_latency = source_update_requested_latency_cb;
 
-    pa_source_set_asyncmsgq(u->source, u->thread_mq->inq);
-    pa_source_set_rtpoll(u->source, u->rtpoll);
+    pa_source_set_asyncmsgq(u->source, pa_tunnel_connection_get_thread_mq(u->connection)->inq);
+    pa_source_set_rtpoll(u->source, pa_tunnel_connection_get_rtpoll(u->connection));
 
     pa_source_put(u->source);
 
@@ -598,12 +574,11 @@ finish:
 
 /* Runs in PA mainloop context */
 static int tunnel_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
-    struct userdata *u = (struct userdata *) data;
+    struct userdata *u = TUNNEL_MSG(o)->userdata;
 
-    pa_assert(u);
     pa_assert_ctl_context();
 
-    if (u->shutting_down)
+    if (!u || u->shutting_down)
         return 0;
 
     switch (code) {
@@ -625,6 +600,7 @@ static int do_init(pa_module *m) {
     const char *remote_server = NULL;
     char *default_source_name = NULL;
     uint32_t reconnect_interval_ms = 0;
+    bool shared_connection = false;
 
     pa_assert(m);
     pa_assert(m->userdata);
@@ -654,32 +630,17 @@ static int do_init(pa_module *m) {
     }
 
     u->remote_server = pa_xstrdup(remote_server);
-    u->thread_mainloop = pa_mainloop_new();
-    if (u->thread_mainloop == NULL) {
-        pa_log("Failed to create mainloop");
-        goto fail;
-    }
-    u->thread_mainloop_api = pa_mainloop_get_api(u->thread_mainloop);
     u->cookie_file = pa_xstrdup(pa_modargs_get_value(ma, "cookie", NULL));
     u->remote_source_name = pa_xstrdup(pa_modargs_get_value(ma, "source", NULL));
 
-    u->thread_mq = pa_xnew0(pa_thread_mq, 1);
-
-    if (pa_thread_mq_init_thread_mainloop(u->thread_mq, m->core->mainloop, u->thread_mainloop_api) < 0) {
-        pa_log("pa_thread_mq_init_thread_mainloop() failed.");
+    if (pa_modargs_get_value_boolean(ma, "shared_connection", &shared_connection) < 0) {
+        pa_log("Failed to parse shared_connection argument.");
         goto fail;
     }
 
     u->msg = pa_msgobject_new(tunnel_msg);
     u->msg->parent.process_msg = tunnel_process_msg;
-
-    /* The rtpoll created here must curently only exist to avoid crashes when
-     * the module is used together with module-loopback. Because module-loopback
-     * runs pa_asyncmsgq_process_one() from the pop callback, the rtpoll need not
-     * be run. We will do so anyway for potential modules similar to
-     * module-combine-sink that use the rtpoll of the underlying source for
-     * message exchange. */
-    u->rtpoll = pa_rtpoll_new();
+    u->msg->userdata = u;
 
     default_source_name = pa_sprintf_malloc("tunnel-source-new.%s", remote_server);
     u->source_name = pa_xstrdup(pa_modargs_get_value(ma, "source_name", default_source_name));
@@ -700,10 +661,10 @@ static int do_init(pa_module *m) {
     pa_modargs_get_value_u32(ma, "reconnect_interval_ms", &reconnect_interval_ms);
     u->reconnect_interval_us = reconnect_interval_ms * PA_USEC_PER_MSEC;
 
-    if (!(u->thread = pa_thread_new("tunnel-source", thread_func, u))) {
-        pa_log("Failed to create thread.");
+    if (!(u->connection = pa_tunnel_connection_get(m->core, "source", u->remote_server, u->cookie_file, shared_connection)))
         goto fail;
-    }
+
+    u->client = pa_tunnel_connection_add_client(u->connection, &client_callbacks, u);
 
     /* If the module is restarting and do_init() finishes successfully, the
      * restart data is no longer needed. If do_init() fails, don't touch the
@@ -746,18 +707,14 @@ static void do_done(pa_module *m) {
     if (u->source)
         pa_source_unlink(u->source);
 
-    if (u->thread) {
-        pa_asyncmsgq_send(u->thread_mq->inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
-        pa_thread_free(u->thread);
-    }
+    if (u->client)
+        pa_tunnel_connection_remove_client(u->connection, u->client);
 
-    if (u->thread_mq) {
-        pa_thread_mq_done(u->thread_mq);
-        pa_xfree(u->thread_mq);
-    }
+    if (u->source)
+        pa_source_unref(u->source);
 
-    if (u->thread_mainloop)
-        pa_mainloop_free(u->thread_mainloop);
+    if (u->connection)
+        pa_tunnel_connection_unref(u->connection);
 
     if (u->cookie_file)
         pa_xfree(u->cookie_file);
@@ -768,31 +725,75 @@ static void do_done(pa_module *m) {
     if (u->remote_server)
         pa_xfree(u->remote_server);
 
-    if (u->source)
-        pa_source_unref(u->source);
-
-    if (u->rtpoll)
-        pa_rtpoll_free(u->rtpoll);
-
     if (u->source_proplist)
         pa_proplist_free(u->source_proplist);
 
     if (u->source_name)
         pa_xfree(u->source_name);
 
-    pa_xfree(u->msg);
+    /* A shared connection may still have messages for us queued */
+    if (u->msg) {
+        u->msg->userdata = NULL;
+        pa_msgobject_unref(PA_MSGOBJECT(u->msg));
+    }
 
     pa_xfree(u);
 
     rd->userdata = NULL;
 }
 
+/* Called from main context */
+static char *get_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    pa_tunnel_stats stats;
+
+    pa_tunnel_connection_get_stats(u->connection, &stats);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_string(encoder, "server", u->remote_server);
+    pa_json_encoder_add_member_bool(encoder, "shared", pa_tunnel_connection_is_shared(u->connection));
+    pa_json_encoder_add_member_int(encoder, "streams", stats.streams);
+    pa_json_encoder_add_member_int(encoder, "bytes", (int64_t) stats.bytes);
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int tunnel_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct module_restart_data *rd = userdata;
+
+    pa_assert(rd);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, rd->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* The counters of the connection, summed up over all tunnels that use
+     * it. Record streams have no underflows or overflows to count. */
+    if (pa_streq(message, "get-stats")) {
+        if (!rd->userdata || !rd->userdata->connection)
+            return -PA_ERR_BADSTATE;
+
+        *response = get_stats(rd->userdata);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module *m) {
+    struct module_restart_data *rd;
     int ret;
 
     pa_assert(m);
 
-    m->userdata = pa_xnew0(struct module_restart_data, 1);
+    m->userdata = rd = pa_xnew0(struct module_restart_data, 1);
+
+    rd->message_handler_path = pa_sprintf_malloc("/module/%u/tunnel", m->index);
+    pa_message_handler_register(m->core, rd->message_handler_path, "Tunnel message handler", tunnel_message_handler, rd);
 
     ret = do_init(m);
 
@@ -813,6 +814,11 @@ void pa__done(pa_module *m) {
         if (rd->restart_data)
             pa_restart_free(rd->restart_data);
 
+        if (rd->message_handler_path) {
+            pa_message_handler_unregister(m->core, rd->message_handler_path);
+            pa_xfree(rd->message_handler_path);
+        }
+
         pa_xfree(m->userdata);
     }
 }
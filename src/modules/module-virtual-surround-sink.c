@@ -27,8 +27,6 @@
 
 #include <math.h>
 
-#include <fftw3.h>
-
 #include <pulse/gccmacro.h>
 #include <pulse/xmalloc.h>
 
@@ -44,6 +42,7 @@
 #include <pulsecore/ltdl-helper.h>
 #include <pulsecore/sound-file.h>
 #include <pulsecore/resampler.h>
+#include <pulsecore/convolver.h>
 
 
 PA_MODULE_AUTHOR("Christopher Snowhill");
@@ -82,16 +81,19 @@ struct userdata {
 
     bool auto_desc;
 
-    size_t fftlen;
     size_t hrir_samples;
     size_t inputs;
 
-    fftwf_plan *p_fw, p_bw;
-    fftwf_complex *f_in, *f_out, **f_ir;
-    float *revspace, *outspace[2], **inspace;
+    /* Filters every input with the left and right ear impulse responses */
+    pa_convolver *convolver;
+    /* Samples the convolver state depends on, kept in memblockq_sink */
+    size_t history;
+    bool convolver_reset;
+
+    float *outspace[2], **inspace;
 };
 
-#define BLOCK_SIZE (512)
+#define BLOCK_SIZE (256)
 
 static const char* const valid_modargs[] = {
     "sink_name",
@@ -111,19 +113,6 @@ static const char* const valid_modargs[] = {
     NULL
 };
 
-/* Vector size of 4 floats */
-#define v_size 4
-static void * alloc(size_t x, size_t s) {
-    size_t f;
-    float *t;
-
-    f = PA_ROUND_UP(x*s, sizeof(float)*v_size);
-    pa_assert_se(t = fftwf_malloc(f));
-    pa_memzero(t, f);
-
-    return t;
-}
-
 static size_t sink_input_samples(size_t nbytes)
 {
     return nbytes / 8;
@@ -397,14 +386,50 @@ static size_t memblockq_missing(pa_memblockq *bq) {
     return l >= pa_memblockq_get_minreq(bq) ? l : 0;
 }
 
+/* Called from I/O thread context */
+static void process_block(struct userdata *u, const float *src) {
+    unsigned c;
+    size_t s;
+
+    for (c = 0; c < u->inputs; c++) {
+        for (s = 0; s < BLOCK_SIZE; s++) {
+            u->inspace[c][s] = src[s * u->inputs + c];
+        }
+    }
+
+    pa_convolver_process(u->convolver, (const float **) u->inspace, u->outspace);
+}
+
+/* Called from I/O thread context */
+static void reset_convolver(struct userdata *u) {
+    pa_memchunk tchunk;
+    size_t n;
+
+    pa_convolver_reset(u->convolver);
+
+    /* Feed the history that is still in the queue to the convolver to
+     * restore its state, the output is discarded */
+    pa_memblockq_rewind(u->memblockq_sink, sink_bytes(u, u->history));
+
+    for (n = 0; n < u->history; n += BLOCK_SIZE) {
+        pa_memblockq_peek_fixed_size(u->memblockq_sink, sink_bytes(u, BLOCK_SIZE), &tchunk);
+        pa_memblockq_drop(u->memblockq_sink, tchunk.length);
+
+        process_block(u, pa_memblock_acquire_chunk(&tchunk));
+
+        pa_memblock_release(tchunk.memblock);
+        pa_memblock_unref(tchunk.memblock);
+    }
+
+    u->convolver_reset = false;
+}
+
 /* Called from I/O thread context */
 static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes_input, pa_memchunk *chunk) {
     struct userdata *u;
-    float *src, *dst;
-    int c, ear;
-    size_t s, bytes_missing, fftlen;
+    float *dst;
+    size_t s, bytes_missing;
     pa_memchunk tchunk;
-    float fftlen_if, *revspace;
 
     pa_sink_input_assert_ref(i);
     pa_assert(chunk);
@@ -421,62 +446,24 @@ static int sink_input_pop_cb(pa_sink_input *i, size_t nbytes_input, pa_memchunk
         pa_memblock_unref(nchunk.memblock);
     }
 
-    pa_memblockq_rewind(u->memblockq_sink, sink_bytes(u, u->fftlen - BLOCK_SIZE));
-    pa_memblockq_peek_fixed_size(u->memblockq_sink, sink_bytes(u, u->fftlen), &tchunk);
+    if (u->convolver_reset)
+        reset_convolver(u);
 
+    pa_memblockq_peek_fixed_size(u->memblockq_sink, sink_bytes(u, BLOCK_SIZE), &tchunk);
     pa_memblockq_drop(u->memblockq_sink, tchunk.length);
 
-    /* Now tchunk contains enough data to perform the FFT
-     * This should be equal to u->fftlen */
-
-    chunk->index = 0;
-    chunk->length = sink_input_bytes(BLOCK_SIZE);
-    chunk->memblock = pa_memblock_new(i->sink->core->mempool, chunk->length);
-
-    src = pa_memblock_acquire_chunk(&tchunk);
-
-    for (c = 0; c < u->inputs; c++) {
-        for (s = 0, fftlen = u->fftlen; s < fftlen; s++) {
-            u->inspace[c][s] = src[s * u->inputs + c];
-        }
-    }
+    process_block(u, pa_memblock_acquire_chunk(&tchunk));
 
     pa_memblock_release(tchunk.memblock);
     pa_memblock_unref(tchunk.memblock);
 
-    fftlen_if = 1.0f / (float)u->fftlen;
-    revspace = u->revspace + u->fftlen - BLOCK_SIZE;
-
-    pa_memzero(u->outspace[0], BLOCK_SIZE * 4);
-    pa_memzero(u->outspace[1], BLOCK_SIZE * 4);
-
-    for (c = 0; c < u->inputs; c++) {
-        fftwf_complex *f_in = u->f_in;
-        fftwf_complex *f_out = u->f_out;
-
-        fftwf_execute(u->p_fw[c]);
-
-        for (ear = 0; ear < 2; ear++) {
-            fftwf_complex *f_ir = u->f_ir[c * 2 + ear];
-            float *outspace = u->outspace[ear];
-
-            for (s = 0, fftlen = u->fftlen / 2 + 1; s < fftlen; s++) {
-                float re = f_ir[s][0] * f_in[s][0] - f_ir[s][1] * f_in[s][1];
-                float im = f_ir[s][1] * f_in[s][0] + f_ir[s][0] * f_in[s][1];
-                f_out[s][0] = re;
-                f_out[s][1] = im;
-            }
-
-            fftwf_execute(u->p_bw);
-
-            for (s = 0, fftlen = BLOCK_SIZE; s < fftlen; ++s)
-                outspace[s] += revspace[s] * fftlen_if;
-        }
-    }
+    chunk->index = 0;
+    chunk->length = sink_input_bytes(BLOCK_SIZE);
+    chunk->memblock = pa_memblock_new(i->sink->core->mempool, chunk->length);
 
     dst = pa_memblock_acquire_chunk(chunk);
 
-    for (s = 0, fftlen = BLOCK_SIZE; s < fftlen; s++) {
+    for (s = 0; s < BLOCK_SIZE; s++) {
         float output;
         float *outspace = u->outspace[0];
 
@@ -524,6 +511,10 @@ static void sink_input_process_rewind_cb(pa_sink_input *i, size_t nbytes_input)
     pa_sink_process_rewind(u->sink, amount);
 
     pa_memblockq_rewind(u->memblockq_sink, nbytes_sink);
+
+    /* The rewound input has already been fed to the convolver */
+    if (nbytes_sink > 0)
+        u->convolver_reset = true;
 }
 
 /* Called from I/O thread context */
@@ -535,7 +526,7 @@ static void sink_input_update_max_rewind_cb(pa_sink_input *i, size_t nbytes_inpu
     pa_assert_se(u = i->userdata);
 
     nbytes_sink = sink_bytes(u, sink_input_samples(nbytes_input));
-    nbytes_memblockq = sink_bytes(u, sink_input_samples(nbytes_input) + u->fftlen);
+    nbytes_memblockq = sink_bytes(u, sink_input_samples(nbytes_input) + u->history);
 
     /* FIXME: Too small max_rewind:
      * https://bugs.freedesktop.org/show_bug.cgi?id=53709 */
@@ -723,15 +714,12 @@ int pa__init(pa_module*m) {
     size_t hrir_samples;
     size_t hrir_copied_length, hrir_total_length;
     int hrir_channels;
-    int fftlen;
 
     float *impulse_temp=NULL;
 
     unsigned *mapping_left=NULL;
     unsigned *mapping_right=NULL;
 
-    fftwf_plan p;
-
     pa_channel_map hrir_map, hrir_right_map;
 
     pa_sample_spec hrir_left_temp_ss;
@@ -1044,78 +1032,40 @@ int pa__init(pa_module*m) {
         }
     }
 
-    fftlen = (hrir_samples + BLOCK_SIZE + 1); /* Grow a bit for overlap */
-    {
-        /* Round up to a power of two */
-        int pow = 1;
-        while (fftlen > 2) { pow++; fftlen /= 2; }
-        fftlen = 2 << pow;
+    if (!(u->convolver = pa_convolver_new(BLOCK_SIZE, hrir_samples, hrir_channels, 2, PA_CONVOLVER_UNIFORM))) {
+        pa_log("Failed to create convolver.");
+        goto fail;
     }
 
-    u->fftlen = fftlen;
-
-    u->f_in = (fftwf_complex*) alloc(sizeof(fftwf_complex), (fftlen/2+1));
-    u->f_out = (fftwf_complex*) alloc(sizeof(fftwf_complex), (fftlen/2+1));
-
-    u->f_ir = (fftwf_complex**) alloc(sizeof(fftwf_complex*), (hrir_channels*2));
-    for (i = 0, j = hrir_channels*2; i < j; i++)
-        u->f_ir[i] = (fftwf_complex*) alloc(sizeof(fftwf_complex), (fftlen/2+1));
+    u->history = pa_convolver_get_history(u->convolver);
 
-    u->revspace = (float*) alloc(sizeof(float), fftlen);
+    u->outspace[0] = pa_xnew0(float, BLOCK_SIZE);
+    u->outspace[1] = pa_xnew0(float, BLOCK_SIZE);
 
-    u->outspace[0] = (float*) alloc(sizeof(float), BLOCK_SIZE);
-    u->outspace[1] = (float*) alloc(sizeof(float), BLOCK_SIZE);
-
-    u->inspace = (float**) alloc(sizeof(float*), hrir_channels);
-    for (i = 0; i < hrir_channels; i++)
-        u->inspace[i] = (float*) alloc(sizeof(float), fftlen);
-
-    u->p_fw = (fftwf_plan*) alloc(sizeof(fftwf_plan), hrir_channels);
+    u->inspace = pa_xnew0(float *, hrir_channels);
     for (i = 0; i < hrir_channels; i++)
-        pa_assert_se(u->p_fw[i] = fftwf_plan_dft_r2c_1d(fftlen, u->inspace[i], u->f_in, FFTW_ESTIMATE));
+        u->inspace[i] = pa_xnew0(float, BLOCK_SIZE);
 
-    pa_assert_se(u->p_bw = fftwf_plan_dft_c2r_1d(fftlen, u->f_out, u->revspace, FFTW_ESTIMATE));
+    impulse_temp = pa_xnew(float, hrir_samples);
 
-    impulse_temp = (float*) alloc(sizeof(float), fftlen);
-
-    if (hrir_right_data) {
-        for (i = 0; i < hrir_channels; i++) {
-            for (ear = 0; ear < 2; ear++) {
-                size_t index = i * 2 + ear;
-                size_t impulse_index = mapping_left[i];
-                float *impulse = (ear == 0) ? hrir_data : hrir_right_data;
-                for (j = 0; j < hrir_samples; j++) {
-                    impulse_temp[j] = impulse[j * hrir_channels + impulse_index];
-                }
+    for (i = 0; i < hrir_channels; i++) {
+        for (ear = 0; ear < 2; ear++) {
+            size_t impulse_index;
+            float *impulse;
 
-                p = fftwf_plan_dft_r2c_1d(fftlen, impulse_temp, u->f_ir[index], FFTW_ESTIMATE);
-                if (p) {
-                    fftwf_execute(p);
-                    fftwf_destroy_plan(p);
-                } else {
-                    pa_log("fftw plan creation failed for %s ear speaker index %d", (ear == 0) ? "left" : "right", i);
-                    goto fail;
-                }
+            if (hrir_right_data) {
+                impulse_index = mapping_left[i];
+                impulse = (ear == 0) ? hrir_data : hrir_right_data;
+            } else {
+                impulse_index = (ear == 0) ? mapping_left[i] : mapping_right[i];
+                impulse = hrir_data;
             }
-        }
-    } else {
-        for (i = 0; i < hrir_channels; i++) {
-            for (ear = 0; ear < 2; ear++) {
-                size_t index = i * 2 + ear;
-                size_t impulse_index = (ear == 0) ? mapping_left[i] : mapping_right[i];
-                for (j = 0; j < hrir_samples; j++) {
-                    impulse_temp[j] = hrir_data[j * hrir_channels + impulse_index];
-                }
 
-                p = fftwf_plan_dft_r2c_1d(fftlen, impulse_temp, u->f_ir[index], FFTW_ESTIMATE);
-                if (p) {
-                    fftwf_execute(p);
-                    fftwf_destroy_plan(p);
-                } else {
-                    pa_log("fftw plan creation failed for %s ear speaker index %d", (ear == 0) ? "left" : "right", i);
-                    goto fail;
-                }
+            for (j = 0; j < hrir_samples; j++) {
+                impulse_temp[j] = impulse[j * hrir_channels + impulse_index];
             }
+
+            pa_convolver_set_ir(u->convolver, i, ear, impulse_temp, hrir_samples);
         }
     }
 
@@ -1128,10 +1078,12 @@ int pa__init(pa_module*m) {
     pa_xfree(mapping_left);
     pa_xfree(mapping_right);
 
-    u->memblockq_sink = pa_memblockq_new("module-virtual-surround-sink memblockq (input)", 0, MEMBLOCKQ_MAXLENGTH, sink_bytes(u, BLOCK_SIZE), &ss_input, 0, 0, sink_bytes(u, u->fftlen), &silence);
+    u->memblockq_sink = pa_memblockq_new("module-virtual-surround-sink memblockq (input)", 0, MEMBLOCKQ_MAXLENGTH, sink_bytes(u, BLOCK_SIZE), &ss_input, 0, 0, sink_bytes(u, u->history), &silence);
     pa_memblock_unref(silence.memblock);
 
-    pa_memblockq_seek(u->memblockq_sink, sink_bytes(u, u->fftlen - BLOCK_SIZE), PA_SEEK_RELATIVE, false);
+    /* Start with silence as history, which matches the state of the new
+     * convolver */
+    pa_memblockq_seek(u->memblockq_sink, sink_bytes(u, u->history), PA_SEEK_RELATIVE, false);
     pa_memblockq_flush_read(u->memblockq_sink);
 
     pa_sink_put(u->sink);
@@ -1213,45 +1165,17 @@ void pa__done(pa_module*m) {
     if (u->memblockq_sink)
         pa_memblockq_free(u->memblockq_sink);
 
-    if (u->p_fw) {
-        for (i = 0, j = u->inputs; i < j; i++) {
-            if (u->p_fw[i])
-                fftwf_destroy_plan(u->p_fw[i]);
-        }
-        fftwf_free(u->p_fw);
-    }
-
-    if (u->p_bw)
-        fftwf_destroy_plan(u->p_bw);
-
-    if (u->f_ir) {
-        for (i = 0, j = u->inputs * 2; i < j; i++) {
-            if (u->f_ir[i])
-                fftwf_free(u->f_ir[i]);
-        }
-        fftwf_free(u->f_ir);
-    }
-
-    if (u->f_out)
-        fftwf_free(u->f_out);
-
-    if (u->f_in)
-        fftwf_free(u->f_in);
-
-    if (u->revspace)
-        fftwf_free(u->revspace);
+    if (u->convolver)
+        pa_convolver_free(u->convolver);
 
-    if (u->outspace[0])
-        fftwf_free(u->outspace[0]);
-    if (u->outspace[1])
-        fftwf_free(u->outspace[1]);
+    pa_xfree(u->outspace[0]);
+    pa_xfree(u->outspace[1]);
 
     if (u->inspace) {
         for (i = 0, j = u->inputs; i < j; i++) {
-            if (u->inspace[i])
-                fftwf_free(u->inspace[i]);
+            pa_xfree(u->inspace[i]);
         }
-        fftwf_free(u->inspace);
+        pa_xfree(u->inspace);
     }
 
     pa_xfree(u);
@@ -0,0 +1,411 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/endianmacros.h>
+#include <pulsecore/macro.h>
+
+#include "raop-alac.h"
+
+/* Frames of a TCP packet, the largest ones */
+#define MAX_FRAMES 4096
+
+#define ID_CPE 1
+#define ID_END 7
+
+/* The size of the frame header of an uncompressed frame, in bytes */
+#define HEADER_SIZE 7
+
+/* The side channel of a stereo pair needs one more bit */
+#define CHANNEL_BITS (PA_RAOP_ALAC_BIT_DEPTH + 1)
+
+/* The adaptive FIR predictor of ALAC, started with the coefficients of
+ * the fixed first order predictor x[n-1] or second order predictor
+ * 2 x[n-1] - x[n-2], and adapted by the decoder after each sample. The
+ * encoder has to do the same. The fixed predictor of order 31 would need
+ * 62 bytes of unused coefficients. */
+#define MAX_ORDER 2
+#define PREDICTOR_SHIFT 9
+#define PB_FACTOR 4
+
+#define RICE_THRESHOLD 8
+#define ESCAPE_CODE 0x1ff
+
+/* Collects bits in a 64 bit word and writes them out 32 at a time */
+struct bit_writer {
+    uint8_t *p, *end;
+    uint64_t bits;
+    unsigned n_bits;
+    bool overflow;
+};
+
+static inline void bit_writer_init(struct bit_writer *w, uint8_t *buffer, size_t size) {
+    w->p = buffer;
+    w->end = buffer + size;
+    w->bits = 0;
+    w->n_bits = 0;
+    w->overflow = false;
+}
+
+/* Appends the n lowest bits of value, n must be between 1 and 32 */
+static inline void put_bits(struct bit_writer *w, uint32_t value, unsigned n) {
+    w->bits = (w->bits << n) | (value & (uint32_t) ((UINT64_C(1) << n) - 1));
+    w->n_bits += n;
+
+    if (w->n_bits >= 32) {
+        uint32_t word;
+
+        w->n_bits -= 32;
+        word = PA_UINT32_TO_BE((uint32_t) (w->bits >> w->n_bits));
+
+        if (w->end - w->p >= 4) {
+            memcpy(w->p, &word, 4);
+            w->p += 4;
+        } else
+            w->overflow = true;
+    }
+}
+
+/* Writes out the remaining bits, padded to a whole byte. Returns the
+ * number of bytes written, or 0 if they did not fit. */
+static size_t bit_writer_finish(struct bit_writer *w, uint8_t *buffer) {
+    unsigned pad = (8 - (w->n_bits & 7)) & 7;
+    uint64_t bits = w->bits << pad;
+    unsigned n = w->n_bits + pad;
+
+    for (; n > 0; n -= 8) {
+        if (w->p >= w->end) {
+            w->overflow = true;
+            break;
+        }
+
+        *(w->p++) = (uint8_t) (bits >> (n - 8));
+    }
+
+    if (w->overflow)
+        return 0;
+
+    return (size_t) (w->p - buffer);
+}
+
+static inline uint32_t read_frame(const uint8_t *raw) {
+    uint32_t frame;
+
+    memcpy(&frame, raw, sizeof(frame));
+    return PA_UINT32_FROM_LE(frame);
+}
+
+static inline int32_t sign_extend(int32_t value, unsigned bits) {
+    return (int32_t) ((uint32_t) value << (32 - bits)) >> (32 - bits);
+}
+
+static void write_header(struct bit_writer *w, uint32_t n_frames, bool compressed) {
+    put_bits(w, ID_CPE, 3);      /* Stereo */
+    put_bits(w, 0, 4);           /* Element instance */
+    put_bits(w, 0, 12);          /* Unused */
+    put_bits(w, 1, 1);           /* Has size */
+    put_bits(w, 0, 2);           /* No uncompressed low bytes */
+    put_bits(w, !compressed, 1); /* Is not compressed */
+    put_bits(w, n_frames, 32);
+}
+
+/* The samples as they are, big endian */
+static size_t write_uncompressed(uint8_t *packet, size_t max, const uint8_t *raw, uint32_t n_frames) {
+    struct bit_writer w;
+    uint32_t i;
+
+    bit_writer_init(&w, packet, max);
+    write_header(&w, n_frames, false);
+
+    for (i = 0; i < n_frames; i++) {
+        uint32_t frame = read_frame(raw + 4 * i);
+
+        put_bits(&w, (frame << 16) | (frame >> 16), 32);
+    }
+
+    return bit_writer_finish(&w, packet);
+}
+
+/* Writes x as a Golomb code with divisor 2^k - 1, in one go: up to 8 ones
+ * and a zero for the quotient, then the remainder plus one in k bits, or
+ * k - 1 zero bits if it is zero. Larger values follow nine ones as they
+ * are, in escape_bits bits. */
+static inline void put_rice(struct bit_writer *w, uint32_t x, unsigned k, unsigned escape_bits) {
+    uint32_t divisor, q, r, bits;
+    unsigned n;
+
+    k = PA_MIN(k, (unsigned) PA_RAOP_ALAC_K_MODIFIER);
+    divisor = (1U << k) - 1;
+    q = x / divisor;
+    r = x - q * divisor;
+
+    if (q > RICE_THRESHOLD) {
+        put_bits(w, ESCAPE_CODE, 9);
+        put_bits(w, x, escape_bits);
+        return;
+    }
+
+    bits = ((1U << q) - 1) << 1;
+    n = q + 1;
+
+    if (k != 1) {
+        if (r > 0) {
+            bits = (bits << k) | (r + 1);
+            n += k;
+        } else {
+            bits <<= k - 1;
+            n += k - 1;
+        }
+    }
+
+    put_bits(w, bits, n);
+}
+
+/* Adaptive Rice coding of the residuals of one channel. The Rice parameter
+ * follows a running average of the values, runs of zeros after a run of
+ * small values are coded as their length. */
+static void put_residuals(struct bit_writer *w, const int32_t *residuals, unsigned n) {
+    uint32_t history = PA_RAOP_ALAC_INITIAL_HISTORY;
+    uint32_t sign_modifier = 0;
+    unsigned i = 0;
+
+    while (i < n) {
+        int32_t s = residuals[i++];
+        uint32_t x = s >= 0 ? 2 * (uint32_t) s : 2 * (uint32_t) -s - 1;
+
+        put_rice(w, x - sign_modifier, pa_ulog2((history >> 9) + 3), CHANNEL_BITS);
+        sign_modifier = 0;
+
+        if (x > 0xffff)
+            history = 0xffff;
+        else
+            history += x * PA_RAOP_ALAC_HISTORY_MULT - ((history * PA_RAOP_ALAC_HISTORY_MULT) >> 9);
+
+        if (history < 128 && i < n) {
+            uint32_t zeros = 0;
+
+            while (i < n && residuals[i] == 0) {
+                zeros++;
+                i++;
+            }
+
+            put_rice(w, zeros, 7 - pa_ulog2(history) + ((history + 16) >> 6), 16);
+
+            /* The next value is not zero, so it is sent less one */
+            sign_modifier = zeros <= 0xffff;
+            history = 0;
+        }
+    }
+}
+
+static inline int32_t sign_of(int32_t v) {
+    return (v > 0) - (v < 0);
+}
+
+/* Picks the order whose fixed predictor leaves smaller residuals */
+static unsigned choose_order(const int32_t *x, unsigned n) {
+    uint64_t cost1 = 0, cost2 = 0;
+    unsigned i;
+
+    for (i = 2; i < n; i++) {
+        cost1 += (uint32_t) abs(x[i] - x[i - 1]);
+        cost2 += (uint32_t) abs(x[i] - 2 * x[i - 1] + x[i - 2]);
+    }
+
+    return cost2 < cost1 ? 2 : 1;
+}
+
+/* Replaces the samples with the residuals, with the arithmetic of the
+ * decoder: after a positive residual the coefficients are moved towards a
+ * smaller prediction, after a negative one towards a larger one, starting
+ * with the one of the oldest sample, until the residual would have changed
+ * sign. The first samples are predicted from the one before. */
+static void predict(int32_t *x, unsigned n, unsigned order, const int16_t *initial) {
+    int32_t original[MAX_ORDER + 1];
+    int16_t coefs[MAX_ORDER];
+    unsigned i, lim = order + 1;
+    int k;
+
+    pa_assert(order >= 1 && order <= MAX_ORDER);
+
+    if (n == 0)
+        return;
+
+    memcpy(coefs, initial, order * sizeof(int16_t));
+
+    /* original[k] is x[i - 1 - k] before it was replaced */
+    original[0] = x[0];
+
+    for (i = 1; i < n; i++) {
+        int32_t sample = x[i];
+
+        if (i < lim)
+            x[i] = sign_extend(sample - original[0], CHANNEL_BITS);
+        else {
+            int32_t top = original[order], residual, del;
+            uint32_t sum = 0;
+
+            for (k = 0; k < (int) order; k++)
+                sum += (uint32_t) coefs[k] * (uint32_t) (original[k] - top);
+
+            residual = sign_extend(sample - (top + ((int32_t) (sum + (1U << (PREDICTOR_SHIFT - 1))) >> PREDICTOR_SHIFT)), CHANNEL_BITS);
+            x[i] = del = residual;
+
+            if (residual > 0) {
+                for (k = order - 1; k >= 0; k--) {
+                    int32_t dd = top - original[k], sgn = sign_of(dd);
+
+                    coefs[k] -= sgn;
+                    del -= (int32_t) (order - k) * ((sgn * dd) >> PREDICTOR_SHIFT);
+                    if (del <= 0)
+                        break;
+                }
+            } else if (residual < 0) {
+                for (k = order - 1; k >= 0; k--) {
+                    int32_t dd = top - original[k], sgn = sign_of(dd);
+
+                    coefs[k] += sgn;
+                    del -= (int32_t) (order - k) * ((-sgn * dd) >> PREDICTOR_SHIFT);
+                    if (del >= 0)
+                        break;
+                }
+            }
+        }
+
+        memmove(original + 1, original, order * sizeof(int32_t));
+        original[0] = sample;
+    }
+}
+
+static size_t write_compressed(uint8_t *packet, size_t max, const uint8_t *raw, uint32_t n_frames) {
+    static const int16_t initial[MAX_ORDER + 1][MAX_ORDER] = {
+        { 0, 0 },
+        { 1 << PREDICTOR_SHIFT, 0 },
+        { 2 << PREDICTOR_SHIFT, -(1 << PREDICTOR_SHIFT) },
+    };
+    int32_t residuals[2][MAX_FRAMES];
+    int32_t l, r, pl = 0, pr = 0, pm = 0, ps = 0;
+    uint64_t cost_lr = 0, cost_ms = 0;
+    unsigned order[2];
+    struct bit_writer w;
+    bool mix;
+    uint32_t i;
+    unsigned c, k;
+
+    pa_assert(n_frames <= MAX_FRAMES);
+
+    /* Mid and side are cheaper for most music, but not for all of it.
+     * Compare the first order residuals of both. */
+    for (i = 0; i < n_frames; i++) {
+        uint32_t frame = read_frame(raw + 4 * i);
+        int32_t m, s;
+
+        l = (int16_t) (frame & 0xffff);
+        r = (int16_t) (frame >> 16);
+        m = (l + r) >> 1;
+        s = l - r;
+
+        cost_lr += (uint32_t) abs(l - pl) + (uint32_t) abs(r - pr);
+        cost_ms += (uint32_t) abs(m - pm) + (uint32_t) abs(s - ps);
+
+        pl = l;
+        pr = r;
+        pm = m;
+        ps = s;
+    }
+
+    mix = cost_ms < cost_lr;
+
+    for (i = 0; i < n_frames; i++) {
+        uint32_t frame = read_frame(raw + 4 * i);
+
+        l = (int16_t) (frame & 0xffff);
+        r = (int16_t) (frame >> 16);
+
+        if (mix) {
+            residuals[0][i] = (l + r) >> 1;
+            residuals[1][i] = l - r;
+        } else {
+            residuals[0][i] = l;
+            residuals[1][i] = r;
+        }
+    }
+
+    for (c = 0; c < 2; c++) {
+        order[c] = choose_order(residuals[c], n_frames);
+
+        predict(residuals[c], n_frames, order[c], initial[order[c]]);
+    }
+
+    bit_writer_init(&w, packet, max);
+    write_header(&w, n_frames, true);
+
+    /* Mixing shift and weight: u = (l + r) / 2, v = l - r */
+    put_bits(&w, mix ? 1 : 0, 8);
+    put_bits(&w, mix ? 1 : 0, 8);
+
+    for (c = 0; c < 2; c++) {
+        put_bits(&w, 0, 4);
+        put_bits(&w, PREDICTOR_SHIFT, 4);
+        put_bits(&w, PB_FACTOR, 3);
+        put_bits(&w, order[c], 5);
+
+        for (k = 0; k < order[c]; k++)
+            put_bits(&w, (uint16_t) initial[order[c]][k], 16);
+    }
+
+    for (c = 0; c < 2; c++) {
+        put_residuals(&w, residuals[c], n_frames);
+
+        if (w.overflow)
+            return 0;
+    }
+
+    put_bits(&w, ID_END, 3);
+
+    return bit_writer_finish(&w, packet);
+}
+
+size_t pa_raop_alac_encode(uint8_t *packet, size_t max, const uint8_t *raw, size_t *length, bool compress) {
+    uint32_t n_frames;
+    size_t uncompressed, size = 0;
+
+    pa_assert(packet);
+    pa_assert(max >= HEADER_SIZE);
+    pa_assert(raw);
+    pa_assert(length);
+
+    n_frames = (uint32_t) PA_MIN(*length / 4, (max - HEADER_SIZE) / 4);
+    uncompressed = HEADER_SIZE + 4 * (size_t) n_frames;
+
+    if (compress && n_frames > 0 && n_frames <= MAX_FRAMES)
+        size = write_compressed(packet, uncompressed, raw, n_frames);
+
+    if (size == 0)
+        size = write_uncompressed(packet, max, raw, n_frames);
+
+    *length = 4 * (size_t) n_frames;
+
+    return size;
+}
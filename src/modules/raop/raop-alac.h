@@ -0,0 +1,40 @@
+#ifndef fooraopalacfoo
+#define fooraopalacfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The ALAC parameters announced in the SDP fmtp attribute */
+#define PA_RAOP_ALAC_BIT_DEPTH 16
+#define PA_RAOP_ALAC_HISTORY_MULT 40
+#define PA_RAOP_ALAC_INITIAL_HISTORY 10
+#define PA_RAOP_ALAC_K_MODIFIER 14
+
+/* Encodes as many of the length bytes of 16 bit little endian stereo
+ * samples in raw as fit into max bytes as one ALAC frame, and sets length
+ * to the number of bytes encoded. Returns the size of the frame.
+ *
+ * If compress is true, the frame is compressed with a first or an
+ * adaptive second order prediction and adaptive Rice coding, unless that
+ * turns out larger than the samples as they are. */
+size_t pa_raop_alac_encode(uint8_t *packet, size_t max, const uint8_t *raw, size_t *length, bool compress);
+
+#endif
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <math.h>
 
 #ifdef HAVE_NETINET_IN_H
@@ -61,6 +62,7 @@
 #include <modules/rtp/rtsp_client.h>
 
 #include "raop-client.h"
+#include "raop-alac.h"
 #include "raop-packet-buffer.h"
 #include "raop-crypto.h"
 #include "raop-util.h"
@@ -90,6 +92,7 @@
 #define VOLUME_MIN -144.0
 
 #define UDP_DEFAULT_PKT_BUF_SIZE 1000
+#define UDP_RESEND_BATCH 64
 #define APPLE_CHALLENGE_LENGTH 16
 
 struct pa_raop_client {
@@ -104,6 +107,7 @@ struct pa_raop_client {
     pa_raop_protocol_t protocol;
     pa_raop_encryption_t encryption;
     pa_raop_codec_t codec;
+    bool alac_compression;
 
     pa_raop_secret *secret;
 
@@ -115,6 +119,13 @@ struct pa_raop_client {
 
     pa_raop_packet_buffer *pbuf;
 
+    /* Retransmission requests: packets resent from the buffer, packets no
+     * longer buffered, and packets dropped because the socket was full */
+    uint64_t resent;
+    uint64_t resend_missing;
+    uint64_t resend_dropped;
+    uint64_t resend_calls;
+
     uint16_t seq;
     uint32_t rtptime;
     bool is_recording;
@@ -222,96 +233,6 @@ static inline uint64_t timeval_to_ntp(struct timeval *tv) {
     return ntp;
 }
 
-/**
- * Function to write bits into a buffer.
- * @param buffer Handle to the buffer. It will be incremented if new data requires it.
- * @param bit_pos A pointer to a position buffer to keep track the current write location (0 for MSB, 7 for LSB)
- * @param size A pointer to the byte size currently written. This allows the calling function to do simple buffer overflow checks
- * @param data The data to write
- * @param data_bit_len The number of bits from data to write
- */
-static inline void bit_writer(uint8_t **buffer, uint8_t *bit_pos, size_t *size, uint8_t data, uint8_t data_bit_len) {
-    int bits_left, bit_overflow;
-    uint8_t bit_data;
-
-    if (!data_bit_len)
-        return;
-
-    /* If bit pos is zero, we will definitely use at least one bit from the current byte so size increments. */
-    if (!*bit_pos)
-        *size += 1;
-
-    /* Calc the number of bits left in the current byte of buffer. */
-    bits_left = 7 - *bit_pos  + 1;
-    /* Calc the overflow of bits in relation to how much space we have left... */
-    bit_overflow = bits_left - data_bit_len;
-    if (bit_overflow >= 0) {
-        /* We can fit the new data in our current byte.
-         * As we write from MSB->LSB we need to left shift by the overflow amount. */
-        bit_data = data << bit_overflow;
-        if (*bit_pos)
-            **buffer |= bit_data;
-        else
-            **buffer = bit_data;
-        /* If our data fits exactly into the current byte, we need to increment our pointer. */
-        if (0 == bit_overflow) {
-            /* Do not increment size as it will be incremented on next call as bit_pos is zero. */
-            *buffer += 1;
-            *bit_pos = 0;
-        } else {
-            *bit_pos += data_bit_len;
-        }
-    } else {
-        /* bit_overflow is negative, there for we will need a new byte from our buffer
-         * Firstly fill up what's left in the current byte. */
-        bit_data = data >> -bit_overflow;
-        **buffer |= bit_data;
-        /* Increment our buffer pointer and size counter. */
-        *buffer += 1;
-        *size += 1;
-        **buffer = data << (8 + bit_overflow);
-        *bit_pos = -bit_overflow;
-    }
-}
-
-static size_t write_ALAC_data(uint8_t *packet, const size_t max, uint8_t *raw, size_t *length, bool compress) {
-    uint32_t nbs = (*length / 2) / 2;
-    uint8_t *ibp, *maxibp;
-    uint8_t *bp, bpos;
-    size_t size = 0;
-
-    bp = packet;
-    pa_memzero(packet, max);
-    size = bpos = 0;
-
-    bit_writer(&bp, &bpos, &size, 1, 3); /* channel=1, stereo */
-    bit_writer(&bp, &bpos, &size, 0, 4); /* Unknown */
-    bit_writer(&bp, &bpos, &size, 0, 8); /* Unknown */
-    bit_writer(&bp, &bpos, &size, 0, 4); /* Unknown */
-    bit_writer(&bp, &bpos, &size, 1, 1); /* Hassize */
-    bit_writer(&bp, &bpos, &size, 0, 2); /* Unused */
-    bit_writer(&bp, &bpos, &size, 1, 1); /* Is-not-compressed */
-    /* Size of data, integer, big endian. */
-    bit_writer(&bp, &bpos, &size, (nbs >> 24) & 0xff, 8);
-    bit_writer(&bp, &bpos, &size, (nbs >> 16) & 0xff, 8);
-    bit_writer(&bp, &bpos, &size, (nbs >> 8)  & 0xff, 8);
-    bit_writer(&bp, &bpos, &size, (nbs)       & 0xff, 8);
-
-    ibp = raw;
-    maxibp = raw + (4 * nbs) - 4;
-    while (ibp <= maxibp) {
-        /* Byte swap stereo data. */
-        bit_writer(&bp, &bpos, &size, *(ibp + 1), 8);
-        bit_writer(&bp, &bpos, &size, *(ibp + 0), 8);
-        bit_writer(&bp, &bpos, &size, *(ibp + 3), 8);
-        bit_writer(&bp, &bpos, &size, *(ibp + 2), 8);
-        ibp += 4;
-    }
-
-    *length = (ibp - raw);
-    return size;
-}
-
 static size_t build_tcp_audio_packet(pa_raop_client *c, pa_memchunk *block, pa_memchunk *packet) {
     const size_t head = sizeof(tcp_audio_header);
     uint32_t *buffer = NULL;
@@ -337,7 +258,7 @@ static size_t build_tcp_audio_packet(pa_raop_client *c, pa_memchunk *block, pa_m
     length = block->length;
     size = sizeof(tcp_audio_header);
     if (c->codec == PA_RAOP_CODEC_ALAC)
-        size += write_ALAC_data(((uint8_t *) buffer + head), packet->length - head, raw, &length, false);
+        size += pa_raop_alac_encode(((uint8_t *) buffer + head), packet->length - head, raw, &length, c->alac_compression);
     else {
         pa_log_debug("Only ALAC encoding is supported, sending zeros...");
         pa_memzero(((uint8_t *) buffer + head), packet->length - head);
@@ -424,7 +345,7 @@ static size_t build_udp_audio_packet(pa_raop_client *c, pa_memchunk *block, pa_m
     length = block->length;
     size = sizeof(udp_audio_header);
     if (c->codec == PA_RAOP_CODEC_ALAC)
-        size += write_ALAC_data(((uint8_t *) buffer + head), packet->length - head, raw, &length, false);
+        size += pa_raop_alac_encode(((uint8_t *) buffer + head), packet->length - head, raw, &length, c->alac_compression);
     else {
         pa_log_debug("Only ALAC encoding is supported, sending zeros...");
         pa_memzero(((uint8_t *) buffer + head), packet->length - head);
@@ -455,11 +376,12 @@ static ssize_t send_udp_audio_packet(pa_raop_client *c, pa_memchunk *block, size
     pa_memchunk *packet = NULL;
     uint8_t *buffer = NULL;
     ssize_t written = -1;
+    uint16_t seq = c->seq;
 
     /* UDP packet has to be sent at once ! */
     pa_assert(block->index == offset);
 
-    if (!(packet = pa_raop_packet_buffer_prepare(c->pbuf, c->seq, max)))
+    if (!(packet = pa_raop_packet_buffer_prepare(c->pbuf, seq, max)))
         return -1;
 
     packet->index = sizeof(udp_audio_retrans_header);
@@ -471,6 +393,12 @@ static ssize_t send_udp_audio_packet(pa_raop_client *c, pa_memchunk *block, size
 
     pa_assert(buffer);
 
+    /* The packet is kept as it is sent in reply to a retransmission
+     * request, so that it can be resent without any further work */
+    memcpy(buffer, udp_audio_retrans_header, sizeof(udp_audio_retrans_header));
+    buffer[2] = (uint8_t) (seq >> 8);
+    buffer[3] = (uint8_t) (seq & 0xff);
+
     buffer += packet->index;
     if (buffer && packet->length > 0)
         written = pa_write(c->udp_sfd, buffer, packet->length, NULL);
@@ -487,58 +415,101 @@ static ssize_t send_udp_audio_packet(pa_raop_client *c, pa_memchunk *block, size
     return written;
 }
 
-static size_t rebuild_udp_audio_packet(pa_raop_client *c, uint16_t seq, pa_memchunk *packet) {
-    size_t size = sizeof(udp_audio_retrans_header);
-    uint32_t *buffer = NULL;
+/* Sends the packets without blocking, returns how many were sent */
+static unsigned send_udp_packets(pa_raop_client *c, int fd, struct iovec *iov, unsigned n) {
+    unsigned sent = 0;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[UDP_RESEND_BATCH];
+    unsigned i;
 
-    buffer = pa_memblock_acquire(packet->memblock);
+    pa_assert(n <= UDP_RESEND_BATCH);
 
-    memcpy(buffer, udp_audio_retrans_header, sizeof(udp_audio_retrans_header));
-    buffer[0] |= htonl((uint32_t) seq);
-    size += packet->length;
+    for (i = 0; i < n; i++) {
+        pa_zero(msgs[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    pa_memblock_release(packet->memblock);
-    packet->length += sizeof(udp_audio_retrans_header);
-    packet->index -= sizeof(udp_audio_retrans_header);
+    while (sent < n) {
+        int r;
 
-    return size;
+        if ((r = sendmmsg(fd, msgs + sent, n - sent, MSG_DONTWAIT)) <= 0)
+            break;
+
+        c->resend_calls++;
+        sent += (unsigned) r;
+    }
+#else
+    for (; sent < n; sent++) {
+        if (send(fd, iov[sent].iov_base, iov[sent].iov_len, MSG_DONTWAIT) < 0)
+            break;
+
+        c->resend_calls++;
+    }
+#endif
+
+    if (sent < n && errno != EAGAIN && errno != EWOULDBLOCK)
+        pa_log_debug("Failed to resend UDP audio packets: %s", pa_cstrerror(errno));
+
+    return sent;
 }
 
+/* Resends the requested packets straight from the packet buffer, where they
+ * are kept ready to be sent, as many at once as possible. Whatever does not
+ * fit into the socket buffer right away is dropped rather than waited for,
+ * it would be too late anyway. */
 static ssize_t resend_udp_audio_packets(pa_raop_client *c, uint16_t seq, uint16_t nbp) {
+    pa_memchunk *packets[UDP_RESEND_BATCH];
+    struct iovec iov[UDP_RESEND_BATCH];
+    unsigned i = 0, j, n, sent;
+    unsigned missing = 0, dropped = 0;
     ssize_t total = 0;
-    int i = 0;
-
-    for (i = 0; i < nbp; i++) {
-        pa_memchunk *packet = NULL;
-        uint8_t *buffer = NULL;
-        ssize_t written = -1;
 
-        if (!(packet = pa_raop_packet_buffer_retrieve(c->pbuf, seq + i)))
-            continue;
+    while (i < nbp) {
+        for (n = 0; n < UDP_RESEND_BATCH && i < nbp; i++) {
+            pa_memchunk *packet;
 
-        if (packet->index > 0) {
-            if (!rebuild_udp_audio_packet(c, seq + i, packet))
+            if (!(packet = pa_raop_packet_buffer_retrieve(c->pbuf, (uint16_t) (seq + i))) || packet->length <= 0) {
+                missing++;
                 continue;
-        }
+            }
+
+            pa_assert(packet->index == sizeof(udp_audio_retrans_header));
 
-        pa_assert(packet->index == 0);
+            packets[n] = packet;
+            iov[n].iov_base = pa_memblock_acquire(packet->memblock);
+            iov[n].iov_len = packet->index + packet->length;
+            n++;
+        }
 
-        buffer = pa_memblock_acquire(packet->memblock);
+        sent = send_udp_packets(c, c->udp_cfd, iov, n);
 
-        pa_assert(buffer);
+        for (j = 0; j < n; j++) {
+            if (j < sent)
+                total += iov[j].iov_len;
 
-        if (buffer && packet->length > 0)
-            written = pa_write(c->udp_cfd, buffer, packet->length, NULL);
-        if (written < 0 && errno == EAGAIN) {
-            pa_log_debug("Discarding UDP (audio-retransmitted, seq=%d) packet due to EAGAIN", seq + i);
-            pa_memblock_release(packet->memblock);
-            continue;
+            pa_memblock_release(packets[j]->memblock);
         }
 
-        pa_memblock_release(packet->memblock);
-        total +=  written;
+        if (sent < n) {
+            /* Don't try again while the socket is full */
+            dropped += n - sent;
+            for (; i < nbp; i++)
+                if (pa_raop_packet_buffer_retrieve(c->pbuf, (uint16_t) (seq + i)))
+                    dropped++;
+                else
+                    missing++;
+            break;
+        }
     }
 
+    c->resent += nbp - missing - dropped;
+    c->resend_missing += missing;
+    c->resend_dropped += dropped;
+
+    if (missing > 0 || dropped > 0)
+        pa_log_debug("Could not resend %u of %u packets starting at %u: %u no longer buffered, %u dropped", missing + dropped, nbp, seq, missing, dropped);
+
     return total;
 }
 
@@ -1497,6 +1468,10 @@ pa_raop_client* pa_raop_client_new(pa_core *core, const char *host, pa_raop_prot
 void pa_raop_client_free(pa_raop_client *c) {
     pa_assert(c);
 
+    if (c->resent > 0 || c->resend_missing > 0 || c->resend_dropped > 0)
+        pa_log_info("Resent %" PRIu64 " UDP audio packets in %" PRIu64 " calls, %" PRIu64 " were no longer buffered, %" PRIu64 " dropped",
+                    c->resent, c->resend_calls, c->resend_missing, c->resend_dropped);
+
     pa_raop_packet_buffer_free(c->pbuf);
 
     pa_xfree(c->sid);
@@ -1850,6 +1825,12 @@ ssize_t pa_raop_client_send_audio_packet(pa_raop_client *c, pa_memchunk *block,
     return written;
 }
 
+void pa_raop_client_set_alac_compression(pa_raop_client *c, bool compress) {
+    pa_assert(c);
+
+    c->alac_compression = compress;
+}
+
 void pa_raop_client_set_state_callback(pa_raop_client *c, pa_raop_client_state_cb_t callback, void *userdata) {
     pa_assert(c);
 
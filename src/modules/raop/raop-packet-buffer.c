@@ -31,10 +31,14 @@
 #include <pulse/xmalloc.h>
 
 #include <pulsecore/core-error.h>
+#include <pulsecore/core-util.h>
 #include <pulsecore/macro.h>
 
 #include "raop-packet-buffer.h"
 
+/* Packets are stored in the slot given by the low bits of their sequence
+ * number, so the number of slots is a power of two that divides the range
+ * of sequence numbers. */
 struct pa_raop_packet_buffer {
     pa_memchunk *packets;
     pa_mempool *mempool;
@@ -42,8 +46,8 @@ struct pa_raop_packet_buffer {
     size_t size;
     size_t count;
 
+    /* The sequence number of the newest packet */
     uint16_t seq;
-    size_t pos;
 };
 
 pa_raop_packet_buffer *pa_raop_packet_buffer_new(pa_mempool *mempool, const size_t size) {
@@ -53,10 +57,10 @@ pa_raop_packet_buffer *pa_raop_packet_buffer_new(pa_mempool *mempool, const size
     pa_assert(size > 0);
 
     pb->count = 0;
-    pb->size = size;
+    pb->size = PA_MIN(pa_make_power_of_two(size), (size_t) UINT16_MAX + 1);
     pb->mempool = mempool;
-    pb->packets = pa_xnew0(pa_memchunk, size);
-    pb->seq = pb->pos = 0;
+    pb->packets = pa_xnew0(pa_memchunk, pb->size);
+    pb->seq = 0;
 
     return pb;
 }
@@ -83,9 +87,8 @@ void pa_raop_packet_buffer_reset(pa_raop_packet_buffer *pb, uint16_t seq) {
     pa_assert(pb);
     pa_assert(pb->packets);
 
-    pb->pos = 0;
     pb->count = 0;
-    pb->seq = (!seq) ? UINT16_MAX : seq - 1;
+    pb->seq = seq - 1;
     for (i = 0; i < pb->size; i++) {
         if (pb->packets[i].memblock)
             pa_memblock_unref(pb->packets[i].memblock);
@@ -95,67 +98,48 @@ void pa_raop_packet_buffer_reset(pa_raop_packet_buffer *pb, uint16_t seq) {
 
 pa_memchunk *pa_raop_packet_buffer_prepare(pa_raop_packet_buffer *pb, uint16_t seq, const size_t size) {
     pa_memchunk *packet = NULL;
-    size_t i;
 
     pa_assert(pb);
     pa_assert(pb->packets);
 
-    if (seq == 0) {
-        /* 0 means seq reached UINT16_MAX and has been wrapped... */
-        pa_assert(pb->seq == UINT16_MAX);
-        pb->seq = 0;
-    } else {
-        /* ...otherwise, seq MUST have be increased! */
-        pa_assert(seq == pb->seq + 1);
-        pb->seq++;
-    }
+    /* seq MUST have been increased, wrapping to 0 after UINT16_MAX */
+    pa_assert(seq == (uint16_t) (pb->seq + 1));
+    pb->seq = seq;
 
-    i = (pb->pos + 1) % pb->size;
+    packet = &pb->packets[seq & (pb->size - 1)];
 
-    if (pb->packets[i].memblock)
-        pa_memblock_unref(pb->packets[i].memblock);
-    pa_memchunk_reset(&pb->packets[i]);
+    /* The memory of the packet dropped from the buffer is reused if nobody
+     * else holds on to it */
+    if (packet->memblock && !(pa_memblock_ref_is_one(packet->memblock) && pa_memblock_get_length(packet->memblock) >= size)) {
+        pa_memblock_unref(packet->memblock);
+        pa_memchunk_reset(packet);
+    }
 
-    pb->packets[i].memblock = pa_memblock_new(pb->mempool, size);
-    pb->packets[i].length = size;
-    pb->packets[i].index = 0;
+    if (!packet->memblock)
+        packet->memblock = pa_memblock_new(pb->mempool, size);
 
-    packet = &pb->packets[i];
+    packet->length = size;
+    packet->index = 0;
 
     if (pb->count < pb->size)
         pb->count++;
-    pb->pos = i;
 
     return packet;
 }
 
 pa_memchunk *pa_raop_packet_buffer_retrieve(pa_raop_packet_buffer *pb, uint16_t seq) {
     pa_memchunk *packet = NULL;
-    size_t delta, i;
+    uint16_t delta;
 
     pa_assert(pb);
     pa_assert(pb->packets);
 
-    if (seq == pb->seq)
-        packet = &pb->packets[pb->pos];
-    else {
-        if (seq < pb->seq) {
-            /* Regular case: pb->seq did not wrapped since seq. */
-            delta = pb->seq - seq;
-        } else {
-            /* Tricky case: pb->seq wrapped since seq! */
-            delta = pb->seq + (UINT16_MAX - seq);
-        }
-
-        /* If the requested packet is too old, do nothing and return */
-        if (delta > pb->count)
-            return NULL;
-
-        i = (pb->size + pb->pos - delta) % pb->size;
-
-        if (delta < pb->size && pb->packets[i].memblock)
-            packet = &pb->packets[i];
-    }
+    /* Packets newer than the newest one are older than the oldest one */
+    delta = pb->seq - seq;
+    if (delta >= pb->count)
+        return NULL;
 
-    return packet;
+    packet = &pb->packets[seq & (pb->size - 1)];
+
+    return packet->memblock ? packet : NULL;
 }
@@ -28,7 +28,8 @@
 
 typedef struct pa_raop_packet_buffer pa_raop_packet_buffer;
 
-/* Allocates a new circular packet buffer, size: Maximum number of packets to store */
+/* Allocates a new circular packet buffer, size: Maximum number of packets to
+ * store, rounded up to a power of two */
 pa_raop_packet_buffer *pa_raop_packet_buffer_new(pa_mempool *mempool, const size_t size);
 void pa_raop_packet_buffer_free(pa_raop_packet_buffer *pb);
 
@@ -740,6 +740,7 @@ pa_sink* pa_raop_sink_new(pa_module *m, pa_modargs *ma, const char *driver) {
     const char *description = NULL;
     pa_device_port *port;
     pa_card_profile *profile;
+    bool alac_compression = false;
 
     pa_assert(m);
     pa_assert(ma);
@@ -843,6 +844,11 @@ pa_sink* pa_raop_sink_new(pa_module *m, pa_modargs *ma, const char *driver) {
         goto fail;
     }
 
+    if (pa_modargs_get_value_boolean(ma, "alac_compression", &alac_compression) < 0) {
+        pa_log("Failed to parse alac_compression argument");
+        goto fail;
+    }
+
     pa_sink_new_data_init(&data);
     data.driver = driver;
     data.module = m;
@@ -927,6 +933,9 @@ pa_sink* pa_raop_sink_new(pa_module *m, pa_modargs *ma, const char *driver) {
 
     pa_raop_client_set_state_callback(u->raop, raop_state_cb, u);
 
+    if (u->codec == PA_RAOP_CODEC_ALAC)
+        pa_raop_client_set_alac_compression(u->raop, alac_compression);
+
     thread_name = pa_sprintf_malloc("raop-sink-%s", server);
     if (!(u->thread = pa_thread_new(thread_name, thread_func, u))) {
         pa_log("Failed to create sink thread");
@@ -0,0 +1,420 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/sconv.h>
+
+#include "jitter-buffer.h"
+
+/* At most this many packets are held, a packet further ahead restarts the
+ * buffer. Must be a power of two. */
+#define N_SLOTS 256
+
+/* A packet this far behind, or this many late packets in a row, mean that
+ * the sender restarted with lower sequence numbers. The buffer then
+ * restarts with the packet. */
+#define MAX_LATE N_SLOTS
+#define MAX_LATE_IN_ROW 32
+
+/* The playout delay is computed from the transit times of this many recent
+ * packets, every DELAY_UPDATE_INTERVAL packets */
+#define N_TRANSITS 512
+#define DELAY_UPDATE_INTERVAL 32
+
+/* Gaps of more than this many packet lengths are not concealed */
+#define MAX_CONCEAL_PACKETS 2
+
+struct slot {
+    bool used;
+    uint16_t sequence;
+    uint32_t rtp_tstamp;
+    pa_usec_t arrival;
+    pa_memchunk chunk;
+};
+
+struct pa_jitter_buffer {
+    pa_mempool *pool;
+    pa_sample_spec ss;
+    size_t frame_size;
+    pa_convert_func_t to_float;
+    pa_convert_func_t from_float;
+
+    double percentile;
+    pa_usec_t min_delay;
+    pa_usec_t max_delay;
+    pa_usec_t delay;
+
+    bool started;
+    uint16_t next_sequence;
+    uint16_t highest_sequence;
+    unsigned n_held;
+    unsigned n_late_in_row;
+    struct slot slots[N_SLOTS];
+
+    /* The last packet returned, for concealment */
+    pa_memchunk last;
+    uint32_t last_tstamp;
+
+    /* Transit time is arrival time minus RTP timestamp. The timestamps are
+     * extended to 64 bit to survive the wrap-around. */
+    bool has_tstamp;
+    uint32_t last_rtp_tstamp;
+    int64_t extended_tstamp;
+    bool has_transit;
+    int64_t last_transit;
+    double jitter;
+
+    int64_t transits[N_TRANSITS];
+    int64_t sorted[N_TRANSITS];
+    unsigned n_transits;
+    unsigned transit_index;
+    unsigned since_update;
+
+    pa_jitter_buffer_stats stats;
+};
+
+pa_jitter_buffer *pa_jitter_buffer_new(pa_mempool *pool, const pa_sample_spec *ss, double percentile,
+                                       pa_usec_t min_delay, pa_usec_t max_delay) {
+    pa_jitter_buffer *j;
+
+    pa_assert(pool);
+    pa_assert(ss);
+    pa_assert(pa_sample_spec_valid(ss));
+    pa_assert(percentile >= 0 && percentile <= 100);
+    pa_assert(min_delay <= max_delay);
+
+    j = pa_xnew0(pa_jitter_buffer, 1);
+    j->pool = pool;
+    j->ss = *ss;
+    j->frame_size = pa_frame_size(ss);
+    j->to_float = pa_get_convert_to_float32ne_function(ss->format);
+    j->from_float = pa_get_convert_from_float32ne_function(ss->format);
+    j->percentile = percentile;
+    j->min_delay = min_delay;
+    j->max_delay = max_delay;
+    j->delay = min_delay;
+
+    return j;
+}
+
+static void drop_held(pa_jitter_buffer *j) {
+    unsigned i;
+
+    for (i = 0; i < N_SLOTS; i++)
+        if (j->slots[i].used) {
+            pa_memblock_unref(j->slots[i].chunk.memblock);
+            j->slots[i].used = false;
+        }
+
+    j->n_held = 0;
+}
+
+void pa_jitter_buffer_free(pa_jitter_buffer *j) {
+    pa_assert(j);
+
+    drop_held(j);
+
+    if (j->last.memblock)
+        pa_memblock_unref(j->last.memblock);
+
+    pa_xfree(j);
+}
+
+void pa_jitter_buffer_reset(pa_jitter_buffer *j) {
+    pa_assert(j);
+
+    drop_held(j);
+
+    if (j->last.memblock)
+        pa_memblock_unref(j->last.memblock);
+    pa_memchunk_reset(&j->last);
+
+    j->started = false;
+    j->n_late_in_row = 0;
+    j->has_tstamp = false;
+    j->has_transit = false;
+
+    /* The transit times of another sender have a different offset */
+    j->n_transits = 0;
+    j->transit_index = 0;
+    j->since_update = 0;
+}
+
+static int compare_transit(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* The playout delay is how much later than the earliest packet the
+ * requested share of packets arrives */
+static void update_delay(pa_jitter_buffer *j) {
+    unsigned k;
+    int64_t d;
+
+    memcpy(j->sorted, j->transits, j->n_transits * sizeof(int64_t));
+    qsort(j->sorted, j->n_transits, sizeof(int64_t), compare_transit);
+
+    k = (unsigned) (j->percentile / 100.0 * (j->n_transits - 1) + 0.5);
+    d = j->sorted[k] - j->sorted[0];
+
+    j->delay = PA_CLAMP((pa_usec_t) PA_MAX(d, 0), j->min_delay, j->max_delay);
+}
+
+static void update_transit(pa_jitter_buffer *j, uint32_t rtp_tstamp, pa_usec_t arrival) {
+    int64_t transit;
+
+    if (!j->has_tstamp) {
+        j->extended_tstamp = rtp_tstamp;
+        j->has_tstamp = true;
+    } else
+        j->extended_tstamp += (int32_t) (rtp_tstamp - j->last_rtp_tstamp);
+
+    j->last_rtp_tstamp = rtp_tstamp;
+
+    transit = (int64_t) arrival - j->extended_tstamp * (int64_t) PA_USEC_PER_SEC / (int64_t) j->ss.rate;
+
+    /* RFC 3550, section 6.4.1 */
+    if (j->has_transit) {
+        int64_t d = transit - j->last_transit;
+
+        j->jitter += ((double) (d < 0 ? -d : d) - j->jitter) / 16.0;
+    }
+
+    j->last_transit = transit;
+    j->has_transit = true;
+
+    j->transits[j->transit_index] = transit;
+    j->transit_index = (j->transit_index + 1) % N_TRANSITS;
+    if (j->n_transits < N_TRANSITS)
+        j->n_transits++;
+
+    if (++j->since_update >= DELAY_UPDATE_INTERVAL) {
+        j->since_update = 0;
+        update_delay(j);
+    }
+}
+
+void pa_jitter_buffer_put(pa_jitter_buffer *j, const pa_memchunk *chunk, uint16_t sequence, uint32_t rtp_tstamp,
+                          pa_usec_t arrival) {
+    struct slot *slot;
+    int16_t d;
+
+    pa_assert(j);
+    pa_assert(chunk);
+    pa_assert(chunk->memblock);
+
+    j->stats.received++;
+
+    if (j->started) {
+        d = (int16_t) (sequence - j->next_sequence);
+
+        if (d < -MAX_LATE || (d < 0 && j->n_late_in_row + 1 >= MAX_LATE_IN_ROW)) {
+            pa_log_debug("Sequence number went back by %i, restarting jitter buffer.", -d);
+            pa_jitter_buffer_reset(j);
+        } else if (d < 0) {
+            /* Returned already, or given up on */
+            update_transit(j, rtp_tstamp, arrival);
+            j->stats.late++;
+            j->n_late_in_row++;
+            return;
+        }
+    }
+
+    j->n_late_in_row = 0;
+
+    update_transit(j, rtp_tstamp, arrival);
+
+    if (!j->started) {
+        j->started = true;
+        j->next_sequence = j->highest_sequence = sequence;
+    }
+
+    d = (int16_t) (sequence - j->next_sequence);
+
+    if (d >= N_SLOTS) {
+        pa_log_debug("Sequence number jumped by %i, restarting jitter buffer.", d);
+        drop_held(j);
+        j->next_sequence = j->highest_sequence = sequence;
+    }
+
+    slot = &j->slots[sequence & (N_SLOTS - 1)];
+
+    if (slot->used) {
+        pa_assert(slot->sequence == sequence);
+        j->stats.duplicates++;
+        return;
+    }
+
+    if ((int16_t) (sequence - j->highest_sequence) < 0)
+        j->stats.reordered++;
+    else
+        j->highest_sequence = sequence;
+
+    slot->used = true;
+    slot->sequence = sequence;
+    slot->rtp_tstamp = rtp_tstamp;
+    slot->arrival = arrival;
+    slot->chunk = *chunk;
+    pa_memblock_ref(slot->chunk.memblock);
+    j->n_held++;
+}
+
+/* Fills the gap between the last packet returned and the next one with both
+ * of them played backwards from the gap's edges, crossfaded. That joins
+ * the edges without a jump. */
+static bool conceal(pa_jitter_buffer *j, const struct slot *next, pa_memchunk *chunk, uint32_t *rtp_tstamp) {
+    size_t last_frames, next_frames, gap, i, c;
+    unsigned channels = j->ss.channels;
+    uint32_t start;
+    float *a, *b, *out;
+    void *data;
+
+    if (!j->last.memblock || !j->to_float || !j->from_float)
+        return false;
+
+    last_frames = j->last.length / j->frame_size;
+    next_frames = next->chunk.length / j->frame_size;
+    start = j->last_tstamp + (uint32_t) last_frames;
+    gap = (size_t) (int32_t) (next->rtp_tstamp - start);
+
+    if ((int32_t) (next->rtp_tstamp - start) <= 0 || gap > MAX_CONCEAL_PACKETS * last_frames ||
+        last_frames == 0 || next_frames == 0)
+        return false;
+
+    a = pa_xnew(float, last_frames * channels);
+    b = pa_xnew(float, next_frames * channels);
+    out = pa_xnew(float, gap * channels);
+
+    j->to_float(last_frames * channels, (uint8_t *) pa_memblock_acquire(j->last.memblock) + j->last.index, a);
+    pa_memblock_release(j->last.memblock);
+    j->to_float(next_frames * channels, (uint8_t *) pa_memblock_acquire(next->chunk.memblock) + next->chunk.index, b);
+    pa_memblock_release(next->chunk.memblock);
+
+    for (i = 0; i < gap; i++) {
+        float w = (float) (i + 1) / (float) (gap + 1);
+        size_t ia = last_frames - 1 - PA_MIN(i, last_frames - 1);
+        size_t ib = PA_MIN(gap - 1 - i, next_frames - 1);
+
+        for (c = 0; c < channels; c++)
+            out[i * channels + c] = (1.0f - w) * a[ia * channels + c] + w * b[ib * channels + c];
+    }
+
+    chunk->memblock = pa_memblock_new(j->pool, gap * j->frame_size);
+    chunk->index = 0;
+    chunk->length = gap * j->frame_size;
+
+    data = pa_memblock_acquire(chunk->memblock);
+    j->from_float(gap * channels, out, data);
+    pa_memblock_release(chunk->memblock);
+
+    *rtp_tstamp = start;
+
+    pa_xfree(a);
+    pa_xfree(b);
+    pa_xfree(out);
+
+    return true;
+}
+
+static void set_last(pa_jitter_buffer *j, const pa_memchunk *chunk, uint32_t rtp_tstamp) {
+    if (j->last.memblock)
+        pa_memblock_unref(j->last.memblock);
+
+    j->last = *chunk;
+    pa_memblock_ref(j->last.memblock);
+    j->last_tstamp = rtp_tstamp;
+}
+
+int pa_jitter_buffer_pop(pa_jitter_buffer *j, pa_usec_t now, pa_memchunk *chunk, uint32_t *rtp_tstamp) {
+    pa_assert(j);
+    pa_assert(chunk);
+    pa_assert(rtp_tstamp);
+
+    for (;;) {
+        struct slot *slot = &j->slots[j->next_sequence & (N_SLOTS - 1)];
+        struct slot *first = NULL;
+        pa_usec_t earliest = 0;
+        uint16_t missing, i;
+
+        if (slot->used) {
+            *chunk = slot->chunk;
+            *rtp_tstamp = slot->rtp_tstamp;
+            slot->used = false;
+            j->n_held--;
+            j->next_sequence++;
+
+            set_last(j, chunk, *rtp_tstamp);
+            return 0;
+        }
+
+        if (j->n_held == 0)
+            return -1;
+
+        /* The next packet is missing. Wait for it as long as the first
+         * packet after it has been here for less than the playout delay. */
+        for (i = 1; i < N_SLOTS; i++) {
+            struct slot *s = &j->slots[(uint16_t) (j->next_sequence + i) & (N_SLOTS - 1)];
+
+            if (!s->used)
+                continue;
+
+            if (!first)
+                first = s;
+
+            if (earliest == 0 || s->arrival < earliest)
+                earliest = s->arrival;
+        }
+
+        pa_assert(first);
+
+        if (now < earliest + j->delay)
+            return -1;
+
+        missing = (uint16_t) (first->sequence - j->next_sequence);
+        j->stats.lost += missing;
+        j->next_sequence = first->sequence;
+
+        if (missing == 1 && conceal(j, first, chunk, rtp_tstamp)) {
+            j->stats.concealed++;
+
+            set_last(j, chunk, *rtp_tstamp);
+            return 0;
+        }
+    }
+}
+
+void pa_jitter_buffer_get_stats(pa_jitter_buffer *j, pa_jitter_buffer_stats *stats) {
+    pa_assert(j);
+    pa_assert(stats);
+
+    *stats = j->stats;
+    stats->jitter = (pa_usec_t) j->jitter;
+    stats->playout_delay = j->delay;
+}
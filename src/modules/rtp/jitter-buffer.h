@@ -0,0 +1,72 @@
+#ifndef foortpjitterbufferhfoo
+#define foortpjitterbufferhfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+
+#include <pulse/sample.h>
+#include <pulsecore/memblock.h>
+#include <pulsecore/memchunk.h>
+
+/* Puts received RTP packets back in order before they are played.
+ *
+ * Packets are returned as soon as all packets before them have been
+ * returned. If one is missing, the packets after it are held back for the
+ * playout delay, counted from the arrival of the first of them, and the
+ * missing one is then given up on. A single lost packet is concealed by
+ * crossfading between its neighbours, longer gaps are left to the caller.
+ *
+ * The playout delay follows the given percentile of the packet transit
+ * time variation, so that about that share of late packets still makes
+ * it. */
+
+typedef struct pa_jitter_buffer pa_jitter_buffer;
+
+typedef struct pa_jitter_buffer_stats {
+    uint64_t received;
+    uint64_t lost;
+    uint64_t late;
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint64_t concealed;
+
+    /* RFC 3550 interarrival jitter */
+    pa_usec_t jitter;
+    pa_usec_t playout_delay;
+} pa_jitter_buffer_stats;
+
+pa_jitter_buffer *pa_jitter_buffer_new(pa_mempool *pool, const pa_sample_spec *ss, double percentile,
+                                       pa_usec_t min_delay, pa_usec_t max_delay);
+void pa_jitter_buffer_free(pa_jitter_buffer *j);
+
+/* Drops all packets held and starts over with the next one */
+void pa_jitter_buffer_reset(pa_jitter_buffer *j);
+
+/* Takes a reference to the chunk. arrival must be on the same clock as the
+ * now argument of pa_jitter_buffer_pop(). */
+void pa_jitter_buffer_put(pa_jitter_buffer *j, const pa_memchunk *chunk, uint16_t sequence, uint32_t rtp_tstamp,
+                          pa_usec_t arrival);
+
+/* Returns the next packet that is due, in order, or -1 if there is none.
+ * The caller owns the reference to the returned chunk. */
+int pa_jitter_buffer_pop(pa_jitter_buffer *j, pa_usec_t now, pa_memchunk *chunk, uint32_t *rtp_tstamp);
+
+void pa_jitter_buffer_get_stats(pa_jitter_buffer *j, pa_jitter_buffer_stats *stats);
+
+#endif
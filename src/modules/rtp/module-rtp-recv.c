@@ -55,8 +55,11 @@
 #include <pulsecore/once.h>
 #include <pulsecore/poll.h>
 #include <pulsecore/arpa-inet.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 
 #include "rtp.h"
+#include "jitter-buffer.h"
 #include "sdp.h"
 #include "sap.h"
 
@@ -68,23 +71,59 @@ PA_MODULE_USAGE(
         "sink=<name of the sink> "
         "sap_address=<multicast address to listen on> "
         "latency_msec=<latency in ms> "
+        "shared_socket=<receive all sessions on one socket per port?> "
+        "max_sessions=<maximum number of sessions> "
+        "jitter_buffer=<reorder packets and conceal single lost packets?> "
+        "jitter_percentile=<percentage of late packets to wait for> "
 );
 
 #define SAP_PORT 9875
 #define DEFAULT_SAP_ADDRESS "224.0.0.56"
 #define DEFAULT_LATENCY_MSEC 500
 #define MEMBLOCKQ_MAXLENGTH (1024*1024*40)
-#define MAX_SESSIONS 16
+#define DEFAULT_MAX_SESSIONS 16
 #define DEATH_TIMEOUT 20
 #define RATE_UPDATE_INTERVAL (5*PA_USEC_PER_SEC)
+#define DEFAULT_JITTER_PERCENTILE 95.0
+#define JITTER_BUFFER_MIN_DELAY (5*PA_USEC_PER_MSEC)
+#define SSRC_TIMEOUT (2*PA_USEC_PER_SEC)
 
 static const char* const valid_modargs[] = {
     "sink",
     "sap_address",
     "latency_msec",
+    "shared_socket",
+    "max_sessions",
+    "jitter_buffer",
+    "jitter_percentile",
     NULL
 };
 
+/* With shared_socket=yes, all sessions on the same port that play to the
+ * same sink are received on one socket, polled from the sink's I/O
+ * thread. Packets are assigned to sessions by SSRC, an SSRC that is not
+ * known yet is assigned to a session sent to the packet's destination
+ * address that has no SSRC yet. A session only changes its SSRC after it
+ * has received nothing for SSRC_TIMEOUT. */
+struct receiver {
+    struct userdata *userdata;
+    PA_LLIST_FIELDS(struct receiver);
+
+    pa_sink *sink;
+    int family;
+    uint16_t port;
+    unsigned n_sessions;
+
+    /* Owned by rtp_context */
+    int fd;
+    pa_rtp_context *rtp_context;
+
+    /* Only used from the I/O thread */
+    pa_rtpoll_item *rtpoll_item;
+    pa_idxset *sessions;
+    pa_hashmap *by_ssrc;
+};
+
 struct session {
     struct userdata *userdata;
     PA_LLIST_FIELDS(struct session);
@@ -98,9 +137,18 @@ struct session {
     struct pa_sdp_info sdp_info;
 
     pa_rtp_context *rtp_context;
+    size_t frame_size;
+
+    /* Only used from the I/O thread */
+    pa_jitter_buffer *jitter_buffer;
 
     pa_rtpoll_item *rtpoll_item;
 
+    struct receiver *receiver;
+    bool has_ssrc;
+    uint32_t ssrc;
+    pa_usec_t last_packet;
+
     pa_atomic_t timestamp;
 
     pa_usec_t intended_latency;
@@ -127,11 +175,25 @@ struct userdata {
     PA_LLIST_HEAD(struct session, sessions);
     pa_hashmap *by_origin;
     int n_sessions;
+    int max_sessions;
+
+    bool shared_socket;
+    PA_LLIST_HEAD(struct receiver, receivers);
 
     pa_usec_t latency;
+
+    bool jitter_buffer;
+    double jitter_percentile;
+
+    char *message_handler_path;
+};
+
+enum {
+    SINK_INPUT_MESSAGE_GET_JITTER_STATS = PA_SINK_INPUT_MESSAGE_MAX
 };
 
 static void session_free(struct session *s);
+static void session_drain_jitter_buffer(struct session *s, pa_usec_t now);
 
 /* Called from I/O thread context */
 static int sink_input_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
@@ -144,6 +206,10 @@ static int sink_input_process_msg(pa_msgobject *o, int code, void *data, int64_t
             /* Fall through, the default handler will add in the extra
              * latency added by the resampler */
             break;
+
+        case SINK_INPUT_MESSAGE_GET_JITTER_STATS:
+            pa_jitter_buffer_get_stats(s->jitter_buffer, data);
+            return 0;
     }
 
     return pa_sink_input_process_msg(o, code, data, offset, chunk);
@@ -155,6 +221,11 @@ static int sink_input_pop_cb(pa_sink_input *i, size_t length, pa_memchunk *chunk
     pa_sink_input_assert_ref(i);
     pa_assert_se(s = i->userdata);
 
+    /* Packets held back behind a lost one may have become due since the
+     * last packet was received */
+    if (s->jitter_buffer)
+        session_drain_jitter_buffer(s, pa_rtclock_now());
+
     if (pa_memblockq_peek(s->memblockq, chunk) < 0)
         return -1;
 
@@ -200,40 +271,18 @@ static void sink_input_suspend_within_thread(pa_sink_input* i, bool b) {
 
     if (b)
         pa_memblockq_flush_read(s->memblockq);
-    else
+    else {
         s->first_packet = false;
-}
-
-/* Called from I/O thread context */
-static int rtpoll_work_cb(pa_rtpoll_item *i) {
-    pa_memchunk chunk;
-    uint32_t timestamp;
-    int64_t k, j, delta;
-    struct timeval now = { 0, 0 };
-    struct session *s;
-    struct pollfd *p;
 
-    pa_assert_se(s = pa_rtpoll_item_get_work_userdata(i));
-
-    p = pa_rtpoll_item_get_pollfd(i, NULL);
-
-    if (p->revents & (POLLERR|POLLNVAL|POLLHUP|POLLOUT)) {
-        pa_log("poll() signalled bad revents.");
-        return -1;
+        if (s->jitter_buffer)
+            pa_jitter_buffer_reset(s->jitter_buffer);
     }
+}
 
-    if ((p->revents & POLLIN) == 0)
-        return 0;
-
-    p->revents = 0;
-
-    if (pa_rtp_recv(s->rtp_context, &chunk, s->userdata->module->core->mempool, &timestamp, &now) < 0)
-        return 0;
-
-    if (!PA_SINK_IS_OPENED(s->sink_input->sink->thread_info.state)) {
-        pa_memblock_unref(chunk.memblock);
-        return 0;
-    }
+/* Called from I/O thread context, writes the packet to the queue at its
+ * timestamp and takes its reference */
+static void session_push_packet(struct session *s, pa_memchunk *chunk, uint32_t timestamp) {
+    int64_t k, j, delta;
 
     if (!s->first_packet) {
         s->first_packet = true;
@@ -249,32 +298,59 @@ static int rtpoll_work_cb(pa_rtpoll_item *i) {
     else
         delta = j;
 
-    pa_memblockq_seek(s->memblockq, delta * (int64_t) pa_rtp_context_get_frame_size(s->rtp_context), PA_SEEK_RELATIVE,
+    pa_memblockq_seek(s->memblockq, delta * (int64_t) s->frame_size, PA_SEEK_RELATIVE,
             true);
 
-    if (now.tv_sec == 0) {
-        PA_ONCE_BEGIN {
-            pa_log_warn("Using artificial time instead of timestamp");
-        } PA_ONCE_END;
-        pa_rtclock_get(&now);
-    } else
-        pa_rtclock_from_wallclock(&now);
-
-    if (pa_memblockq_push(s->memblockq, &chunk) < 0) {
+    if (pa_memblockq_push(s->memblockq, chunk) < 0) {
         pa_log_warn("Queue overrun");
-        pa_memblockq_seek(s->memblockq, (int64_t) chunk.length, PA_SEEK_RELATIVE, true);
+        pa_memblockq_seek(s->memblockq, (int64_t) chunk->length, PA_SEEK_RELATIVE, true);
     }
 
 /*     pa_log("blocks in q: %u", pa_memblockq_get_nblocks(s->memblockq)); */
 
-    pa_memblock_unref(chunk.memblock);
+    pa_memblock_unref(chunk->memblock);
 
     /* The next timestamp we expect */
-    s->offset = timestamp + (uint32_t) (chunk.length / pa_rtp_context_get_frame_size(s->rtp_context));
+    s->offset = timestamp + (uint32_t) (chunk->length / s->frame_size);
+}
 
-    pa_atomic_store(&s->timestamp, (int) now.tv_sec);
+/* Called from I/O thread context */
+static void session_drain_jitter_buffer(struct session *s, pa_usec_t now) {
+    pa_memchunk chunk;
+    uint32_t timestamp;
 
-    if (s->last_rate_update + RATE_UPDATE_INTERVAL < pa_timeval_load(&now)) {
+    while (pa_jitter_buffer_pop(s->jitter_buffer, now, &chunk, &timestamp) >= 0)
+        session_push_packet(s, &chunk, timestamp);
+}
+
+/* Called from I/O thread context. sequence is NULL if the sequence number
+ * of the packet is not known, it then bypasses the jitter buffer. */
+static void session_process_packet(struct session *s, pa_memchunk *chunk, uint32_t timestamp, const uint16_t *sequence,
+                                   struct timeval *now) {
+    if (!PA_SINK_IS_OPENED(s->sink_input->sink->thread_info.state)) {
+        pa_memblock_unref(chunk->memblock);
+        return;
+    }
+
+    if (now->tv_sec == 0) {
+        PA_ONCE_BEGIN {
+            pa_log_warn("Using artificial time instead of timestamp");
+        } PA_ONCE_END;
+        pa_rtclock_get(now);
+    } else
+        pa_rtclock_from_wallclock(now);
+
+    if (s->jitter_buffer && sequence) {
+        pa_jitter_buffer_put(s->jitter_buffer, chunk, *sequence, timestamp, pa_timeval_load(now));
+        pa_memblock_unref(chunk->memblock);
+
+        session_drain_jitter_buffer(s, pa_rtclock_now());
+    } else
+        session_push_packet(s, chunk, timestamp);
+
+    pa_atomic_store(&s->timestamp, (int) now->tv_sec);
+
+    if (s->last_rate_update + RATE_UPDATE_INTERVAL < pa_timeval_load(now)) {
         pa_usec_t wi, ri, render_delay, sink_delay = 0, latency;
         uint32_t current_rate = s->sink_input->sample_spec.rate;
         uint32_t new_rate;
@@ -363,7 +439,7 @@ static int rtpoll_work_cb(pa_rtpoll_item *i) {
 
         pa_log_debug("Updated sampling rate to %lu Hz.", (unsigned long) s->sink_input->sample_spec.rate);
 
-        s->last_rate_update = pa_timeval_load(&now);
+        s->last_rate_update = pa_timeval_load(now);
     }
 
     if (pa_memblockq_is_readable(s->memblockq) &&
@@ -373,6 +449,144 @@ static int rtpoll_work_cb(pa_rtpoll_item *i) {
                                      (size_t) (s->sink_input->thread_info.underrun_for == (uint64_t) -1 ? 0 : s->sink_input->thread_info.underrun_for),
                                      false, true, false);
     }
+}
+
+/* Called from I/O thread context */
+static int rtpoll_work_cb(pa_rtpoll_item *i) {
+    struct session *s;
+    struct pollfd *p;
+
+    pa_assert_se(s = pa_rtpoll_item_get_work_userdata(i));
+
+    p = pa_rtpoll_item_get_pollfd(i, NULL);
+
+    if (p->revents & (POLLERR|POLLNVAL|POLLHUP|POLLOUT)) {
+        pa_log("poll() signalled bad revents.");
+        return -1;
+    }
+
+    if ((p->revents & POLLIN) == 0)
+        return 0;
+
+    p->revents = 0;
+
+    /* Several packets may have been received with one system call */
+    do {
+        pa_memchunk chunk;
+        uint32_t timestamp;
+        uint16_t sequence;
+        struct timeval now = { 0, 0 };
+
+        if (pa_rtp_recv(s->rtp_context, &chunk, s->userdata->module->core->mempool, &timestamp, &now) < 0)
+            continue;
+
+        session_process_packet(s, &chunk, timestamp,
+                               pa_rtp_context_get_last_sequence(s->rtp_context, &sequence) ? &sequence : NULL, &now);
+    } while (pa_rtp_context_has_pending(s->rtp_context));
+
+    return 1;
+}
+
+static bool same_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family)
+        return false;
+
+    if (a->ss_family == AF_INET)
+        return ((const struct sockaddr_in *) a)->sin_addr.s_addr == ((const struct sockaddr_in *) b)->sin_addr.s_addr;
+#ifdef HAVE_IPV6
+    if (a->ss_family == AF_INET6)
+        return memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr, &((const struct sockaddr_in6 *) b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+#endif
+
+    return false;
+}
+
+/* Called from I/O thread context */
+static struct session *receiver_find_session(struct receiver *r, const pa_rtp_packet_info *info, pa_usec_t now) {
+    struct session *s, *silent = NULL;
+    uint32_t idx;
+
+    if ((s = pa_hashmap_get(r->by_ssrc, PA_UINT32_TO_PTR(info->ssrc)))) {
+        s->last_packet = now;
+        return s;
+    }
+
+    if (!info->has_dst)
+        return NULL;
+
+    PA_IDXSET_FOREACH(s, r->sessions, idx) {
+        if (s->sdp_info.payload != info->payload || !same_address(&s->sdp_info.sa, &info->dst))
+            continue;
+
+        if (!s->has_ssrc)
+            break;
+
+        /* The sender restarted or was replaced */
+        if (!silent && s->last_packet + SSRC_TIMEOUT < now)
+            silent = s;
+    }
+
+    /* Packets of further senders are dropped until they are announced and
+     * get a session of their own */
+    if (!s && !(s = silent))
+        return NULL;
+
+    if (s->has_ssrc) {
+        pa_log_info("Session '%s' changes SSRC from 0x%08x to 0x%08x", s->sdp_info.session_name, s->ssrc, info->ssrc);
+        pa_hashmap_remove(r->by_ssrc, PA_UINT32_TO_PTR(s->ssrc));
+    } else
+        pa_log_debug("Session '%s' has SSRC 0x%08x", s->sdp_info.session_name, info->ssrc);
+
+    s->ssrc = info->ssrc;
+    s->has_ssrc = true;
+    s->last_packet = now;
+    pa_hashmap_put(r->by_ssrc, PA_UINT32_TO_PTR(s->ssrc), s);
+
+    /* The sequence numbers and timestamps of another sender are unrelated */
+    if (s->jitter_buffer)
+        pa_jitter_buffer_reset(s->jitter_buffer);
+    s->first_packet = false;
+
+    return s;
+}
+
+/* Called from I/O thread context */
+static int receiver_work_cb(pa_rtpoll_item *i) {
+    struct receiver *r;
+    struct pollfd *p;
+    pa_usec_t now;
+
+    pa_assert_se(r = pa_rtpoll_item_get_work_userdata(i));
+
+    p = pa_rtpoll_item_get_pollfd(i, NULL);
+
+    if (p->revents & (POLLERR|POLLNVAL|POLLHUP|POLLOUT)) {
+        pa_log("poll() signalled bad revents.");
+        return -1;
+    }
+
+    if ((p->revents & POLLIN) == 0)
+        return 0;
+
+    p->revents = 0;
+
+    now = pa_rtclock_now();
+
+    do {
+        pa_memchunk chunk;
+        pa_rtp_packet_info info;
+        struct session *s;
+
+        if (pa_rtp_recv_packet(r->rtp_context, &chunk, r->userdata->module->core->mempool, &info) < 0)
+            continue;
+
+        if (!(s = receiver_find_session(r, &info, now)) || info.payload != s->sdp_info.payload || chunk.length % s->frame_size != 0) {
+            pa_memblock_unref(chunk.memblock);
+            continue;
+        }
+
+        session_process_packet(s, &chunk, info.rtp_tstamp, &info.sequence, &info.tstamp);
+    } while (pa_rtp_context_has_pending(r->rtp_context));
 
     return 1;
 }
@@ -380,34 +594,63 @@ static int rtpoll_work_cb(pa_rtpoll_item *i) {
 /* Called from I/O thread context */
 static void sink_input_attach(pa_sink_input *i) {
     struct session *s;
+    struct receiver *r;
 
     pa_sink_input_assert_ref(i);
     pa_assert_se(s = i->userdata);
 
-    pa_assert(!s->rtpoll_item);
-    s->rtpoll_item = pa_rtp_context_get_rtpoll_item(s->rtp_context, i->sink->thread_info.rtpoll);
+    if (!(r = s->receiver)) {
+        pa_assert(!s->rtpoll_item);
+        s->rtpoll_item = pa_rtp_context_get_rtpoll_item(s->rtp_context, i->sink->thread_info.rtpoll);
 
-    pa_rtpoll_item_set_work_callback(s->rtpoll_item, rtpoll_work_cb, s);
+        pa_rtpoll_item_set_work_callback(s->rtpoll_item, rtpoll_work_cb, s);
+        return;
+    }
+
+    /* The sink inputs of a receiver cannot be moved, so they are all
+     * attached to the same thread */
+    pa_idxset_put(r->sessions, s, NULL);
+    s->has_ssrc = false;
+
+    if (!r->rtpoll_item) {
+        r->rtpoll_item = pa_rtp_context_get_rtpoll_item(r->rtp_context, i->sink->thread_info.rtpoll);
+        pa_rtpoll_item_set_work_callback(r->rtpoll_item, receiver_work_cb, r);
+    }
 }
 
 /* Called from I/O thread context */
 static void sink_input_detach(pa_sink_input *i) {
     struct session *s;
+    struct receiver *r;
+
     pa_sink_input_assert_ref(i);
     pa_assert_se(s = i->userdata);
 
-    pa_assert(s->rtpoll_item);
-    pa_rtpoll_item_free(s->rtpoll_item);
-    s->rtpoll_item = NULL;
-}
+    if (!(r = s->receiver)) {
+        pa_assert(s->rtpoll_item);
+        pa_rtpoll_item_free(s->rtpoll_item);
+        s->rtpoll_item = NULL;
+        return;
+    }
 
-static int mcast_socket(const struct sockaddr* sa, socklen_t salen) {
-    int af, fd = -1, r, one;
+    pa_idxset_remove_by_data(r->sessions, s, NULL);
 
-    pa_assert(sa);
-    pa_assert(salen > 0);
+    if (s->has_ssrc) {
+        pa_hashmap_remove(r->by_ssrc, PA_UINT32_TO_PTR(s->ssrc));
+        s->has_ssrc = false;
+    }
+
+    if (pa_idxset_isempty(r->sessions)) {
+        pa_assert(r->rtpoll_item);
+        pa_rtpoll_item_free(r->rtpoll_item);
+        r->rtpoll_item = NULL;
+    }
+}
+
+/* Creates a UDP socket with the options all receive sockets need */
+static int recv_socket(int af) {
+    int fd, one;
 
-    af = sa->sa_family;
     if ((fd = pa_socket_cloexec(af, SOCK_DGRAM, 0)) < 0) {
         pa_log("Failed to create socket: %s", pa_cstrerror(errno));
         goto fail;
@@ -432,8 +675,20 @@ static int mcast_socket(const struct sockaddr* sa, socklen_t salen) {
         goto fail;
     }
 
-    r = 0;
-    if (af == AF_INET) {
+    return fd;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+
+    return -1;
+}
+
+/* Joins or leaves the multicast group sa, if it is a multicast address */
+static int mcast_membership(int fd, const struct sockaddr* sa, bool join) {
+    int r = 0;
+
+    if (sa->sa_family == AF_INET) {
         /* IPv4 multicast addresses are in the 224.0.0.0-239.255.255.255 range */
         static const uint32_t ipv4_mcast_mask = 0xe0000000;
 
@@ -441,22 +696,34 @@ static int mcast_socket(const struct sockaddr* sa, socklen_t salen) {
             struct ip_mreq mr4;
             memset(&mr4, 0, sizeof(mr4));
             mr4.imr_multiaddr = ((const struct sockaddr_in*) sa)->sin_addr;
-            r = setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr4, sizeof(mr4));
+            r = setsockopt(fd, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP, &mr4, sizeof(mr4));
         }
 #ifdef HAVE_IPV6
-    } else if (af == AF_INET6) {
+    } else if (sa->sa_family == AF_INET6) {
         /* IPv6 multicast addresses have 255 as the most significant byte */
         if (((const struct sockaddr_in6*) sa)->sin6_addr.s6_addr[0] == 0xff) {
             struct ipv6_mreq mr6;
             memset(&mr6, 0, sizeof(mr6));
             mr6.ipv6mr_multiaddr = ((const struct sockaddr_in6*) sa)->sin6_addr;
-            r = setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mr6, sizeof(mr6));
+            r = setsockopt(fd, IPPROTO_IPV6, join ? IPV6_JOIN_GROUP : IPV6_LEAVE_GROUP, &mr6, sizeof(mr6));
         }
 #endif
     } else
         pa_assert_not_reached();
 
-    if (r < 0) {
+    return r;
+}
+
+static int mcast_socket(const struct sockaddr* sa, socklen_t salen) {
+    int fd = -1;
+
+    pa_assert(sa);
+    pa_assert(salen > 0);
+
+    if ((fd = recv_socket(sa->sa_family)) < 0)
+        goto fail;
+
+    if (mcast_membership(fd, sa, true) < 0) {
         pa_log_info("Joining mcast group failed: %s", pa_cstrerror(errno));
         goto fail;
     }
@@ -475,6 +742,159 @@ fail:
     return -1;
 }
 
+static uint16_t sockaddr_port(const struct sockaddr *sa) {
+    if (sa->sa_family == AF_INET)
+        return ntohs(((const struct sockaddr_in *) sa)->sin_port);
+#ifdef HAVE_IPV6
+    if (sa->sa_family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6 *) sa)->sin6_port);
+#endif
+
+    return 0;
+}
+
+/* A socket bound to the port on all addresses, that tells the destination
+ * of every packet */
+static int shared_socket(int af, uint16_t port) {
+    int fd = -1, one = 1;
+    struct sockaddr_storage ss;
+    socklen_t salen;
+
+    if ((fd = recv_socket(af)) < 0)
+        goto fail;
+
+    pa_zero(ss);
+
+    if (af == AF_INET) {
+        struct sockaddr_in *sa4 = (struct sockaddr_in *) &ss;
+
+        if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) < 0) {
+            pa_log("IP_PKTINFO failed: %s", pa_cstrerror(errno));
+            goto fail;
+        }
+
+#ifdef IP_MULTICAST_ALL
+        /* Only the groups joined on this socket, not the ones joined by
+         * other sockets on the same port */
+        one = 0;
+        if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &one, sizeof(one)) < 0)
+            pa_log_warn("IP_MULTICAST_ALL failed: %s", pa_cstrerror(errno));
+#endif
+
+        sa4->sin_family = AF_INET;
+        sa4->sin_addr.s_addr = htonl(INADDR_ANY);
+        sa4->sin_port = htons(port);
+        salen = sizeof(*sa4);
+#if defined(HAVE_IPV6) && defined(IPV6_RECVPKTINFO)
+    } else if (af == AF_INET6) {
+        struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *) &ss;
+
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one)) < 0) {
+            pa_log("IPV6_RECVPKTINFO failed: %s", pa_cstrerror(errno));
+            goto fail;
+        }
+
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_addr = in6addr_any;
+        sa6->sin6_port = htons(port);
+        salen = sizeof(*sa6);
+#endif
+    } else {
+        pa_log("Shared sockets are not supported for this address family");
+        goto fail;
+    }
+
+    if (bind(fd, (struct sockaddr *) &ss, salen) < 0) {
+        pa_log("bind() failed: %s", pa_cstrerror(errno));
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+
+    return -1;
+}
+
+static void receiver_free(struct receiver *r) {
+    pa_assert(r);
+    pa_assert(!r->rtpoll_item);
+
+    PA_LLIST_REMOVE(struct receiver, r->userdata->receivers, r);
+
+    pa_rtp_context_free(r->rtp_context);
+    pa_idxset_free(r->sessions, NULL);
+    pa_hashmap_free(r->by_ssrc);
+    pa_xfree(r);
+}
+
+/* Returns the receiver for the session with sdp_info playing to sink, and
+ * joins the session's multicast group on its socket */
+static struct receiver *receiver_get(struct userdata *u, pa_sink *sink, const pa_sdp_info *sdp_info) {
+    const struct sockaddr *sa = (const struct sockaddr *) &sdp_info->sa;
+    uint16_t port = sockaddr_port(sa);
+    struct receiver *r;
+    int fd;
+
+    PA_LLIST_FOREACH(r, u->receivers)
+        if (r->sink == sink && r->family == sa->sa_family && r->port == port)
+            break;
+
+    if (!r) {
+        pa_rtp_context *c;
+
+        if ((fd = shared_socket(sa->sa_family, port)) < 0)
+            return NULL;
+
+        if (!(c = pa_rtp_context_new_recv_shared(fd))) {
+            pa_close(fd);
+            return NULL;
+        }
+
+        r = pa_xnew0(struct receiver, 1);
+        r->userdata = u;
+        r->sink = sink;
+        r->family = sa->sa_family;
+        r->port = port;
+        r->fd = fd;
+        r->rtp_context = c;
+        r->sessions = pa_idxset_new(NULL, NULL);
+        r->by_ssrc = pa_hashmap_new(NULL, NULL);
+
+        PA_LLIST_PREPEND(struct receiver, u->receivers, r);
+
+        pa_log_info("Receiving sessions on port %u on a shared socket", port);
+    }
+
+    if (mcast_membership(r->fd, sa, true) < 0) {
+        pa_log_info("Joining mcast group failed: %s%s", pa_cstrerror(errno),
+                    errno == ENOBUFS ? " (see net.ipv4.igmp_max_memberships)" : "");
+
+        if (r->n_sessions == 0)
+            receiver_free(r);
+
+        return NULL;
+    }
+
+    r->n_sessions++;
+
+    return r;
+}
+
+/* Leaves the session's multicast group, frees the receiver with its last
+ * session */
+static void receiver_release(struct receiver *r, const pa_sdp_info *sdp_info) {
+    pa_assert(r);
+    pa_assert(r->n_sessions > 0);
+
+    mcast_membership(r->fd, (const struct sockaddr *) &sdp_info->sa, false);
+
+    if (--r->n_sessions == 0)
+        receiver_free(r);
+}
+
 static struct session *session_new(struct userdata *u, const pa_sdp_info *sdp_info) {
     struct session *s = NULL;
     pa_sink *sink;
@@ -486,7 +906,7 @@ static struct session *session_new(struct userdata *u, const pa_sdp_info *sdp_in
     pa_assert(u);
     pa_assert(sdp_info);
 
-    if (u->n_sessions >= MAX_SESSIONS) {
+    if (u->n_sessions >= u->max_sessions) {
         pa_log("Session limit reached.");
         goto fail;
     }
@@ -508,7 +928,10 @@ static struct session *session_new(struct userdata *u, const pa_sdp_info *sdp_in
     s->last_latency = u->latency;
     pa_atomic_store(&s->timestamp, (int) now.tv_sec);
 
-    if ((fd = mcast_socket((const struct sockaddr*) &sdp_info->sa, sdp_info->salen)) < 0)
+    if (u->shared_socket) {
+        if (!(s->receiver = receiver_get(u, sink, sdp_info)))
+            goto fail;
+    } else if ((fd = mcast_socket((const struct sockaddr*) &sdp_info->sa, sdp_info->salen)) < 0)
         goto fail;
 
     pa_sink_input_new_data_init(&data);
@@ -529,6 +952,10 @@ static struct session *session_new(struct userdata *u, const pa_sdp_info *sdp_in
     pa_sink_input_new_data_set_sample_spec(&data, &sdp_info->sample_spec);
     data.flags = PA_SINK_INPUT_VARIABLE_RATE;
 
+    /* The receiver is polled from the thread of the sink */
+    if (s->receiver)
+        data.flags |= PA_SINK_INPUT_DONT_MOVE;
+
     pa_sink_input_new(&s->sink_input, u->module->core, &data);
     pa_sink_input_new_data_done(&data);
 
@@ -572,8 +999,23 @@ static struct session *session_new(struct userdata *u, const pa_sdp_info *sdp_in
 
     pa_memblock_unref(silence.memblock);
 
-    if (!(s->rtp_context = pa_rtp_context_new_recv(fd, sdp_info->payload, &s->sdp_info.sample_spec, sdp_info->enable_opus)))
-        goto fail;
+    /* Packets held back for longer than half the queue would be too late
+     * to be played */
+    if (u->jitter_buffer) {
+        pa_usec_t max_delay = (s->intended_latency - s->sink_latency) / 2;
+
+        s->jitter_buffer = pa_jitter_buffer_new(u->module->core->mempool, &s->sink_input->sample_spec, u->jitter_percentile,
+                                                PA_MIN(JITTER_BUFFER_MIN_DELAY, max_delay), max_delay);
+    }
+
+    if (s->receiver)
+        s->frame_size = pa_frame_size(&s->sdp_info.sample_spec);
+    else {
+        if (!(s->rtp_context = pa_rtp_context_new_recv(fd, sdp_info->payload, &s->sdp_info.sample_spec, sdp_info->enable_opus)))
+            goto fail;
+
+        s->frame_size = pa_rtp_context_get_frame_size(s->rtp_context);
+    }
 
     pa_hashmap_put(s->userdata->by_origin, s->sdp_info.origin, s);
     u->n_sessions++;
@@ -586,6 +1028,12 @@ static struct session *session_new(struct userdata *u, const pa_sdp_info *sdp_in
     return s;
 
 fail:
+    if (s && s->receiver)
+        receiver_release(s->receiver, sdp_info);
+
+    if (s && s->jitter_buffer)
+        pa_jitter_buffer_free(s->jitter_buffer);
+
     pa_xfree(s);
 
     if (fd >= 0)
@@ -606,9 +1054,16 @@ static void session_free(struct session *s) {
     pa_assert(s->userdata->n_sessions >= 1);
     s->userdata->n_sessions--;
 
+    if (s->receiver)
+        receiver_release(s->receiver, &s->sdp_info);
+    else
+        pa_rtp_context_free(s->rtp_context);
+
+    if (s->jitter_buffer)
+        pa_jitter_buffer_free(s->jitter_buffer);
+
     pa_memblockq_free(s->memblockq);
     pa_sdp_info_destroy(&s->sdp_info);
-    pa_rtp_context_free(s->rtp_context);
 
     pa_xfree(s);
 }
@@ -677,6 +1132,65 @@ static void check_death_event_cb(pa_mainloop_api *m, pa_time_event *t, const str
     pa_core_rttime_restart(u->module->core, t, pa_rtclock_now() + DEATH_TIMEOUT * PA_USEC_PER_SEC);
 }
 
+/* Called from main context */
+static char *get_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct session *s;
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_array(encoder);
+
+    PA_LLIST_FOREACH(s, u->sessions) {
+        pa_jitter_buffer_stats stats;
+
+        pa_json_encoder_begin_element_object(encoder);
+        pa_json_encoder_add_member_string(encoder, "session", s->sdp_info.session_name);
+        pa_json_encoder_add_member_string(encoder, "origin", s->sdp_info.origin);
+        pa_json_encoder_add_member_int(encoder, "sink_input", s->sink_input->index);
+
+        if (s->jitter_buffer) {
+            pa_assert_se(pa_asyncmsgq_send(s->sink_input->sink->asyncmsgq, PA_MSGOBJECT(s->sink_input),
+                                           SINK_INPUT_MESSAGE_GET_JITTER_STATS, &stats, 0, NULL) == 0);
+
+            pa_json_encoder_add_member_int(encoder, "received", (int64_t) stats.received);
+            pa_json_encoder_add_member_int(encoder, "lost", (int64_t) stats.lost);
+            pa_json_encoder_add_member_int(encoder, "late", (int64_t) stats.late);
+            pa_json_encoder_add_member_int(encoder, "duplicates", (int64_t) stats.duplicates);
+            pa_json_encoder_add_member_int(encoder, "reordered", (int64_t) stats.reordered);
+            pa_json_encoder_add_member_int(encoder, "concealed", (int64_t) stats.concealed);
+            pa_json_encoder_add_member_int(encoder, "jitter", (int64_t) stats.jitter);
+            pa_json_encoder_add_member_int(encoder, "playout_delay", (int64_t) stats.playout_delay);
+        }
+
+        pa_json_encoder_end_object(encoder);
+    }
+
+    pa_json_encoder_end_array(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int rtp_recv_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* One object per session, the jitter buffer counters are only there
+     * if it is enabled. Jitter and playout delay are in usec. */
+    if (pa_streq(message, "get-stats")) {
+        *response = get_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module*m) {
     struct userdata *u;
     pa_modargs *ma = NULL;
@@ -691,7 +1205,9 @@ int pa__init(pa_module*m) {
     struct sockaddr *sa;
     socklen_t salen;
     const char *sap_address;
-    uint32_t latency_msec;
+    uint32_t latency_msec, max_sessions;
+    bool shared = false, jitter_buffer = true;
+    double jitter_percentile;
     int fd = -1;
 
     pa_assert(m);
@@ -748,6 +1264,29 @@ int pa__init(pa_module*m) {
         goto fail;
     }
 
+    max_sessions = DEFAULT_MAX_SESSIONS;
+    if (pa_modargs_get_value_u32(ma, "max_sessions", &max_sessions) < 0 || max_sessions < 1 || max_sessions > 1024) {
+        pa_log("Invalid max_sessions value");
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_boolean(ma, "shared_socket", &shared) < 0) {
+        pa_log("Failed to parse shared_socket argument");
+        goto fail;
+    }
+
+    if (pa_modargs_get_value_boolean(ma, "jitter_buffer", &jitter_buffer) < 0) {
+        pa_log("Failed to parse jitter_buffer argument");
+        goto fail;
+    }
+
+    jitter_percentile = DEFAULT_JITTER_PERCENTILE;
+    if (pa_modargs_get_value_double(ma, "jitter_percentile", &jitter_percentile) < 0 ||
+        jitter_percentile < 0 || jitter_percentile > 100) {
+        pa_log("Invalid jitter_percentile value");
+        goto fail;
+    }
+
     if ((fd = mcast_socket(sa, salen)) < 0)
         goto fail;
 
@@ -756,16 +1295,24 @@ int pa__init(pa_module*m) {
     u->core = m->core;
     u->sink_name = pa_xstrdup(pa_modargs_get_value(ma, "sink", NULL));
     u->latency = (pa_usec_t) latency_msec * PA_USEC_PER_MSEC;
+    u->max_sessions = (int) max_sessions;
+    u->shared_socket = shared;
+    u->jitter_buffer = jitter_buffer;
+    u->jitter_percentile = jitter_percentile;
 
     u->sap_event = m->core->mainloop->io_new(m->core->mainloop, fd, PA_IO_EVENT_INPUT, sap_event_cb, u);
     pa_sap_context_init_recv(&u->sap_context, fd);
 
     PA_LLIST_HEAD_INIT(struct session, u->sessions);
+    PA_LLIST_HEAD_INIT(struct receiver, u->receivers);
     u->n_sessions = 0;
     u->by_origin = pa_hashmap_new_full(pa_idxset_string_hash_func, pa_idxset_string_compare_func, NULL, (pa_free_cb_t) session_free);
 
     u->check_death_event = pa_core_rttime_new(m->core, pa_rtclock_now() + DEATH_TIMEOUT * PA_USEC_PER_SEC, check_death_event_cb, u);
 
+    u->message_handler_path = pa_sprintf_malloc("/module/%u/rtp-recv", m->index);
+    pa_message_handler_register(m->core, u->message_handler_path, "RTP receiver message handler", rtp_recv_message_handler, u);
+
     pa_modargs_free(ma);
 
 #if defined(HAVE_GETADDRINFO)
@@ -797,6 +1344,11 @@ void pa__done(pa_module*m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     if (u->sap_event)
         m->core->mainloop->io_free(u->sap_event);
 
@@ -808,6 +1360,9 @@ void pa__done(pa_module*m) {
     if (u->by_origin)
         pa_hashmap_free(u->by_origin);
 
+    /* Freed with their last session */
+    pa_assert(!u->receivers);
+
     pa_xfree(u->sink_name);
     pa_xfree(u);
 }
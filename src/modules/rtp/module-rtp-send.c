@@ -48,6 +48,8 @@
 #include <pulsecore/macro.h>
 #include <pulsecore/socket-util.h>
 #include <pulsecore/arpa-inet.h>
+#include <pulsecore/json.h>
+#include <pulsecore/message-handler.h>
 
 #include "rtp.h"
 #include "sdp.h"
@@ -118,6 +120,18 @@ struct userdata {
     pa_time_event *sap_event;
 
     enum inhibit_auto_suspend inhibit_auto_suspend;
+
+    char *message_handler_path;
+};
+
+struct send_stats {
+    bool available;
+    uint64_t packets;
+    uint64_t calls;
+};
+
+enum {
+    SOURCE_OUTPUT_MESSAGE_GET_SEND_STATS = PA_SOURCE_OUTPUT_MESSAGE_MAX
 };
 
 /* Called from I/O thread context */
@@ -132,6 +146,13 @@ static int source_output_process_msg(pa_msgobject *o, int code, void *data, int6
             /* Fall through, the default handler will add in the extra
              * latency added by the resampler */
             break;
+
+        case SOURCE_OUTPUT_MESSAGE_GET_SEND_STATS: {
+            struct send_stats *stats = data;
+
+            stats->available = pa_rtp_context_get_send_stats(u->rtp_context, &stats->packets, &stats->calls);
+            return 0;
+        }
     }
 
     return pa_source_output_process_msg(o, code, data, offset, chunk);
@@ -209,6 +230,56 @@ static void sap_event_cb(pa_mainloop_api *m, pa_time_event *t, const struct time
     pa_core_rttime_restart(u->module->core, t, pa_rtclock_now() + SAP_INTERVAL);
 }
 
+/* Called from main context */
+static char *get_stats(struct userdata *u) {
+    pa_json_encoder *encoder;
+    struct send_stats stats;
+
+    pa_zero(stats);
+
+    /* The counters are updated by the IO thread of the source, which is
+     * only there while the stream is linked to one */
+    if (u->source_output->source)
+        pa_assert_se(pa_asyncmsgq_send(u->source_output->source->asyncmsgq, PA_MSGOBJECT(u->source_output),
+                                       SOURCE_OUTPUT_MESSAGE_GET_SEND_STATS, &stats, 0, NULL) == 0);
+
+    encoder = pa_json_encoder_new();
+    pa_json_encoder_begin_element_object(encoder);
+    pa_json_encoder_add_member_int(encoder, "source_output", u->source_output->index);
+
+    if (stats.available) {
+        pa_json_encoder_add_member_int(encoder, "packets", (int64_t) stats.packets);
+        pa_json_encoder_add_member_int(encoder, "calls", (int64_t) stats.calls);
+        pa_json_encoder_add_member_double(encoder, "packets_per_call",
+                                          stats.calls > 0 ? (double) stats.packets / stats.calls : 0.0, 1);
+    }
+
+    pa_json_encoder_end_object(encoder);
+
+    return pa_json_encoder_to_string_free(encoder);
+}
+
+/* Called from main context */
+static int rtp_send_message_handler(const char *object_path, const char *message, const pa_json_object *parameters, char **response, void *userdata) {
+    struct userdata *u = userdata;
+
+    pa_assert(u);
+    pa_assert(message);
+    pa_assert(response);
+
+    if (!object_path || !pa_streq(object_path, u->message_handler_path))
+        return -PA_ERR_NOENTITY;
+
+    /* The packet counters are only there if the backend keeps them, the
+     * GStreamer one does not */
+    if (pa_streq(message, "get-stats")) {
+        *response = get_stats(u);
+        return PA_OK;
+    }
+
+    return -PA_ERR_NOTIMPLEMENTED;
+}
+
 int pa__init(pa_module*m) {
     struct userdata *u;
     pa_modargs *ma = NULL;
@@ -545,6 +616,7 @@ int pa__init(pa_module*m) {
     m->userdata = o->userdata = u = pa_xnew(struct userdata, 1);
     u->module = m;
     u->source_output = o;
+    u->message_handler_path = NULL;
 
     u->memblockq = pa_memblockq_new(
             "module-rtp-send memblockq",
@@ -595,6 +667,9 @@ int pa__init(pa_module*m) {
 
     pa_source_output_put(u->source_output);
 
+    u->message_handler_path = pa_sprintf_malloc("/module/%u/rtp-send", m->index);
+    pa_message_handler_register(m->core, u->message_handler_path, "RTP sender message handler", rtp_send_message_handler, u);
+
     pa_modargs_free(ma);
 
     return 0;
@@ -619,6 +694,11 @@ void pa__done(pa_module*m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->message_handler_path) {
+        pa_message_handler_unregister(m->core, u->message_handler_path);
+        pa_xfree(u->message_handler_path);
+    }
+
     if (u->sap_event)
         m->core->mainloop->time_free(u->sap_event);
 
@@ -627,7 +707,15 @@ void pa__done(pa_module*m) {
         pa_source_output_unref(u->source_output);
     }
 
-    pa_rtp_context_free(u->rtp_context);
+    if (u->rtp_context) {
+        uint64_t packets, calls;
+
+        if (pa_rtp_context_get_send_stats(u->rtp_context, &packets, &calls) && calls > 0)
+            pa_log_debug("Sent %llu RTP packets with %llu system calls, %.1f packets per call",
+                         (unsigned long long) packets, (unsigned long long) calls, (double) packets / calls);
+
+        pa_rtp_context_free(u->rtp_context);
+    }
 
     pa_sap_send(&u->sap_context, 1);
     pa_sap_context_destroy(&u->sap_context);
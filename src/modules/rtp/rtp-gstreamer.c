@@ -552,6 +552,10 @@ static GstFlowReturn appsink_new_sample(GstAppSink *appsink, gpointer userdata)
     return GST_FLOW_OK;
 }
 
+bool pa_rtp_context_get_send_stats(pa_rtp_context *c, uint64_t *packets, uint64_t *calls) {
+    return false;
+}
+
 pa_rtp_context* pa_rtp_context_new_recv(int fd, uint8_t payload, const pa_sample_spec *ss, bool enable_opus) {
     pa_rtp_context *c = NULL;
     GstAppSinkCallbacks callbacks = { 0, };
@@ -716,6 +720,23 @@ fail:
     return -1;
 }
 
+bool pa_rtp_context_has_pending(pa_rtp_context *c) {
+    return false;
+}
+
+bool pa_rtp_context_get_last_sequence(pa_rtp_context *c, uint16_t *sequence) {
+    return false;
+}
+
+pa_rtp_context* pa_rtp_context_new_recv_shared(int fd) {
+    pa_log("Shared receive sockets are not supported by the GStreamer RTP backend");
+    return NULL;
+}
+
+int pa_rtp_recv_packet(pa_rtp_context *c, pa_memchunk *chunk, pa_mempool *pool, pa_rtp_packet_info *info) {
+    return -1;
+}
+
 void pa_rtp_context_free(pa_rtp_context *c) {
     pa_assert(c);
 
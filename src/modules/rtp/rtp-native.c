@@ -35,15 +35,58 @@
 #include <sys/uio.h>
 #endif
 
+#ifdef HAVE_NETINET_UDP_H
+#include <netinet/udp.h>
+#endif
+
 #include <pulsecore/core-error.h>
 #include <pulsecore/log.h>
 #include <pulsecore/macro.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/arpa-inet.h>
 #include <pulsecore/poll.h>
+#include <pulsecore/once.h>
 
 #include "rtp.h"
 
+#define MAX_IOVECS 16
+
+/* Packets collected before they are sent with as few system calls as
+ * possible */
+#define MAX_PACKETS 32
+
+/* A UDP datagram cannot carry more, and the kernel splits a GSO buffer
+ * into at most this many segments */
+#define MAX_GSO_BYTES 65507
+#define MAX_GSO_SEGMENTS 64
+
+/* Packets received with one system call */
+#ifdef HAVE_RECVMMSG
+#define RECV_BATCH 32
+#else
+#define RECV_BATCH 1
+#endif
+
+#define RECV_SLOT_SIZE 2048
+#define RECV_AUX_SIZE 256
+
+#ifdef HAVE_RECVMMSG
+typedef struct mmsghdr recv_msg_t;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} recv_msg_t;
+#endif
+
+struct packet {
+    uint32_t header[3];
+    struct iovec iov[MAX_IOVECS];
+    pa_memblock *mb[MAX_IOVECS];
+    unsigned n_iov;
+    size_t length;
+};
+
 typedef struct pa_rtp_context {
     int fd;
     uint16_t sequence;
@@ -53,9 +96,30 @@ typedef struct pa_rtp_context {
     size_t frame_size;
     size_t mtu;
 
-    uint8_t *recv_buf;
-    size_t recv_buf_size;
-    pa_memchunk memchunk;
+    struct packet *packets;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr *msgs;
+#endif
+#ifdef UDP_SEGMENT
+    struct iovec *gso_iov;
+    bool gso;
+#endif
+    uint64_t packets_sent;
+    uint64_t send_calls;
+
+    /* Packets are received into slots of recv_block, one after the other,
+     * and handed out as chunks of it without copying */
+    pa_memblock *recv_block;
+    size_t recv_offset;
+    size_t slot_size;
+    size_t batch_offset;
+    size_t batch_slot_size;
+    recv_msg_t *recv_msgs;
+    struct iovec *recv_iov;
+    uint8_t *recv_aux;
+    unsigned n_received;
+    unsigned next_received;
+    bool shared;
 } pa_rtp_context;
 
 pa_rtp_context* pa_rtp_context_new_send(int fd, uint8_t payload, size_t mtu, const pa_sample_spec *ss, bool enable_opus) {
@@ -75,20 +139,180 @@ pa_rtp_context* pa_rtp_context_new_send(int fd, uint8_t payload, size_t mtu, con
     c->frame_size = pa_frame_size(ss);
     c->mtu = mtu;
 
-    c->recv_buf = NULL;
-    c->recv_buf_size = 0;
-    pa_memchunk_reset(&c->memchunk);
+    c->packets = pa_xnew0(struct packet, MAX_PACKETS);
+#ifdef HAVE_SENDMMSG
+    c->msgs = pa_xnew0(struct mmsghdr, MAX_PACKETS);
+#endif
+#ifdef UDP_SEGMENT
+    c->gso_iov = pa_xnew(struct iovec, MAX_PACKETS * MAX_IOVECS);
+    c->gso = true;
+#endif
 
     return c;
 }
 
-#define MAX_IOVECS 16
+static void packet_to_msghdr(struct packet *p, struct msghdr *m) {
+    pa_zero(*m);
+    m->msg_iov = p->iov;
+    m->msg_iovlen = p->n_iov;
+}
+
+#ifdef UDP_SEGMENT
+/* Sends packets[first..last) with one sendmsg(), letting the kernel split
+ * the buffer into datagrams of segment bytes. All packets but the last
+ * must have exactly that size. */
+static ssize_t send_gso(pa_rtp_context *c, unsigned first, unsigned last, uint16_t segment) {
+    union {
+        struct cmsghdr cm;
+        uint8_t buf[CMSG_SPACE(sizeof(uint16_t))];
+    } control;
+    struct cmsghdr *cm;
+    struct msghdr m;
+    size_t n_iov = 0;
+    unsigned i;
+
+    for (i = first; i < last; i++) {
+        memcpy(c->gso_iov + n_iov, c->packets[i].iov, c->packets[i].n_iov * sizeof(struct iovec));
+        n_iov += c->packets[i].n_iov;
+    }
+
+    pa_zero(m);
+    pa_zero(control);
+    m.msg_iov = c->gso_iov;
+    m.msg_iovlen = n_iov;
+    m.msg_control = control.buf;
+    m.msg_controllen = sizeof(control.buf);
+
+    cm = CMSG_FIRSTHDR(&m);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cm), &segment, sizeof(uint16_t));
+
+    return sendmsg(c->fd, &m, MSG_DONTWAIT);
+}
+
+/* Sends runs of full sized packets with one system call each. Turns GSO
+ * off for good if the kernel refuses it, the caller then has to send the
+ * remaining packets some other way. */
+static unsigned send_packets_gso(pa_rtp_context *c, unsigned n_packets) {
+    size_t segment = c->mtu + sizeof(c->packets[0].header);
+    unsigned max = (unsigned) PA_MIN(MAX_GSO_BYTES / segment, (size_t) MAX_GSO_SEGMENTS);
+    unsigned i = 0;
+
+    if (max < 2) {
+        c->gso = false;
+        return 0;
+    }
+
+    while (i < n_packets) {
+        unsigned j = i + 1;
+        ssize_t k;
+
+        /* Only the last packet of a run may be shorter */
+        while (j < n_packets && j - i < max && c->packets[j - 1].length == segment)
+            j++;
+
+        if (j - i > 1)
+            k = send_gso(c, i, j, (uint16_t) segment);
+        else {
+            struct msghdr m;
+
+            packet_to_msghdr(&c->packets[i], &m);
+            k = sendmsg(c->fd, &m, MSG_DONTWAIT);
+        }
+
+        if (k < 0) {
+            if (j - i > 1 && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                /* Old kernel, or the route cannot do it, e.g. without
+                 * checksum offloading */
+                pa_log_info("UDP GSO not available, falling back to sendmmsg(): %s", pa_cstrerror(errno));
+                c->gso = false;
+            }
+
+            break;
+        }
+
+        c->send_calls++;
+        i = j;
+    }
+
+    return i;
+}
+#endif
+
+/* Returns the number of packets sent, errno is set if that is less than
+ * n_packets */
+static unsigned send_packets(pa_rtp_context *c, unsigned n_packets) {
+    unsigned i = 0;
+
+#ifdef UDP_SEGMENT
+    if (c->gso && n_packets > 1) {
+        i = send_packets_gso(c, n_packets);
+
+        if (i >= n_packets || c->gso)
+            return i;
+    }
+#endif
+
+#ifdef HAVE_SENDMMSG
+    while (i < n_packets) {
+        unsigned j;
+        int r;
+
+        for (j = i; j < n_packets; j++)
+            packet_to_msghdr(&c->packets[j], &c->msgs[j].msg_hdr);
+
+        if ((r = sendmmsg(c->fd, c->msgs + i, n_packets - i, MSG_DONTWAIT)) <= 0)
+            break;
+
+        c->send_calls++;
+        i += (unsigned) r;
+    }
+#else
+    for (; i < n_packets; i++) {
+        struct msghdr m;
+
+        packet_to_msghdr(&c->packets[i], &m);
+
+        if (sendmsg(c->fd, &m, MSG_DONTWAIT) < 0)
+            break;
+
+        c->send_calls++;
+    }
+#endif
+
+    return i;
+}
+
+/* Sends the packets collected so far and releases their memory blocks.
+ * Packets that could not be sent are dropped. */
+static int flush_packets(pa_rtp_context *c, unsigned n_packets) {
+    unsigned sent, i, j;
+
+    if (n_packets <= 0)
+        return 0;
 
+    sent = send_packets(c, n_packets);
+    c->packets_sent += sent;
+
+    if (sent < n_packets && errno != EAGAIN && errno != EINTR) /* If the queue is full, just ignore it */
+        pa_log("sendmsg() failed: %s", pa_cstrerror(errno));
+
+    for (i = 0; i < n_packets; i++)
+        for (j = 1; j < c->packets[i].n_iov; j++) {
+            pa_memblock_release(c->packets[i].mb[j]);
+            pa_memblock_unref(c->packets[i].mb[j]);
+        }
+
+    return sent < n_packets ? -1 : 0;
+}
+
+/* Takes every whole packet there is in the queue and sends them in one go,
+ * with UDP GSO if possible, sendmmsg() otherwise */
 int pa_rtp_send(pa_rtp_context *c, pa_memblockq *q) {
-    struct iovec iov[MAX_IOVECS];
-    pa_memblock* mb[MAX_IOVECS];
-    int iov_idx = 1;
-    size_t n = 0;
+    unsigned n_packets = 0;
+    struct packet *p = NULL;
 
     pa_assert(c);
     pa_assert(q);
@@ -100,298 +324,388 @@ int pa_rtp_send(pa_rtp_context *c, pa_memblockq *q) {
         int r;
         pa_memchunk chunk;
 
+        if (!p) {
+            p = &c->packets[n_packets];
+            p->n_iov = 1;
+            p->length = 0;
+        }
+
         pa_memchunk_reset(&chunk);
 
         if ((r = pa_memblockq_peek(q, &chunk)) >= 0) {
 
-            size_t k = n + chunk.length > c->mtu ? c->mtu - n : chunk.length;
+            size_t k = p->length + chunk.length > c->mtu ? c->mtu - p->length : chunk.length;
 
             pa_assert(chunk.memblock);
 
-            iov[iov_idx].iov_base = pa_memblock_acquire_chunk(&chunk);
-            iov[iov_idx].iov_len = k;
-            mb[iov_idx] = chunk.memblock;
-            iov_idx ++;
+            p->iov[p->n_iov].iov_base = pa_memblock_acquire_chunk(&chunk);
+            p->iov[p->n_iov].iov_len = k;
+            p->mb[p->n_iov] = chunk.memblock;
+            p->n_iov++;
 
-            n += k;
+            p->length += k;
             pa_memblockq_drop(q, k);
         }
 
-        pa_assert(n % c->frame_size == 0);
-
-        if (r < 0 || n >= c->mtu || iov_idx >= MAX_IOVECS) {
-            uint32_t header[3];
-            struct msghdr m;
-            ssize_t k;
-            int i;
-
-            if (n > 0) {
-                header[0] = htonl(((uint32_t) 2 << 30) | ((uint32_t) c->payload << 16) | ((uint32_t) c->sequence));
-                header[1] = htonl(c->timestamp);
-                header[2] = htonl(c->ssrc);
+        pa_assert(p->length % c->frame_size == 0);
 
-                iov[0].iov_base = (void*)header;
-                iov[0].iov_len = sizeof(header);
+        if (r < 0 || p->length >= c->mtu || p->n_iov >= MAX_IOVECS) {
+            bool done = r < 0 || pa_memblockq_get_length(q) < c->mtu;
 
-                m.msg_name = NULL;
-                m.msg_namelen = 0;
-                m.msg_iov = iov;
-                m.msg_iovlen = (size_t) iov_idx;
-                m.msg_control = NULL;
-                m.msg_controllen = 0;
-                m.msg_flags = 0;
+            if (p->length > 0) {
+                p->header[0] = htonl(((uint32_t) 2 << 30) | ((uint32_t) c->payload << 16) | ((uint32_t) c->sequence));
+                p->header[1] = htonl(c->timestamp);
+                p->header[2] = htonl(c->ssrc);
 
-                k = sendmsg(c->fd, &m, MSG_DONTWAIT);
+                p->iov[0].iov_base = (void*) p->header;
+                p->iov[0].iov_len = sizeof(p->header);
 
-                for (i = 1; i < iov_idx; i++) {
-                    pa_memblock_release(mb[i]);
-                    pa_memblock_unref(mb[i]);
-                }
+                c->timestamp += (unsigned) (p->length / c->frame_size);
+                p->length += sizeof(p->header);
 
                 c->sequence++;
-            } else
-                k = 0;
+                n_packets++;
+            }
 
-            c->timestamp += (unsigned) (n/c->frame_size);
+            p = NULL;
 
-            if (k < 0) {
-                if (errno != EAGAIN && errno != EINTR) /* If the queue is full, just ignore it */
-                    pa_log("sendmsg() failed: %s", pa_cstrerror(errno));
-                return -1;
+            if (done || n_packets >= MAX_PACKETS) {
+                if (flush_packets(c, n_packets) < 0)
+                    return -1;
+
+                n_packets = 0;
             }
 
-            if (r < 0 || pa_memblockq_get_length(q) < c->mtu)
+            if (done)
                 break;
-
-            n = 0;
-            iov_idx = 1;
         }
     }
 
     return 0;
 }
 
-pa_rtp_context* pa_rtp_context_new_recv(int fd, uint8_t payload, const pa_sample_spec *ss, bool enable_opus) {
-    pa_rtp_context *c;
+bool pa_rtp_context_get_send_stats(pa_rtp_context *c, uint64_t *packets, uint64_t *calls) {
+    pa_assert(c);
+    pa_assert(packets);
+    pa_assert(calls);
 
-    pa_log_info("Initialising native RTP backend for receive");
+    *packets = c->packets_sent;
+    *calls = c->send_calls;
+
+    return true;
+}
+
+static pa_rtp_context *context_new_recv(int fd) {
+    pa_rtp_context *c;
 
     c = pa_xnew0(pa_rtp_context, 1);
 
     c->fd = fd;
+    c->slot_size = RECV_SLOT_SIZE;
+    c->recv_msgs = pa_xnew0(recv_msg_t, RECV_BATCH);
+    c->recv_iov = pa_xnew0(struct iovec, RECV_BATCH);
+    c->recv_aux = pa_xmalloc(RECV_BATCH * RECV_AUX_SIZE);
+
+    return c;
+}
+
+pa_rtp_context* pa_rtp_context_new_recv(int fd, uint8_t payload, const pa_sample_spec *ss, bool enable_opus) {
+    pa_rtp_context *c;
+
+    pa_log_info("Initialising native RTP backend for receive");
+
+    c = context_new_recv(fd);
     c->payload = payload;
     c->frame_size = pa_frame_size(ss);
 
-    c->recv_buf_size = 2000;
-    c->recv_buf = pa_xmalloc(c->recv_buf_size);
-    pa_memchunk_reset(&c->memchunk);
+    return c;
+}
+
+pa_rtp_context* pa_rtp_context_new_recv_shared(int fd) {
+    pa_rtp_context *c;
+
+    pa_log_info("Initialising native RTP backend for receive on a shared socket");
+
+    c = context_new_recv(fd);
+    c->shared = true;
 
     return c;
 }
 
-int pa_rtp_recv(pa_rtp_context *c, pa_memchunk *chunk, pa_mempool *pool, uint32_t *rtp_tstamp, struct timeval *tstamp) {
-    int size;
-    size_t audio_length;
-    size_t metadata_length;
-    struct msghdr m;
-    struct cmsghdr *cm;
-    struct iovec iov;
-    uint32_t header;
-    uint32_t ssrc;
-    uint8_t payload;
-    unsigned cc;
-    uint8_t aux[1024];
-    bool found_tstamp = false;
+/* Receives as many packets as there are, up to RECV_BATCH, into the free
+ * slots of the receive block. Returns the number of packets received. */
+static int receive_batch(pa_rtp_context *c, pa_mempool *pool) {
+    size_t block_size;
+    uint8_t *data;
+    unsigned i, n;
+    int r;
 
-    pa_assert(c);
-    pa_assert(chunk);
+    c->n_received = c->next_received = 0;
 
-    pa_memchunk_reset(chunk);
+    if (c->recv_block && c->recv_offset + c->slot_size > pa_memblock_get_length(c->recv_block)) {
+        pa_memblock_unref(c->recv_block);
+        c->recv_block = NULL;
+    }
 
-    /* FIONREAD works on both BSD and Linux, but they do something different:
-     * - on Linux it returns the amount of bytes in the next datagram
-     * - on BSDs it returns the total amount of bytes in the output buffer; this can be
-     *   more than one datagram and includes headers
-     *
-     * So the result will be a lower bound of how many bytes are needed, but might not be
-     * the exact size of the buffer size needed.
-     */
-
-    if (ioctl(c->fd, FIONREAD, &size) < 0) {
-        pa_log_warn("FIONREAD failed: %s", pa_cstrerror(errno));
-        goto fail;
+    if (!c->recv_block) {
+        block_size = pa_mempool_block_size_max(pool);
+        c->slot_size = PA_MIN(c->slot_size, block_size);
+        c->recv_block = pa_memblock_new(pool, PA_MAX(block_size, c->slot_size));
+        c->recv_offset = 0;
     }
 
-    if (size <= 0) {
-        /* size can be 0 due to any of the following reasons:
-         *
-         * 1. Somebody sent us a perfectly valid zero-length UDP packet.
-         * 2. Somebody sent us a UDP packet with a bad CRC.
-         *
-         * It is unknown whether size can actually be less than zero.
-         *
-         * In the first case, the packet has to be read out, otherwise the
-         * kernel will tell us again and again about it, thus preventing
-         * reception of any further packets. So let's just read it out
-         * now and discard it later, when comparing the number of bytes
-         * received (0) with the number of bytes wanted (1, see below).
-         *
-         * In the second case, recvmsg() will fail, thus allowing us to
-         * return the error.
-         *
-         * Just to avoid passing zero-sized memchunks and NULL pointers to
-         * recvmsg(), let's force allocation of at least one byte by setting
-         * size to 1.
-         */
-        size = 1;
+    n = (unsigned) PA_MIN((pa_memblock_get_length(c->recv_block) - c->recv_offset) / c->slot_size, (size_t) RECV_BATCH);
+    pa_assert(n > 0);
+
+    c->batch_offset = c->recv_offset;
+    c->batch_slot_size = c->slot_size;
+
+    data = pa_memblock_acquire(c->recv_block);
+
+    for (i = 0; i < n; i++) {
+        struct msghdr *m = &c->recv_msgs[i].msg_hdr;
+
+        c->recv_iov[i].iov_base = data + c->batch_offset + i * c->slot_size;
+        c->recv_iov[i].iov_len = c->slot_size;
+
+        pa_zero(*m);
+        m->msg_iov = &c->recv_iov[i];
+        m->msg_iovlen = 1;
+        m->msg_control = c->recv_aux + i * RECV_AUX_SIZE;
+        m->msg_controllen = RECV_AUX_SIZE;
     }
 
-    /* Since size is a lower bound, also constrain it to an upper bound */
-    size = PA_MIN(size, 1<<16);
+#ifdef HAVE_RECVMMSG
+    r = recvmmsg(c->fd, c->recv_msgs, n, MSG_DONTWAIT, NULL);
+#else
+    {
+        ssize_t k;
+
+        if ((k = recvmsg(c->fd, &c->recv_msgs[0].msg_hdr, MSG_DONTWAIT)) >= 0) {
+            c->recv_msgs[0].msg_len = (unsigned) k;
+            r = 1;
+        } else
+            r = -1;
+    }
+#endif
 
-    if (c->recv_buf_size < (size_t) size) {
-        do
-            c->recv_buf_size *= 2;
-        while (c->recv_buf_size < (size_t) size);
+    pa_memblock_release(c->recv_block);
 
-        c->recv_buf = pa_xrealloc(c->recv_buf, c->recv_buf_size);
+    if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            pa_log_warn("recvmmsg() failed: %s", pa_cstrerror(errno));
+        return -1;
     }
 
-    pa_assert(c->recv_buf_size >= (size_t) size);
+    /* Only the slots that were filled are used up */
+    c->recv_offset += (size_t) r * c->slot_size;
+    c->n_received = (unsigned) r;
+
+    return r;
+}
 
-    iov.iov_base = c->recv_buf;
-    iov.iov_len = (size_t) size;
+static void packet_info_from_aux(pa_rtp_packet_info *info, struct msghdr *m) {
+    struct cmsghdr *cm;
+    bool found_tstamp = false;
+
+    for (cm = CMSG_FIRSTHDR(m); cm; cm = CMSG_NXTHDR(m, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(&info->tstamp, CMSG_DATA(cm), sizeof(struct timeval));
+            found_tstamp = true;
+        }
+#ifdef IP_PKTINFO
+        else if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo pi;
+            struct sockaddr_in *sa = (struct sockaddr_in *) &info->dst;
+
+            memcpy(&pi, CMSG_DATA(cm), sizeof(pi));
+            pa_zero(*sa);
+            sa->sin_family = AF_INET;
+            sa->sin_addr = pi.ipi_addr;
+            info->has_dst = true;
+        }
+#endif
+#if defined(HAVE_IPV6) && defined(IPV6_PKTINFO)
+        else if (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo pi;
+            struct sockaddr_in6 *sa = (struct sockaddr_in6 *) &info->dst;
+
+            memcpy(&pi, CMSG_DATA(cm), sizeof(pi));
+            pa_zero(*sa);
+            sa->sin6_family = AF_INET6;
+            sa->sin6_addr = pi.ipi6_addr;
+            info->has_dst = true;
+        }
+#endif
+    }
 
-    m.msg_name = NULL;
-    m.msg_namelen = 0;
-    m.msg_iov = &iov;
-    m.msg_iovlen = 1;
-    m.msg_control = aux;
-    m.msg_controllen = sizeof(aux);
-    m.msg_flags = 0;
+    if (!found_tstamp) {
+        PA_ONCE_BEGIN {
+            pa_log_warn("Couldn't find SCM_TIMESTAMP data in auxiliary recvmsg() data!");
+        } PA_ONCE_END;
+        pa_zero(info->tstamp);
+    }
+}
 
-    size = recvmsg(c->fd, &m, 0);
+/* Parses the next packet of the batch, returns -1 if it is not a valid
+ * RTP packet */
+static int parse_packet(pa_rtp_context *c, unsigned i, pa_memchunk *chunk, pa_rtp_packet_info *info) {
+    recv_msg_t *msg = &c->recv_msgs[i];
+    size_t size = msg->msg_len, offset, metadata_length;
+    uint32_t header, ssrc, tstamp;
+    uint8_t *data;
+    unsigned cc;
 
-    if (size < 0) {
-        if (errno != EAGAIN && errno != EINTR)
-            pa_log_warn("recvmsg() failed: %s", pa_cstrerror(errno));
-        goto fail;
+    if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+        if (c->slot_size == c->batch_slot_size && c->slot_size < 1 << 16) {
+            pa_log_info("Dropped an RTP packet larger than %zu bytes, receiving into larger slots from now on.", c->slot_size);
+            c->slot_size *= 2;
+        }
+        return -1;
     }
 
     if (size < 12) {
         pa_log_warn("RTP packet too short.");
-        goto fail;
+        return -1;
     }
 
-    memcpy(&header, iov.iov_base, sizeof(uint32_t));
-    memcpy(rtp_tstamp, (uint8_t*) iov.iov_base + 4, sizeof(uint32_t));
-    memcpy(&ssrc, (uint8_t*) iov.iov_base + 8, sizeof(uint32_t));
+    offset = c->batch_offset + i * c->batch_slot_size;
+    data = (uint8_t *) pa_memblock_acquire(c->recv_block) + offset;
+
+    memcpy(&header, data, sizeof(uint32_t));
+    memcpy(&tstamp, data + 4, sizeof(uint32_t));
+    memcpy(&ssrc, data + 8, sizeof(uint32_t));
+
+    pa_memblock_release(c->recv_block);
 
     header = ntohl(header);
-    *rtp_tstamp = ntohl(*rtp_tstamp);
-    ssrc = ntohl(c->ssrc);
 
     if ((header >> 30) != 2) {
         pa_log_warn("Unsupported RTP version.");
-        goto fail;
+        return -1;
     }
 
     if ((header >> 29) & 1) {
         pa_log_warn("RTP padding not supported.");
-        goto fail;
+        return -1;
     }
 
     if ((header >> 28) & 1) {
         pa_log_warn("RTP header extensions not supported.");
-        goto fail;
-    }
-
-    if (ssrc != c->ssrc) {
-        pa_log_debug("Got unexpected SSRC");
-        goto fail;
+        return -1;
     }
 
     cc = (header >> 24) & 0xF;
-    payload = (uint8_t) ((header >> 16) & 127U);
-    c->sequence = (uint16_t) (header & 0xFFFFU);
-
     metadata_length = 12 + cc * 4;
 
-    if (payload != c->payload) {
-        pa_log_debug("Got unexpected payload: %u", payload);
-        goto fail;
-    }
-
-    if (metadata_length > (unsigned) size) {
+    if (metadata_length > size) {
         pa_log_warn("RTP packet too short. (CSRC)");
-        goto fail;
+        return -1;
     }
 
-    audio_length = size - metadata_length;
+    info->payload = (uint8_t) ((header >> 16) & 127U);
+    info->sequence = (uint16_t) (header & 0xFFFFU);
+    info->rtp_tstamp = ntohl(tstamp);
+    info->ssrc = ntohl(ssrc);
+    info->has_dst = false;
+    packet_info_from_aux(info, &msg->msg_hdr);
 
-    if (audio_length % c->frame_size != 0) {
-        pa_log_warn("Bad RTP packet size.");
-        goto fail;
-    }
-
-    if (c->memchunk.length < (unsigned) audio_length) {
-        size_t l;
+    chunk->memblock = pa_memblock_ref(c->recv_block);
+    chunk->index = offset + metadata_length;
+    chunk->length = size - metadata_length;
 
-        if (c->memchunk.memblock)
-            pa_memblock_unref(c->memchunk.memblock);
+    return 0;
+}
 
-        l = PA_MAX((size_t) audio_length, pa_mempool_block_size_max(pool));
+int pa_rtp_recv_packet(pa_rtp_context *c, pa_memchunk *chunk, pa_mempool *pool, pa_rtp_packet_info *info) {
+    pa_assert(c);
+    pa_assert(chunk);
+    pa_assert(pool);
+    pa_assert(info);
 
-        c->memchunk.memblock = pa_memblock_new(pool, l);
-        c->memchunk.index = 0;
-        c->memchunk.length = pa_memblock_get_length(c->memchunk.memblock);
-    }
+    pa_memchunk_reset(chunk);
 
-    memcpy(pa_memblock_acquire_chunk(&c->memchunk), c->recv_buf + metadata_length, audio_length);
-    pa_memblock_release(c->memchunk.memblock);
+    for (;;) {
+        unsigned i;
+
+        if (c->next_received >= c->n_received) {
+            /* Only ask the kernel again if the last batch was full,
+             * otherwise the socket is most likely empty by now and we
+             * let poll() tell us about new packets */
+            if (c->n_received > 0 && c->n_received < RECV_BATCH) {
+                c->n_received = c->next_received = 0;
+                return -1;
+            }
 
-    chunk->memblock = pa_memblock_ref(c->memchunk.memblock);
-    chunk->index = c->memchunk.index;
-    chunk->length = audio_length;
+            if (receive_batch(c, pool) <= 0)
+                return -1;
+        }
 
-    c->memchunk.index += audio_length;
-    c->memchunk.length -= audio_length;
+        i = c->next_received++;
 
-    if (c->memchunk.length <= 0) {
-        pa_memblock_unref(c->memchunk.memblock);
-        pa_memchunk_reset(&c->memchunk);
+        if (parse_packet(c, i, chunk, info) >= 0)
+            return 0;
     }
+}
 
-    for (cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm))
-        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMP) {
-            memcpy(tstamp, CMSG_DATA(cm), sizeof(struct timeval));
-            found_tstamp = true;
-            break;
-        }
+bool pa_rtp_context_has_pending(pa_rtp_context *c) {
+    pa_assert(c);
 
-    if (!found_tstamp) {
-        pa_log_warn("Couldn't find SCM_TIMESTAMP data in auxiliary recvmsg() data!");
-        pa_zero(*tstamp);
-    }
+    return c->next_received < c->n_received || c->n_received >= RECV_BATCH;
+}
 
-    return 0;
+int pa_rtp_recv(pa_rtp_context *c, pa_memchunk *chunk, pa_mempool *pool, uint32_t *rtp_tstamp, struct timeval *tstamp) {
+    pa_rtp_packet_info info;
+
+    pa_assert(c);
+    pa_assert(chunk);
+    pa_assert(!c->shared);
+
+    while (pa_rtp_recv_packet(c, chunk, pool, &info) >= 0) {
+        if (info.payload != c->payload)
+            pa_log_debug("Got unexpected payload: %u", info.payload);
+        else if (chunk->length % c->frame_size != 0)
+            pa_log_warn("Bad RTP packet size.");
+        else {
+            c->sequence = info.sequence;
+            *rtp_tstamp = info.rtp_tstamp;
+            *tstamp = info.tstamp;
+            return 0;
+        }
 
-fail:
-    if (chunk->memblock)
         pa_memblock_unref(chunk->memblock);
+        pa_memchunk_reset(chunk);
+    }
 
     return -1;
 }
 
+bool pa_rtp_context_get_last_sequence(pa_rtp_context *c, uint16_t *sequence) {
+    pa_assert(c);
+    pa_assert(sequence);
+
+    *sequence = c->sequence;
+    return true;
+}
+
 void pa_rtp_context_free(pa_rtp_context *c) {
     pa_assert(c);
 
     pa_assert_se(pa_close(c->fd) == 0);
 
-    if (c->memchunk.memblock)
-        pa_memblock_unref(c->memchunk.memblock);
+    if (c->recv_block)
+        pa_memblock_unref(c->recv_block);
 
-    pa_xfree(c->recv_buf);
+    pa_xfree(c->packets);
+#ifdef HAVE_SENDMMSG
+    pa_xfree(c->msgs);
+#endif
+#ifdef UDP_SEGMENT
+    pa_xfree(c->gso_iov);
+#endif
+    pa_xfree(c->recv_msgs);
+    pa_xfree(c->recv_iov);
+    pa_xfree(c->recv_aux);
     pa_xfree(c);
 }
 
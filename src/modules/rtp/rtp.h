@@ -36,9 +36,41 @@ pa_rtp_context* pa_rtp_context_new_send(int fd, uint8_t payload, size_t mtu, con
  * guarantee that the current read index doesn't point to a hole. */
 int pa_rtp_send(pa_rtp_context *c, pa_memblockq *q);
 
+/* Number of packets sent and of system calls needed for that. Returns false
+ * if the backend does not know. */
+bool pa_rtp_context_get_send_stats(pa_rtp_context *c, uint64_t *packets, uint64_t *calls);
+
 pa_rtp_context* pa_rtp_context_new_recv(int fd, uint8_t payload, const pa_sample_spec *ss, bool enable_opus);
 int pa_rtp_recv(pa_rtp_context *c, pa_memchunk *chunk, pa_mempool *pool, uint32_t *rtp_tstamp, struct timeval *tstamp);
 
+/* The sequence number of the packet last returned by pa_rtp_recv().
+ * Returns false if the backend does not know. */
+bool pa_rtp_context_get_last_sequence(pa_rtp_context *c, uint16_t *sequence);
+
+/* Packets may be received several at a time, in which case the ones not
+ * returned yet are pending and should be fetched before waiting for the
+ * socket to become readable again. */
+bool pa_rtp_context_has_pending(pa_rtp_context *c);
+
+typedef struct pa_rtp_packet_info {
+    uint8_t payload;
+    uint16_t sequence;
+    uint32_t ssrc;
+    uint32_t rtp_tstamp;
+    struct timeval tstamp;
+
+    /* The address the packet was sent to, the port is not set */
+    bool has_dst;
+    struct sockaddr_storage dst;
+} pa_rtp_packet_info;
+
+/* A receive context for a socket several sessions are received on. It
+ * does not filter by payload type, the caller demultiplexes the packets
+ * by SSRC and destination. Returns NULL if the backend does not support
+ * this. */
+pa_rtp_context* pa_rtp_context_new_recv_shared(int fd);
+int pa_rtp_recv_packet(pa_rtp_context *c, pa_memchunk *chunk, pa_mempool *pool, pa_rtp_packet_info *info);
+
 void pa_rtp_context_free(pa_rtp_context *c);
 
 size_t pa_rtp_context_get_frame_size(pa_rtp_context *c);
@@ -0,0 +1,448 @@
+/***
+    This file is part of PulseAudio.
+
+    PulseAudio is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation; either version 2.1 of the License,
+    or (at your option) any later version.
+
+    PulseAudio is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "tunnel-connection.h"
+
+#include <pulse/error.h>
+#include <pulse/mainloop.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/atomic.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/llist.h>
+#include <pulsecore/log.h>
+#include <pulsecore/msgobject.h>
+#include <pulsecore/proplist-util.h>
+#include <pulsecore/shared.h>
+#include <pulsecore/thread.h>
+
+#define TUNNEL_THREAD_FAILED_MAINLOOP 1
+
+struct pa_tunnel_client {
+    pa_tunnel_client_callbacks callbacks;
+    void *userdata;
+
+    pa_tunnel_stats stats;
+
+    PA_LLIST_FIELDS(pa_tunnel_client);
+};
+
+struct pa_tunnel_connection {
+    pa_msgobject parent;
+
+    pa_core *core;
+    unsigned n_users;
+
+    /* The name under which a shared connection is registered, NULL for a
+     * private connection */
+    char *shared_name;
+    char *server;
+    char *cookie_file;
+
+    pa_thread *thread;
+    pa_thread_mq thread_mq;
+    pa_mainloop *thread_mainloop;
+    pa_mainloop_api *thread_mainloop_api;
+    pa_rtpoll *rtpoll;
+
+    /* Set by the IO thread when the context is gone, a failed connection is
+     * not handed out to new tunnels anymore */
+    pa_atomic_t failed;
+
+    /* Only accessed from the IO thread */
+    pa_context *context;
+    bool ready;
+    PA_LLIST_HEAD(pa_tunnel_client, clients);
+    pa_tunnel_stats removed;
+};
+
+typedef pa_tunnel_connection tunnel_connection;
+PA_DEFINE_PRIVATE_CLASS(tunnel_connection, pa_msgobject);
+#define TUNNEL_CONNECTION(o) (tunnel_connection_cast(o))
+
+enum {
+    TUNNEL_CONNECTION_MESSAGE_ADD_CLIENT,
+    TUNNEL_CONNECTION_MESSAGE_REMOVE_CLIENT,
+    TUNNEL_CONNECTION_MESSAGE_GET_STATS,
+};
+
+static void add_stats(pa_tunnel_stats *sum, const pa_tunnel_stats *stats) {
+    sum->bytes += stats->bytes;
+    sum->underflows += stats->underflows;
+    sum->overflows += stats->overflows;
+}
+
+/* Called from IO thread */
+static void context_state_cb(pa_context *context, void *userdata) {
+    pa_tunnel_connection *c = userdata;
+    pa_tunnel_client *client;
+
+    pa_assert(c);
+
+    switch (pa_context_get_state(context)) {
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+            break;
+        case PA_CONTEXT_READY:
+            pa_log_debug("Connection to %s successful.", c->server);
+            c->ready = true;
+
+            PA_LLIST_FOREACH(client, c->clients)
+                client->callbacks.ready(c->context, client->userdata);
+            break;
+        case PA_CONTEXT_FAILED:
+            pa_log_debug("Context failed: %s.", pa_strerror(pa_context_errno(context)));
+            c->ready = false;
+            c->thread_mainloop_api->quit(c->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+            break;
+        case PA_CONTEXT_TERMINATED:
+            pa_log_debug("Context terminated.");
+            c->ready = false;
+            c->thread_mainloop_api->quit(c->thread_mainloop_api, TUNNEL_THREAD_FAILED_MAINLOOP);
+            break;
+    }
+}
+
+/* Called from IO thread */
+static int connection_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
+    pa_tunnel_connection *c = TUNNEL_CONNECTION(o);
+    pa_tunnel_client *client;
+
+    pa_assert(c);
+
+    switch (code) {
+        case TUNNEL_CONNECTION_MESSAGE_ADD_CLIENT:
+            client = data;
+            PA_LLIST_PREPEND(pa_tunnel_client, c->clients, client);
+
+            if (pa_atomic_load(&c->failed))
+                client->callbacks.failed(client->userdata);
+            else if (c->ready)
+                client->callbacks.ready(c->context, client->userdata);
+
+            return 0;
+
+        case TUNNEL_CONNECTION_MESSAGE_REMOVE_CLIENT:
+            client = data;
+            client->callbacks.detach(client->userdata);
+
+            add_stats(&c->removed, &client->stats);
+            PA_LLIST_REMOVE(pa_tunnel_client, c->clients, client);
+
+            return 0;
+
+        case TUNNEL_CONNECTION_MESSAGE_GET_STATS: {
+            pa_tunnel_stats *stats = data;
+
+            *stats = c->removed;
+            stats->streams = 0;
+
+            PA_LLIST_FOREACH(client, c->clients) {
+                add_stats(stats, &client->stats);
+                stats->streams++;
+            }
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static pa_proplist* tunnel_new_proplist(void) {
+    pa_proplist *proplist = pa_proplist_new();
+    pa_assert(proplist);
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "PulseAudio");
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, "org.PulseAudio.PulseAudio");
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
+    pa_init_proplist(proplist);
+
+    return proplist;
+}
+
+static void thread_func(void *userdata) {
+    pa_tunnel_connection *c = userdata;
+    pa_tunnel_client *client;
+    pa_proplist *proplist;
+
+    pa_assert(c);
+
+    pa_log_debug("Thread starting up");
+    pa_thread_mq_install(&c->thread_mq);
+
+    proplist = tunnel_new_proplist();
+    c->context = pa_context_new_with_proplist(c->thread_mainloop_api,
+                                              "PulseAudio",
+                                              proplist);
+    pa_proplist_free(proplist);
+
+    if (!c->context) {
+        pa_log("Failed to create libpulse context");
+        goto fail;
+    }
+
+    if (c->cookie_file && pa_context_load_cookie_from_file(c->context, c->cookie_file) != 0) {
+        pa_log_error("Can not load cookie file!");
+        goto fail;
+    }
+
+    pa_context_set_state_callback(c->context, context_state_cb, c);
+    if (pa_context_connect(c->context,
+                           c->server,
+                           PA_CONTEXT_NOAUTOSPAWN,
+                           NULL) < 0) {
+        pa_log("Failed to connect libpulse context: %s", pa_strerror(pa_context_errno(c->context)));
+        goto fail;
+    }
+
+    for (;;) {
+        int ret;
+
+        if (pa_mainloop_iterate(c->thread_mainloop, 1, &ret) < 0) {
+            if (ret == 0)
+                goto finish;
+            else
+                goto fail;
+        }
+
+        PA_LLIST_FOREACH(client, c->clients)
+            client->callbacks.iterate(client->userdata);
+
+        /* Run the rtpoll to process messages that other modules (module-combine-sink,
+         * module-loopback and module-rtp-recv) may have placed in the queue. */
+        pa_rtpoll_set_timer_relative(c->rtpoll, 0);
+        if (pa_rtpoll_run(c->rtpoll) < 0)
+            goto fail;
+    }
+
+fail:
+    /* Tell all clients, so that they ask the ctl thread to either terminate
+     * or restart their modules. This thread keeps processing messages until
+     * the last of them is gone and the shutdown message comes. */
+    pa_atomic_store(&c->failed, 1);
+
+    PA_LLIST_FOREACH(client, c->clients)
+        client->callbacks.failed(client->userdata);
+
+    pa_asyncmsgq_wait_for(c->thread_mq.inq, PA_MESSAGE_SHUTDOWN);
+
+finish:
+    pa_assert(!c->clients);
+
+    if (c->context) {
+        pa_context_disconnect(c->context);
+        pa_context_unref(c->context);
+        c->context = NULL;
+    }
+
+    pa_log_debug("Thread shutting down");
+}
+
+static void connection_free(pa_tunnel_connection *c) {
+    pa_assert(c);
+
+    if (c->thread) {
+        pa_asyncmsgq_send(c->thread_mq.inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
+        pa_thread_free(c->thread);
+    }
+
+    pa_thread_mq_done(&c->thread_mq);
+
+    if (c->thread_mainloop)
+        pa_mainloop_free(c->thread_mainloop);
+
+    if (c->rtpoll)
+        pa_rtpoll_free(c->rtpoll);
+
+    if (c->removed.bytes > 0)
+        pa_log_info("Connection to %s: %llu bytes, %llu underflows, %llu overflows.", c->server,
+                    (unsigned long long) c->removed.bytes,
+                    (unsigned long long) c->removed.underflows,
+                    (unsigned long long) c->removed.overflows);
+
+    pa_xfree(c->shared_name);
+    pa_xfree(c->server);
+    pa_xfree(c->cookie_file);
+
+    pa_msgobject_unref(PA_MSGOBJECT(c));
+}
+
+static pa_tunnel_connection *connection_new(pa_core *core, const char *type, const char *server, const char *cookie_file) {
+    pa_tunnel_connection *c;
+    char *thread_name;
+
+    c = pa_msgobject_new(tunnel_connection);
+    c->parent.process_msg = connection_process_msg;
+    c->core = core;
+    c->n_users = 1;
+    c->server = pa_xstrdup(server);
+    c->cookie_file = pa_xstrdup(cookie_file);
+    pa_atomic_store(&c->failed, 0);
+
+    if (!(c->thread_mainloop = pa_mainloop_new())) {
+        pa_log("Failed to create mainloop");
+        goto fail;
+    }
+    c->thread_mainloop_api = pa_mainloop_get_api(c->thread_mainloop);
+
+    if (pa_thread_mq_init_thread_mainloop(&c->thread_mq, core->mainloop, c->thread_mainloop_api) < 0) {
+        pa_log("pa_thread_mq_init_thread_mainloop() failed.");
+        goto fail;
+    }
+
+    /* The rtpoll created here is only run for the sake of module-combine-sink. It must
+     * exist to avoid crashes when the tunnels are used together with
+     * module-loopback or module-combine-sink. Both modules base their asyncmsgq on the
+     * rtpoll provided by the sink. module-loopback and combine-sink only work because
+     * they call pa_asyncmsq_process_one() themselves. module-combine-sink does this
+     * however only for the audio_inq, so without running the rtpoll, messages placed
+     * in control_inq would never be executed. */
+    c->rtpoll = pa_rtpoll_new();
+
+    thread_name = pa_sprintf_malloc("tunnel-%s", type);
+    c->thread = pa_thread_new(thread_name, thread_func, c);
+    pa_xfree(thread_name);
+
+    if (!c->thread) {
+        pa_log("Failed to create thread.");
+        goto fail;
+    }
+
+    return c;
+
+fail:
+    connection_free(c);
+
+    return NULL;
+}
+
+pa_tunnel_connection *pa_tunnel_connection_get(pa_core *core, const char *type, const char *server, const char *cookie_file, bool shared) {
+    pa_tunnel_connection *c;
+    char *name;
+
+    pa_assert(core);
+    pa_assert(type);
+    pa_assert(server);
+    pa_assert_ctl_context();
+
+    if (!shared)
+        return connection_new(core, type, server, cookie_file);
+
+    name = pa_sprintf_malloc("tunnel-%s-connection:%s:%s", type, server, pa_strempty(cookie_file));
+
+    if ((c = pa_shared_get(core, name)) && !pa_atomic_load(&c->failed)) {
+        pa_log_debug("Sharing connection to %s with %u other tunnel(s).", server, c->n_users);
+        c->n_users++;
+        pa_xfree(name);
+
+        return c;
+    }
+
+    if (!(c = connection_new(core, type, server, cookie_file))) {
+        pa_xfree(name);
+        return NULL;
+    }
+
+    /* A failed connection is replaced, it goes away when the last of its
+     * tunnels has been restarted */
+    c->shared_name = name;
+    pa_shared_replace(core, name, c);
+
+    return c;
+}
+
+void pa_tunnel_connection_unref(pa_tunnel_connection *c) {
+    pa_assert(c);
+    pa_assert(c->n_users > 0);
+    pa_assert_ctl_context();
+
+    if (--c->n_users > 0)
+        return;
+
+    if (c->shared_name && pa_shared_get(c->core, c->shared_name) == c)
+        pa_shared_remove(c->core, c->shared_name);
+
+    connection_free(c);
+}
+
+pa_thread_mq *pa_tunnel_connection_get_thread_mq(pa_tunnel_connection *c) {
+    pa_assert(c);
+
+    return &c->thread_mq;
+}
+
+pa_rtpoll *pa_tunnel_connection_get_rtpoll(pa_tunnel_connection *c) {
+    pa_assert(c);
+
+    return c->rtpoll;
+}
+
+bool pa_tunnel_connection_is_shared(pa_tunnel_connection *c) {
+    pa_assert(c);
+
+    return !!c->shared_name;
+}
+
+pa_tunnel_client *pa_tunnel_connection_add_client(pa_tunnel_connection *c, const pa_tunnel_client_callbacks *callbacks, void *userdata) {
+    pa_tunnel_client *client;
+
+    pa_assert(c);
+    pa_assert(callbacks);
+    pa_assert(callbacks->ready);
+    pa_assert(callbacks->failed);
+    pa_assert(callbacks->iterate);
+    pa_assert(callbacks->detach);
+    pa_assert_ctl_context();
+
+    client = pa_xnew0(pa_tunnel_client, 1);
+    client->callbacks = *callbacks;
+    client->userdata = userdata;
+
+    pa_assert_se(pa_asyncmsgq_send(c->thread_mq.inq, PA_MSGOBJECT(c), TUNNEL_CONNECTION_MESSAGE_ADD_CLIENT, client, 0, NULL) == 0);
+
+    return client;
+}
+
+void pa_tunnel_connection_remove_client(pa_tunnel_connection *c, pa_tunnel_client *client) {
+    pa_assert(c);
+    pa_assert(client);
+    pa_assert_ctl_context();
+
+    pa_assert_se(pa_asyncmsgq_send(c->thread_mq.inq, PA_MSGOBJECT(c), TUNNEL_CONNECTION_MESSAGE_REMOVE_CLIENT, client, 0, NULL) == 0);
+
+    pa_xfree(client);
+}
+
+void pa_tunnel_connection_get_stats(pa_tunnel_connection *c, pa_tunnel_stats *stats) {
+    pa_assert(c);
+    pa_assert(stats);
+    pa_assert_ctl_context();
+
+    pa_assert_se(pa_asyncmsgq_send(c->thread_mq.inq, PA_MSGOBJECT(c), TUNNEL_CONNECTION_MESSAGE_GET_STATS, stats, 0, NULL) == 0);
+}
+
+pa_tunnel_stats *pa_tunnel_client_get_stats(pa_tunnel_client *client) {
+    pa_assert(client);
+
+    return &client->stats;
+}
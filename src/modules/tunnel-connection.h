@@ -0,0 +1,86 @@
+#ifndef footunnelconnectionhfoo
+#define footunnelconnectionhfoo
+
+/***
+    This file is part of PulseAudio.
+
+    PulseAudio is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation; either version 2.1 of the License,
+    or (at your option) any later version.
+
+    PulseAudio is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pulse/context.h>
+
+#include <pulsecore/core.h>
+#include <pulsecore/rtpoll.h>
+#include <pulsecore/thread-mq.h>
+
+/* The libpulse context, IO thread and thread message queue of the tunnel
+ * modules. Each tunnel adds itself as a client and creates its own stream on
+ * the context. A shared connection is used by all tunnels of the same type to
+ * the same server with the same cookie, so that they need only one
+ * connection and one thread; a private connection is used by one tunnel only.
+ *
+ * Only tunnels of the same type share a connection, because the IO thread
+ * runs code of the module that created the connection. */
+
+typedef struct pa_tunnel_connection pa_tunnel_connection;
+typedef struct pa_tunnel_client pa_tunnel_client;
+
+typedef struct pa_tunnel_client_callbacks {
+    /* Called when the context is ready, or when the client is added to a
+     * connection that is ready already */
+    void (*ready)(pa_context *context, void *userdata);
+    /* Called when the context failed or was terminated. The client should ask
+     * for its module to be restarted, a new connection is made then. */
+    void (*failed)(void *userdata);
+    /* Called after every iteration of the mainloop of the connection */
+    void (*iterate)(void *userdata);
+    /* Called when the client is removed, the client must free its stream */
+    void (*detach)(void *userdata);
+} pa_tunnel_client_callbacks;
+
+/* Flow control counters, kept by the clients in the IO thread and summed up
+ * over all clients for the connection. Bytes are the bytes written for sinks
+ * and the bytes read for sources. */
+typedef struct pa_tunnel_stats {
+    unsigned streams;
+    uint64_t bytes;
+    uint64_t underflows;
+    uint64_t overflows;
+} pa_tunnel_stats;
+
+/* Called from main context. Returns the shared connection to the server for
+ * the given type, creating it if necessary, or a new private connection if
+ * shared is false. */
+pa_tunnel_connection *pa_tunnel_connection_get(pa_core *core, const char *type, const char *server, const char *cookie_file, bool shared);
+void pa_tunnel_connection_unref(pa_tunnel_connection *c);
+
+/* The thread message queue and the rtpoll to use for the sink or source of
+ * a client */
+pa_thread_mq *pa_tunnel_connection_get_thread_mq(pa_tunnel_connection *c);
+pa_rtpoll *pa_tunnel_connection_get_rtpoll(pa_tunnel_connection *c);
+bool pa_tunnel_connection_is_shared(pa_tunnel_connection *c);
+
+/* Called from main context. The callbacks are called from the IO thread,
+ * until pa_tunnel_connection_remove_client() returns. */
+pa_tunnel_client *pa_tunnel_connection_add_client(pa_tunnel_connection *c, const pa_tunnel_client_callbacks *callbacks, void *userdata);
+void pa_tunnel_connection_remove_client(pa_tunnel_connection *c, pa_tunnel_client *client);
+
+/* Called from main context. Sums up the counters of all current and former
+ * clients of the connection. */
+void pa_tunnel_connection_get_stats(pa_tunnel_connection *c, pa_tunnel_stats *stats);
+
+/* Called from IO thread. The counters of the client. */
+pa_tunnel_stats *pa_tunnel_client_get_stats(pa_tunnel_client *client);
+
+#endif
@@ -0,0 +1,192 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <pulsecore/macro.h>
+#include <pulsecore/log.h>
+#include <pulsecore/filter/biquad-cascade.h>
+
+#include "cpu-arm.h"
+
+#include <arm_neon.h>
+
+/* Four channels per vector, two vectors at a time, one section after the
+ * other over a block of frames padded to the stride, see biquad_sse.c.
+ * Multiplications and additions are not fused to give the same results
+ * as the generic code. */
+
+#define BLOCK_FRAMES 64
+
+struct section {
+    float32x4_t b0, b1, b2, a1, a2;
+    float32x4_t x1, x2, y1, y2;
+};
+
+static inline void section_load(struct section *q, const float *s, const float *z, unsigned stride) {
+    q->b0 = vld1q_f32(s);
+    q->b1 = vld1q_f32(s + stride);
+    q->b2 = vld1q_f32(s + 2 * stride);
+    q->a1 = vld1q_f32(s + 3 * stride);
+    q->a2 = vld1q_f32(s + 4 * stride);
+
+    q->x1 = vld1q_f32(z);
+    q->x2 = vld1q_f32(z + stride);
+    q->y1 = vld1q_f32(z + 2 * stride);
+    q->y2 = vld1q_f32(z + 3 * stride);
+}
+
+static inline void section_store(const struct section *q, float *z, unsigned stride, bool last) {
+    vst1q_f32(z, q->x1);
+    vst1q_f32(z + stride, q->x2);
+
+    if (last) {
+        vst1q_f32(z + 2 * stride, q->y1);
+        vst1q_f32(z + 3 * stride, q->y2);
+    }
+}
+
+static inline float32x4_t section_run(struct section *q, float32x4_t x) {
+    float32x4_t y;
+
+    y = vmulq_f32(q->b0, x);
+    y = vaddq_f32(y, vmulq_f32(q->b1, q->x1));
+    y = vaddq_f32(y, vmulq_f32(q->b2, q->x2));
+    y = vsubq_f32(y, vmulq_f32(q->a2, q->y2));
+    y = vsubq_f32(y, vmulq_f32(q->a1, q->y1));
+
+    q->x2 = q->x1;
+    q->x1 = x;
+    q->y2 = q->y1;
+    q->y1 = y;
+
+    return y;
+}
+
+/* Runs section k over the block, for all channels */
+static void filter_block(float *buf, unsigned n, unsigned stride, unsigned k, bool last,
+                         const float *coefficients, float *state) {
+    const float *s = coefficients + 5 * k * stride;
+    float *z = state + 2 * k * stride;
+    unsigned c, i;
+
+    for (c = 0; c + 8 <= stride; c += 8) {
+        struct section q0, q1;
+        float *d = buf + c;
+
+        section_load(&q0, s + c, z + c, stride);
+        section_load(&q1, s + c + 4, z + c + 4, stride);
+
+        for (i = 0; i < n; i++, d += stride) {
+            float32x4_t y0 = section_run(&q0, vld1q_f32(d));
+            float32x4_t y1 = section_run(&q1, vld1q_f32(d + 4));
+
+            vst1q_f32(d, y0);
+            vst1q_f32(d + 4, y1);
+        }
+
+        section_store(&q0, z + c, stride, last);
+        section_store(&q1, z + c + 4, stride, last);
+    }
+
+    if (c < stride) {
+        struct section q;
+        float *d = buf + c;
+
+        section_load(&q, s + c, z + c, stride);
+
+        for (i = 0; i < n; i++, d += stride)
+            vst1q_f32(d, section_run(&q, vld1q_f32(d)));
+
+        section_store(&q, z + c, stride, last);
+    }
+}
+
+static unsigned biquad_cascade_float32ne_neon(void *samples, unsigned channels, unsigned n_frames,
+                                              unsigned n_sections, const float *coefficients, float *state) {
+    float buf[BLOCK_FRAMES * PA_CHANNELS_MAX];
+    unsigned stride = PA_BIQUAD_CASCADE_STRIDE(channels);
+    unsigned f, i, k, n;
+
+    pa_assert(stride <= PA_CHANNELS_MAX);
+
+    /* The padding lanes are never written by the copies below */
+    memset(buf, 0, sizeof(buf));
+
+    for (f = 0; f < n_frames; f += n) {
+        const float *src = (float *) samples + f * channels;
+
+        n = PA_MIN(n_frames - f, BLOCK_FRAMES);
+
+        for (i = 0; i < n; i++)
+            memcpy(buf + i * stride, src + i * channels, channels * sizeof(float));
+
+        for (k = 0; k < n_sections; k++)
+            filter_block(buf, n, stride, k, k == n_sections - 1, coefficients, state);
+
+        for (i = 0; i < n; i++)
+            memcpy((float *) samples + (f + i) * channels, buf + i * stride, channels * sizeof(float));
+    }
+
+    return channels;
+}
+
+static unsigned biquad_cascade_s16ne_neon(void *samples, unsigned channels, unsigned n_frames,
+                                          unsigned n_sections, const float *coefficients, float *state) {
+    float buf[BLOCK_FRAMES * PA_CHANNELS_MAX];
+    unsigned stride = PA_BIQUAD_CASCADE_STRIDE(channels);
+    unsigned f, i, c, k, n;
+
+    pa_assert(stride <= PA_CHANNELS_MAX);
+
+    memset(buf, 0, sizeof(buf));
+
+    for (f = 0; f < n_frames; f += n) {
+        int16_t *d = (int16_t *) samples + f * channels;
+
+        n = PA_MIN(n_frames - f, BLOCK_FRAMES);
+
+        for (i = 0; i < n; i++)
+            for (c = 0; c < channels; c++)
+                buf[i * stride + c] = d[i * channels + c];
+
+        for (k = 0; k < n_sections; k++)
+            filter_block(buf, n, stride, k, k == n_sections - 1, coefficients, state);
+
+        /* vcvtq truncates like the generic code, vqmovn saturates */
+        for (i = 0; i < n; i++) {
+            for (c = 0; c + 4 <= channels; c += 4)
+                vst1_s16(d + i * channels + c, vqmovn_s32(vcvtq_s32_f32(vld1q_f32(buf + i * stride + c))));
+
+            for (; c < channels; c++)
+                d[i * channels + c] = (int16_t) PA_CLAMP_UNLIKELY((int) buf[i * stride + c], -0x8000, 0x7fff);
+        }
+    }
+
+    return channels;
+}
+
+void pa_biquad_cascade_func_init_neon(pa_cpu_arm_flag_t flags) {
+    pa_log_info("Initialising ARM NEON optimized biquad filters.");
+
+    pa_set_biquad_cascade_func(PA_SAMPLE_FLOAT32NE, biquad_cascade_float32ne_neon);
+    pa_set_biquad_cascade_func(PA_SAMPLE_S16NE, biquad_cascade_s16ne_neon);
+}
@@ -0,0 +1,216 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <pulsecore/macro.h>
+#include <pulsecore/log.h>
+#include <pulsecore/filter/biquad-cascade.h>
+
+#include "cpu-x86.h"
+
+#if defined (__i386__) || defined (__amd64__)
+
+#include <xmmintrin.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Four channels per vector. The samples are copied into a buffer of
+ * frames padded to the stride, so that the channels at the end form a
+ * whole vector as well, and filtered one section after the other over a
+ * block of frames, two vectors at a time. The recursion of every section
+ * only allows one frame after the other, working on two independent
+ * vectors keeps the pipeline busy. See filter_section() in
+ * filter/biquad-cascade.c for the order of operations and the state
+ * handling, which are the same here. */
+
+#define BLOCK_FRAMES 64
+
+struct section {
+    __m128 b0, b1, b2, a1, a2;
+    __m128 x1, x2, y1, y2;
+};
+
+static inline void section_load(struct section *q, const float *s, const float *z, unsigned stride) {
+    q->b0 = _mm_loadu_ps(s);
+    q->b1 = _mm_loadu_ps(s + stride);
+    q->b2 = _mm_loadu_ps(s + 2 * stride);
+    q->a1 = _mm_loadu_ps(s + 3 * stride);
+    q->a2 = _mm_loadu_ps(s + 4 * stride);
+
+    q->x1 = _mm_loadu_ps(z);
+    q->x2 = _mm_loadu_ps(z + stride);
+    q->y1 = _mm_loadu_ps(z + 2 * stride);
+    q->y2 = _mm_loadu_ps(z + 3 * stride);
+}
+
+static inline void section_store(const struct section *q, float *z, unsigned stride, bool last) {
+    _mm_storeu_ps(z, q->x1);
+    _mm_storeu_ps(z + stride, q->x2);
+
+    if (last) {
+        _mm_storeu_ps(z + 2 * stride, q->y1);
+        _mm_storeu_ps(z + 3 * stride, q->y2);
+    }
+}
+
+static inline __m128 section_run(struct section *q, __m128 x) {
+    __m128 y;
+
+    y = _mm_mul_ps(q->b0, x);
+    y = _mm_add_ps(y, _mm_mul_ps(q->b1, q->x1));
+    y = _mm_add_ps(y, _mm_mul_ps(q->b2, q->x2));
+    y = _mm_sub_ps(y, _mm_mul_ps(q->a2, q->y2));
+    y = _mm_sub_ps(y, _mm_mul_ps(q->a1, q->y1));
+
+    q->x2 = q->x1;
+    q->x1 = x;
+    q->y2 = q->y1;
+    q->y1 = y;
+
+    return y;
+}
+
+/* Runs section k over the block, for all channels */
+static void filter_block(float *buf, unsigned n, unsigned stride, unsigned k, bool last,
+                         const float *coefficients, float *state) {
+    const float *s = coefficients + 5 * k * stride;
+    float *z = state + 2 * k * stride;
+    unsigned c, i;
+
+    for (c = 0; c + 8 <= stride; c += 8) {
+        struct section q0, q1;
+        float *d = buf + c;
+
+        section_load(&q0, s + c, z + c, stride);
+        section_load(&q1, s + c + 4, z + c + 4, stride);
+
+        for (i = 0; i < n; i++, d += stride) {
+            __m128 y0 = section_run(&q0, _mm_load_ps(d));
+            __m128 y1 = section_run(&q1, _mm_load_ps(d + 4));
+
+            _mm_store_ps(d, y0);
+            _mm_store_ps(d + 4, y1);
+        }
+
+        section_store(&q0, z + c, stride, last);
+        section_store(&q1, z + c + 4, stride, last);
+    }
+
+    if (c < stride) {
+        struct section q;
+        float *d = buf + c;
+
+        section_load(&q, s + c, z + c, stride);
+
+        for (i = 0; i < n; i++, d += stride)
+            _mm_store_ps(d, section_run(&q, _mm_load_ps(d)));
+
+        section_store(&q, z + c, stride, last);
+    }
+}
+
+static unsigned biquad_cascade_float32ne_sse(void *samples, unsigned channels, unsigned n_frames,
+                                             unsigned n_sections, const float *coefficients, float *state) {
+    PA_DECLARE_ALIGNED(16, float, buf[BLOCK_FRAMES * PA_CHANNELS_MAX]);
+    unsigned stride = PA_BIQUAD_CASCADE_STRIDE(channels);
+    unsigned f, i, k, n;
+
+    pa_assert(stride <= PA_CHANNELS_MAX);
+
+    /* The padding lanes are never written by the copies below */
+    memset(buf, 0, sizeof(buf));
+
+    for (f = 0; f < n_frames; f += n) {
+        const float *src = (float *) samples + f * channels;
+
+        n = PA_MIN(n_frames - f, BLOCK_FRAMES);
+
+        for (i = 0; i < n; i++)
+            memcpy(buf + i * stride, src + i * channels, channels * sizeof(float));
+
+        for (k = 0; k < n_sections; k++)
+            filter_block(buf, n, stride, k, k == n_sections - 1, coefficients, state);
+
+        for (i = 0; i < n; i++)
+            memcpy((float *) samples + (f + i) * channels, buf + i * stride, channels * sizeof(float));
+    }
+
+    return channels;
+}
+
+#ifdef __SSE2__
+static unsigned biquad_cascade_s16ne_sse2(void *samples, unsigned channels, unsigned n_frames,
+                                          unsigned n_sections, const float *coefficients, float *state) {
+    PA_DECLARE_ALIGNED(16, float, buf[BLOCK_FRAMES * PA_CHANNELS_MAX]);
+    unsigned stride = PA_BIQUAD_CASCADE_STRIDE(channels);
+    unsigned f, i, c, k, n;
+
+    pa_assert(stride <= PA_CHANNELS_MAX);
+
+    memset(buf, 0, sizeof(buf));
+
+    for (f = 0; f < n_frames; f += n) {
+        int16_t *d = (int16_t *) samples + f * channels;
+
+        n = PA_MIN(n_frames - f, BLOCK_FRAMES);
+
+        for (i = 0; i < n; i++)
+            for (c = 0; c < channels; c++)
+                buf[i * stride + c] = d[i * channels + c];
+
+        for (k = 0; k < n_sections; k++)
+            filter_block(buf, n, stride, k, k == n_sections - 1, coefficients, state);
+
+        /* Truncate like the generic code, saturate while packing */
+        for (i = 0; i < n; i++) {
+            for (c = 0; c + 4 <= channels; c += 4) {
+                __m128i v = _mm_cvttps_epi32(_mm_load_ps(buf + i * stride + c));
+                _mm_storel_epi64((__m128i *) (d + i * channels + c), _mm_packs_epi32(v, v));
+            }
+
+            for (; c < channels; c++)
+                d[i * channels + c] = (int16_t) PA_CLAMP_UNLIKELY((int) buf[i * stride + c], -0x8000, 0x7fff);
+        }
+    }
+
+    return channels;
+}
+#endif /* __SSE2__ */
+
+#endif /* defined (__i386__) || defined (__amd64__) */
+
+void pa_biquad_cascade_func_init_sse(pa_cpu_x86_flag_t flags) {
+#if defined (__i386__) || defined (__amd64__)
+
+    if (flags & PA_CPU_X86_SSE) {
+        pa_log_info("Initialising SSE optimized biquad filters.");
+        pa_set_biquad_cascade_func(PA_SAMPLE_FLOAT32NE, biquad_cascade_float32ne_sse);
+    }
+
+#ifdef __SSE2__
+    if (flags & PA_CPU_X86_SSE2)
+        pa_set_biquad_cascade_func(PA_SAMPLE_S16NE, biquad_cascade_s16ne_sse2);
+#endif
+
+#endif /* defined (__i386__) || defined (__amd64__) */
+}
@@ -73,6 +73,8 @@ struct command {
 #define META_IFEXISTS ".ifexists"
 #define META_ELSE ".else"
 #define META_ENDIF ".endif"
+#define META_PARALLEL ".parallel"
+#define META_ENDPARALLEL ".endparallel"
 
 enum {
     IFSTATE_NONE = -1,
@@ -2047,7 +2049,68 @@ static int pa_cli_command_dump_volumes(pa_core *c, pa_tokenizer *t, pa_strbuf *b
     return 0;
 }
 
-int pa_cli_command_execute_line_stateful(pa_core *c, const char *s, pa_strbuf *buf, bool *fail, int *ifstate) {
+/* Starts preparing a module listed in a .parallel block. The module
+ * is loaded when the block is flushed. */
+static int parallel_prepare(pa_core *c, const char *cs, pa_strbuf *buf, bool *fail, pa_dynarray *batch) {
+    pa_tokenizer *t;
+    const char *name;
+    pa_module_prepare *p;
+    int ret = 0;
+
+    pa_assert_se(t = pa_tokenizer_new(cs, 3));
+
+    if (!(name = pa_tokenizer_get(t, 1))) {
+        pa_strbuf_puts(buf, "You need to specify the module name and optionally arguments.\n");
+        ret = -1;
+    } else if (!(p = pa_module_prepare_new(c, name, pa_tokenizer_get(t, 2)))) {
+        pa_strbuf_puts(buf, "Module load failed.\n");
+        ret = -1;
+    } else
+        pa_dynarray_append(batch, p);
+
+    pa_tokenizer_free(t);
+
+    return ret < 0 && *fail ? -1 : 0;
+}
+
+/* Loads the modules of a .parallel block in the order they were
+ * listed and frees the block. */
+static int parallel_flush(pa_core *c, pa_strbuf *buf, bool *fail, pa_dynarray *batch) {
+    pa_module_prepare *p;
+    unsigned i, n;
+    int ret = 0;
+
+    n = pa_dynarray_size(batch);
+
+    for (i = 0; i < n; i++) {
+        pa_module *m = NULL;
+        int r;
+
+        p = pa_dynarray_get(batch, i);
+
+        /* After a fatal failure only clean up the rest */
+        if (ret < 0) {
+            pa_module_prepare_free(p);
+            continue;
+        }
+
+        if ((r = pa_module_load_prepared(&m, p)) < 0) {
+            if (r == -PA_ERR_EXIST)
+                pa_strbuf_puts(buf, "Module already loaded; ignoring.\n");
+            else {
+                pa_strbuf_puts(buf, "Module load failed.\n");
+                if (*fail)
+                    ret = -1;
+            }
+        }
+    }
+
+    pa_dynarray_free(batch);
+
+    return ret;
+}
+
+static int execute_line(pa_core *c, const char *s, pa_strbuf *buf, bool *fail, int *ifstate, pa_dynarray **parallel) {
     const char *cs;
 
     pa_assert(c);
@@ -2082,7 +2145,27 @@ int pa_cli_command_execute_line_stateful(pa_core *c, const char *s, pa_strbuf *b
             *fail = true;
         else if (!strcmp(cs, META_NOFAIL))
             *fail = false;
-        else {
+        else if (!strcmp(cs, META_PARALLEL)) {
+            if (!parallel || (ifstate && *ifstate != IFSTATE_NONE)) {
+                pa_strbuf_printf(buf, "Meta command %s is not valid in this context\n", cs);
+                return -1;
+            } else if (*parallel) {
+                pa_strbuf_printf(buf, "Nested %s commands not supported\n", cs);
+                return -1;
+            }
+            *parallel = pa_dynarray_new(NULL);
+        } else if (!strcmp(cs, META_ENDPARALLEL)) {
+            int r;
+
+            if (!parallel || !*parallel || (ifstate && *ifstate != IFSTATE_NONE)) {
+                pa_strbuf_printf(buf, "Meta command %s is not valid in this context\n", cs);
+                return -1;
+            }
+
+            r = parallel_flush(c, buf, fail, *parallel);
+            *parallel = NULL;
+            return r;
+        } else {
             size_t l;
             l = strcspn(cs, whitespace);
 
@@ -2091,6 +2174,12 @@ int pa_cli_command_execute_line_stateful(pa_core *c, const char *s, pa_strbuf *b
                 const char *fn = cs+l+strspn(cs+l, whitespace);
 
                 char *filename;
+
+                if (parallel && *parallel) {
+                    pa_strbuf_printf(buf, "Meta command %s is not valid in a %s block\n", META_INCLUDE, META_PARALLEL);
+                    return -1;
+                }
+
 #ifdef OS_IS_WIN32
                 if (strncmp(fn, PA_DEFAULT_CONFIG_DIR, strlen(PA_DEFAULT_CONFIG_DIR)) == 0)
                     filename = pa_sprintf_malloc("%s" PA_PATH_SEP "etc" PA_PATH_SEP "pulse" PA_PATH_SEP "%s",
@@ -2199,6 +2288,15 @@ int pa_cli_command_execute_line_stateful(pa_core *c, const char *s, pa_strbuf *b
 
         l = strcspn(cs, whitespace);
 
+        if (parallel && *parallel) {
+            if (l != sizeof("load-module")-1 || strncmp(cs, "load-module", l)) {
+                pa_strbuf_printf(buf, "Only load-module is allowed in a %s block: %s\n", META_PARALLEL, cs);
+                return -1;
+            }
+
+            return parallel_prepare(c, cs, buf, fail, *parallel);
+        }
+
         for (command = commands; command->name; command++)
             if (strlen(command->name) == l && !strncmp(cs, command->name, l)) {
                 int ret;
@@ -2224,13 +2322,40 @@ int pa_cli_command_execute_line_stateful(pa_core *c, const char *s, pa_strbuf *b
     return 0;
 }
 
+int pa_cli_command_execute_line_stateful(pa_core *c, const char *s, pa_strbuf *buf, bool *fail, int *ifstate) {
+    return execute_line(c, s, buf, fail, ifstate, NULL);
+}
+
 int pa_cli_command_execute_line(pa_core *c, const char *s, pa_strbuf *buf, bool *fail) {
     return pa_cli_command_execute_line_stateful(c, s, buf, fail, NULL);
 }
 
+/* Deals with a .parallel block that is still open when a script ends:
+ * the pending modules are loaded, unless the script failed. */
+static int parallel_finish(pa_core *c, pa_strbuf *buf, bool *fail, pa_dynarray *parallel, bool failed) {
+    pa_module_prepare *p;
+    unsigned i;
+
+    if (!parallel)
+        return 0;
+
+    if (!failed) {
+        pa_strbuf_printf(buf, "Missing %s, loading pending modules\n", META_ENDPARALLEL);
+        return parallel_flush(c, buf, fail, parallel);
+    }
+
+    PA_DYNARRAY_FOREACH(p, parallel, i)
+        pa_module_prepare_free(p);
+
+    pa_dynarray_free(parallel);
+
+    return -1;
+}
+
 int pa_cli_command_execute_file_stream(pa_core *c, FILE *f, pa_strbuf *buf, bool *fail) {
     char line[2048];
     int ifstate = IFSTATE_NONE;
+    pa_dynarray *parallel = NULL;
     int ret = -1;
     bool _fail = true;
 
@@ -2244,11 +2369,13 @@ int pa_cli_command_execute_file_stream(pa_core *c, FILE *f, pa_strbuf *buf, bool
     while (fgets(line, sizeof(line), f)) {
         pa_strip_nl(line);
 
-        if (pa_cli_command_execute_line_stateful(c, line, buf, fail, &ifstate) < 0 && *fail)
+        if (execute_line(c, line, buf, fail, &ifstate, &parallel) < 0 && *fail) {
+            parallel_finish(c, buf, fail, parallel, true);
             goto fail;
+        }
     }
 
-    ret = 0;
+    ret = parallel_finish(c, buf, fail, parallel, false);
 
 fail:
 
@@ -2287,6 +2414,7 @@ fail:
 int pa_cli_command_execute(pa_core *c, const char *s, pa_strbuf *buf, bool *fail) {
     const char *p;
     int ifstate = IFSTATE_NONE;
+    pa_dynarray *parallel = NULL;
     bool _fail = true;
 
     pa_assert(c);
@@ -2301,7 +2429,8 @@ int pa_cli_command_execute(pa_core *c, const char *s, pa_strbuf *buf, bool *fail
         size_t l = strcspn(p, linebreak);
         char *line = pa_xstrndup(p, l);
 
-        if (pa_cli_command_execute_line_stateful(c, line, buf, fail, &ifstate) < 0 && *fail) {
+        if (execute_line(c, line, buf, fail, &ifstate, &parallel) < 0 && *fail) {
+            parallel_finish(c, buf, fail, parallel, true);
             pa_xfree(line);
             return -1;
         }
@@ -2311,5 +2440,5 @@ int pa_cli_command_execute(pa_core *c, const char *s, pa_strbuf *buf, bool *fail
         p += strspn(p, linebreak);
     }
 
-    return 0;
+    return parallel_finish(c, buf, fail, parallel, false);
 }
@@ -0,0 +1,433 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* The impulse response is split into stages. Every stage covers a range
+ * of the impulse response with partitions of a fixed size P, and runs
+ * uniformly partitioned overlap-save convolution: whenever P new input
+ * samples are collected, the last 2P input samples are transformed and
+ * stored in a frequency-domain delay line, which holds the spectra of the
+ * last K partitions of the input. The output spectrum is the sum of the
+ * delay line entries multiplied with the spectra of the matching
+ * impulse response partitions, so one forward transform per input and one
+ * inverse transform per output are needed per partition, regardless of K.
+ *
+ * The first stage uses the block size and starts at the first tap. A
+ * stage with partition size P that starts at tap offset O >= P produces
+ * its output at least P samples before it is needed, so larger partitions
+ * can be used for later parts of the impulse response without adding
+ * latency. All stages add their output into one ring buffer per output,
+ * at the position in time where it is needed, from which the blocks are
+ * read. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <fftw3.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "convolver.h"
+
+/* Partitions are never larger than this for non-uniform partitioning */
+#define MAX_PARTITION_SIZE 16384
+
+/* Every stage is this much larger than the previous one */
+#define PARTITION_GROWTH 4
+
+struct stage {
+    unsigned partition_size;
+    unsigned n_partitions;
+    unsigned offset;
+    unsigned n_bins;
+
+    /* Samples of the current partition collected so far */
+    unsigned fill;
+    /* Slot of the newest spectrum in the delay lines */
+    unsigned fdl_pos;
+
+    fftwf_plan forward, inverse;
+    float *time;
+    fftwf_complex *spectrum;
+    fftwf_complex *accum;
+
+    /* Per input: the previous and the current partition */
+    float **input;
+    /* Per input: n_partitions spectra */
+    fftwf_complex **fdl;
+    /* Per input and output: n_partitions spectra or NULL */
+    fftwf_complex **filter;
+};
+
+struct pa_convolver {
+    unsigned block_size;
+    unsigned ir_length;
+    unsigned n_inputs, n_outputs;
+
+    unsigned n_stages;
+    struct stage *stages;
+
+    /* Per output, indexed by time modulo ring_size */
+    float **ring;
+    unsigned ring_size;
+    unsigned ring_pos;
+};
+
+static void *alloc(size_t n) {
+    void *p;
+
+    pa_assert_se(p = fftwf_malloc(n));
+    memset(p, 0, n);
+
+    return p;
+}
+
+static void multiply_accumulate(fftwf_complex * restrict acc, const fftwf_complex * restrict x, const fftwf_complex * restrict h, unsigned n) {
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        acc[i][0] += x[i][0] * h[i][0] - x[i][1] * h[i][1];
+        acc[i][1] += x[i][0] * h[i][1] + x[i][1] * h[i][0];
+    }
+}
+
+static bool stage_init(struct stage *s, unsigned partition_size, unsigned n_partitions, unsigned offset, unsigned n_inputs, unsigned n_outputs) {
+    unsigned i;
+
+    s->partition_size = partition_size;
+    s->n_partitions = n_partitions;
+    s->offset = offset;
+    s->n_bins = partition_size + 1;
+
+    s->time = alloc(2 * partition_size * sizeof(float));
+    s->spectrum = alloc(s->n_bins * sizeof(fftwf_complex));
+    s->accum = alloc(s->n_bins * sizeof(fftwf_complex));
+
+    s->input = pa_xnew0(float *, n_inputs);
+    s->fdl = pa_xnew0(fftwf_complex *, n_inputs);
+    for (i = 0; i < n_inputs; i++) {
+        s->input[i] = alloc(2 * partition_size * sizeof(float));
+        s->fdl[i] = alloc(n_partitions * s->n_bins * sizeof(fftwf_complex));
+    }
+
+    s->filter = pa_xnew0(fftwf_complex *, n_inputs * n_outputs);
+
+    if (!(s->forward = fftwf_plan_dft_r2c_1d(2 * partition_size, s->time, s->spectrum, FFTW_ESTIMATE)) ||
+        !(s->inverse = fftwf_plan_dft_c2r_1d(2 * partition_size, s->accum, s->time, FFTW_ESTIMATE))) {
+        pa_log_error("Failed to create FFTW plans of size %u.", 2 * partition_size);
+        return false;
+    }
+
+    return true;
+}
+
+static void stage_done(struct stage *s, unsigned n_inputs, unsigned n_outputs) {
+    unsigned i;
+
+    if (s->forward)
+        fftwf_destroy_plan(s->forward);
+    if (s->inverse)
+        fftwf_destroy_plan(s->inverse);
+
+    for (i = 0; i < n_inputs * n_outputs; i++)
+        if (s->filter[i])
+            fftwf_free(s->filter[i]);
+    pa_xfree(s->filter);
+
+    for (i = 0; i < n_inputs; i++) {
+        fftwf_free(s->input[i]);
+        fftwf_free(s->fdl[i]);
+    }
+    pa_xfree(s->input);
+    pa_xfree(s->fdl);
+
+    fftwf_free(s->time);
+    fftwf_free(s->spectrum);
+    fftwf_free(s->accum);
+}
+
+/* Split the impulse response into stages. Returns the number of stages,
+ * if stages is NULL they are only counted. */
+static unsigned partition(unsigned block_size, unsigned ir_length, pa_convolver_partitioning_t partitioning,
+                          struct stage *stages, unsigned n_inputs, unsigned n_outputs, bool *ok) {
+    unsigned n = 0, offset = 0, size = block_size;
+
+    while (offset < ir_length) {
+        unsigned next = size * PARTITION_GROWTH, count;
+
+        /* Cover everything up to the offset at which the next stage can
+         * start with the current size, unless the rest fits */
+        if (partitioning == PA_CONVOLVER_NON_UNIFORM && next <= MAX_PARTITION_SIZE && next < ir_length)
+            count = (next - offset) / size;
+        else
+            count = (ir_length - offset + size - 1) / size;
+
+        if (stages && *ok)
+            *ok = stage_init(&stages[n], size, count, offset, n_inputs, n_outputs);
+
+        n++;
+        offset += count * size;
+        size = next;
+    }
+
+    return n;
+}
+
+pa_convolver *pa_convolver_new(
+        unsigned block_size,
+        unsigned ir_length,
+        unsigned n_inputs,
+        unsigned n_outputs,
+        pa_convolver_partitioning_t partitioning) {
+
+    pa_convolver *c;
+    struct stage *last;
+    unsigned i;
+    bool ok = true;
+
+    pa_assert(block_size > 0);
+    pa_assert(ir_length > 0);
+    pa_assert(n_inputs > 0);
+    pa_assert(n_outputs > 0);
+
+    c = pa_xnew0(pa_convolver, 1);
+    c->block_size = block_size;
+    c->ir_length = ir_length;
+    c->n_inputs = n_inputs;
+    c->n_outputs = n_outputs;
+
+    c->n_stages = partition(block_size, ir_length, partitioning, NULL, 0, 0, NULL);
+    c->stages = pa_xnew0(struct stage, c->n_stages);
+    partition(block_size, ir_length, partitioning, c->stages, n_inputs, n_outputs, &ok);
+
+    if (!ok) {
+        pa_convolver_free(c);
+        return NULL;
+    }
+
+    /* The last stage writes up to offset + block_size samples ahead */
+    last = &c->stages[c->n_stages - 1];
+    c->ring_size = 1;
+    while (c->ring_size < last->offset + block_size)
+        c->ring_size <<= 1;
+
+    c->ring = pa_xnew0(float *, n_outputs);
+    for (i = 0; i < n_outputs; i++)
+        c->ring[i] = alloc(c->ring_size * sizeof(float));
+
+    pa_log_debug("Convolver for %u samples with block size %u uses %u stage(s):", ir_length, block_size, c->n_stages);
+    for (i = 0; i < c->n_stages; i++)
+        pa_log_debug("  %u partition(s) of %u samples at offset %u",
+                     c->stages[i].n_partitions, c->stages[i].partition_size, c->stages[i].offset);
+
+    return c;
+}
+
+void pa_convolver_free(pa_convolver *c) {
+    unsigned i;
+
+    pa_assert(c);
+
+    /* Stages that were not initialized are all zero, except for the
+     * arrays that are allocated first */
+    for (i = 0; i < c->n_stages; i++)
+        if (c->stages[i].input)
+            stage_done(&c->stages[i], c->n_inputs, c->n_outputs);
+    pa_xfree(c->stages);
+
+    if (c->ring) {
+        for (i = 0; i < c->n_outputs; i++)
+            fftwf_free(c->ring[i]);
+        pa_xfree(c->ring);
+    }
+
+    pa_xfree(c);
+}
+
+void pa_convolver_set_ir(pa_convolver *c, unsigned input, unsigned output, const float *ir, unsigned length) {
+    unsigned i, k;
+
+    pa_assert(c);
+    pa_assert(input < c->n_inputs);
+    pa_assert(output < c->n_outputs);
+    pa_assert(!ir || length <= c->ir_length);
+
+    for (i = 0; i < c->n_stages; i++) {
+        struct stage *s = &c->stages[i];
+        fftwf_complex **filter = &s->filter[input * c->n_outputs + output];
+        unsigned P = s->partition_size;
+        float scale = 1.0f / (2 * P);
+
+        if (!ir) {
+            if (*filter)
+                fftwf_free(*filter);
+            *filter = NULL;
+            continue;
+        }
+
+        if (!*filter)
+            *filter = alloc(s->n_partitions * s->n_bins * sizeof(fftwf_complex));
+
+        for (k = 0; k < s->n_partitions; k++) {
+            unsigned start = s->offset + k * P, j, n;
+
+            n = start < length ? PA_MIN(P, length - start) : 0;
+
+            /* The scale of the inverse transform is applied here */
+            for (j = 0; j < n; j++)
+                s->time[j] = ir[start + j] * scale;
+            memset(s->time + n, 0, (2 * P - n) * sizeof(float));
+
+            fftwf_execute(s->forward);
+            memcpy(*filter + k * s->n_bins, s->spectrum, s->n_bins * sizeof(fftwf_complex));
+        }
+    }
+}
+
+void pa_convolver_reset(pa_convolver *c) {
+    unsigned i, j;
+
+    pa_assert(c);
+
+    for (i = 0; i < c->n_stages; i++) {
+        struct stage *s = &c->stages[i];
+
+        s->fill = 0;
+        s->fdl_pos = 0;
+
+        for (j = 0; j < c->n_inputs; j++) {
+            memset(s->input[j], 0, 2 * s->partition_size * sizeof(float));
+            memset(s->fdl[j], 0, s->n_partitions * s->n_bins * sizeof(fftwf_complex));
+        }
+    }
+
+    for (i = 0; i < c->n_outputs; i++)
+        memset(c->ring[i], 0, c->ring_size * sizeof(float));
+
+    c->ring_pos = 0;
+}
+
+/* Transform the last two partitions of every input into the delay line and
+ * add the output of the stage to the ring buffers. Called once the stage
+ * has collected a full partition. */
+static void stage_process(pa_convolver *c, struct stage *s) {
+    unsigned P = s->partition_size, K = s->n_partitions, i, o, k, j;
+    unsigned mask = c->ring_size - 1, pos;
+
+    s->fdl_pos = (s->fdl_pos + 1) % K;
+
+    for (i = 0; i < c->n_inputs; i++) {
+        fftwf_execute_dft_r2c(s->forward, s->input[i], s->spectrum);
+        memcpy(s->fdl[i] + s->fdl_pos * s->n_bins, s->spectrum, s->n_bins * sizeof(fftwf_complex));
+
+        /* The current partition becomes the previous one */
+        memcpy(s->input[i], s->input[i] + P, P * sizeof(float));
+    }
+
+    /* The partition ends with the current block, the output is needed
+     * offset samples after its first sample */
+    pos = c->ring_pos + c->block_size - P + s->offset;
+
+    for (o = 0; o < c->n_outputs; o++) {
+        bool used = false;
+
+        memset(s->accum, 0, s->n_bins * sizeof(fftwf_complex));
+
+        for (i = 0; i < c->n_inputs; i++) {
+            const fftwf_complex *h = s->filter[i * c->n_outputs + o];
+
+            if (!h)
+                continue;
+
+            for (k = 0; k < K; k++) {
+                unsigned slot = (s->fdl_pos + K - k) % K;
+
+                multiply_accumulate(s->accum, s->fdl[i] + slot * s->n_bins, h + k * s->n_bins, s->n_bins);
+            }
+
+            used = true;
+        }
+
+        if (!used)
+            continue;
+
+        fftwf_execute(s->inverse);
+
+        /* Only the second half is free of circular aliasing */
+        for (j = 0; j < P; j++)
+            c->ring[o][(pos + j) & mask] += s->time[P + j];
+    }
+}
+
+void pa_convolver_process(pa_convolver *c, const float **in, float **out) {
+    unsigned i, j, n = c->block_size, mask = c->ring_size - 1;
+
+    pa_assert(c);
+    pa_assert(in);
+    pa_assert(out);
+
+    for (i = 0; i < c->n_stages; i++) {
+        struct stage *s = &c->stages[i];
+
+        for (j = 0; j < c->n_inputs; j++)
+            memcpy(s->input[j] + s->partition_size + s->fill, in[j], n * sizeof(float));
+
+        s->fill += n;
+
+        if (s->fill < s->partition_size)
+            continue;
+
+        s->fill = 0;
+        stage_process(c, s);
+    }
+
+    for (i = 0; i < c->n_outputs; i++) {
+        float *ring = c->ring[i];
+
+        for (j = 0; j < n; j++) {
+            unsigned p = (c->ring_pos + j) & mask;
+
+            out[i][j] = ring[p];
+            ring[p] = 0;
+        }
+    }
+
+    c->ring_pos = (c->ring_pos + n) & mask;
+}
+
+unsigned pa_convolver_get_block_size(pa_convolver *c) {
+    pa_assert(c);
+
+    return c->block_size;
+}
+
+unsigned pa_convolver_get_history(pa_convolver *c) {
+    struct stage *last;
+
+    pa_assert(c);
+
+    /* The delay line and the partition that is being collected */
+    last = &c->stages[c->n_stages - 1];
+
+    return PA_ROUND_UP(last->offset + (last->n_partitions + 1) * last->partition_size, c->block_size);
+}
@@ -0,0 +1,80 @@
+#ifndef foopulseconvolverhfoo
+#define foopulseconvolverhfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* Partitioned FFT convolution of planar float signals with long impulse
+ * responses. Samples are processed in blocks of a fixed size, and the
+ * output of a block only depends on input that has already been
+ * processed, so the convolver does not add any latency on top of the
+ * block size. The cost per block grows with the number of partitions
+ * instead of the length of the impulse response.
+ *
+ * A convolver filters n_inputs signals into n_outputs signals, every
+ * output is the sum of the inputs convolved with the impulse response
+ * that was set for that pair. Pairs without an impulse response cost
+ * nothing.
+ *
+ * Only available if PulseAudio was built with FFTW. */
+
+typedef struct pa_convolver pa_convolver;
+
+typedef enum pa_convolver_partitioning {
+    /* All partitions have the block size. Constant cost per block. */
+    PA_CONVOLVER_UNIFORM,
+    /* The first partitions have the block size, later parts of the
+     * impulse response are split into larger partitions, which is cheaper
+     * for very long impulse responses. Blocks that complete a large
+     * partition are more expensive than others. */
+    PA_CONVOLVER_NON_UNIFORM,
+} pa_convolver_partitioning_t;
+
+/* Create a new convolver for impulse responses of up to ir_length
+ * samples. Uses the FFTW planner, so this must not be called
+ * concurrently with other code creating FFTW plans, which in practice
+ * means it should be called from the main thread. */
+pa_convolver *pa_convolver_new(
+        unsigned block_size,
+        unsigned ir_length,
+        unsigned n_inputs,
+        unsigned n_outputs,
+        pa_convolver_partitioning_t partitioning);
+void pa_convolver_free(pa_convolver *c);
+
+/* Set the impulse response from input to output, ir may be NULL to
+ * remove it. length must not be larger than the ir_length the convolver
+ * was created with. The first call for a pair allocates memory, later
+ * calls may be done from the IO thread. */
+void pa_convolver_set_ir(pa_convolver *c, unsigned input, unsigned output, const float *ir, unsigned length);
+
+/* Forget all past input. */
+void pa_convolver_reset(pa_convolver *c);
+
+/* Filter one block. in and out point to n_inputs and n_outputs arrays of
+ * block_size samples each. */
+void pa_convolver_process(pa_convolver *c, const float **in, float **out);
+
+unsigned pa_convolver_get_block_size(pa_convolver *c);
+
+/* Number of samples of past input that the state of the convolver
+ * depends on. After pa_convolver_reset(), processing that much history
+ * (a multiple of the block size) makes the output continue as if there
+ * had been no reset. */
+unsigned pa_convolver_get_history(pa_convolver *c);
+
+#endif
@@ -196,6 +196,7 @@ pa_core* pa_core_new(pa_mainloop_api *m, bool shared, bool enable_memfd, size_t
     c->lfe_crossover_freq = 0;
     c->deferred_volume = true;
     c->resample_method = PA_RESAMPLER_SPEEX_FLOAT_BASE + 1;
+    c->startup_profile = NULL;
 
     for (j = 0; j < PA_CORE_HOOK_MAX; j++)
         pa_hook_init(&c->hooks[j], c);
@@ -269,6 +270,9 @@ static void core_free(pa_object *o) {
     pa_xfree(c->policy_default_source);
     pa_xfree(c->policy_default_sink);
 
+    if (c->startup_profile)
+        pa_dynarray_free(c->startup_profile);
+
     pa_silence_cache_done(&c->silence_cache);
     pa_mempool_unref(c->mempool);
 
@@ -661,6 +665,74 @@ void pa_core_maybe_vacuum(pa_core *c) {
     pa_mempool_vacuum(c->mempool);
 }
 
+struct startup_profile_entry {
+    char *phase;
+    char *name;
+    pa_usec_t duration;
+};
+
+static void startup_profile_entry_free(struct startup_profile_entry *e) {
+    pa_xfree(e->phase);
+    pa_xfree(e->name);
+    pa_xfree(e);
+}
+
+void pa_core_startup_profile_begin(pa_core *c) {
+    pa_core_assert_ref(c);
+
+    if (!c->startup_profile)
+        c->startup_profile = pa_dynarray_new((pa_free_cb_t) startup_profile_entry_free);
+}
+
+void pa_core_startup_profile_add(pa_core *c, const char *phase, const char *name, const char *argument, pa_usec_t duration) {
+    struct startup_profile_entry *e;
+
+    pa_core_assert_ref(c);
+    pa_assert(phase);
+
+    if (!c->startup_profile)
+        return;
+
+    e = pa_xnew(struct startup_profile_entry, 1);
+    e->phase = pa_xstrdup(phase);
+
+    if (name && argument && *argument)
+        e->name = pa_sprintf_malloc("%s %s", name, argument);
+    else
+        e->name = pa_xstrdup(name);
+
+    e->duration = duration;
+
+    pa_dynarray_append(c->startup_profile, e);
+}
+
+void pa_core_startup_profile_end(pa_core *c) {
+    struct startup_profile_entry *e;
+    pa_usec_t total = 0;
+    unsigned i;
+
+    pa_core_assert_ref(c);
+
+    if (!c->startup_profile)
+        return;
+
+    pa_log_notice("Startup profile:");
+
+    PA_DYNARRAY_FOREACH(e, c->startup_profile, i) {
+        pa_log_notice("  %8.2f ms  %-8s %s", (double) e->duration / PA_USEC_PER_MSEC, e->phase, pa_strempty(e->name));
+
+        /* Module preparation and initialization are part of the phase
+         * that loads them, so only count the phases themselves */
+        if (!e->name)
+            total += e->duration;
+    }
+
+    pa_log_notice("  %8.2f ms  total", (double) total / PA_USEC_PER_MSEC);
+
+    pa_dynarray_free(c->startup_profile);
+    c->startup_profile = NULL;
+}
+
 pa_time_event* pa_core_rttime_new(pa_core *c, pa_usec_t usec, pa_time_event_cb_t cb, void *userdata) {
     struct timeval tv;
 
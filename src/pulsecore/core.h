@@ -41,6 +41,7 @@ typedef enum pa_suspend_cause {
     PA_SUSPEND_ALL = 0xFFFF      /* Magic cause that can be used to resume forcibly */
 } pa_suspend_cause_t;
 
+#include <pulsecore/dynarray.h>
 #include <pulsecore/idxset.h>
 #include <pulsecore/hashmap.h>
 #include <pulsecore/memblock.h>
@@ -240,6 +241,10 @@ struct pa_core {
     pa_server_type_t server_type;
     pa_cpu_info cpu_info;
 
+    /* Non-NULL while daemon startup is being profiled, see
+     * pa_core_startup_profile_add() */
+    pa_dynarray *startup_profile;
+
     /* hooks */
     pa_hook hooks[PA_CORE_HOOK_MAX];
 };
@@ -280,6 +285,14 @@ int pa_core_exit(pa_core *c, bool force, int retval);
 
 void pa_core_maybe_vacuum(pa_core *c);
 
+/* Startup profiling. Between _begin() and _end() the time spent in each
+ * startup phase and in the preparation and initialization of each
+ * module is recorded, _end() logs the report. _add() does nothing
+ * when profiling is not active. */
+void pa_core_startup_profile_begin(pa_core *c);
+void pa_core_startup_profile_add(pa_core *c, const char *phase, const char *name, const char *argument, pa_usec_t duration);
+void pa_core_startup_profile_end(pa_core *c);
+
 /* wrapper for c->mainloop->time_*() RT time events */
 pa_time_event* pa_core_rttime_new(pa_core *c, pa_usec_t usec, pa_time_event_cb_t cb, void *userdata);
 void pa_core_rttime_restart(pa_core *c, pa_time_event *e, pa_usec_t usec);
@@ -0,0 +1,506 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pulse/rtclock.h>
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/llist.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/msgobject.h>
+#include <pulsecore/rtpoll.h>
+#include <pulsecore/thread.h>
+#include <pulsecore/thread-mq.h>
+
+#include "database-async.h"
+
+/* One cached key/value pair. The entries are kept in a list in
+ * addition to the hashmap so that first()/next() can walk them in a
+ * stable order. */
+struct entry {
+    pa_datum key;
+    pa_datum data;
+    PA_LLIST_FIELDS(struct entry);
+};
+
+/* A queued modification. data.data == NULL means the key is removed. */
+struct op {
+    pa_datum key;
+    pa_datum data;
+};
+
+/* A set of modifications that is handed to the worker thread in one go. */
+struct batch {
+    bool clear;
+    pa_hashmap *ops;
+    pa_database_async_cb_t cb;
+    void *userdata;
+    int result;
+    pa_usec_t submitted;
+};
+
+struct pa_database_async {
+    pa_msgobject parent;
+
+    pa_core *core;
+    pa_database *database;
+    bool for_write;
+    bool closing;
+
+    pa_hashmap *entries;
+    PA_LLIST_HEAD(struct entry, entry_list);
+
+    /* Modifications that have not been handed to the worker yet */
+    pa_hashmap *pending;
+    bool pending_clear;
+
+    pa_thread *thread;
+    pa_thread_mq thread_mq;
+    pa_rtpoll *rtpoll;
+};
+
+enum {
+    DATABASE_ASYNC_MESSAGE_WRITE,        /* main -> worker */
+    DATABASE_ASYNC_MESSAGE_WRITE_DONE,   /* worker -> main */
+};
+
+PA_DEFINE_PRIVATE_CLASS(pa_database_async, pa_msgobject);
+#define PA_DATABASE_ASYNC(o) (pa_database_async_cast(o))
+
+static unsigned datum_hash_func(const void *p) {
+    const pa_datum *d = p;
+    const uint8_t *c;
+    unsigned hash = 0;
+
+    for (c = d->data; c < (const uint8_t*) d->data + d->size; c++)
+        hash = 31 * hash + (unsigned) *c;
+
+    return hash;
+}
+
+static int datum_compare_func(const void *a, const void *b) {
+    const pa_datum *x = a, *y = b;
+
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+
+    return memcmp(x->data, y->data, x->size);
+}
+
+static void datum_copy(pa_datum *dst, const pa_datum *src) {
+    dst->size = src->size;
+    dst->data = src->size > 0 ? pa_xmemdup(src->data, src->size) : NULL;
+}
+
+static void entry_free(struct entry *e) {
+    pa_datum_free(&e->key);
+    pa_datum_free(&e->data);
+    pa_xfree(e);
+}
+
+static void op_free(struct op *o) {
+    pa_datum_free(&o->key);
+    pa_xfree(o->data.data);
+    pa_xfree(o);
+}
+
+static pa_hashmap *op_hashmap_new(void) {
+    return pa_hashmap_new_full(datum_hash_func, datum_compare_func, NULL, (pa_free_cb_t) op_free);
+}
+
+static void batch_free(struct batch *b) {
+    pa_hashmap_free(b->ops);
+    pa_xfree(b);
+}
+
+/* Called from main context */
+static void queue_op(pa_database_async *db, const pa_datum *key, const pa_datum *data) {
+    struct op *o;
+
+    if (!(o = pa_hashmap_get(db->pending, key))) {
+        o = pa_xnew0(struct op, 1);
+        datum_copy(&o->key, key);
+        pa_hashmap_put(db->pending, &o->key, o);
+    }
+
+    pa_xfree(o->data.data);
+
+    if (data) {
+        /* Never store a NULL pointer for an existing value, it would
+         * be mistaken for a removal. */
+        o->data.size = data->size;
+        o->data.data = pa_xmemdup(data->data, PA_MAX(data->size, (size_t) 1));
+    } else
+        pa_zero(o->data);
+}
+
+/* Called from worker thread */
+static int write_batch(pa_database *database, struct batch *b) {
+    struct op *o;
+    void *state;
+    int r = 0;
+
+    if (b->clear && pa_database_clear(database) < 0)
+        r = -1;
+
+    PA_HASHMAP_FOREACH(o, b->ops, state) {
+        if (o->data.data) {
+            if (pa_database_set(database, &o->key, &o->data, true) < 0)
+                r = -1;
+        } else
+            /* Removing a key that is not on disk yet is fine */
+            pa_database_unset(database, &o->key);
+    }
+
+    if (pa_database_sync(database) < 0)
+        r = -1;
+
+    return r;
+}
+
+static int database_async_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
+    pa_database_async *db = PA_DATABASE_ASYNC(o);
+    struct batch *b = data;
+
+    pa_database_async_assert_ref(db);
+
+    switch (code) {
+
+        /* Called from worker thread */
+        case DATABASE_ASYNC_MESSAGE_WRITE:
+            b->result = write_batch(db->database, b);
+            pa_asyncmsgq_post(db->thread_mq.outq, PA_MSGOBJECT(db), DATABASE_ASYNC_MESSAGE_WRITE_DONE, b, 0, NULL, NULL);
+            return 0;
+
+        /* Called from main context */
+        case DATABASE_ASYNC_MESSAGE_WRITE_DONE:
+            if (b->result < 0)
+                pa_log_warn("Failed to write database changes to disk.");
+
+            pa_log_debug("Wrote %u database changes in %0.2f ms.", pa_hashmap_size(b->ops),
+                         (double) (pa_rtclock_now() - b->submitted) / PA_USEC_PER_MSEC);
+
+            if (b->cb && !db->closing)
+                b->cb(db, b->result, b->userdata);
+
+            batch_free(b);
+            return 0;
+    }
+
+    return -1;
+}
+
+static void thread_func(void *userdata) {
+    pa_database_async *db = userdata;
+
+    pa_assert(db);
+
+    pa_log_debug("Database thread starting up");
+
+    pa_thread_mq_install(&db->thread_mq);
+
+    for (;;) {
+        int ret;
+
+        if ((ret = pa_rtpoll_run(db->rtpoll)) < 0)
+            goto fail;
+
+        if (ret == 0)
+            goto finish;
+    }
+
+fail:
+    /* If this was no regular exit from the loop we have to continue
+     * processing messages until we received PA_MESSAGE_SHUTDOWN */
+    pa_asyncmsgq_wait_for(db->thread_mq.inq, PA_MESSAGE_SHUTDOWN);
+
+finish:
+    pa_log_debug("Database thread shutting down");
+}
+
+static void database_async_free(pa_object *o) {
+    pa_database_async *db = PA_DATABASE_ASYNC(o);
+
+    pa_assert(db);
+
+    if (db->database)
+        pa_database_close(db->database);
+
+    if (db->pending)
+        pa_hashmap_free(db->pending);
+
+    if (db->entries)
+        pa_hashmap_free(db->entries);
+
+    pa_xfree(db);
+}
+
+/* Called from main context */
+static void load_entries(pa_database_async *db) {
+    pa_datum key, next_key;
+    bool done;
+
+    done = !pa_database_first(db->database, &key, NULL);
+
+    while (!done) {
+        struct entry *e;
+
+        done = !pa_database_next(db->database, &key, &next_key, NULL);
+
+        e = pa_xnew0(struct entry, 1);
+        e->key = key;
+
+        if (!pa_database_get(db->database, &e->key, &e->data))
+            entry_free(e);
+        else {
+            pa_hashmap_put(db->entries, &e->key, e);
+            PA_LLIST_PREPEND(struct entry, db->entry_list, e);
+        }
+
+        key = next_key;
+    }
+}
+
+pa_database_async* pa_database_async_open(pa_core *core, const char *path, const char *fn, bool prependmid, bool for_write) {
+    pa_database_async *db;
+    pa_usec_t start;
+
+    pa_assert(core);
+    pa_assert(path);
+    pa_assert(fn);
+
+    db = pa_msgobject_new(pa_database_async);
+    db->parent.parent.free = database_async_free;
+    db->parent.process_msg = database_async_process_msg;
+    db->core = core;
+    db->for_write = for_write;
+    db->closing = false;
+    db->database = NULL;
+    db->thread = NULL;
+    db->rtpoll = NULL;
+    db->pending_clear = false;
+    db->pending = op_hashmap_new();
+    db->entries = pa_hashmap_new_full(datum_hash_func, datum_compare_func, NULL, (pa_free_cb_t) entry_free);
+    PA_LLIST_HEAD_INIT(struct entry, db->entry_list);
+
+    if (!(db->database = pa_database_open(path, fn, prependmid, for_write)))
+        goto fail;
+
+    start = pa_rtclock_now();
+    load_entries(db);
+    pa_log_debug("Loaded %u entries of '%s' database in %0.2f ms.", pa_hashmap_size(db->entries), fn,
+                 (double) (pa_rtclock_now() - start) / PA_USEC_PER_MSEC);
+
+    db->rtpoll = pa_rtpoll_new();
+
+    if (pa_thread_mq_init(&db->thread_mq, core->mainloop, db->rtpoll) < 0) {
+        pa_log("pa_thread_mq_init() failed.");
+        pa_rtpoll_free(db->rtpoll);
+        db->rtpoll = NULL;
+        goto fail;
+    }
+
+    if (!(db->thread = pa_thread_new("database", thread_func, db))) {
+        pa_log("Failed to create database thread.");
+        pa_thread_mq_done(&db->thread_mq);
+        pa_rtpoll_free(db->rtpoll);
+        db->rtpoll = NULL;
+        goto fail;
+    }
+
+    return db;
+
+fail:
+    pa_database_async_unref(db);
+    return NULL;
+}
+
+void pa_database_async_close(pa_database_async *db) {
+    pa_database_async_assert_ref(db);
+
+    db->closing = true;
+
+    if (db->pending_clear || !pa_hashmap_isempty(db->pending)) {
+        struct batch *b;
+
+        b = pa_xnew0(struct batch, 1);
+        b->clear = db->pending_clear;
+        b->ops = db->pending;
+        b->submitted = pa_rtclock_now();
+
+        db->pending = op_hashmap_new();
+        db->pending_clear = false;
+
+        /* Wait until everything queued so far has hit the disk. */
+        pa_asyncmsgq_send(db->thread_mq.inq, PA_MSGOBJECT(db), DATABASE_ASYNC_MESSAGE_WRITE, b, 0, NULL);
+    }
+
+    pa_asyncmsgq_send(db->thread_mq.inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
+    pa_thread_free(db->thread);
+    db->thread = NULL;
+
+    /* Dispatch the remaining completions so that the batches get freed */
+    pa_asyncmsgq_flush(db->thread_mq.outq, true);
+
+    pa_thread_mq_done(&db->thread_mq);
+    pa_rtpoll_free(db->rtpoll);
+    db->rtpoll = NULL;
+
+    pa_database_async_unref(db);
+}
+
+pa_datum* pa_database_async_get(pa_database_async *db, const pa_datum *key, pa_datum* data) {
+    struct entry *e;
+
+    pa_database_async_assert_ref(db);
+    pa_assert(key);
+    pa_assert(data);
+
+    if (!(e = pa_hashmap_get(db->entries, key)))
+        return NULL;
+
+    datum_copy(data, &e->data);
+
+    return data;
+}
+
+int pa_database_async_set(pa_database_async *db, const pa_datum *key, const pa_datum* data, bool overwrite) {
+    struct entry *e;
+
+    pa_database_async_assert_ref(db);
+    pa_assert(key);
+    pa_assert(data);
+
+    if (!db->for_write)
+        return -1;
+
+    if ((e = pa_hashmap_get(db->entries, key))) {
+        if (!overwrite)
+            return -1;
+
+        pa_datum_free(&e->data);
+    } else {
+        e = pa_xnew0(struct entry, 1);
+        datum_copy(&e->key, key);
+        pa_hashmap_put(db->entries, &e->key, e);
+        PA_LLIST_PREPEND(struct entry, db->entry_list, e);
+    }
+
+    datum_copy(&e->data, data);
+    queue_op(db, key, data);
+
+    return 0;
+}
+
+int pa_database_async_unset(pa_database_async *db, const pa_datum *key) {
+    struct entry *e;
+
+    pa_database_async_assert_ref(db);
+    pa_assert(key);
+
+    if (!db->for_write)
+        return -1;
+
+    if (!(e = pa_hashmap_remove(db->entries, key)))
+        return -1;
+
+    PA_LLIST_REMOVE(struct entry, db->entry_list, e);
+    entry_free(e);
+
+    queue_op(db, key, NULL);
+
+    return 0;
+}
+
+int pa_database_async_clear(pa_database_async *db) {
+    pa_database_async_assert_ref(db);
+
+    if (!db->for_write)
+        return -1;
+
+    PA_LLIST_HEAD_INIT(struct entry, db->entry_list);
+    pa_hashmap_remove_all(db->entries);
+
+    /* Anything queued before is superseded by the clear */
+    pa_hashmap_remove_all(db->pending);
+    db->pending_clear = true;
+
+    return 0;
+}
+
+signed pa_database_async_size(pa_database_async *db) {
+    pa_database_async_assert_ref(db);
+
+    return (signed) pa_hashmap_size(db->entries);
+}
+
+static pa_datum* return_entry(struct entry *e, pa_datum *key, pa_datum *data) {
+    if (!e)
+        return NULL;
+
+    datum_copy(key, &e->key);
+
+    if (data)
+        datum_copy(data, &e->data);
+
+    return key;
+}
+
+pa_datum* pa_database_async_first(pa_database_async *db, pa_datum *key, pa_datum *data) {
+    pa_database_async_assert_ref(db);
+    pa_assert(key);
+
+    return return_entry(db->entry_list, key, data);
+}
+
+pa_datum* pa_database_async_next(pa_database_async *db, const pa_datum *key, pa_datum *next, pa_datum *data) {
+    struct entry *e;
+
+    pa_database_async_assert_ref(db);
+    pa_assert(key);
+    pa_assert(next);
+
+    if (!(e = pa_hashmap_get(db->entries, key)))
+        return NULL;
+
+    return return_entry(e->next, next, data);
+}
+
+void pa_database_async_sync(pa_database_async *db, pa_database_async_cb_t cb, void *userdata) {
+    struct batch *b;
+
+    pa_database_async_assert_ref(db);
+
+    b = pa_xnew0(struct batch, 1);
+    b->clear = db->pending_clear;
+    b->ops = db->pending;
+    b->cb = cb;
+    b->userdata = userdata;
+    b->submitted = pa_rtclock_now();
+
+    db->pending = op_hashmap_new();
+    db->pending_clear = false;
+
+    pa_asyncmsgq_post(db->thread_mq.inq, PA_MSGOBJECT(db), DATABASE_ASYNC_MESSAGE_WRITE, b, 0, NULL, NULL);
+}
@@ -0,0 +1,64 @@
+#ifndef foopulsecoredatabaseasynchfoo
+#define foopulsecoredatabaseasynchfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pulsecore/core.h>
+#include <pulsecore/database.h>
+
+/* A write-behind wrapper around pa_database for use from the main
+ * loop. The whole database is loaded into memory when it is opened,
+ * so reads and iteration never touch the disk. Modifications are
+ * applied to the in-memory copy right away and queued; the queue is
+ * written out and synced to disk by a worker thread when
+ * pa_database_async_sync() is called, so slow storage never blocks
+ * the main loop. All functions must be called from the main
+ * context. */
+
+typedef struct pa_database_async pa_database_async;
+
+/* Called from the main context once a sync requested with
+ * pa_database_async_sync() has reached the disk. result is 0 on
+ * success and negative if writing or syncing failed. */
+typedef void (*pa_database_async_cb_t)(pa_database_async *db, int result, void *userdata);
+
+/* Same arguments as pa_database_open(). */
+pa_database_async* pa_database_async_open(pa_core *core, const char *path, const char *fn, bool prependmid, bool for_write);
+
+/* Writes out all pending modifications synchronously and closes the
+ * database. Completion callbacks of outstanding syncs are not
+ * called anymore. */
+void pa_database_async_close(pa_database_async *db);
+
+pa_datum* pa_database_async_get(pa_database_async *db, const pa_datum *key, pa_datum* data);
+
+int pa_database_async_set(pa_database_async *db, const pa_datum *key, const pa_datum* data, bool overwrite);
+int pa_database_async_unset(pa_database_async *db, const pa_datum *key);
+
+int pa_database_async_clear(pa_database_async *db);
+
+signed pa_database_async_size(pa_database_async *db);
+
+pa_datum* pa_database_async_first(pa_database_async *db, pa_datum *key, pa_datum *data /* may be NULL */);
+pa_datum* pa_database_async_next(pa_database_async *db, const pa_datum *key, pa_datum *next, pa_datum *data /* may be NULL */);
+
+/* Hands all modifications made since the last call over to the
+ * worker thread and returns immediately. cb may be NULL. */
+void pa_database_async_sync(pa_database_async *db, pa_database_async_cb_t cb, void *userdata);
+
+#endif
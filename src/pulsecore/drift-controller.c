@@ -0,0 +1,145 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* The latency L of a stream changes with the difference between the rate
+ * at which data arrives and the rate at which it is consumed:
+ *
+ *     dL/dt = d - (f - 1)
+ *
+ * where d is the relative clock drift and f the rate factor applied to the
+ * consumer. With the error e = L - target, the controller
+ *
+ *     f = 1 + 2/T * e + 1/T^2 * integral(e dt)
+ *
+ * turns this into a critically damped second order system with time
+ * constant T. In steady state, the integral part equals the drift and the
+ * error is zero. The latency measurements are noisy, because sinks and
+ * sources report their latency with the granularity of their buffers, so
+ * they are low pass filtered with a time constant much smaller than T. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pulse/sample.h>
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/macro.h>
+
+#include "drift-controller.h"
+
+/* If there was no update for this long, e.g. because the stream was
+ * suspended, the filter state is stale */
+#define MAX_UPDATE_INTERVAL (PA_USEC_PER_SEC)
+
+/* The measurement filter is this much faster than the controller */
+#define FILTER_RATIO 8
+
+struct pa_drift_controller {
+    /* Parameters, in seconds */
+    double time_constant;
+    double max_deviation;
+
+    /* Filtered latency error in seconds and its integral */
+    double error;
+    double integral;
+
+    double rate_factor;
+
+    pa_usec_t time_stamp;
+    bool have_error;
+};
+
+pa_drift_controller* pa_drift_controller_new(pa_usec_t time_constant, double max_deviation) {
+    pa_drift_controller *c;
+
+    pa_assert(time_constant > 0);
+    pa_assert(max_deviation > 0 && max_deviation < 1);
+
+    c = pa_xnew0(pa_drift_controller, 1);
+    c->time_constant = (double) time_constant / PA_USEC_PER_SEC;
+    c->max_deviation = max_deviation;
+
+    pa_drift_controller_reset(c);
+
+    return c;
+}
+
+void pa_drift_controller_free(pa_drift_controller *c) {
+    pa_assert(c);
+
+    pa_xfree(c);
+}
+
+void pa_drift_controller_reset(pa_drift_controller *c) {
+    pa_assert(c);
+
+    c->error = 0;
+    c->integral = 0;
+    c->rate_factor = 1.0;
+    c->time_stamp = 0;
+    c->have_error = false;
+}
+
+double pa_drift_controller_update(pa_drift_controller *c, pa_usec_t time_stamp, int64_t latency_error) {
+    double error, integral, dt, alpha, factor;
+
+    pa_assert(c);
+
+    error = (double) latency_error / PA_USEC_PER_SEC;
+    integral = c->integral;
+
+    if (!c->have_error || time_stamp <= c->time_stamp || time_stamp - c->time_stamp > MAX_UPDATE_INTERVAL) {
+        /* Restart the filter, but keep the drift estimate */
+        c->error = error;
+        c->have_error = true;
+    } else {
+        dt = (double) (time_stamp - c->time_stamp) / PA_USEC_PER_SEC;
+
+        alpha = PA_MIN(dt * FILTER_RATIO / c->time_constant, 1.0);
+        c->error += alpha * (error - c->error);
+
+        integral += c->error * dt;
+    }
+
+    c->time_stamp = time_stamp;
+
+    factor = 1.0 + 2.0 * c->error / c->time_constant + integral / (c->time_constant * c->time_constant);
+
+    /* Don't let the integral wind up while the factor is limited */
+    if (factor > 1.0 + c->max_deviation) {
+        factor = 1.0 + c->max_deviation;
+        if (integral < c->integral)
+            c->integral = integral;
+    } else if (factor < 1.0 - c->max_deviation) {
+        factor = 1.0 - c->max_deviation;
+        if (integral > c->integral)
+            c->integral = integral;
+    } else
+        c->integral = integral;
+
+    c->rate_factor = factor;
+
+    return factor;
+}
+
+double pa_drift_controller_get_rate_factor(pa_drift_controller *c) {
+    pa_assert(c);
+
+    return c->rate_factor;
+}
@@ -0,0 +1,52 @@
+#ifndef foopulsedriftcontrollerhfoo
+#define foopulsedriftcontrollerhfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pulse/sample.h>
+#include <pulse/timeval.h>
+
+/* PI controller that keeps the latency of a stream at a target value by
+ * adjusting the rate at which the stream is consumed. It is meant to be
+ * updated from the IO thread whenever a new latency measurement is
+ * available. The result is a factor for the input rate of a resampler,
+ * see pa_resampler_set_rate_adjustment(). */
+
+typedef struct pa_drift_controller pa_drift_controller;
+
+#define PA_DRIFT_CONTROLLER_DEFAULT_TIME_CONSTANT (5 * PA_USEC_PER_SEC)
+
+/* Create new controller. The time constant determines how fast latency
+ * errors are corrected, the maximum deviation limits the rate factor to
+ * 1 +/- max_deviation. */
+pa_drift_controller* pa_drift_controller_new(pa_usec_t time_constant, double max_deviation);
+/* Free the controller */
+void pa_drift_controller_free(pa_drift_controller *c);
+/* Forget the state, the rate factor returns to 1 */
+void pa_drift_controller_reset(pa_drift_controller *c);
+
+/* Add a new measurement of the difference between current and target
+ * latency and return the new rate factor. A positive latency error means
+ * that there is too much data queued, so the factor will be larger
+ * than 1. */
+double pa_drift_controller_update(pa_drift_controller *c, pa_usec_t time_stamp, int64_t latency_error);
+
+/* Return the current rate factor */
+double pa_drift_controller_get_rate_factor(pa_drift_controller *c);
+
+#endif
@@ -0,0 +1,260 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/macro.h>
+
+#include "biquad-cascade.h"
+
+struct pa_biquad_cascade {
+    pa_sample_format_t format;
+    unsigned channels;
+    unsigned n_sections;
+    unsigned stride;
+
+    float *coefficients;
+    float *state;
+};
+
+/* Samples are filtered in blocks of this many frames, one section after
+ * the other */
+#define BLOCK_FRAMES 64
+
+/* Runs one section over n samples of one channel, or of two channels if
+ * buf2 is not NULL: the recursion only allows one sample after the other,
+ * two independent ones keep the pipeline busy. z points to the state of
+ * the section input, the state of its output follows two rows later. Only
+ * the input state is written back, the output state is the input state of
+ * the next section and still needed by it, except for the last section. */
+static inline void filter_section(float *buf, float *buf2, unsigned n, const float *s, float *z, unsigned stride, bool last) {
+    float b0 = s[0], b1 = s[stride], b2 = s[2 * stride], a1 = s[3 * stride], a2 = s[4 * stride];
+    float x1 = z[0], x2 = z[stride], y1 = z[2 * stride], y2 = z[3 * stride];
+    unsigned i;
+
+    if (buf2) {
+        float c0 = s[1], c1 = s[stride + 1], c2 = s[2 * stride + 1], d1 = s[3 * stride + 1], d2 = s[4 * stride + 1];
+        float u1 = z[1], u2 = z[stride + 1], v1 = z[2 * stride + 1], v2 = z[3 * stride + 1];
+
+        for (i = 0; i < n; i++) {
+            float x = buf[i], u = buf2[i];
+            float y = b0 * x + b1 * x1 + b2 * x2 - a2 * y2 - a1 * y1;
+            float v = c0 * u + c1 * u1 + c2 * u2 - d2 * v2 - d1 * v1;
+
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+            buf[i] = y;
+
+            u2 = u1;
+            u1 = u;
+            v2 = v1;
+            v1 = v;
+            buf2[i] = v;
+        }
+
+        z[1] = u1;
+        z[stride + 1] = u2;
+
+        if (last) {
+            z[2 * stride + 1] = v1;
+            z[3 * stride + 1] = v2;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            float x = buf[i];
+            float y = b0 * x + b1 * x1 + b2 * x2 - a2 * y2 - a1 * y1;
+
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+            buf[i] = y;
+        }
+    }
+
+    z[0] = x1;
+    z[stride] = x2;
+
+    if (last) {
+        z[2 * stride] = y1;
+        z[3 * stride] = y2;
+    }
+}
+
+/* The generic implementation, filters the channels from first on, two
+ * channels at a time */
+static inline void filter_channels(void *samples, bool s16, unsigned channels, unsigned first, unsigned n_frames,
+                                   unsigned n_sections, const float *coefficients, float *state) {
+    unsigned stride = PA_BIQUAD_CASCADE_STRIDE(channels);
+    float buf[2][BLOCK_FRAMES];
+    unsigned c, f, i, j, k, m, n;
+
+    for (c = first; c < channels; c += m) {
+        m = PA_MIN(channels - c, 2U);
+
+        for (f = 0; f < n_frames; f += n) {
+            unsigned p = f * channels + c;
+
+            n = PA_MIN(n_frames - f, BLOCK_FRAMES);
+
+            for (j = 0; j < m; j++)
+                if (s16)
+                    for (i = 0; i < n; i++)
+                        buf[j][i] = ((int16_t *) samples)[p + j + i * channels];
+                else
+                    for (i = 0; i < n; i++)
+                        buf[j][i] = ((float *) samples)[p + j + i * channels];
+
+            for (k = 0; k < n_sections; k++)
+                filter_section(buf[0], m > 1 ? buf[1] : NULL, n, coefficients + 5 * k * stride + c,
+                               state + 2 * k * stride + c, stride, k == n_sections - 1);
+
+            for (j = 0; j < m; j++)
+                if (s16)
+                    for (i = 0; i < n; i++)
+                        ((int16_t *) samples)[p + j + i * channels] = (int16_t) PA_CLAMP_UNLIKELY((int) buf[j][i], -0x8000, 0x7fff);
+                else
+                    for (i = 0; i < n; i++)
+                        ((float *) samples)[p + j + i * channels] = buf[j][i];
+        }
+    }
+}
+
+static unsigned biquad_cascade_float32ne_c(void *samples, unsigned channels, unsigned n_frames,
+                                           unsigned n_sections, const float *coefficients, float *state) {
+    filter_channels(samples, false, channels, 0, n_frames, n_sections, coefficients, state);
+    return channels;
+}
+
+static unsigned biquad_cascade_s16ne_c(void *samples, unsigned channels, unsigned n_frames,
+                                       unsigned n_sections, const float *coefficients, float *state) {
+    filter_channels(samples, true, channels, 0, n_frames, n_sections, coefficients, state);
+    return channels;
+}
+
+static pa_biquad_cascade_func_t biquad_cascade_table[] = {
+    [PA_SAMPLE_FLOAT32NE] = biquad_cascade_float32ne_c,
+    [PA_SAMPLE_S16NE]     = biquad_cascade_s16ne_c,
+};
+
+pa_biquad_cascade_func_t pa_get_biquad_cascade_func(pa_sample_format_t f) {
+    pa_assert(f == PA_SAMPLE_FLOAT32NE || f == PA_SAMPLE_S16NE);
+
+    return biquad_cascade_table[f];
+}
+
+void pa_set_biquad_cascade_func(pa_sample_format_t f, pa_biquad_cascade_func_t func) {
+    pa_assert(f == PA_SAMPLE_FLOAT32NE || f == PA_SAMPLE_S16NE);
+
+    biquad_cascade_table[f] = func;
+}
+
+pa_biquad_cascade *pa_biquad_cascade_new(pa_sample_format_t format, unsigned channels, unsigned n_sections) {
+    pa_biquad_cascade *c;
+    unsigned k, i;
+
+    pa_assert(format == PA_SAMPLE_FLOAT32NE || format == PA_SAMPLE_S16NE);
+    pa_assert(channels > 0);
+    pa_assert(n_sections > 0 && n_sections <= PA_BIQUAD_CASCADE_MAX_SECTIONS);
+
+    c = pa_xnew0(pa_biquad_cascade, 1);
+    c->format = format;
+    c->channels = channels;
+    c->n_sections = n_sections;
+    c->stride = PA_BIQUAD_CASCADE_STRIDE(channels);
+
+    c->coefficients = pa_xnew0(float, 5 * n_sections * c->stride);
+    c->state = pa_xnew0(float, 2 * (n_sections + 1) * c->stride);
+
+    /* b0 = 1, all sections pass through */
+    for (k = 0; k < n_sections; k++)
+        for (i = 0; i < c->stride; i++)
+            c->coefficients[5 * k * c->stride + i] = 1.0f;
+
+    return c;
+}
+
+void pa_biquad_cascade_free(pa_biquad_cascade *c) {
+    pa_assert(c);
+
+    pa_xfree(c->coefficients);
+    pa_xfree(c->state);
+    pa_xfree(c);
+}
+
+void pa_biquad_cascade_set(pa_biquad_cascade *c, unsigned channel, unsigned section, const struct biquad *bq) {
+    float *s;
+
+    pa_assert(c);
+    pa_assert(channel < c->channels);
+    pa_assert(section < c->n_sections);
+
+    s = c->coefficients + 5 * section * c->stride + channel;
+
+    s[0] = bq ? bq->b0 : 1.0f;
+    s[c->stride] = bq ? bq->b1 : 0.0f;
+    s[2 * c->stride] = bq ? bq->b2 : 0.0f;
+    s[3 * c->stride] = bq ? bq->a1 : 0.0f;
+    s[4 * c->stride] = bq ? bq->a2 : 0.0f;
+}
+
+void pa_biquad_cascade_reset(pa_biquad_cascade *c) {
+    pa_assert(c);
+
+    memset(c->state, 0, pa_biquad_cascade_get_state_size(c));
+}
+
+size_t pa_biquad_cascade_get_state_size(pa_biquad_cascade *c) {
+    pa_assert(c);
+
+    return 2 * (c->n_sections + 1) * c->stride * sizeof(float);
+}
+
+void pa_biquad_cascade_save_state(pa_biquad_cascade *c, void *state) {
+    pa_assert(c);
+    pa_assert(state);
+
+    memcpy(state, c->state, pa_biquad_cascade_get_state_size(c));
+}
+
+void pa_biquad_cascade_restore_state(pa_biquad_cascade *c, const void *state) {
+    pa_assert(c);
+    pa_assert(state);
+
+    memcpy(c->state, state, pa_biquad_cascade_get_state_size(c));
+}
+
+void pa_biquad_cascade_process(pa_biquad_cascade *c, void *samples, unsigned n_frames) {
+    unsigned done;
+
+    pa_assert(c);
+    pa_assert(samples);
+
+    done = biquad_cascade_table[c->format](samples, c->channels, n_frames, c->n_sections, c->coefficients, c->state);
+
+    if (done < c->channels)
+        filter_channels(samples, c->format == PA_SAMPLE_S16NE, c->channels, done, n_frames,
+                        c->n_sections, c->coefficients, c->state);
+}
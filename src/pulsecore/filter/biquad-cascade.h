@@ -0,0 +1,77 @@
+#ifndef foobiquadcascadehfoo
+#define foobiquadcascadehfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pulse/sample.h>
+
+#include <pulsecore/filter/biquad.h>
+
+/* A chain of biquad sections applied to every channel of interleaved
+ * float or s16 audio, in place. Every channel has its own coefficients
+ * for every section, sections that were not set pass the signal
+ * unchanged. An LR4 crossover is a cascade of two identical Butterworth
+ * sections.
+ *
+ * Coefficients and filter state are stored with the channels next to
+ * each other, so that optimized implementations can filter several
+ * channels at once with one vector operation per coefficient. */
+
+#define PA_BIQUAD_CASCADE_MAX_SECTIONS 8
+
+/* Coefficients and state are stored in rows of this many floats, one per
+ * channel, padded to a multiple of four channels */
+#define PA_BIQUAD_CASCADE_STRIDE(channels) (((channels) + 3U) & ~3U)
+
+typedef struct pa_biquad_cascade pa_biquad_cascade;
+
+/* Filters n_frames frames of interleaved samples in place.
+ *
+ * coefficients holds five rows (b0, b1, b2, a1, a2) for every section.
+ * state holds two rows (the last and the second to last sample) for the
+ * input and for the output of every section, the output of one section
+ * being the input of the next, so 2 * (n_sections + 1) rows in total.
+ *
+ * An implementation may leave channels at the end untouched, for example
+ * the ones that do not fill a whole vector, and returns the number of
+ * channels it processed. The rest is done by the generic code. */
+typedef unsigned (*pa_biquad_cascade_func_t)(void *samples, unsigned channels, unsigned n_frames,
+                                             unsigned n_sections, const float *coefficients, float *state);
+
+pa_biquad_cascade_func_t pa_get_biquad_cascade_func(pa_sample_format_t f);
+void pa_set_biquad_cascade_func(pa_sample_format_t f, pa_biquad_cascade_func_t func);
+
+/* format must be PA_SAMPLE_FLOAT32NE or PA_SAMPLE_S16NE */
+pa_biquad_cascade *pa_biquad_cascade_new(pa_sample_format_t format, unsigned channels, unsigned n_sections);
+void pa_biquad_cascade_free(pa_biquad_cascade *c);
+
+/* Sets the coefficients of one section for one channel, bq may be NULL to
+ * let the section pass the signal unchanged. Does not reset the state. */
+void pa_biquad_cascade_set(pa_biquad_cascade *c, unsigned channel, unsigned section, const struct biquad *bq);
+
+/* Forgets all past samples */
+void pa_biquad_cascade_reset(pa_biquad_cascade *c);
+
+/* The filter state can be saved and restored, e.g. for rewinding */
+size_t pa_biquad_cascade_get_state_size(pa_biquad_cascade *c);
+void pa_biquad_cascade_save_state(pa_biquad_cascade *c, void *state);
+void pa_biquad_cascade_restore_state(pa_biquad_cascade *c, const void *state);
+
+void pa_biquad_cascade_process(pa_biquad_cascade *c, void *samples, unsigned n_frames);
+
+#endif
@@ -26,13 +26,16 @@
 #include <pulsecore/flist.h>
 #include <pulsecore/llist.h>
 #include <pulsecore/filter/biquad.h>
-#include <pulsecore/filter/crossover.h>
+#include <pulsecore/filter/biquad-cascade.h>
+
+/* An LR4 filter is two identical biquad sections */
+#define LR4_SECTIONS 2
 
 struct saved_state {
     PA_LLIST_FIELDS(struct saved_state);
     pa_memchunk chunk;
     int64_t index;
-    struct lr4 lr4[PA_CHANNELS_MAX];
+    float lr4[2 * (LR4_SECTIONS + 1) * PA_BIQUAD_CASCADE_STRIDE(PA_CHANNELS_MAX)];
 };
 
 PA_STATIC_FLIST_DECLARE(lfe_state, 0, pa_xfree);
@@ -53,7 +56,7 @@ struct pa_lfe_filter {
     pa_sample_spec ss;
     size_t maxrewind;
     bool active;
-    struct lr4 lr4[PA_CHANNELS_MAX];
+    pa_biquad_cascade *lr4;
 };
 
 static void remove_state(pa_lfe_filter_t *f, struct saved_state *s) {
@@ -69,6 +72,8 @@ pa_lfe_filter_t * pa_lfe_filter_new(const pa_sample_spec* ss, const pa_channel_m
     f->cm = *cm;
     f->ss = *ss;
     f->maxrewind = maxrewind;
+    f->lr4 = pa_biquad_cascade_new(ss->format, cm->channels, LR4_SECTIONS);
+    pa_assert(pa_biquad_cascade_get_state_size(f->lr4) <= sizeof(((struct saved_state *) NULL)->lr4));
     pa_lfe_filter_update_rate(f, ss->rate);
     return f;
 }
@@ -77,6 +82,7 @@ void pa_lfe_filter_free(pa_lfe_filter_t *f) {
     while (f->saved)
         remove_state(f, f->saved);
 
+    pa_biquad_cascade_free(f->lr4);
     pa_xfree(f);
 }
 
@@ -86,26 +92,20 @@ void pa_lfe_filter_reset(pa_lfe_filter_t *f) {
 
 static void process_block(pa_lfe_filter_t *f, pa_memchunk *buf, bool store_result) {
     int samples = buf->length / pa_frame_size(&f->ss);
+    void *data = pa_memblock_acquire_chunk(buf);
 
-    void *garbage = store_result ? NULL : pa_xmalloc(buf->length);
+    /* The filter works in place, when only the state is wanted the
+     * samples must not be touched */
+    if (store_result)
+        pa_biquad_cascade_process(f->lr4, data, samples);
+    else {
+        void *garbage = pa_xmemdup(data, buf->length);
 
-    if (f->ss.format == PA_SAMPLE_FLOAT32NE) {
-        int i;
-        float *data = pa_memblock_acquire_chunk(buf);
-        for (i = 0; i < f->cm.channels; i++)
-            lr4_process_float32(&f->lr4[i], samples, f->cm.channels, &data[i], garbage ? garbage : &data[i]);
-        pa_memblock_release(buf->memblock);
-    }
-    else if (f->ss.format == PA_SAMPLE_S16NE) {
-        int i;
-        short *data = pa_memblock_acquire_chunk(buf);
-        for (i = 0; i < f->cm.channels; i++)
-            lr4_process_s16(&f->lr4[i], samples, f->cm.channels, &data[i], garbage ? garbage : &data[i]);
-        pa_memblock_release(buf->memblock);
+        pa_biquad_cascade_process(f->lr4, garbage, samples);
+        pa_xfree(garbage);
     }
-    else pa_assert_not_reached();
 
-    pa_xfree(garbage);
+    pa_memblock_release(buf->memblock);
     f->index += samples;
 }
 
@@ -138,7 +138,7 @@ pa_memchunk * pa_lfe_filter_process(pa_lfe_filter_t *f, pa_memchunk *buf) {
     pa_mempool_unref(pool), pool = NULL;
 
     s->index = f->index;
-    memcpy(s->lr4, f->lr4, sizeof(struct lr4) * f->cm.channels);
+    pa_biquad_cascade_save_state(f->lr4, s->lr4);
     PA_LLIST_PREPEND(struct saved_state, f->saved, s);
 
     process_block(f, buf, true);
@@ -160,8 +160,15 @@ void pa_lfe_filter_update_rate(pa_lfe_filter_t *f, uint32_t new_rate) {
         return;
     }
 
-    for (i = 0; i < f->cm.channels; i++)
-        lr4_set(&f->lr4[i], f->cm.map[i] == PA_CHANNEL_POSITION_LFE ? BQ_LOWPASS : BQ_HIGHPASS, biquad_freq);
+    for (i = 0; i < f->cm.channels; i++) {
+        struct biquad bq;
+
+        biquad_set(&bq, f->cm.map[i] == PA_CHANNEL_POSITION_LFE ? BQ_LOWPASS : BQ_HIGHPASS, biquad_freq);
+        pa_biquad_cascade_set(f->lr4, i, 0, &bq);
+        pa_biquad_cascade_set(f->lr4, i, 1, &bq);
+    }
+
+    pa_biquad_cascade_reset(f->lr4);
 
     f->active = true;
 }
@@ -185,7 +192,7 @@ void pa_lfe_filter_rewind(pa_lfe_filter_t *f, size_t amount) {
     }
     pa_log_debug("Rewinding LFE filter %zu samples to position %lli. Found saved state at position %lli",
         samples, (long long) f->index, (long long) s->index);
-    memcpy(f->lr4, s->lr4, sizeof(struct lr4) * f->cm.channels);
+    pa_biquad_cascade_restore_state(f->lr4, s->lr4);
 
     /* now fast forward to the actual position */
     if (f->index > s->index) {
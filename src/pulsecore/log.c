@@ -61,8 +61,14 @@
 #include <pulse/timeval.h>
 
 #include <pulsecore/macro.h>
+#include <pulsecore/asyncq.h>
+#include <pulsecore/atomic.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/core-error.h>
+#include <pulsecore/fdsem.h>
+#include <pulsecore/flist.h>
+#include <pulsecore/llist.h>
+#include <pulsecore/mutex.h>
 #include <pulsecore/once.h>
 #include <pulsecore/ratelimit.h>
 #include <pulsecore/thread.h>
@@ -82,6 +88,9 @@
 #define ENV_LOG_BACKTRACE_SKIP "PULSE_LOG_BACKTRACE_SKIP"
 #define ENV_LOG_NO_RATELIMIT "PULSE_LOG_NO_RATE_LIMIT"
 #define LOG_MAX_SUFFIX_NUMBER 99
+#define LOG_ASYNC_TEXT_MAX 1024
+#define LOG_ASYNC_RING_SIZE 256
+#define LOG_ASYNC_RECORDS 1024
 
 static char *ident = NULL; /* in local charset format */
 static pa_log_target target = { PA_LOG_STDERR, NULL };
@@ -355,7 +364,7 @@ static void init_defaults(void) {
 }
 
 #ifdef HAVE_SYSLOG_H
-static void log_syslog(pa_log_level_t level, char *t, char *timestamp, char *location, char *bt) {
+static void log_syslog(pa_log_level_t level, char *t, char *timestamp, char *location, const char *bt) {
     char *local_t;
 
     openlog(ident, LOG_PID, LOG_USER);
@@ -368,84 +377,64 @@ static void log_syslog(pa_log_level_t level, char *t, char *timestamp, char *loc
 }
 #endif
 
-void pa_log_levelv_meta(
+static void format_timestamp(char *timestamp, size_t l, pa_usec_t u) {
+    static pa_usec_t start, last;
+    pa_usec_t a, r;
+
+    PA_ONCE_BEGIN {
+        start = u;
+        last = u;
+    } PA_ONCE_END;
+
+    r = u - last;
+    a = u - start;
+
+    /* This is not thread safe, but this is a debugging tool only
+     * anyway. */
+    last = u;
+
+    pa_snprintf(timestamp, l, "(%4llu.%03llu|%4llu.%03llu) ",
+                (unsigned long long) (a / PA_USEC_PER_SEC),
+                (unsigned long long) (((a / PA_USEC_PER_MSEC)) % 1000),
+                (unsigned long long) (r / PA_USEC_PER_SEC),
+                (unsigned long long) (((r / PA_USEC_PER_MSEC)) % 1000));
+}
+
+/* Adds the location and time prefixes to an already formatted message
+ * and writes it to the current target. text is modified in place. */
+static void write_message(
         pa_log_level_t level,
-        const char*file,
+        const char *file,
         int line,
         const char *func,
-        const char *format,
-        va_list ap) {
+        const char *thread_name,
+        pa_usec_t now,
+        char *text,
+        const char *bt) {
 
     char *t, *n;
     int saved_errno = errno;
-    char *bt = NULL;
     pa_log_target_type_t _target;
-    pa_log_level_t _maximum_level;
-    unsigned _show_backtrace;
     pa_log_flags_t _flags;
-
-    /* We don't use dynamic memory allocation here to minimize the hit
-     * in RT threads */
-    char text[16*1024], location[128], timestamp[32];
-
-    pa_assert(level < PA_LOG_LEVEL_MAX);
-    pa_assert(format);
-
-    init_defaults();
+    char location[128], timestamp[32];
 
     _target = target_override_set ? target_override : target.type;
-    _maximum_level = PA_MAX(maximum_level, maximum_level_override);
-    _show_backtrace = PA_MAX(show_backtrace, show_backtrace_override);
     _flags = flags | flags_override;
 
-    if (PA_LIKELY(level > _maximum_level)) {
-        errno = saved_errno;
-        return;
-    }
-
-    pa_vsnprintf(text, sizeof(text), format, ap);
-
     if ((_flags & PA_LOG_PRINT_META) && file && line > 0 && func)
         pa_snprintf(location, sizeof(location), "[%s][%s:%i %s()] ",
-                    pa_strnull(pa_thread_get_name(pa_thread_self())), file, line, func);
+                    pa_strnull(thread_name), file, line, func);
     else if ((_flags & (PA_LOG_PRINT_META|PA_LOG_PRINT_FILE)) && file)
         pa_snprintf(location, sizeof(location), "[%s] %s: ",
-                    pa_strnull(pa_thread_get_name(pa_thread_self())), pa_path_get_filename(file));
+                    pa_strnull(thread_name), pa_path_get_filename(file));
     else
         location[0] = 0;
 
-    if (_flags & PA_LOG_PRINT_TIME) {
-        static pa_usec_t start, last;
-        pa_usec_t u, a, r;
-
-        u = pa_rtclock_now();
-
-        PA_ONCE_BEGIN {
-            start = u;
-            last = u;
-        } PA_ONCE_END;
-
-        r = u - last;
-        a = u - start;
-
-        /* This is not thread safe, but this is a debugging tool only
-         * anyway. */
-        last = u;
-
-        pa_snprintf(timestamp, sizeof(timestamp), "(%4llu.%03llu|%4llu.%03llu) ",
-                    (unsigned long long) (a / PA_USEC_PER_SEC),
-                    (unsigned long long) (((a / PA_USEC_PER_MSEC)) % 1000),
-                    (unsigned long long) (r / PA_USEC_PER_SEC),
-                    (unsigned long long) (((r / PA_USEC_PER_MSEC)) % 1000));
-
-    } else
+    if (_flags & PA_LOG_PRINT_TIME)
+        format_timestamp(timestamp, sizeof(timestamp), now);
+    else
         timestamp[0] = 0;
 
-#ifdef HAVE_EXECINFO_H
-    if (_show_backtrace > 0)
-        bt = get_backtrace(_show_backtrace);
-#endif
-
     if (!pa_utf8_valid(text))
         pa_logl(level, "Invalid UTF-8 string following below:");
 
@@ -569,6 +558,289 @@ void pa_log_levelv_meta(
         }
     }
 
+    errno = saved_errno;
+}
+
+/* Asynchronous logging: every thread that logs gets its own
+ * single-producer ring of fixed-size records. The message text is
+ * formatted into a record taken from a preallocated lock-free free
+ * list, everything else (prefixes, charset conversion, the actual
+ * write to the target) is done by a dedicated logging thread. If no
+ * record is free or the ring is full the message is dropped and
+ * counted, the calling thread never blocks. */
+
+struct log_record {
+    pa_log_level_t level;
+    const char *file;
+    int line;
+    const char *func;
+    pa_usec_t time;
+    char thread_name[32];
+    char text[LOG_ASYNC_TEXT_MAX];
+};
+
+struct log_ring {
+    pa_asyncq *queue;
+    pa_atomic_t dead;
+    PA_LLIST_FIELDS(struct log_ring);
+};
+
+static pa_atomic_t async_enabled = PA_ATOMIC_INIT(0);
+static pa_atomic_t async_users = PA_ATOMIC_INIT(0);
+static pa_atomic_t async_dropped = PA_ATOMIC_INIT(0);
+static pa_static_mutex async_mutex = PA_STATIC_MUTEX_INIT;
+static PA_LLIST_HEAD(struct log_ring, async_rings) = NULL;
+static pa_flist *async_records = NULL;
+static pa_fdsem *async_fdsem = NULL;
+static pa_thread *async_thread = NULL;
+static bool async_quit = false;
+
+static void ring_thread_exit(void *p) {
+    struct log_ring *r = p;
+
+    /* The logging thread frees the ring once it is drained */
+    pa_atomic_store(&r->dead, 1);
+
+    if (async_fdsem)
+        pa_fdsem_post(async_fdsem);
+}
+
+PA_STATIC_TLS_DECLARE(log_ring, ring_thread_exit);
+
+static struct log_ring *get_ring(void) {
+    struct log_ring *r;
+
+    if ((r = PA_STATIC_TLS_GET(log_ring)))
+        return r;
+
+    /* This allocates once per thread, on its first log message */
+    r = pa_xnew0(struct log_ring, 1);
+    r->queue = pa_asyncq_new(LOG_ASYNC_RING_SIZE);
+
+    pa_mutex_lock(pa_static_mutex_get(&async_mutex, false, false));
+    PA_LLIST_PREPEND(struct log_ring, async_rings, r);
+    pa_mutex_unlock(pa_static_mutex_get(&async_mutex, false, false));
+
+    PA_STATIC_TLS_SET(log_ring, r);
+
+    return r;
+}
+
+/* Returns false if the message shall be written synchronously instead */
+static bool queue_message(
+        pa_log_level_t level,
+        const char *file,
+        int line,
+        const char *func,
+        pa_log_flags_t _flags,
+        const char *format,
+        va_list ap) {
+
+    struct log_ring *r;
+    struct log_record *rec;
+    bool queued = true;
+
+    if (!pa_atomic_load(&async_enabled))
+        return false;
+
+    pa_atomic_inc(&async_users);
+
+    /* Recheck now that we are registered, and never queue messages
+     * of the logging thread itself */
+    if (!pa_atomic_load(&async_enabled) || pa_thread_self() == async_thread) {
+        queued = false;
+        goto finish;
+    }
+
+    r = get_ring();
+
+    if (!(rec = pa_flist_pop(async_records))) {
+        pa_atomic_inc(&async_dropped);
+        goto finish;
+    }
+
+    rec->level = level;
+    rec->file = file;
+    rec->line = line;
+    rec->func = func;
+    rec->time = (_flags & PA_LOG_PRINT_TIME) ? pa_rtclock_now() : 0;
+    rec->thread_name[0] = 0;
+
+    if (_flags & (PA_LOG_PRINT_META|PA_LOG_PRINT_FILE))
+        pa_strlcpy(rec->thread_name, pa_strnull(pa_thread_get_name(pa_thread_self())), sizeof(rec->thread_name));
+
+    pa_vsnprintf(rec->text, sizeof(rec->text), format, ap);
+
+    if (pa_asyncq_push(r->queue, rec, false) < 0) {
+        pa_assert_se(pa_flist_push(async_records, rec) >= 0);
+        pa_atomic_inc(&async_dropped);
+        goto finish;
+    }
+
+    pa_fdsem_post(async_fdsem);
+
+finish:
+    pa_atomic_dec(&async_users);
+    return queued;
+}
+
+/* Writes out everything that is currently queued. Returns the number
+ * of records written. */
+static unsigned drain_rings(void) {
+    struct log_ring *r, *n, *head;
+    unsigned count = 0;
+    int dropped;
+
+    /* Rings are only ever prepended by other threads, so the list can
+     * be walked from a snapshot of its head without holding the lock
+     * while writing. Only removal needs the lock. */
+    pa_mutex_lock(pa_static_mutex_get(&async_mutex, false, false));
+    head = async_rings;
+    pa_mutex_unlock(pa_static_mutex_get(&async_mutex, false, false));
+
+    for (r = head; r; r = n) {
+        struct log_record *rec;
+        bool dead = pa_atomic_load(&r->dead);
+
+        n = r->next;
+
+        while ((rec = pa_asyncq_pop(r->queue, false))) {
+            write_message(rec->level, rec->file, rec->line, rec->func, rec->thread_name, rec->time, rec->text, NULL);
+            pa_assert_se(pa_flist_push(async_records, rec) >= 0);
+            count++;
+        }
+
+        /* The owning thread is gone and cannot push anymore */
+        if (dead) {
+            pa_mutex_lock(pa_static_mutex_get(&async_mutex, false, false));
+            PA_LLIST_REMOVE(struct log_ring, async_rings, r);
+            pa_mutex_unlock(pa_static_mutex_get(&async_mutex, false, false));
+
+            pa_asyncq_free(r->queue, NULL);
+            pa_xfree(r);
+        }
+    }
+
+    if ((dropped = pa_atomic_load(&async_dropped)) > 0) {
+        char text[64];
+
+        pa_atomic_sub(&async_dropped, dropped);
+        pa_snprintf(text, sizeof(text), "%i log messages dropped due to overload.", dropped);
+        write_message(PA_LOG_WARN, NULL, 0, NULL, NULL, pa_rtclock_now(), text, NULL);
+    }
+
+    return count;
+}
+
+static void async_thread_func(void *userdata) {
+    for (;;) {
+        if (drain_rings() > 0)
+            continue;
+
+        if (async_quit)
+            break;
+
+        pa_fdsem_wait(async_fdsem);
+    }
+}
+
+int pa_log_set_async(bool enable) {
+    unsigned i;
+
+    if (enable == !!pa_atomic_load(&async_enabled))
+        return 0;
+
+    if (!enable) {
+        pa_atomic_store(&async_enabled, 0);
+
+        /* Wait for producers that are about to push a record */
+        while (pa_atomic_load(&async_users) > 0)
+            pa_thread_yield();
+
+        async_quit = true;
+        pa_fdsem_post(async_fdsem);
+        pa_thread_free(async_thread);
+        async_thread = NULL;
+
+        /* Records are kept around in case asynchronous logging gets
+         * enabled again, since rings of live threads refer to them. */
+        drain_rings();
+        return 0;
+    }
+
+    if (!async_records) {
+        async_records = pa_flist_new_with_name(LOG_ASYNC_RECORDS, "log-records");
+
+        for (i = 0; i < LOG_ASYNC_RECORDS; i++)
+            pa_assert_se(pa_flist_push(async_records, pa_xnew(struct log_record, 1)) >= 0);
+
+        async_fdsem = pa_fdsem_new();
+    }
+
+    async_quit = false;
+
+    if (!(async_thread = pa_thread_new("log", async_thread_func, NULL))) {
+        pa_log_error("Failed to create logging thread.");
+        return -1;
+    }
+
+    pa_atomic_store(&async_enabled, 1);
+
+    return 0;
+}
+
+void pa_log_levelv_meta(
+        pa_log_level_t level,
+        const char*file,
+        int line,
+        const char *func,
+        const char *format,
+        va_list ap) {
+
+    int saved_errno = errno;
+    char *bt = NULL;
+    pa_log_level_t _maximum_level;
+    unsigned _show_backtrace;
+    pa_log_flags_t _flags;
+    const char *thread_name = NULL;
+
+    /* We don't use dynamic memory allocation here to minimize the hit
+     * in RT threads */
+    char text[16*1024];
+
+    pa_assert(level < PA_LOG_LEVEL_MAX);
+    pa_assert(format);
+
+    init_defaults();
+
+    _maximum_level = PA_MAX(maximum_level, maximum_level_override);
+    _show_backtrace = PA_MAX(show_backtrace, show_backtrace_override);
+    _flags = flags | flags_override;
+
+    if (PA_LIKELY(level > _maximum_level)) {
+        errno = saved_errno;
+        return;
+    }
+
+    /* Errors are always written synchronously, since they are often
+     * followed by an abort(). Backtraces can only be taken here. */
+    if (level > PA_LOG_ERROR && _show_backtrace == 0 && queue_message(level, file, line, func, _flags, format, ap)) {
+        errno = saved_errno;
+        return;
+    }
+
+    pa_vsnprintf(text, sizeof(text), format, ap);
+
+    if (_flags & (PA_LOG_PRINT_META|PA_LOG_PRINT_FILE))
+        thread_name = pa_thread_get_name(pa_thread_self());
+
+#ifdef HAVE_EXECINFO_H
+    if (_show_backtrace > 0)
+        bt = get_backtrace(_show_backtrace);
+#endif
+
+    write_message(level, file, line, func, thread_name, (_flags & PA_LOG_PRINT_TIME) ? pa_rtclock_now() : 0, text, bt);
+
     pa_xfree(bt);
     errno = saved_errno;
 }
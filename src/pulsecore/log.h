@@ -87,6 +87,11 @@ void pa_log_set_show_backtrace(unsigned nlevels);
 /* Skip the first backtrace frames */
 void pa_log_set_skip_backtrace(unsigned nlevels);
 
+/* Hand messages below error level over to a background thread instead
+ * of writing them on the calling thread. Messages are dropped (and
+ * the drops counted) rather than blocking the caller on overload. */
+int pa_log_set_async(bool enable);
+
 void pa_log_level_meta(
         pa_log_level_t level,
         const char*file,
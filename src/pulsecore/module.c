@@ -30,6 +30,7 @@
 
 #include <pulse/xmalloc.h>
 #include <pulse/proplist.h>
+#include <pulse/rtclock.h>
 
 #include <pulsecore/core-subscribe.h>
 #include <pulsecore/log.h>
@@ -37,6 +38,7 @@
 #include <pulsecore/macro.h>
 #include <pulsecore/ltdl-helper.h>
 #include <pulsecore/modinfo.h>
+#include <pulsecore/thread.h>
 
 #include "module.h"
 
@@ -46,6 +48,22 @@
 #define PA_SYMBOL_GET_N_USED "pa__get_n_used"
 #define PA_SYMBOL_GET_DEPRECATE "pa__get_deprecated"
 #define PA_SYMBOL_GET_VERSION "pa__get_version"
+#define PA_SYMBOL_PREPARE "pa__prepare"
+#define PA_SYMBOL_FREE_PREPARED "pa__free_prepared"
+
+struct pa_module_prepare {
+    pa_core *core;
+    char *name, *argument;
+
+    lt_dlhandle dl;
+    int (*prepare)(pa_core *c, const char *argument, void **prepared);
+    void (*free_prepared)(void *prepared);
+
+    pa_thread *thread;
+    void *prepared;
+    int ret;
+    pa_usec_t duration;
+};
 
 bool pa_module_exists(const char *name) {
     const char *paths, *state = NULL;
@@ -112,18 +130,29 @@ void pa_module_hook_connect(pa_module *m, pa_hook *hook, pa_hook_priority_t prio
     pa_dynarray_append(m->hooks, pa_hook_connect(hook, prio, cb, data));
 }
 
-int pa_module_load(pa_module** module, pa_core *c, const char *name, const char *argument) {
+static void release_prepared(void **prepared, void (*free_prepared)(void *prepared)) {
+    if (*prepared && free_prepared)
+        free_prepared(*prepared);
+
+    *prepared = NULL;
+}
+
+static int module_load(pa_module** module, pa_core *c, const char *name, const char *argument,
+                       void *prepared, void (*free_prepared)(void *prepared)) {
     pa_module *m = NULL;
     const char *(*get_version)(void);
     bool (*load_once)(void);
     const char* (*get_deprecated)(void);
     pa_modinfo *mi;
+    pa_usec_t start;
     int errcode, rval;
 
     pa_assert(module);
     pa_assert(c);
     pa_assert(name);
 
+    start = pa_rtclock_now();
+
     if (c->disallow_module_loading) {
         errcode = -PA_ERR_ACCESS;
         goto fail;
@@ -132,6 +161,8 @@ int pa_module_load(pa_module** module, pa_core *c, const char *name, const char
     m = pa_xnew(pa_module, 1);
     m->name = pa_xstrdup(name);
     m->argument = pa_xstrdup(argument);
+    m->prepared = prepared;
+    prepared = NULL;
     m->load_once = false;
     m->proplist = pa_proplist_new();
     m->hooks = pa_dynarray_new((pa_free_cb_t) pa_hook_slot_free);
@@ -205,7 +236,10 @@ int pa_module_load(pa_module** module, pa_core *c, const char *name, const char
     pa_assert_se(pa_idxset_put(c->modules, m, &m->index) >= 0);
     pa_assert(m->index != PA_IDXSET_INVALID);
 
-    if ((rval = m->init(m)) < 0) {
+    rval = m->init(m);
+    release_prepared(&m->prepared, free_prepared);
+
+    if (rval < 0) {
         if (rval == -PA_MODULE_ERR_SKIP) {
             errcode = -PA_ERR_NOENTITY;
             goto fail;
@@ -235,13 +269,18 @@ int pa_module_load(pa_module** module, pa_core *c, const char *name, const char
 
     pa_hook_fire(&m->core->hooks[PA_CORE_HOOK_MODULE_NEW], m);
 
+    pa_core_startup_profile_add(c, "init", name, argument, pa_rtclock_now() - start);
+
     *module = m;
 
     return 0;
 
 fail:
+    release_prepared(&prepared, free_prepared);
 
     if (m) {
+        release_prepared(&m->prepared, free_prepared);
+
         if (m->index != PA_IDXSET_INVALID)
             pa_idxset_remove_by_index(c->modules, m->index);
 
@@ -265,6 +304,99 @@ fail:
     return errcode;
 }
 
+int pa_module_load(pa_module** module, pa_core *c, const char *name, const char *argument) {
+    return module_load(module, c, name, argument, NULL, NULL);
+}
+
+static void prepare_thread_func(void *userdata) {
+    pa_module_prepare *p = userdata;
+    pa_usec_t start;
+
+    start = pa_rtclock_now();
+    p->ret = p->prepare(p->core, p->argument, &p->prepared);
+    p->duration = pa_rtclock_now() - start;
+}
+
+pa_module_prepare* pa_module_prepare_new(pa_core *c, const char *name, const char *argument) {
+    pa_module_prepare *p;
+    char *thread_name;
+
+    pa_assert(c);
+    pa_assert(name);
+
+    p = pa_xnew0(pa_module_prepare, 1);
+    p->core = c;
+    p->name = pa_xstrdup(name);
+    p->argument = pa_xstrdup(argument);
+
+    /* libltdl is not thread-safe, so the module is opened here. The
+     * handle keeps the module mapped until it is loaded for real. */
+    if (!(p->dl = lt_dlopenext(name))) {
+        pa_log("Failed to open module \"%s\".", name);
+        pa_xfree(p->name);
+        pa_xfree(p->argument);
+        pa_xfree(p);
+        return NULL;
+    }
+
+    p->prepare = (int (*)(pa_core*, const char*, void**)) pa_load_sym(p->dl, name, PA_SYMBOL_PREPARE);
+    p->free_prepared = (void (*)(void*)) pa_load_sym(p->dl, name, PA_SYMBOL_FREE_PREPARED);
+
+    if (!p->prepare)
+        return p;
+
+    thread_name = pa_sprintf_malloc("prepare-%u", pa_idxset_size(c->modules));
+    if (!(p->thread = pa_thread_new(thread_name, prepare_thread_func, p))) {
+        /* Not fatal, pa__init() has to cope without preparation anyway */
+        pa_log_warn("Failed to create thread for preparing module \"%s\".", name);
+        p->prepare = NULL;
+    }
+    pa_xfree(thread_name);
+
+    return p;
+}
+
+static void prepare_free(pa_module_prepare *p) {
+    lt_dlclose(p->dl);
+    pa_xfree(p->name);
+    pa_xfree(p->argument);
+    pa_xfree(p);
+}
+
+void pa_module_prepare_free(pa_module_prepare *p) {
+    pa_assert(p);
+
+    if (p->thread)
+        pa_thread_free(p->thread);
+
+    release_prepared(&p->prepared, p->free_prepared);
+    prepare_free(p);
+}
+
+int pa_module_load_prepared(pa_module** module, pa_module_prepare *p) {
+    int r;
+
+    pa_assert(module);
+    pa_assert(p);
+
+    if (p->thread) {
+        pa_thread_free(p->thread);
+
+        pa_core_startup_profile_add(p->core, "prepare", p->name, p->argument, p->duration);
+
+        if (p->ret < 0) {
+            /* Let pa__init() do everything on its own */
+            pa_log_info("Preparing module \"%s\" failed, initializing it without preparation.", p->name);
+            release_prepared(&p->prepared, p->free_prepared);
+        }
+    }
+
+    r = module_load(module, p->core, p->name, p->argument, p->prepared, p->free_prepared);
+    prepare_free(p);
+
+    return r;
+}
+
 static void postponed_dlclose(pa_mainloop_api *api, void *userdata) {
     lt_dlhandle dl = userdata;
 
@@ -24,6 +24,7 @@
 #include <ltdl.h>
 
 typedef struct pa_module pa_module;
+typedef struct pa_module_prepare pa_module_prepare;
 
 #include <pulse/proplist.h>
 #include <pulsecore/dynarray.h>
@@ -48,6 +49,12 @@ struct pa_module {
 
     void *userdata;
 
+    /* Result of pa__prepare() when the module was loaded through
+     * pa_module_load_prepared(). pa__init() takes ownership by
+     * resetting it to NULL, otherwise it is freed with
+     * pa__free_prepared() after initialization. */
+    void *prepared;
+
     bool load_once:1;
     bool unload_requested:1;
 
@@ -59,6 +66,21 @@ bool pa_module_exists(const char *name);
 
 int pa_module_load(pa_module** m, pa_core *c, const char *name, const char *argument);
 
+/* Opens the module and, if it exports pa__prepare(), starts running
+ * that in a worker thread. pa__prepare() may only do work that does
+ * not touch the core (e.g. probing hardware), so that several modules
+ * can be prepared concurrently. Returns NULL if the module cannot be
+ * opened. */
+pa_module_prepare* pa_module_prepare_new(pa_core *c, const char *name, const char *argument);
+
+/* Waits for the preparation to finish, then loads and initializes the
+ * module like pa_module_load() does and frees p. */
+int pa_module_load_prepared(pa_module** m, pa_module_prepare *p);
+
+/* Waits for the preparation to finish and frees p without loading the
+ * module. */
+void pa_module_prepare_free(pa_module_prepare *p);
+
 void pa_module_unload(pa_module *m, bool force);
 void pa_module_unload_by_index(pa_core *c, uint32_t idx, bool force);
 
@@ -113,11 +135,18 @@ void pa_module_hook_connect(pa_module *m, pa_hook *hook, pa_hook_priority_t prio
 #define pa__get_deprecated _MACRO_CONCAT(PA_MODULE_NAME, _LTX_pa__get_deprecated)
 #define pa__load_once _MACRO_CONCAT(PA_MODULE_NAME, _LTX_pa__load_once)
 #define pa__get_n_used _MACRO_CONCAT(PA_MODULE_NAME, _LTX_pa__get_n_used)
+#define pa__prepare _MACRO_CONCAT(PA_MODULE_NAME, _LTX_pa__prepare)
+#define pa__free_prepared _MACRO_CONCAT(PA_MODULE_NAME, _LTX_pa__free_prepared)
 
 int pa__init(pa_module*m);
 void pa__done(pa_module*m);
 int pa__get_n_used(pa_module*m);
 
+/* Optional, see pa_module_prepare_new(). Called from a worker thread,
+ * the core must only be read. */
+int pa__prepare(pa_core *c, const char *argument, void **prepared);
+void pa__free_prepared(void *prepared);
+
 const char* pa__get_author(void);
 const char* pa__get_description(void);
 const char* pa__get_usage(void);
@@ -368,6 +368,7 @@ pa_resampler* pa_resampler_new(
     r->flags = flags;
     r->in_frames = 0;
     r->out_frames = 0;
+    r->rate_adjustment = 1.0;
 
     /* Fill sample specs */
     r->i_ss = *a;
@@ -530,6 +531,27 @@ void pa_resampler_set_output_rate(pa_resampler *r, uint32_t rate) {
         pa_lfe_filter_update_rate(r->lfe_filter, rate);
 }
 
+bool pa_resampler_set_rate_adjustment(pa_resampler *r, double factor) {
+    pa_assert(r);
+    pa_assert(factor > 0);
+    pa_assert(r->flags & PA_RESAMPLER_VARIABLE_RATE);
+
+    if (!r->impl.update_rate_adjustment)
+        return false;
+
+    if (r->rate_adjustment == factor)
+        return true;
+
+    /* Recalculate delay counters */
+    r->in_frames = pa_resampler_get_delay(r, false);
+    r->out_frames = 0;
+
+    r->rate_adjustment = factor;
+    r->impl.update_rate_adjustment(r);
+
+    return true;
+}
+
 /* pa_resampler_request() and pa_resampler_result() should be as exact as
  * possible to ensure that no samples are lost or duplicated during rewinds.
  * Ignore the leftover buffer, the value appears to be wrong for ffmpeg
@@ -550,7 +572,10 @@ size_t pa_resampler_request(pa_resampler *r, size_t out_length) {
      * behavior of the used resamplers and will calculate the
      * minimum number of input frames that are needed to produce
      * the given number of output frames. */
-    in_length = (out_length - 1) * r->i_ss.rate / r->o_ss.rate + 1;
+    if (r->rate_adjustment != 1.0)
+        in_length = (size_t) ((double) (out_length - 1) * r->i_ss.rate * r->rate_adjustment / r->o_ss.rate) + 1;
+    else
+        in_length = (out_length - 1) * r->i_ss.rate / r->o_ss.rate + 1;
 
     /* Convert to input length */
     return in_length * r->i_fz;
@@ -583,6 +608,12 @@ size_t pa_resampler_result(pa_resampler *r, size_t in_length) {
         in_length = in_length - in_length % block_size;
     }
 
+    /* With a fractional rate, the result can only be estimated */
+    if (r->rate_adjustment != 1.0) {
+        out_length = (size_t) ceil((double) in_length * r->o_ss.rate / (r->i_ss.rate * r->rate_adjustment));
+        return out_length * r->o_fz;
+    }
+
     /* Convert to output frames. This matches exactly the algorithm
      * used by the resamplers except for the soxr resamplers. */
 
@@ -1559,6 +1590,8 @@ static pa_memchunk *resample(pa_resampler *r, pa_memchunk *input) {
     in_n_frames = (unsigned) (input->length / r->w_fz);
 
     out_n_frames = ((in_n_frames*r->o_ss.rate)/r->i_ss.rate)+EXTRA_FRAMES;
+    if (r->rate_adjustment < 1.0)
+        out_n_frames = (unsigned) (out_n_frames / r->rate_adjustment) + 1;
     fit_buf(r, &r->resample_buf, r->w_fz * out_n_frames, &r->resample_buf_size, 0);
 
     leftover_n_frames = r->impl.resample(r, input, in_n_frames, &r->resample_buf, &out_n_frames);
@@ -1644,7 +1677,7 @@ void pa_resampler_run(pa_resampler *r, const pa_memchunk *in, pa_memchunk *out)
 double pa_resampler_get_delay(pa_resampler *r, bool allow_negative) {
     double frames;
 
-    frames = r->out_frames * r->i_ss.rate / r->o_ss.rate;
+    frames = r->out_frames * r->i_ss.rate * r->rate_adjustment / r->o_ss.rate;
     if (frames >= r->in_frames && !allow_negative)
         return 0;
     return r->in_frames - frames;
@@ -34,6 +34,10 @@ typedef struct pa_resampler_impl pa_resampler_impl;
 struct pa_resampler_impl {
     void (*free)(pa_resampler *r);
     void (*update_rates)(pa_resampler *r);
+    /* Optional, applies rate_adjustment. NULL if the implementation only
+     * supports integer rates. May round rate_adjustment to the value the
+     * implementation can represent. */
+    void (*update_rate_adjustment)(pa_resampler *r);
 
     /* Returns the number of leftover frames in the input buffer. */
     unsigned (*resample)(pa_resampler *r, const pa_memchunk *in, unsigned in_n_frames, pa_memchunk *out, unsigned *out_n_frames);
@@ -119,6 +123,9 @@ struct pa_resampler {
     double out_frames;
     unsigned gcd;
 
+    /* Factor for the input rate, for fractional rate adjustments */
+    double rate_adjustment;
+
     pa_lfe_filter_t *lfe_filter;
 
     pa_resampler_impl impl;
@@ -154,6 +161,12 @@ void pa_resampler_set_input_rate(pa_resampler *r, uint32_t rate);
 /* Change the output rate of the resampler object */
 void pa_resampler_set_output_rate(pa_resampler *r, uint32_t rate);
 
+/* Fine tune the input rate of a variable rate resampler by a factor close
+ * to 1, e.g. for clock drift compensation. The nominal rates are not
+ * changed. Returns false if the resampling method does not support
+ * fractional rates. */
+bool pa_resampler_set_rate_adjustment(pa_resampler *r, double factor);
+
 /* Reinitialize state of the resampler, possibly due to seeking or other discontinuities */
 void pa_resampler_reset(pa_resampler *r);
 
@@ -43,7 +43,7 @@ static unsigned libsamplerate_resample(pa_resampler *r, const pa_memchunk *input
     data.data_out = pa_memblock_acquire_chunk(output);
     data.output_frames = (long int) *out_n_frames;
 
-    data.src_ratio = (double) r->o_ss.rate / r->i_ss.rate;
+    data.src_ratio = (double) r->o_ss.rate / (r->i_ss.rate * r->rate_adjustment);
     data.end_of_input = 0;
 
     pa_assert_se(src_process(state, &data) == 0);
@@ -61,7 +61,7 @@ static void libsamplerate_update_rates(pa_resampler *r) {
     pa_assert(r);
 
     state = r->impl.data;
-    pa_assert_se(src_set_ratio(state, (double) r->o_ss.rate / r->i_ss.rate) == 0);
+    pa_assert_se(src_set_ratio(state, (double) r->o_ss.rate / (r->i_ss.rate * r->rate_adjustment)) == 0);
 }
 
 static void libsamplerate_reset(pa_resampler *r) {
@@ -92,6 +92,7 @@ int pa_resampler_libsamplerate_init(pa_resampler *r) {
 
     r->impl.free = libsamplerate_free;
     r->impl.update_rates = libsamplerate_update_rates;
+    r->impl.update_rate_adjustment = libsamplerate_update_rates;
     r->impl.resample = libsamplerate_resample;
     r->impl.reset = libsamplerate_reset;
     r->impl.data = state;
@@ -71,7 +71,7 @@ static void resampler_soxr_reset(pa_resampler *r) {
 
     soxr_clear(r->impl.data);
 
-    ratio = (double)r->i_ss.rate / (double)r->o_ss.rate;
+    ratio = (double)r->i_ss.rate * r->rate_adjustment / (double)r->o_ss.rate;
     soxr_set_io_ratio(r->impl.data, ratio, 0);
 #else
     /* With libsoxr prior to 0.1.2 soxr_clear() makes soxr_process() crash afterwards,
@@ -98,7 +98,7 @@ static void resampler_soxr_update_rates(pa_resampler *r) {
 
     pa_assert(r);
 
-    ratio = (double)r->i_ss.rate / (double)r->o_ss.rate;
+    ratio = (double)r->i_ss.rate * r->rate_adjustment / (double)r->o_ss.rate;
     soxr_set_io_ratio(r->impl.data, ratio, 0);
 }
 
@@ -154,12 +154,13 @@ int pa_resampler_soxr_init(pa_resampler *r) {
         return -1;
     }
 
-    ratio = (double)r->i_ss.rate / (double)r->o_ss.rate;
+    ratio = (double)r->i_ss.rate * r->rate_adjustment / (double)r->o_ss.rate;
     soxr_set_io_ratio(state, ratio, 0);
 
     r->impl.free = resampler_soxr_free;
     r->impl.reset = resampler_soxr_reset;
     r->impl.update_rates = resampler_soxr_update_rates;
+    r->impl.update_rate_adjustment = resampler_soxr_update_rates;
     r->impl.resample = resampler_soxr_resample;
     r->impl.data = state;
 
@@ -24,6 +24,7 @@
 #include <speex/speex_resampler.h>
 #include <math.h>
 
+#include <pulsecore/core-util.h>
 #include <pulsecore/once.h>
 #include <pulsecore/resampler.h>
 
@@ -116,13 +117,58 @@ static unsigned speex_resample_int(pa_resampler *r, const pa_memchunk *input, un
     return 0;
 }
 
+/* When the ratio changes, speex rescales the fractional sample position
+ * from the old to the new denominator in 32 bits, and it multiplies the
+ * position by the oversampling factor, so the denominator of fractional
+ * ratios is kept at or below 2^16. This limits the resolution of rate
+ * adjustments to about 15 ppm of the ratio, which is finer than the 1 Hz
+ * steps of integer rate adjustment. */
+#define SPEEX_FRAC_DEN_MAX (1U << 16)
+
 static void speex_update_rates(pa_resampler *r) {
     SpeexResamplerState *state;
+    spx_uint32_t num, den, old_num, old_den, old_in, old_out;
+    unsigned gcd;
+    int err;
+
     pa_assert(r);
 
     state = r->impl.data;
 
-    pa_assert_se(speex_resampler_set_rate(state, r->i_ss.rate, r->o_ss.rate) == 0);
+    if (r->rate_adjustment == 1.0) {
+        num = r->i_ss.rate / r->gcd;
+        den = r->o_ss.rate / r->gcd;
+    } else {
+        /* The product of the old and the new denominator must fit into
+         * 32 bits, also when switching from or to the integer ratio */
+        den = PA_MIN(SPEEX_FRAC_DEN_MAX, UINT32_MAX / (r->o_ss.rate / r->gcd));
+        num = (spx_uint32_t) lrint((double) r->i_ss.rate * r->rate_adjustment * den / r->o_ss.rate);
+        num = PA_MAX(num, 1U);
+
+        gcd = pa_gcd(num, den);
+        num /= gcd;
+        den /= gcd;
+    }
+
+    speex_resampler_get_ratio(state, &old_num, &old_den);
+    speex_resampler_get_rate(state, &old_in, &old_out);
+
+    /* Changing the ratio recomputes the filter, which is expensive. Small
+     * changes of the rate adjustment often end up with the same ratio. */
+    if (num != old_num || den != old_den || r->i_ss.rate != old_in || r->o_ss.rate != old_out) {
+        if ((err = speex_resampler_set_rate_frac(state, num, den, r->i_ss.rate, r->o_ss.rate)) != RESAMPLER_ERR_SUCCESS) {
+            pa_log_warn("Failed to set speex resampling ratio %u/%u: %s", num, den, speex_resampler_strerror(err));
+
+            /* The filter state may be inconsistent after a failure, start
+             * over from the integer ratio */
+            pa_assert_se(speex_resampler_reset_mem(state) == 0);
+            pa_assert_se(speex_resampler_set_rate(state, r->i_ss.rate, r->o_ss.rate) == 0);
+            speex_resampler_get_ratio(state, &num, &den);
+        }
+    }
+
+    /* Report the adjustment that is actually in effect */
+    r->rate_adjustment = ((double) num * r->o_ss.rate) / ((double) den * r->i_ss.rate);
 }
 
 static void speex_reset(pa_resampler *r) {
@@ -154,6 +200,7 @@ int pa_resampler_speex_init(pa_resampler *r) {
 
     r->impl.free = speex_free;
     r->impl.update_rates = speex_update_rates;
+    r->impl.update_rate_adjustment = speex_update_rates;
     r->impl.reset = speex_reset;
 
     if (r->method >= PA_RESAMPLER_SPEEX_FIXED_BASE && r->method <= PA_RESAMPLER_SPEEX_FIXED_MAX) {
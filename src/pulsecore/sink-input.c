@@ -1349,6 +1349,17 @@ void pa_sink_input_update_max_request(pa_sink_input *i, size_t nbytes  /* in the
         i->update_max_request(i, pa_resampler_request(i->thread_info.resampler, nbytes));
 }
 
+/* Called from thread context */
+bool pa_sink_input_set_rate_adjustment_within_thread(pa_sink_input *i, double factor) {
+    pa_sink_input_assert_ref(i);
+    pa_sink_input_assert_io_context(i);
+
+    if (!(i->flags & PA_SINK_INPUT_VARIABLE_RATE) || !i->thread_info.resampler)
+        return false;
+
+    return pa_resampler_set_rate_adjustment(i->thread_info.resampler, factor);
+}
+
 /* Called from thread context */
 pa_usec_t pa_sink_input_set_requested_latency_within_thread(pa_sink_input *i, pa_usec_t usec) {
     pa_sink_input_assert_ref(i);
@@ -439,6 +439,11 @@ int pa_sink_input_process_msg(pa_msgobject *o, int code, void *userdata, int64_t
 
 pa_usec_t pa_sink_input_set_requested_latency_within_thread(pa_sink_input *i, pa_usec_t usec);
 
+/* Fine tune the rate of a variable rate stream, see
+ * pa_resampler_set_rate_adjustment(). Returns false if the resampler does
+ * not support fractional rates. */
+bool pa_sink_input_set_rate_adjustment_within_thread(pa_sink_input *i, double factor);
+
 bool pa_sink_input_safe_to_remove(pa_sink_input *i);
 bool pa_sink_input_process_underrun(pa_sink_input *i);
 
@@ -0,0 +1,92 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* Compares how long querying the UCM profiles of a card takes with and
+ * without the UCM cache. Usage: alsa-ucm-cache-test [CARD] [ITERATIONS] */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <pulse/rtclock.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/core-util.h>
+
+#include <modules/alsa/alsa-ucm.h>
+
+static pa_usec_t run(int card, unsigned iterations, bool use_cache) {
+    pa_alsa_ucm_config ucm;
+    pa_usec_t start, elapsed = 0;
+    unsigned i;
+    int r;
+
+    for (i = 0; i < iterations; i++) {
+        pa_zero(ucm);
+        ucm.use_cache = use_cache;
+
+        start = pa_rtclock_now();
+        r = pa_alsa_ucm_query_profiles(&ucm, card);
+        elapsed += pa_rtclock_now() - start;
+
+        pa_alsa_ucm_free(&ucm);
+
+        if (r < 0) {
+            pa_log("Failed to query UCM profiles of card %i.", card);
+            return 0;
+        }
+    }
+
+    return elapsed / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int card = 0;
+    unsigned iterations = 10;
+    pa_usec_t uncached, cached;
+
+    if (argc > 1 && pa_atoi(argv[1], &card) < 0) {
+        pa_log("Invalid card index %s", argv[1]);
+        return 1;
+    }
+
+    if (argc > 2 && (pa_atou(argv[2], &iterations) < 0 || iterations == 0)) {
+        pa_log("Invalid iteration count %s", argv[2]);
+        return 1;
+    }
+
+    if (!getenv("MAKE_CHECK"))
+        pa_log_set_level(PA_LOG_INFO);
+
+    if (!(uncached = run(card, iterations, false)))
+        return 1;
+
+    /* Fills the cache, so it is not part of the measurement */
+    if (!run(card, 1, true))
+        return 1;
+
+    cached = run(card, iterations, true);
+
+    printf("Card %i, %u iterations\n", card, iterations);
+    printf("  without cache: %llu usec\n", (unsigned long long) uncached);
+    printf("  with cache:    %llu usec\n", (unsigned long long) cached);
+
+    return 0;
+}
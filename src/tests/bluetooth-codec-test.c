@@ -0,0 +1,294 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <check.h>
+
+#include <pulse/rtclock.h>
+#include <pulse/sample.h>
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/sconv.h>
+
+#include <modules/bluetooth/a2dp-codec-util.h>
+
+/* Drives the encoders and decoders of all Bluetooth codecs with synthetic
+ * audio, without any Bluetooth hardware, and reports how fast they are, how
+ * long the slowest block took compared to the time it plays, and what the
+ * bitrate adaptation does to the block size and the bitrate. */
+
+/* Typical link MTUs of an A2DP stream and an SCO link */
+#define A2DP_MTU 895
+#define SCO_MTU 60
+
+#define SECONDS 5
+
+static const pa_sample_spec default_ss = {
+    .format = PA_SAMPLE_S16LE,
+    .rate = 48000,
+    .channels = 2
+};
+
+struct result {
+    size_t encoded;
+    size_t decoded;
+    unsigned blocks;
+    pa_usec_t encode_time;
+    pa_usec_t max_block_time;
+};
+
+/* Two tones with a little noise, converted to the format the encoder
+ * asked for */
+static void generate(uint8_t *buffer, size_t length, const pa_sample_spec *ss, uint64_t *frame) {
+    size_t n = length / pa_frame_size(ss), i;
+    float *samples = pa_xnew(float, n * ss->channels);
+    pa_convert_func_t convert;
+    unsigned c;
+
+    for (i = 0; i < n; i++, (*frame)++) {
+        double t = (double) *frame / ss->rate;
+
+        for (c = 0; c < ss->channels; c++)
+            samples[i * ss->channels + c] = (float) (0.25 * sin(2 * M_PI * (440 + 110 * c) * t) + 0.05 * sin(2 * M_PI * 3000 * t) +
+                                                     0.001 * (rand() % 1000 - 500) / 500);
+    }
+
+    pa_assert_se(convert = pa_get_convert_from_float32ne_function(ss->format));
+    convert(n * ss->channels, samples, buffer);
+
+    pa_xfree(samples);
+}
+
+/* Encodes SECONDS of audio one block at a time, like module-bluez5-device
+ * does, and decodes the result if there is a decoder */
+static void run(const pa_bt_codec *codec, void *encoder, void *decoder, const pa_sample_spec *ss, size_t mtu, struct result *r) {
+    size_t block_size, encoded_size, decoded_size = 0;
+    uint8_t *input, *output, *decoded = NULL;
+    uint64_t frame = 0;
+    pa_usec_t block_duration;
+
+    pa_zero(*r);
+
+    block_size = codec->get_write_block_size(encoder, mtu);
+    fail_unless(block_size > 0);
+    fail_unless(pa_frame_aligned(block_size, ss));
+
+    encoded_size = codec->get_encoded_block_size ? codec->get_encoded_block_size(encoder, block_size) : block_size;
+    block_duration = pa_bytes_to_usec(block_size, ss);
+
+    input = pa_xmalloc(block_size);
+    output = pa_xmalloc(encoded_size);
+
+    if (decoder) {
+        decoded_size = codec->get_read_block_size(decoder, mtu);
+        decoded = pa_xmalloc(decoded_size);
+    }
+
+    while (frame < (uint64_t) SECONDS * ss->rate) {
+        pa_usec_t start, time;
+        size_t processed, length;
+
+        generate(input, block_size, ss, &frame);
+
+        start = pa_rtclock_now();
+        length = codec->encode_buffer(encoder, (uint32_t) (frame - block_size / pa_frame_size(ss)), input, block_size, output, encoded_size, &processed);
+        time = pa_rtclock_now() - start;
+
+        ck_assert_int_eq(processed, block_size);
+        fail_unless(length <= encoded_size);
+
+        r->encode_time += time;
+        r->max_block_time = PA_MAX(r->max_block_time, time);
+        r->encoded += length;
+        r->blocks++;
+
+        if (decoder && length > 0) {
+            size_t consumed = 0;
+
+            /* Encoded blocks may be sent in chunks of the MTU */
+            while (consumed < length) {
+                size_t n = codec->decode_buffer(decoder, output + consumed, length - consumed, decoded, decoded_size, &processed);
+
+                if (processed == 0)
+                    break;
+
+                consumed += processed;
+                r->decoded += n;
+            }
+        }
+    }
+
+    pa_log_debug("%s: %u blocks of %zu bytes (%0.2f ms), %0.1f kbit/s, %0.1f times real time, slowest block %0.1f%% of its duration",
+                 codec->name, r->blocks, block_size, (double) block_duration / PA_USEC_PER_MSEC,
+                 (double) r->encoded * 8 / SECONDS / 1000,
+                 r->encode_time ? (double) SECONDS * PA_USEC_PER_SEC / r->encode_time : INFINITY,
+                 (double) r->max_block_time * 100 / block_duration);
+
+    if (decoder)
+        pa_log_debug("%s: decoded %zu of %zu bytes", codec->name, r->decoded, (size_t) r->blocks * block_size);
+
+    pa_xfree(decoded);
+    pa_xfree(output);
+    pa_xfree(input);
+}
+
+/* Steps the bitrate all the way down and back up, like the device module
+ * does when the socket does not keep up and when it does again. Some codecs
+ * can only go down. */
+static void adapt(const pa_bt_codec *codec, void *encoder, const pa_sample_spec *ss, size_t mtu) {
+    size_t initial, block_size, last;
+    unsigned steps;
+
+    if (!codec->reduce_encoder_bitrate)
+        return;
+
+    initial = last = codec->get_write_block_size(encoder, mtu);
+
+    for (steps = 0; steps < 100 && (block_size = codec->reduce_encoder_bitrate(encoder, mtu)) > 0; steps++) {
+        struct result r;
+
+        fail_unless(pa_frame_aligned(block_size, ss));
+        last = block_size;
+
+        run(codec, encoder, NULL, ss, mtu, &r);
+    }
+
+    fail_unless(steps < 100);
+    pa_log_debug("%s: %u steps down to blocks of %zu bytes", codec->name, steps, last);
+
+    if (!codec->increase_encoder_bitrate)
+        return;
+
+    for (steps = 0; steps < 100 && (block_size = codec->increase_encoder_bitrate(encoder, mtu)) > 0; steps++)
+        last = block_size;
+
+    fail_unless(steps < 100);
+    pa_log_debug("%s: %u steps back up to blocks of %zu bytes", codec->name, steps, last);
+
+    ck_assert_int_eq(codec->get_write_block_size(encoder, mtu), initial);
+}
+
+START_TEST (a2dp_codec_test) {
+    unsigned i;
+
+    for (i = 0; i < pa_bluetooth_a2dp_endpoint_conf_count(); i++) {
+        const pa_a2dp_endpoint_conf *conf = pa_bluetooth_a2dp_endpoint_conf_iter(i);
+        const pa_bt_codec *codec = &conf->bt_codec;
+        uint8_t capabilities[MAX_A2DP_CAPS_SIZE], config[MAX_A2DP_CAPS_SIZE];
+        uint8_t capabilities_size, config_size;
+        pa_sample_spec encoder_ss, decoder_ss;
+        void *encoder, *decoder;
+        struct result r;
+
+        if (!conf->can_be_supported(true)) {
+            pa_log_info("%s: not supported, skipping", codec->name);
+            continue;
+        }
+
+        capabilities_size = conf->fill_capabilities(capabilities);
+        fail_unless(capabilities_size > 0);
+        config_size = conf->fill_preferred_configuration(&default_ss, capabilities, capabilities_size, config);
+        fail_unless(config_size > 0);
+        fail_unless(conf->is_configuration_valid(config, config_size));
+
+        fail_unless((encoder = codec->init(true, false, config, config_size, &encoder_ss, NULL)) != NULL);
+
+        /* The main stream of codecs with a backchannel is decoded like the
+         * backchannel of the other side */
+        decoder = NULL;
+        if (conf->can_be_supported(false))
+            decoder = codec->init(false, codec->support_backchannel, config, config_size, &decoder_ss, NULL);
+
+        if (decoder)
+            fail_unless(pa_sample_spec_equal(&encoder_ss, &decoder_ss));
+
+        run(codec, encoder, decoder, &encoder_ss, A2DP_MTU, &r);
+        fail_unless(r.encoded > 0);
+
+        /* Codecs may hold back a few frames */
+        if (decoder)
+            fail_unless(r.decoded > 0 && r.decoded <= (size_t) r.blocks * codec->get_write_block_size(encoder, A2DP_MTU));
+
+        adapt(codec, encoder, &encoder_ss, A2DP_MTU);
+
+        if (decoder)
+            codec->deinit(decoder);
+        codec->deinit(encoder);
+    }
+}
+END_TEST
+
+START_TEST (hf_codec_test) {
+    unsigned i;
+
+    for (i = 0; i < pa_bluetooth_hf_codec_count(); i++) {
+        const pa_bt_codec *codec = pa_bluetooth_hf_codec_iter(i);
+        pa_sample_spec encoder_ss, decoder_ss;
+        void *encoder, *decoder;
+        struct result r;
+
+        fail_unless((encoder = codec->init(true, false, NULL, 0, &encoder_ss, NULL)) != NULL);
+        fail_unless((decoder = codec->init(false, false, NULL, 0, &decoder_ss, NULL)) != NULL);
+        fail_unless(pa_sample_spec_equal(&encoder_ss, &decoder_ss));
+
+        run(codec, encoder, decoder, &encoder_ss, SCO_MTU, &r);
+        fail_unless(r.encoded > 0);
+        fail_unless(r.decoded > 0);
+
+        adapt(codec, encoder, &encoder_ss, SCO_MTU);
+
+        codec->deinit(decoder);
+        codec->deinit(encoder);
+    }
+}
+END_TEST
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    Suite *s;
+    TCase *tc;
+    SRunner *sr;
+
+    if (!getenv("MAKE_CHECK"))
+        pa_log_set_level(PA_LOG_DEBUG);
+
+    pa_bluetooth_a2dp_codec_gst_init();
+
+    s = suite_create("Bluetooth codecs");
+    tc = tcase_create("bluetooth-codec");
+    tcase_add_test(tc, a2dp_codec_test);
+    tcase_add_test(tc, hf_codec_test);
+    tcase_set_timeout(tc, 120);
+    suite_add_tcase(s, tc);
+
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
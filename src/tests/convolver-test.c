@@ -0,0 +1,273 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <check.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/convolver.h>
+
+#include "runtime-test-util.h"
+
+#define N_INPUTS 2
+#define N_OUTPUTS 2
+
+/* Bench: one second of audio at 48 kHz per run */
+#define BENCH_SAMPLES 48000
+#define TIMES 1
+#define TIMES2 5
+
+static unsigned seed = 1;
+
+static float random_sample(void) {
+    seed = seed * 1103515245 + 12345;
+    return (float) ((int) ((seed >> 8) % 2001) - 1000) / 1000.0f;
+}
+
+/* Filters random input with random impulse responses, once with the
+ * convolver and once directly in the time domain, and returns the largest
+ * difference. The impulse responses have different lengths and one pair
+ * has none. If reset_at is not 0, the convolver is reset at that block and
+ * restored by processing its history again. */
+static double run_convolution(unsigned block_size, unsigned ir_length, pa_convolver_partitioning_t partitioning, unsigned reset_at) {
+    pa_convolver *c;
+    float *x[N_INPUTS], *y[N_OUTPUTS], *h[N_INPUTS][N_OUTPUTS];
+    unsigned lengths[N_INPUTS][N_OUTPUTS];
+    unsigned n_samples, i, o, j, k, b;
+    double max_error = 0;
+
+    pa_assert_se(c = pa_convolver_new(block_size, ir_length, N_INPUTS, N_OUTPUTS, partitioning));
+
+    n_samples = PA_ROUND_UP(pa_convolver_get_history(c), block_size) + PA_MAX(reset_at, 50U) * block_size;
+
+    for (i = 0; i < N_INPUTS; i++) {
+        x[i] = pa_xnew(float, n_samples);
+        for (j = 0; j < n_samples; j++)
+            x[i][j] = random_sample();
+    }
+
+    for (o = 0; o < N_OUTPUTS; o++)
+        y[o] = pa_xnew0(float, n_samples);
+
+    for (i = 0; i < N_INPUTS; i++) {
+        for (o = 0; o < N_OUTPUTS; o++) {
+            lengths[i][o] = ir_length > 7 * i + 3 * o ? ir_length - 7 * i - 3 * o : 1;
+            h[i][o] = pa_xnew(float, lengths[i][o]);
+
+            for (j = 0; j < lengths[i][o]; j++)
+                h[i][o][j] = random_sample() * expf(-(float) j / ir_length);
+
+            if (i == 1 && o == 0) {
+                pa_xfree(h[i][o]);
+                h[i][o] = NULL;
+            } else
+                pa_convolver_set_ir(c, i, o, h[i][o], lengths[i][o]);
+        }
+    }
+
+    for (b = 0; b < n_samples / block_size; b++) {
+        const float *in[N_INPUTS];
+        float *out[N_OUTPUTS];
+
+        if (reset_at && b == reset_at) {
+            unsigned history = pa_convolver_get_history(c);
+            float *discard[N_OUTPUTS];
+
+            fail_unless(history <= b * block_size);
+
+            for (o = 0; o < N_OUTPUTS; o++)
+                discard[o] = pa_xnew(float, block_size);
+
+            pa_convolver_reset(c);
+
+            for (j = b * block_size - history; j < b * block_size; j += block_size) {
+                for (i = 0; i < N_INPUTS; i++)
+                    in[i] = x[i] + j;
+                pa_convolver_process(c, in, discard);
+            }
+
+            for (o = 0; o < N_OUTPUTS; o++)
+                pa_xfree(discard[o]);
+        }
+
+        for (i = 0; i < N_INPUTS; i++)
+            in[i] = x[i] + b * block_size;
+        for (o = 0; o < N_OUTPUTS; o++)
+            out[o] = y[o] + b * block_size;
+
+        pa_convolver_process(c, in, out);
+    }
+
+    for (o = 0; o < N_OUTPUTS; o++) {
+        for (j = 0; j < n_samples; j++) {
+            double r = 0;
+
+            for (i = 0; i < N_INPUTS; i++) {
+                if (!h[i][o])
+                    continue;
+
+                for (k = 0; k < lengths[i][o] && k <= j; k++)
+                    r += h[i][o][k] * x[i][j - k];
+            }
+
+            max_error = PA_MAX(max_error, fabs(r - y[o][j]));
+        }
+    }
+
+    for (i = 0; i < N_INPUTS; i++) {
+        pa_xfree(x[i]);
+        for (o = 0; o < N_OUTPUTS; o++)
+            pa_xfree(h[i][o]);
+    }
+    for (o = 0; o < N_OUTPUTS; o++)
+        pa_xfree(y[o]);
+
+    pa_convolver_free(c);
+
+    return max_error;
+}
+
+START_TEST (convolver_test) {
+    static const unsigned block_sizes[] = { 64, 256 };
+    static const unsigned ir_lengths[] = { 1, 20, 64, 300, 1000, 5000 };
+    unsigned i, j, p;
+
+    for (p = 0; p < 2; p++) {
+        for (i = 0; i < PA_ELEMENTSOF(block_sizes); i++) {
+            for (j = 0; j < PA_ELEMENTSOF(ir_lengths); j++) {
+                pa_convolver_partitioning_t partitioning = p ? PA_CONVOLVER_NON_UNIFORM : PA_CONVOLVER_UNIFORM;
+                double error;
+
+                error = run_convolution(block_sizes[i], ir_lengths[j], partitioning, 0);
+                pa_log_debug("%s, block size %u, %u taps: max error %g",
+                             p ? "non-uniform" : "uniform", block_sizes[i], ir_lengths[j], error);
+                fail_unless(error < 1e-4);
+            }
+        }
+    }
+}
+END_TEST
+
+START_TEST (reset_test) {
+    double error;
+
+    /* With non-uniform partitions, the reset happens in the middle of a
+     * large partition */
+    error = run_convolution(64, 5000, PA_CONVOLVER_NON_UNIFORM, 300);
+    pa_log_debug("reset: max error %g", error);
+    fail_unless(error < 1e-4);
+
+    error = run_convolution(256, 1000, PA_CONVOLVER_UNIFORM, 20);
+    pa_log_debug("reset: max error %g", error);
+    fail_unless(error < 1e-4);
+}
+END_TEST
+
+/* Runs stereo to stereo convolution with full matrix over a range of impulse
+ * response lengths and block sizes, with both kinds of partitioning. */
+START_TEST (convolver_bench) {
+    static const unsigned block_sizes[] = { 64, 256, 1024 };
+    static const unsigned ir_lengths[] = { 256, 1024, 4096, 16384, 65536 };
+    float *x[N_INPUTS], *y[N_OUTPUTS], *h;
+    unsigned i, j, k, p;
+
+    for (i = 0; i < N_INPUTS; i++) {
+        x[i] = pa_xnew(float, BENCH_SAMPLES);
+        for (j = 0; j < BENCH_SAMPLES; j++)
+            x[i][j] = random_sample();
+    }
+    for (i = 0; i < N_OUTPUTS; i++)
+        y[i] = pa_xnew(float, BENCH_SAMPLES);
+
+    h = pa_xnew(float, ir_lengths[PA_ELEMENTSOF(ir_lengths) - 1]);
+    for (j = 0; j < ir_lengths[PA_ELEMENTSOF(ir_lengths) - 1]; j++)
+        h[j] = random_sample() * 0.01f;
+
+    for (p = 0; p < 2; p++) {
+        for (i = 0; i < PA_ELEMENTSOF(block_sizes); i++) {
+            for (j = 0; j < PA_ELEMENTSOF(ir_lengths); j++) {
+                pa_convolver_partitioning_t partitioning = p ? PA_CONVOLVER_NON_UNIFORM : PA_CONVOLVER_UNIFORM;
+                unsigned block_size = block_sizes[i];
+                unsigned n_blocks = BENCH_SAMPLES / block_size;
+                unsigned in, out;
+                pa_convolver *c;
+                char label[64];
+
+                pa_assert_se(c = pa_convolver_new(block_size, ir_lengths[j], N_INPUTS, N_OUTPUTS, partitioning));
+                for (in = 0; in < N_INPUTS; in++)
+                    for (out = 0; out < N_OUTPUTS; out++)
+                        pa_convolver_set_ir(c, in, out, h, ir_lengths[j]);
+
+                pa_snprintf(label, sizeof(label), "%s %4u/%5u", p ? "non-uniform" : "uniform    ", block_size, ir_lengths[j]);
+
+                PA_RUNTIME_TEST_RUN_START(label, TIMES, TIMES2) {
+                    for (k = 0; k < n_blocks; k++) {
+                        const float *bin[N_INPUTS] = { x[0] + k * block_size, x[1] + k * block_size };
+                        float *bout[N_OUTPUTS] = { y[0] + k * block_size, y[1] + k * block_size };
+
+                        pa_convolver_process(c, bin, bout);
+                    }
+                } PA_RUNTIME_TEST_RUN_STOP
+
+                pa_convolver_free(c);
+            }
+        }
+    }
+
+    for (i = 0; i < N_INPUTS; i++)
+        pa_xfree(x[i]);
+    for (i = 0; i < N_OUTPUTS; i++)
+        pa_xfree(y[i]);
+    pa_xfree(h);
+}
+END_TEST
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    Suite *s;
+    TCase *tc;
+    SRunner *sr;
+
+    if (!getenv("MAKE_CHECK"))
+        pa_log_set_level(PA_LOG_DEBUG);
+
+    s = suite_create("Convolver");
+    tc = tcase_create("convolver");
+    tcase_add_test(tc, convolver_test);
+    tcase_add_test(tc, reset_test);
+    tcase_add_test(tc, convolver_bench);
+    /* The benchmark takes a while with the long impulse responses */
+    tcase_set_timeout(tc, 120);
+    suite_add_tcase(s, tc);
+
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,146 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <check.h>
+
+#include <pulse/timeval.h>
+
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/drift-controller.h>
+
+#define UPDATE_USEC (10 * PA_USEC_PER_MSEC)
+#define MAX_DEVIATION 0.01
+
+/* Simulates a stream whose producer runs faster than the consumer by the
+ * given drift. The latency is measured with up to 2 ms of noise, every
+ * 10 ms. Returns the largest latency error and the average rate factor
+ * over the second half of the run. */
+static void simulate(double drift, double initial_error, double *max_error, double *avg_factor) {
+    pa_drift_controller *c;
+    double latency = initial_error, factor = 1.0, sum = 0;
+    unsigned seed = 1, i, n = 0;
+    pa_usec_t now = 0;
+
+    c = pa_drift_controller_new(2 * PA_USEC_PER_SEC, MAX_DEVIATION);
+
+    *max_error = 0;
+
+    for (i = 0; i < 6000; i++) {
+        double noise;
+
+        now += UPDATE_USEC;
+        latency += (drift - (factor - 1.0)) * UPDATE_USEC / PA_USEC_PER_SEC;
+
+        seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+        noise = (double) ((int) ((seed >> 8) % 4001) - 2000) / PA_USEC_PER_SEC;
+
+        factor = pa_drift_controller_update(c, now, (int64_t) ((latency + noise) * PA_USEC_PER_SEC));
+
+        fail_unless(factor <= 1.0 + MAX_DEVIATION && factor >= 1.0 - MAX_DEVIATION);
+
+        if (i >= 3000) {
+            *max_error = PA_MAX(*max_error, fabs(latency));
+            sum += factor;
+            n++;
+        }
+    }
+
+    *avg_factor = sum / n;
+
+    pa_drift_controller_free(c);
+}
+
+START_TEST (drift_test) {
+    static const double drifts[] = { 0, 2e-4, -5e-4, 3e-3 };
+    double max_error, avg_factor;
+    unsigned i;
+
+    for (i = 0; i < PA_ELEMENTSOF(drifts); i++) {
+        simulate(drifts[i], 0.005, &max_error, &avg_factor);
+
+        pa_log_debug("drift %g: max error %0.3f ms, average factor %0.6f", drifts[i], max_error * 1000, avg_factor);
+
+        /* The latency settles within half a millisecond and the factor
+         * compensates the drift */
+        fail_unless(max_error < 0.0005);
+        fail_unless(fabs(avg_factor - 1.0 - drifts[i]) < 2e-5);
+    }
+}
+END_TEST
+
+START_TEST (limit_test) {
+    pa_drift_controller *c;
+    double factor;
+    pa_usec_t now = 0;
+    unsigned i;
+
+    c = pa_drift_controller_new(2 * PA_USEC_PER_SEC, MAX_DEVIATION);
+
+    /* A huge error saturates the factor */
+    for (i = 0; i < 1000; i++) {
+        now += UPDATE_USEC;
+        factor = pa_drift_controller_update(c, now, PA_USEC_PER_SEC);
+        ck_assert(factor == 1.0 + MAX_DEVIATION);
+    }
+
+    /* Without integral windup, the factor follows the error as soon as
+     * it is back in range */
+    now += UPDATE_USEC;
+    factor = pa_drift_controller_update(c, now, 0);
+    for (i = 0; i < 200; i++) {
+        now += UPDATE_USEC;
+        factor = pa_drift_controller_update(c, now, 0);
+    }
+    ck_assert(factor < 1.0 + MAX_DEVIATION);
+
+    pa_drift_controller_reset(c);
+    ck_assert(pa_drift_controller_get_rate_factor(c) == 1.0);
+
+    pa_drift_controller_free(c);
+}
+END_TEST
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    Suite *s;
+    TCase *tc;
+    SRunner *sr;
+
+    if (!getenv("MAKE_CHECK"))
+        pa_log_set_level(PA_LOG_DEBUG);
+
+    s = suite_create("Drift controller");
+    tc = tcase_create("drift-controller");
+    tcase_add_test(tc, drift_test);
+    tcase_add_test(tc, limit_test);
+    suite_add_tcase(s, tc);
+
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -24,8 +24,14 @@
 #include <pulse/pulseaudio.h>
 #include <pulse/sample.h>
 #include <pulsecore/memblock.h>
+#include <pulsecore/sample-util.h>
+#include <pulsecore/cpu-arm.h>
+#include <pulsecore/cpu-x86.h>
 
 #include <pulsecore/filter/lfe-filter.h>
+#include <pulsecore/filter/biquad-cascade.h>
+
+#include "runtime-test-util.h"
 
 struct lfe_filter_test {
     pa_lfe_filter_t *lf;
@@ -172,6 +178,183 @@ START_TEST (lfe_filter_test) {
 }
 END_TEST
 
+/* Installs the optimized biquad kernels for this CPU, if there are any */
+static bool init_optimized_biquad(void) {
+#if defined (__i386__) || defined (__amd64__)
+    pa_cpu_x86_flag_t flags = 0;
+
+    pa_cpu_get_x86_flags(&flags);
+
+    if (flags & PA_CPU_X86_SSE) {
+        pa_biquad_cascade_func_init_sse(flags);
+        return true;
+    }
+#elif defined (__arm__) && defined (__linux__) && defined (HAVE_NEON)
+    pa_cpu_arm_flag_t flags = 0;
+
+    pa_cpu_get_arm_flags(&flags);
+
+    if (flags & PA_CPU_ARM_NEON) {
+        pa_biquad_cascade_func_init_neon(flags);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+#define CASCADE_FRAMES 1000
+
+/* Runs the same random input through a cascade with the generic and the
+ * optimized kernel, in two halves to also compare the saved state. */
+static void run_cascade_test(pa_sample_format_t format, unsigned channels,
+                             pa_biquad_cascade_func_t generic_func, pa_biquad_cascade_func_t optimized_func) {
+    pa_biquad_cascade *c[2];
+    size_t fs = channels * pa_sample_size_of_format(format);
+    uint8_t *data[2];
+    unsigned i, j, k;
+
+    data[0] = pa_xmalloc(CASCADE_FRAMES * fs);
+    for (i = 0; i < CASCADE_FRAMES * channels; i++) {
+        if (format == PA_SAMPLE_FLOAT32NE)
+            ((float *) data[0])[i] = (float) (random() % 20001 - 10000) / 10000.0f;
+        else
+            ((int16_t *) data[0])[i] = (int16_t) random();
+    }
+    data[1] = pa_xmemdup(data[0], CASCADE_FRAMES * fs);
+
+    for (k = 0; k < 2; k++) {
+        c[k] = pa_biquad_cascade_new(format, channels, 3);
+
+        for (i = 0; i < channels; i++) {
+            struct biquad bq;
+
+            /* Different filters for every channel and section, the last
+             * channel keeps one section unset */
+            biquad_set(&bq, i % 2 ? BQ_HIGHPASS : BQ_LOWPASS, 0.01 + 0.05 * i);
+            pa_biquad_cascade_set(c[k], i, 0, &bq);
+            biquad_set(&bq, BQ_LOWPASS, 0.5 - 0.02 * i);
+            pa_biquad_cascade_set(c[k], i, 1, &bq);
+            biquad_set(&bq, BQ_HIGHPASS, 0.002 * (i + 1));
+            pa_biquad_cascade_set(c[k], i, 2, i == channels - 1 ? NULL : &bq);
+        }
+    }
+
+    for (j = 0; j < 2; j++) {
+        unsigned offset = j * CASCADE_FRAMES / 2;
+
+        for (k = 0; k < 2; k++) {
+            pa_set_biquad_cascade_func(format, k ? optimized_func : generic_func);
+            pa_biquad_cascade_process(c[k], data[k] + offset * fs, CASCADE_FRAMES / 2);
+        }
+    }
+
+    for (i = 0; i < CASCADE_FRAMES * channels; i++) {
+        if (format == PA_SAMPLE_FLOAT32NE) {
+            float a = ((float *) data[0])[i], b = ((float *) data[1])[i];
+
+            if (fabsf(a - b) > 1e-5f) {
+                pa_log_error("Biquad cascade mismatch: %u channels, sample %u: %f != %f", channels, i, a, b);
+                ck_abort();
+            }
+        } else {
+            int16_t a = ((int16_t *) data[0])[i], b = ((int16_t *) data[1])[i];
+
+            if (abs(a - b) > TOLERANT_VARIATION) {
+                pa_log_error("Biquad cascade mismatch: %u channels, sample %u: %d != %d", channels, i, a, b);
+                ck_abort();
+            }
+        }
+    }
+
+    for (k = 0; k < 2; k++) {
+        pa_biquad_cascade_free(c[k]);
+        pa_xfree(data[k]);
+    }
+
+    pa_set_biquad_cascade_func(format, optimized_func);
+}
+
+START_TEST (biquad_cascade_test) {
+    pa_biquad_cascade_func_t generic_float, generic_s16;
+    unsigned channels;
+
+    generic_float = pa_get_biquad_cascade_func(PA_SAMPLE_FLOAT32NE);
+    generic_s16 = pa_get_biquad_cascade_func(PA_SAMPLE_S16NE);
+
+    if (!init_optimized_biquad()) {
+        pa_log_info("No optimized biquad filters for this CPU. Skipping");
+        return;
+    }
+
+    for (channels = 1; channels <= 9; channels++) {
+        pa_log_debug("Checking biquad cascade with %u channels", channels);
+        run_cascade_test(PA_SAMPLE_FLOAT32NE, channels, generic_float, pa_get_biquad_cascade_func(PA_SAMPLE_FLOAT32NE));
+        run_cascade_test(PA_SAMPLE_S16NE, channels, generic_s16, pa_get_biquad_cascade_func(PA_SAMPLE_S16NE));
+    }
+
+    pa_set_biquad_cascade_func(PA_SAMPLE_FLOAT32NE, generic_float);
+    pa_set_biquad_cascade_func(PA_SAMPLE_S16NE, generic_s16);
+}
+END_TEST
+
+/* Throughput of the LFE filter as used when remixing stereo to 5.1 and
+ * 7.1, one second of audio in blocks of BENCH_BLOCK frames per run */
+#define BENCH_RATE 48000
+#define BENCH_BLOCK 1024
+#define TIMES 1
+#define TIMES2 20
+
+static void run_lfe_filter_bench(pa_mempool *pool, pa_sample_format_t format, const pa_channel_map *map, const char *label) {
+    pa_sample_spec ss;
+    pa_lfe_filter_t *lf;
+    pa_memchunk chunk;
+    unsigned i;
+
+    ss.format = format;
+    ss.rate = BENCH_RATE;
+    ss.channels = map->channels;
+
+    pa_assert_se(lf = pa_lfe_filter_new(&ss, map, 120, 0));
+
+    chunk.memblock = pa_memblock_new(pool, BENCH_BLOCK * pa_frame_size(&ss));
+    chunk.index = 0;
+    chunk.length = pa_memblock_get_length(chunk.memblock);
+    pa_silence_memchunk(&chunk, &ss);
+
+    PA_RUNTIME_TEST_RUN_START(label, TIMES, TIMES2) {
+        for (i = 0; i < BENCH_RATE / BENCH_BLOCK; i++)
+            pa_lfe_filter_process(lf, &chunk);
+    } PA_RUNTIME_TEST_RUN_STOP
+
+    pa_memblock_unref(chunk.memblock);
+    pa_lfe_filter_free(lf);
+}
+
+START_TEST (lfe_filter_bench) {
+    pa_channel_map map51, map71;
+    pa_mempool *pool;
+    unsigned k;
+
+    pa_assert_se(pool = pa_mempool_new(PA_MEM_TYPE_PRIVATE, 0, true));
+    pa_channel_map_init_extend(&map51, 6, PA_CHANNEL_MAP_DEFAULT);
+    pa_channel_map_init_extend(&map71, 8, PA_CHANNEL_MAP_DEFAULT);
+
+    for (k = 0; k < 2; k++) {
+        if (k == 1 && !init_optimized_biquad())
+            break;
+
+        pa_log_debug("LFE filter throughput with %s biquad filters", k ? "optimized" : "generic");
+        run_lfe_filter_bench(pool, PA_SAMPLE_FLOAT32NE, &map51, "float32 5.1");
+        run_lfe_filter_bench(pool, PA_SAMPLE_FLOAT32NE, &map71, "float32 7.1");
+        run_lfe_filter_bench(pool, PA_SAMPLE_S16NE, &map51, "s16 5.1");
+        run_lfe_filter_bench(pool, PA_SAMPLE_S16NE, &map71, "s16 7.1");
+    }
+
+    pa_mempool_unref(pool);
+}
+END_TEST
+
 int main(int argc, char *argv[]) {
     int failed = 0;
     Suite *s;
@@ -184,6 +367,8 @@ int main(int argc, char *argv[]) {
     s = suite_create("lfe-filter");
     tc = tcase_create("lfe-filter");
     tcase_add_test(tc, lfe_filter_test);
+    tcase_add_test(tc, biquad_cascade_test);
+    tcase_add_test(tc, lfe_filter_bench);
     suite_add_tcase(s, tc);
 
     sr = srunner_create(s);
@@ -0,0 +1,467 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <check.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include <modules/raop/raop-alac.h>
+
+#include "runtime-test-util.h"
+
+#define UDP_FRAMES 352
+#define TCP_FRAMES 4096
+#define MAX_SIZE (8 + 4 * TCP_FRAMES)
+
+/* The byte at a time bit writer the encoder used before, for comparison */
+static void byte_bit_writer(uint8_t **buffer, uint8_t *bit_pos, size_t *size, uint8_t data, uint8_t data_bit_len) {
+    int bits_left, bit_overflow;
+
+    if (!*bit_pos)
+        *size += 1;
+
+    bits_left = 7 - *bit_pos + 1;
+    bit_overflow = bits_left - data_bit_len;
+    if (bit_overflow >= 0) {
+        if (*bit_pos)
+            **buffer |= data << bit_overflow;
+        else
+            **buffer = data << bit_overflow;
+        if (bit_overflow == 0) {
+            *buffer += 1;
+            *bit_pos = 0;
+        } else
+            *bit_pos += data_bit_len;
+    } else {
+        **buffer |= data >> -bit_overflow;
+        *buffer += 1;
+        *size += 1;
+        **buffer = data << (8 + bit_overflow);
+        *bit_pos = -bit_overflow;
+    }
+}
+
+static size_t byte_encode(uint8_t *packet, size_t max, const uint8_t *raw, size_t *length) {
+    uint32_t nbs = (*length / 2) / 2, i;
+    uint8_t *bp = packet, bpos = 0;
+    size_t size = 0;
+
+    pa_memzero(packet, max);
+
+    byte_bit_writer(&bp, &bpos, &size, 1, 3);
+    byte_bit_writer(&bp, &bpos, &size, 0, 4);
+    byte_bit_writer(&bp, &bpos, &size, 0, 8);
+    byte_bit_writer(&bp, &bpos, &size, 0, 4);
+    byte_bit_writer(&bp, &bpos, &size, 1, 1);
+    byte_bit_writer(&bp, &bpos, &size, 0, 2);
+    byte_bit_writer(&bp, &bpos, &size, 1, 1);
+    byte_bit_writer(&bp, &bpos, &size, (nbs >> 24) & 0xff, 8);
+    byte_bit_writer(&bp, &bpos, &size, (nbs >> 16) & 0xff, 8);
+    byte_bit_writer(&bp, &bpos, &size, (nbs >> 8) & 0xff, 8);
+    byte_bit_writer(&bp, &bpos, &size, nbs & 0xff, 8);
+
+    for (i = 0; i < nbs; i++) {
+        byte_bit_writer(&bp, &bpos, &size, raw[4 * i + 1], 8);
+        byte_bit_writer(&bp, &bpos, &size, raw[4 * i + 0], 8);
+        byte_bit_writer(&bp, &bpos, &size, raw[4 * i + 3], 8);
+        byte_bit_writer(&bp, &bpos, &size, raw[4 * i + 2], 8);
+    }
+
+    *length = 4 * nbs;
+    return size;
+}
+
+/* A decoder for the subset of ALAC the encoder produces, written after
+ * the reference decoder */
+struct bit_reader {
+    const uint8_t *data;
+    size_t n_bits;
+    size_t pos;
+};
+
+static uint32_t peek_bits(struct bit_reader *r, unsigned n) {
+    uint32_t v = 0;
+    size_t pos;
+
+    for (pos = r->pos; pos < r->pos + n; pos++) {
+        v <<= 1;
+        if (pos < r->n_bits)
+            v |= (r->data[pos / 8] >> (7 - pos % 8)) & 1;
+    }
+
+    return v;
+}
+
+static uint32_t get_bits(struct bit_reader *r, unsigned n) {
+    uint32_t v = peek_bits(r, n);
+
+    r->pos += n;
+    return v;
+}
+
+static uint32_t decode_scalar(struct bit_reader *r, unsigned k, unsigned bits) {
+    uint32_t x = 0;
+
+    while (x <= 8 && get_bits(r, 1))
+        x++;
+
+    if (x > 8)
+        return get_bits(r, bits);
+
+    k = PA_MIN(k, (unsigned) PA_RAOP_ALAC_K_MODIFIER);
+
+    if (k != 1) {
+        uint32_t extra = peek_bits(r, k);
+
+        x = (x << k) - x;
+
+        if (extra > 1) {
+            x += extra - 1;
+            r->pos += k;
+        } else
+            r->pos += k - 1;
+    }
+
+    return x;
+}
+
+static void rice_decode(struct bit_reader *r, int32_t *out, unsigned n, unsigned mult) {
+    uint32_t history = PA_RAOP_ALAC_INITIAL_HISTORY;
+    unsigned sign_modifier = 0, i;
+
+    for (i = 0; i < n; i++) {
+        uint32_t x = decode_scalar(r, pa_ulog2((history >> 9) + 3), PA_RAOP_ALAC_BIT_DEPTH + 1) + sign_modifier;
+
+        sign_modifier = 0;
+        out[i] = (int32_t) (x >> 1) ^ -(int32_t) (x & 1);
+
+        if (x > 0xffff)
+            history = 0xffff;
+        else
+            history += x * mult - ((history * mult) >> 9);
+
+        if (history < 128 && i + 1 < n) {
+            uint32_t zeros = decode_scalar(r, 7 - pa_ulog2(history) + ((history + 16) >> 6), 16);
+
+            fail_unless(zeros < n - i);
+
+            memset(out + i + 1, 0, zeros * sizeof(int32_t));
+            i += zeros;
+
+            sign_modifier = zeros <= 0xffff;
+            history = 0;
+        }
+    }
+}
+
+static int32_t sign_extend(int32_t v, unsigned bits) {
+    return (int32_t) ((uint32_t) v << (32 - bits)) >> (32 - bits);
+}
+
+static int32_t sign_of(int32_t v) {
+    return (v > 0) - (v < 0);
+}
+
+/* Undoes the prediction in place, the adaptive FIR filter of the reference
+ * decoder with order 31 meaning first order prediction */
+static void unpredict(int32_t *x, unsigned n, unsigned order, int16_t *coefs, unsigned shift) {
+    unsigned j, lim;
+    int k;
+
+    for (j = 1; j < n && (order == 31 || j <= order); j++)
+        x[j] = sign_extend(x[j - 1] + x[j], PA_RAOP_ALAC_BIT_DEPTH + 1);
+
+    if (order == 0 || order == 31)
+        return;
+
+    lim = order + 1;
+
+    for (j = lim; j < n; j++) {
+        int32_t top = x[j - lim], del, del0, sum = 0;
+
+        for (k = 0; k < (int) order; k++)
+            sum += coefs[k] * (x[j - 1 - k] - top);
+
+        del = del0 = x[j];
+        x[j] = sign_extend(del + top + ((sum + (1 << (shift - 1))) >> shift), PA_RAOP_ALAC_BIT_DEPTH + 1);
+
+        if (del0 > 0) {
+            for (k = order - 1; k >= 0; k--) {
+                int32_t dd = top - x[j - 1 - k], sgn = sign_of(dd);
+
+                coefs[k] -= sgn;
+                del0 -= (int32_t) (order - k) * ((sgn * dd) >> shift);
+                if (del0 <= 0)
+                    break;
+            }
+        } else if (del0 < 0) {
+            for (k = order - 1; k >= 0; k--) {
+                int32_t dd = top - x[j - 1 - k], sgn = sign_of(dd);
+
+                coefs[k] += sgn;
+                del0 -= (int32_t) (order - k) * ((-sgn * dd) >> shift);
+                if (del0 >= 0)
+                    break;
+            }
+        }
+    }
+}
+
+/* Returns the number of frames decoded to out */
+static unsigned decode(const uint8_t *packet, size_t size, int16_t *out, bool *compressed) {
+    struct bit_reader r = { packet, size * 8, 0 };
+    static int32_t buf[2][TCP_FRAMES];
+    int16_t coefs[2][32];
+    unsigned n, i, k, c, shift, weight, order[2], quant[2], mult[2];
+
+    ck_assert_int_eq(get_bits(&r, 3), 1);
+    ck_assert_int_eq(get_bits(&r, 4), 0);
+    ck_assert_int_eq(get_bits(&r, 12), 0);
+    ck_assert_int_eq(get_bits(&r, 1), 1);
+    ck_assert_int_eq(get_bits(&r, 2), 0);
+    *compressed = !get_bits(&r, 1);
+    n = get_bits(&r, 32);
+    fail_unless(n <= TCP_FRAMES);
+
+    if (!*compressed) {
+        for (i = 0; i < 2 * n; i++)
+            out[i] = (int16_t) get_bits(&r, 16);
+
+        fail_unless(r.pos <= r.n_bits && r.n_bits - r.pos < 8);
+        return n;
+    }
+
+    shift = get_bits(&r, 8);
+    weight = get_bits(&r, 8);
+
+    for (c = 0; c < 2; c++) {
+        ck_assert_int_eq(get_bits(&r, 4), 0);
+        quant[c] = get_bits(&r, 4);
+        fail_unless(quant[c] != 0);
+        mult[c] = get_bits(&r, 3) * PA_RAOP_ALAC_HISTORY_MULT / 4;
+        order[c] = get_bits(&r, 5);
+
+        for (k = 0; k < order[c]; k++)
+            coefs[c][k] = (int16_t) get_bits(&r, 16);
+    }
+
+    for (c = 0; c < 2; c++) {
+        rice_decode(&r, buf[c], n, mult[c]);
+
+        unpredict(buf[c], n, order[c], coefs[c], quant[c]);
+    }
+
+    for (i = 0; i < n; i++) {
+        int32_t a = buf[0][i], b = buf[1][i];
+
+        if (weight) {
+            a -= (b * (int32_t) weight) >> shift;
+            b += a;
+            out[2 * i] = (int16_t) b;
+            out[2 * i + 1] = (int16_t) a;
+        } else {
+            out[2 * i] = (int16_t) a;
+            out[2 * i + 1] = (int16_t) b;
+        }
+    }
+
+    ck_assert_int_eq(get_bits(&r, 3), 7);
+    fail_unless(r.pos <= r.n_bits && r.n_bits - r.pos < 8);
+
+    return n;
+}
+
+enum signal {
+    SIGNAL_SILENCE,
+    SIGNAL_MUSIC,
+    SIGNAL_NOISE,
+    SIGNAL_EXTREMES,
+    SIGNAL_MONO,
+};
+
+/* Little endian stereo, like the RAOP sink receives it */
+static void generate(uint8_t *raw, unsigned n, enum signal signal, unsigned offset) {
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        double t = (double) (i + offset) / 44100;
+        int32_t l = 0, r = 0;
+
+        switch (signal) {
+            case SIGNAL_SILENCE:
+                break;
+            case SIGNAL_MUSIC:
+                l = (int32_t) (8000 * sin(2 * M_PI * 220 * t) + 3000 * sin(2 * M_PI * 1375 * t)) + rand() % 64 - 32;
+                r = (int32_t) (7000 * sin(2 * M_PI * 220 * t + 0.3) + 2000 * sin(2 * M_PI * 2750 * t)) + rand() % 64 - 32;
+                break;
+            case SIGNAL_NOISE:
+                l = rand() % 65536 - 32768;
+                r = rand() % 65536 - 32768;
+                break;
+            case SIGNAL_EXTREMES:
+                l = i & 1 ? 32767 : -32768;
+                r = i & 1 ? -32768 : 32767;
+                break;
+            case SIGNAL_MONO:
+                l = r = (int32_t) (10000 * sin(2 * M_PI * 440 * t));
+                break;
+        }
+
+        raw[4 * i + 0] = (uint8_t) (l & 0xff);
+        raw[4 * i + 1] = (uint8_t) ((l >> 8) & 0xff);
+        raw[4 * i + 2] = (uint8_t) (r & 0xff);
+        raw[4 * i + 3] = (uint8_t) ((r >> 8) & 0xff);
+    }
+}
+
+static size_t check_round_trip(const uint8_t *raw, size_t length, size_t max, bool compress) {
+    static uint8_t packet[MAX_SIZE], reference[MAX_SIZE];
+    static int16_t out[2 * TCP_FRAMES];
+    size_t size, consumed = length, ref_length = length, ref_size;
+    bool compressed;
+    unsigned n, i;
+
+    size = pa_raop_alac_encode(packet, max, raw, &consumed, compress);
+    fail_unless(size <= max);
+    fail_unless(size <= 7 + consumed);
+    ck_assert_int_eq(consumed, PA_MIN(length / 4, (max - 7) / 4) * 4);
+
+    n = decode(packet, size, out, &compressed);
+    ck_assert_int_eq(n, consumed / 4);
+
+    for (i = 0; i < 2 * n; i++)
+        ck_assert_int_eq(out[i], (int16_t) (raw[2 * i] | raw[2 * i + 1] << 8));
+
+    /* Uncompressed frames did not change */
+    if (!compressed && consumed == length / 4 * 4) {
+        ref_size = byte_encode(reference, sizeof(reference), raw, &ref_length);
+        ck_assert_int_eq(ref_size, size);
+        fail_unless(memcmp(reference, packet, size) == 0);
+    }
+
+    return compressed ? size : 0;
+}
+
+START_TEST (alac_test) {
+    static uint8_t raw[4 * TCP_FRAMES];
+    size_t size;
+
+    /* Silence compresses down to almost nothing */
+    generate(raw, UDP_FRAMES, SIGNAL_SILENCE, 0);
+    check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, false);
+    size = check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, true);
+    fail_unless(size > 0 && size < 100);
+
+    generate(raw, TCP_FRAMES, SIGNAL_MUSIC, 0);
+    check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, false);
+    size = check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, true);
+    pa_log_debug("Music packet compressed to %zu of %u bytes", size, 7 + 4 * UDP_FRAMES);
+    fail_unless(size > 0 && size < 4 * UDP_FRAMES * 3 / 4);
+    size = check_round_trip(raw, 4 * TCP_FRAMES, MAX_SIZE, true);
+    fail_unless(size > 0 && size < 4 * TCP_FRAMES * 3 / 4);
+
+    /* Noise does not compress and is sent as it is */
+    generate(raw, UDP_FRAMES, SIGNAL_NOISE, 0);
+    size = check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, true);
+    ck_assert_int_eq(size, 0);
+
+    /* The side channel and the residuals use the whole 17 bits */
+    generate(raw, UDP_FRAMES, SIGNAL_EXTREMES, 0);
+    check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, true);
+
+    generate(raw, UDP_FRAMES, SIGNAL_MONO, 0);
+    size = check_round_trip(raw, 4 * UDP_FRAMES, MAX_SIZE, true);
+    fail_unless(size > 0);
+
+    /* Short packets, and packets cut to what fits */
+    generate(raw, UDP_FRAMES, SIGNAL_MUSIC, 1000);
+    check_round_trip(raw, 4 * 1, MAX_SIZE, true);
+    check_round_trip(raw, 4 * 100 + 3, MAX_SIZE, true);
+    check_round_trip(raw, 0, MAX_SIZE, true);
+    check_round_trip(raw, 4 * UDP_FRAMES, 7 + 4 * 200 + 2, true);
+    check_round_trip(raw, 4 * UDP_FRAMES, 7 + 4 * 200 + 2, false);
+}
+END_TEST
+
+/* Encoding throughput, one second of audio in UDP packets per run */
+#define TIMES 1
+#define TIMES2 20
+#define PACKETS (44100 / UDP_FRAMES)
+
+START_TEST (alac_bench) {
+    static uint8_t raw[4 * UDP_FRAMES * PACKETS], packet[MAX_SIZE];
+    size_t sizes[2] = { 0, 0 };
+    unsigned i, k;
+
+    generate(raw, UDP_FRAMES * PACKETS, SIGNAL_MUSIC, 0);
+
+    PA_RUNTIME_TEST_RUN_START("byte at a time", TIMES, TIMES2) {
+        for (i = 0; i < PACKETS; i++) {
+            size_t length = 4 * UDP_FRAMES;
+
+            byte_encode(packet, MAX_SIZE, raw + 4 * UDP_FRAMES * i, &length);
+        }
+    } PA_RUNTIME_TEST_RUN_STOP
+
+    for (k = 0; k < 2; k++) {
+        PA_RUNTIME_TEST_RUN_START(k ? "compressed" : "uncompressed", TIMES, TIMES2) {
+            sizes[k] = 0;
+
+            for (i = 0; i < PACKETS; i++) {
+                size_t length = 4 * UDP_FRAMES;
+
+                sizes[k] += pa_raop_alac_encode(packet, MAX_SIZE, raw + 4 * UDP_FRAMES * i, &length, k);
+            }
+        } PA_RUNTIME_TEST_RUN_STOP
+    }
+
+    pa_log_debug("Compressed to %0.1f%%", 100.0 * sizes[1] / sizes[0]);
+}
+END_TEST
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    Suite *s;
+    TCase *tc;
+    SRunner *sr;
+
+    if (!getenv("MAKE_CHECK"))
+        pa_log_set_level(PA_LOG_DEBUG);
+
+    s = suite_create("RAOP ALAC");
+    tc = tcase_create("raop-alac");
+    tcase_add_test(tc, alac_test);
+    tcase_add_test(tc, alac_bench);
+    suite_add_tcase(s, tc);
+
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
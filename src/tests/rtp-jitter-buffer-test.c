@@ -0,0 +1,372 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published
+  by the Free Software Foundation; either version 2.1 of the License,
+  or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with PulseAudio; if not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <check.h>
+
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/memblock.h>
+#include <pulsecore/arpa-inet.h>
+
+#include <modules/rtp/rtp.h>
+#include <modules/rtp/jitter-buffer.h>
+
+/* L16 stereo, RTP payload type 10 */
+#define PAYLOAD 10
+#define FRAMES 256
+#define N_PACKETS 200
+#define SAMPLE_VALUE 1000
+
+/* Packets arrive every packet length plus up to a millisecond of jitter */
+#define PACKET_USEC ((pa_usec_t) FRAMES * PA_USEC_PER_SEC / 44100)
+#define ARRIVAL(i) ((pa_usec_t) (i) * PACKET_USEC + ((i) * 7919 % 1000))
+
+#define MIN_DELAY (5 * PA_USEC_PER_MSEC)
+#define MAX_DELAY (50 * PA_USEC_PER_MSEC)
+
+static const pa_sample_spec ss = {
+    .format = PA_SAMPLE_S16BE,
+    .rate = 44100,
+    .channels = 2
+};
+
+/* Sequence numbers and timestamps wrap around in the middle of the test */
+#define FIRST_SEQUENCE 65500
+#define FIRST_TSTAMP (0xffffffffU - 100 * FRAMES)
+
+struct result {
+    unsigned n_chunks;
+    uint32_t next_tstamp;
+    bool bad_tstamp;
+    bool bad_samples;
+};
+
+static void make_chunk(pa_mempool *pool, pa_memchunk *chunk) {
+    int16_t *d;
+    unsigned i;
+
+    chunk->memblock = pa_memblock_new(pool, FRAMES * pa_frame_size(&ss));
+    chunk->index = 0;
+    chunk->length = pa_memblock_get_length(chunk->memblock);
+
+    d = pa_memblock_acquire(chunk->memblock);
+    for (i = 0; i < FRAMES * ss.channels; i++)
+        d[i] = (int16_t) htons(SAMPLE_VALUE);
+    pa_memblock_release(chunk->memblock);
+}
+
+/* Checks that the chunks popped are contiguous, and that the concealed ones
+ * fit in with the constant signal around them */
+static void pop_all(pa_jitter_buffer *j, pa_usec_t now, struct result *r) {
+    pa_memchunk chunk;
+    uint32_t tstamp;
+
+    while (pa_jitter_buffer_pop(j, now, &chunk, &tstamp) >= 0) {
+        const int16_t *d;
+        unsigned i;
+
+        if (r->n_chunks > 0 && tstamp != r->next_tstamp)
+            r->bad_tstamp = true;
+
+        r->next_tstamp = tstamp + (uint32_t) (chunk.length / pa_frame_size(&ss));
+        r->n_chunks++;
+
+        d = (const int16_t *) ((uint8_t *) pa_memblock_acquire(chunk.memblock) + chunk.index);
+        for (i = 0; i < chunk.length / sizeof(int16_t); i++)
+            if (abs((int16_t) ntohs(d[i]) - SAMPLE_VALUE) > 1)
+                r->bad_samples = true;
+        pa_memblock_release(chunk.memblock);
+
+        pa_memblock_unref(chunk.memblock);
+    }
+}
+
+START_TEST (jitter_buffer_test) {
+    pa_mempool *pool;
+    pa_jitter_buffer *j;
+    pa_jitter_buffer_stats stats;
+    struct result r;
+    pa_memchunk chunk;
+
+    pool = pa_mempool_new(PA_MEM_TYPE_PRIVATE, 0, true);
+    fail_unless(pool != NULL);
+
+    j = pa_jitter_buffer_new(pool, &ss, 95, MIN_DELAY, MAX_DELAY);
+    make_chunk(pool, &chunk);
+    pa_zero(r);
+
+    /* 0, 2, 1, 3, 4 (lost), 5, 3 (duplicate), 6 */
+    pa_jitter_buffer_put(j, &chunk, 0, 0, ARRIVAL(0));
+    pop_all(j, ARRIVAL(0), &r);
+    ck_assert_int_eq(r.n_chunks, 1);
+
+    pa_jitter_buffer_put(j, &chunk, 2, 2 * FRAMES, ARRIVAL(1));
+    pop_all(j, ARRIVAL(1), &r);
+    ck_assert_int_eq(r.n_chunks, 1);
+
+    pa_jitter_buffer_put(j, &chunk, 1, FRAMES, ARRIVAL(2));
+    pa_jitter_buffer_put(j, &chunk, 3, 3 * FRAMES, ARRIVAL(3));
+    pop_all(j, ARRIVAL(3), &r);
+    ck_assert_int_eq(r.n_chunks, 4);
+
+    pa_jitter_buffer_put(j, &chunk, 5, 5 * FRAMES, ARRIVAL(4));
+    pop_all(j, ARRIVAL(4) + MIN_DELAY - 1, &r);
+    ck_assert_int_eq(r.n_chunks, 4);
+    pa_jitter_buffer_put(j, &chunk, 3, 3 * FRAMES, ARRIVAL(5));
+    pop_all(j, ARRIVAL(4) + MIN_DELAY, &r);
+    ck_assert_int_eq(r.n_chunks, 6);
+
+    pa_jitter_buffer_put(j, &chunk, 6, 6 * FRAMES, ARRIVAL(6));
+    pop_all(j, ARRIVAL(6), &r);
+    ck_assert_int_eq(r.n_chunks, 7);
+
+    fail_if(r.bad_tstamp);
+    fail_if(r.bad_samples);
+
+    pa_jitter_buffer_get_stats(j, &stats);
+    ck_assert_int_eq(stats.received, 7);
+    ck_assert_int_eq(stats.lost, 1);
+    ck_assert_int_eq(stats.concealed, 1);
+    ck_assert_int_eq(stats.reordered, 1);
+    ck_assert_int_eq(stats.late, 1);
+    ck_assert_int_eq(stats.duplicates, 0);
+    fail_unless(stats.playout_delay >= MIN_DELAY && stats.playout_delay <= MAX_DELAY);
+
+    pa_memblock_unref(chunk.memblock);
+    pa_jitter_buffer_free(j);
+    pa_mempool_unref(pool);
+}
+END_TEST
+
+/* A sender that restarts with lower sequence numbers must not have all of
+ * its packets dropped as late */
+START_TEST (restart_test) {
+    pa_mempool *pool;
+    pa_jitter_buffer *j;
+    pa_jitter_buffer_stats stats;
+    struct result r;
+    pa_memchunk chunk;
+    unsigned i;
+
+    pool = pa_mempool_new(PA_MEM_TYPE_PRIVATE, 0, true);
+    fail_unless(pool != NULL);
+
+    j = pa_jitter_buffer_new(pool, &ss, 95, MIN_DELAY, MAX_DELAY);
+    make_chunk(pool, &chunk);
+
+    pa_zero(r);
+    for (i = 0; i < 10; i++) {
+        pa_jitter_buffer_put(j, &chunk, 1000 + i, i * FRAMES, ARRIVAL(i));
+        pop_all(j, ARRIVAL(i), &r);
+    }
+    ck_assert_int_eq(r.n_chunks, 10);
+
+    /* Far behind, the buffer restarts right away */
+    pa_zero(r);
+    for (i = 10; i < 20; i++) {
+        pa_jitter_buffer_put(j, &chunk, 100 + i, (5000 + i) * FRAMES, ARRIVAL(i));
+        pop_all(j, ARRIVAL(i), &r);
+    }
+    ck_assert_int_eq(r.n_chunks, 10);
+    fail_if(r.bad_tstamp);
+
+    pa_jitter_buffer_get_stats(j, &stats);
+    ck_assert_int_eq(stats.late, 0);
+
+    /* 70 packets behind, the first 31 are dropped as late, then the buffer
+     * restarts */
+    pa_zero(r);
+    for (i = 20; i < 84; i++) {
+        pa_jitter_buffer_put(j, &chunk, 30 + i, (9000 + i) * FRAMES, ARRIVAL(i));
+        pop_all(j, ARRIVAL(i), &r);
+    }
+    ck_assert_int_eq(r.n_chunks, 33);
+    fail_if(r.bad_tstamp);
+    fail_if(r.bad_samples);
+
+    pa_jitter_buffer_get_stats(j, &stats);
+    ck_assert_int_eq(stats.received, 84);
+    ck_assert_int_eq(stats.late, 31);
+    ck_assert_int_eq(stats.lost, 0);
+
+    pa_memblock_unref(chunk.memblock);
+    pa_jitter_buffer_free(j);
+    pa_mempool_unref(pool);
+}
+END_TEST
+
+/* The GStreamer RTP backend does not report sequence numbers */
+#ifndef HAVE_GSTREAMER
+static void send_packet(int fd, unsigned i) {
+    uint8_t packet[12 + FRAMES * 4];
+    uint32_t header[3];
+    int16_t *d = (int16_t *) (packet + 12);
+    unsigned k;
+
+    header[0] = htonl(((uint32_t) 2 << 30) | ((uint32_t) PAYLOAD << 16) | (uint16_t) (FIRST_SEQUENCE + i));
+    header[1] = htonl(FIRST_TSTAMP + i * FRAMES);
+    header[2] = htonl(0x12345678);
+    memcpy(packet, header, sizeof(header));
+
+    for (k = 0; k < FRAMES * ss.channels; k++)
+        d[k] = (int16_t) htons(SAMPLE_VALUE);
+
+    fail_unless(send(fd, packet, sizeof(packet), 0) == sizeof(packet));
+}
+
+/* Sends packets over the loopback interface, with some of them lost,
+ * swapped, sent twice while held back or sent late, and feeds what is
+ * received to the jitter buffer like module-rtp-recv does */
+START_TEST (loopback_test) {
+    pa_mempool *pool;
+    pa_rtp_context *c;
+    pa_jitter_buffer *j;
+    pa_jitter_buffer_stats stats;
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    struct result r;
+    int rx, tx, n = 1 << 22;
+    unsigned i, n_received = 0;
+
+    pool = pa_mempool_new(PA_MEM_TYPE_PRIVATE, 0, true);
+    fail_unless(pool != NULL);
+
+    pa_zero(sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fail_unless((rx = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+    fail_unless((tx = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+    fail_unless(bind(rx, (struct sockaddr *) &sa, sizeof(sa)) == 0);
+    fail_unless(getsockname(rx, (struct sockaddr *) &sa, &salen) == 0);
+    fail_unless(connect(tx, (struct sockaddr *) &sa, sizeof(sa)) == 0);
+
+    fail_unless((c = pa_rtp_context_new_recv(rx, PAYLOAD, &ss, false)) != NULL);
+
+    for (i = 0; i < N_PACKETS; i++) {
+        switch (i % 50) {
+            case 10:
+                /* Lost */
+                break;
+            case 11:
+                send_packet(tx, i);
+                send_packet(tx, i);
+                break;
+            case 30:
+                send_packet(tx, i + 1);
+                send_packet(tx, i);
+                break;
+            case 31:
+                break;
+            case 45:
+                send_packet(tx, i);
+                send_packet(tx, i - 20);
+                break;
+            default:
+                send_packet(tx, i);
+        }
+    }
+
+    j = pa_jitter_buffer_new(pool, &ss, 95, MIN_DELAY, MAX_DELAY);
+    pa_zero(r);
+
+    do {
+        pa_memchunk chunk;
+        uint32_t tstamp;
+        uint16_t sequence;
+        struct timeval tv;
+        pa_usec_t arrival;
+
+        if (pa_rtp_recv(c, &chunk, pool, &tstamp, &tv) < 0)
+            continue;
+
+        fail_unless(pa_rtp_context_get_last_sequence(c, &sequence));
+
+        /* The packets all arrived at once, make up arrival times spaced
+         * like the packets were sent in real time */
+        arrival = ARRIVAL(n_received);
+        n_received++;
+
+        pa_jitter_buffer_put(j, &chunk, sequence, tstamp, arrival);
+        pa_memblock_unref(chunk.memblock);
+
+        pop_all(j, arrival, &r);
+    } while (pa_rtp_context_has_pending(c) || n_received < N_PACKETS + 4);
+
+    pop_all(j, (pa_usec_t) -1 / 2, &r);
+
+    fail_if(r.bad_tstamp);
+    fail_if(r.bad_samples);
+    ck_assert_int_eq(r.n_chunks, N_PACKETS);
+    ck_assert_int_eq(r.next_tstamp, FIRST_TSTAMP + N_PACKETS * FRAMES);
+
+    pa_jitter_buffer_get_stats(j, &stats);
+    ck_assert_int_eq(stats.received, N_PACKETS + 4);
+    ck_assert_int_eq(stats.lost, 4);
+    ck_assert_int_eq(stats.concealed, 4);
+    ck_assert_int_eq(stats.reordered, 4);
+    ck_assert_int_eq(stats.duplicates, 4);
+    ck_assert_int_eq(stats.late, 4);
+
+    pa_jitter_buffer_free(j);
+    pa_rtp_context_free(c);
+    pa_close(tx);
+    pa_mempool_unref(pool);
+}
+END_TEST
+#endif
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    Suite *s;
+    TCase *tc;
+    SRunner *sr;
+
+    if (!getenv("MAKE_CHECK"))
+        pa_log_set_level(PA_LOG_DEBUG);
+
+    s = suite_create("RTP jitter buffer");
+    tc = tcase_create("rtp-jitter-buffer");
+    tcase_add_test(tc, jitter_buffer_test);
+    tcase_add_test(tc, restart_test);
+#ifndef HAVE_GSTREAMER
+    tcase_add_test(tc, loopback_test);
+#endif
+    suite_add_tcase(s, tc);
+
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}